@@ -11,37 +11,70 @@ class ADAM : public Optimiser
 	const FP	_alpha;
 	const FP	_beta1;
 	const FP	_beta2;
+	const FP	_weightDecay;	// Decoupled weight decay (AdamW), parameters shrink by 'alpha*weightDecay' each step.
 	int			_t;
 
 public:
-	ADAM(const std::vector<TensorPtr>& parameters,const FP alpha=0.001) :
+	ADAM(const std::vector<TensorPtr>& parameters,const FP alpha=0.001,const FP weightDecay=0) :
 		Optimiser(parameters),
 		_alpha(alpha),
 		_beta1(FP(0.9)),
 		_beta2(FP(0.999)),
+		_weightDecay(weightDecay),
+		_t(0)
+	{
+	}
+
+	ADAM(const ParameterArenaPtr& arena,const FP alpha=0.001,const FP weightDecay=0) :
+		Optimiser(arena),
+		_alpha(alpha),
+		_beta1(FP(0.9)),
+		_beta2(FP(0.999)),
+		_weightDecay(weightDecay),
 		_t(0)
 	{
 	}
 
 	void Step(bool zero=true)
 	{
+		// One step for every parameter, the bias correction doesn't depend on the number of parameters.
+		++_t;
+		const FP beta1t = pow(_beta1,FP(_t));
+		const FP beta2t = pow(_beta2,FP(_t));
+
+		std::vector<NDArrays> dense;
 		for(auto& p:_parameters)
 		{
-			++_t;
-
-			p->Momentum()->Data() = p->Momentum()->Data()*_beta1 + p->Gradient()->Data()*(1-_beta1);
-			p->Momentum2()->Data() = p->Momentum2()->Data()*_beta2 + ((p->Gradient()->Data()*p->Gradient()->Data())*(1-_beta2));
+			p->MergeSparseGradient();		// Both sparse and dense gradients are stepped as dense.
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse&&!p->Gradient())
+			{
+				// Lazy update, the moments and parameters of rows without a gradient are left as they are.
+				if(!sparse->Empty())
+				{
+					const std::vector<int>& rows = sparse->Rows();
+					const NDArray& g = sparse->Values();
+					const NDArray m = p->Momentum()->Data().SelectRows(rows)*_beta1 + g*(1-_beta1);
+					const NDArray v = p->Momentum2()->Data().SelectRows(rows)*_beta2 + (g*g)*(1-_beta2);
+					p->Momentum()->Data()._SetRows(rows,m);
+					p->Momentum2()->Data()._SetRows(rows,v);
 
-			FP beta1t = pow(_beta1,FP(_t));
-			FP beta2t = pow(_beta2,FP(_t));
-
-			NDArray mhat = p->Momentum()->Data()/(1-beta1t);
-			NDArray vhat = p->Momentum2()->Data()/(1-beta2t);
-
-			p->Data() -= (mhat*_alpha)/(vhat.Sqrt()+_eps);
-			
-			if(zero)
-				p->Gradient()->Data() *= 0.0;
+					const NDArray mhat = m/(1-beta1t);
+					const NDArray vhat = v/(1-beta2t);
+					NDArray update = (mhat*(-_alpha))/(vhat.Sqrt()+_eps);
+					if(_weightDecay!=0)
+						update -= p->Data().SelectRows(rows)*(_alpha*_weightDecay);
+					p->Data()._AddRows(rows,update);
+				}
+				if(zero)
+					sparse->Clear();
+			}
+			else if(p->Gradient()&&!InArena(p))
+				dense.push_back({p->Data(),p->Gradient()->Data(),p->Momentum()->Data(),p->Momentum2()->Data()});
 		}
+		AddArena(dense);
+
+		// Parameters with a dense gradient are updated together in a single pass.
+		NDData::_OptimiserStep(optimiser_adam{_alpha,_beta1,_beta2,_eps,1/(1-beta1t),1/(1-beta2t),_weightDecay},dense,zero);
 	}
 };
\ No newline at end of file
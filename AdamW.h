@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ADAM.h"
+
+
+// ADAM with decoupled weight decay (Loshchilov & Hutter), the decay is applied to the parameters directly rather than added to the
+// gradient so it isn't scaled by the adaptive learning rate.
+//
+class AdamW : public ADAM
+{
+public:
+	AdamW(const std::vector<TensorPtr>& parameters,const FP alpha=0.001,const FP weightDecay=0.01) :
+		ADAM(parameters,alpha,weightDecay)
+	{
+	}
+
+	AdamW(const ParameterArenaPtr& arena,const FP alpha=0.001,const FP weightDecay=0.01) :
+		ADAM(arena,alpha,weightDecay)
+	{
+	}
+};
\ No newline at end of file
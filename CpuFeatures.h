@@ -0,0 +1,73 @@
+#pragma once
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// Runtime instruction set detection.
+// ==================================
+//
+// Kernels are compiled for several instruction sets and the fastest one supported by the CPU is chosen at runtime, so a single build
+// runs everywhere. Functions using AVX intrinsics are marked with the target macros so GCC/Clang generate code for them without the
+// whole program being built with -mavx2, MSVC generates AVX code for intrinsics without any annotation.
+//
+
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2		__attribute__((target("avx2,fma")))
+#define TARGET_AVX512	__attribute__((target("avx512f")))
+#endif
+
+
+// Returns 'true' if the CPU and OS support AVX2 and FMA.
+//
+inline bool cpu_has_avx2()
+{
+	static const bool supported = []()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info,0);
+		if(info[0]<7)
+			return false;
+		__cpuid(info,1);
+		const bool fma = (info[2]&(1<<12))!=0;
+		const bool osxsave = (info[2]&(1<<27))!=0;
+		if(!fma||!osxsave||(_xgetbv(0)&0x6)!=0x6)	// OS saves xmm and ymm state.
+			return false;
+		__cpuidex(info,7,0);
+		return (info[1]&(1<<5))!=0;
+#else
+		return __builtin_cpu_supports("avx2")&&__builtin_cpu_supports("fma");
+#endif
+	}();
+	return supported;
+}
+
+
+// Returns 'true' if the CPU and OS support AVX-512F.
+//
+inline bool cpu_has_avx512()
+{
+	static const bool supported = []()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info,0);
+		if(info[0]<7)
+			return false;
+		__cpuid(info,1);
+		const bool osxsave = (info[2]&(1<<27))!=0;
+		if(!osxsave||(_xgetbv(0)&0xe6)!=0xe6)		// OS saves xmm, ymm, opmask and zmm state.
+			return false;
+		__cpuidex(info,7,0);
+		return (info[1]&(1<<16))!=0;
+#else
+		return __builtin_cpu_supports("avx512f");
+#endif
+	}();
+	return supported;
+}
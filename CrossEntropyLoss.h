@@ -5,9 +5,18 @@
 
 class CrossEntropyLoss
 {
+	const FP	_smoothing;		// Label smoothing.
+	const int	_ignoreIndex;	// Target index excluded from the loss.
+
 public:
+	CrossEntropyLoss(const FP smoothing=0,const int ignoreIndex=-100) :
+		_smoothing(smoothing),
+		_ignoreIndex(ignoreIndex)
+	{
+	}
+
 	TensorPtr Forward(const TensorPtr& input,const TensorPtr& target)
 	{
-		return input->CrossEntropy(target);
+		return input->CrossEntropy(target,_smoothing,_ignoreIndex);
 	}
 };
\ No newline at end of file
@@ -0,0 +1,565 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cmath>
+#include <cstddef>
+#include "CpuFeatures.h"
+#include "VectorMath.h"
+#include "NDShape.h"
+#include "NDThreadPool.h"
+
+
+// Elementwise kernels.
+// ====================
+//
+// Applies an operation to every element of one or two strided operands, writing a strided result of the same shape. Broadcast operands
+// arrive with zero strides so no copies are made.
+//
+// Dimensions of length 1 are dropped and neighbouring dimensions that are contiguous in every operand are merged, so most layouts reduce
+// to a set of rows along the least significant dimension:
+//
+//	contiguous				one row, the operands are flat arrays.
+//	scalar broadcast		one row, the broadcast operand has a zero stride.
+//	row broadcast			many rows, the broadcast operand has a zero row stride and a unit column stride.
+//
+// Rows whose result and operands have unit or zero stride run the AVX-512 or AVX2 version of the operation (the widest the operation and
+// the CPU both have), any other strides run the scalar version. Large arrays are split across the thread pool in blocks of rows, or
+// blocks of one long row.
+//
+// An operation is a functor with a scalar operator() and, if its 'avx2' member is 'true', a TARGET_AVX2 'vector' method on 8 lanes,
+// and if its 'avx512' member is 'true', a TARGET_AVX512 'vector' method on 16 lanes (unary operations only).
+//
+
+
+// Elements per task, smaller arrays are computed on the calling thread.
+constexpr int elementwise_grain = 16384;
+
+
+// Instruction set used for unit stride rows.
+//
+enum class elementwise_isa
+{
+	generic,
+	avx2,
+	avx512
+};
+
+
+// Returns the widest instruction set supported by both the operation and the CPU.
+//
+template<typename OP>
+inline elementwise_isa elementwise_select_isa()
+{
+	if(OP::avx512&&cpu_has_avx512())
+		return elementwise_isa::avx512;
+	if(OP::avx2&&cpu_has_avx2())
+		return elementwise_isa::avx2;
+	return elementwise_isa::generic;
+}
+
+
+// Binary operations.
+//
+struct elementwise_add
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a,const float b) const { return a+b; }
+	TARGET_AVX2 __m256 vector(const __m256 a,const __m256 b) const { return _mm256_add_ps(a,b); }
+};
+
+struct elementwise_sub
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a,const float b) const { return a-b; }
+	TARGET_AVX2 __m256 vector(const __m256 a,const __m256 b) const { return _mm256_sub_ps(a,b); }
+};
+
+struct elementwise_mul
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a,const float b) const { return a*b; }
+	TARGET_AVX2 __m256 vector(const __m256 a,const __m256 b) const { return _mm256_mul_ps(a,b); }
+};
+
+struct elementwise_div
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a,const float b) const { return a/b; }
+	TARGET_AVX2 __m256 vector(const __m256 a,const __m256 b) const { return _mm256_div_ps(a,b); }
+};
+
+
+// Unary operations.
+//
+struct elementwise_copy
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return a; }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return a; }
+};
+
+struct elementwise_negate
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return -a; }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return _mm256_xor_ps(a,_mm256_set1_ps(-0.0f)); }
+};
+
+struct elementwise_square
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return a*a; }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return _mm256_mul_ps(a,a); }
+};
+
+struct elementwise_sqrt
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return std::sqrt(a); }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return _mm256_sqrt_ps(a); }
+};
+
+struct elementwise_exp
+{
+	static constexpr bool avx2 = false;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return std::exp(a); }
+};
+
+struct elementwise_log
+{
+	static constexpr bool avx2 = false;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return std::log(a); }
+};
+
+struct elementwise_tanh
+{
+	static constexpr bool avx2 = false;
+	static constexpr bool avx512 = false;
+	float operator()(const float a) const { return std::tanh(a); }
+};
+
+struct elementwise_pow
+{
+	static constexpr bool avx2 = false;
+	static constexpr bool avx512 = false;
+	const float exponent;
+	float operator()(const float a) const { return std::pow(a,exponent); }
+};
+
+
+// Fast unary operations (VectorMath.h).
+//	Strided rows, which can't be vectorised, fall back to the C library.
+//
+struct elementwise_fast_exp
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = true;
+	float operator()(const float a) const { return std::exp(a); }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return exp_avx2(a); }
+	TARGET_AVX512 __m512 vector(const __m512 a) const { return exp_avx512(a); }
+};
+
+struct elementwise_fast_log
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = true;
+	float operator()(const float a) const { return std::log(a); }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return log_avx2(a); }
+	TARGET_AVX512 __m512 vector(const __m512 a) const { return log_avx512(a); }
+};
+
+struct elementwise_fast_tanh
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = true;
+	float operator()(const float a) const { return std::tanh(a); }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return tanh_avx2(a); }
+	TARGET_AVX512 __m512 vector(const __m512 a) const { return tanh_avx512(a); }
+};
+
+struct elementwise_fast_pow
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = true;
+	const float exponent;
+	float operator()(const float a) const { return std::pow(a,exponent); }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { return pow_avx2(a,exponent); }
+	TARGET_AVX512 __m512 vector(const __m512 a) const { return pow_avx512(a,exponent); }
+};
+
+
+// c[i] = op(a[i]) for 'n' elements with strides 'cs' and 'as'.
+//
+template<typename OP>
+static void elementwise_row_generic(const OP& op,const int n,float* const c,const int cs,const float* const a,const int as)
+{
+	for(int i=0;i<n;++i)
+		c[(ptrdiff_t)i*cs] = op(a[(ptrdiff_t)i*as]);
+}
+
+
+// c[i] = op(a[i],b[i]) for 'n' elements with strides 'cs', 'as' and 'bs'.
+//
+template<typename OP>
+static void elementwise_row_generic(const OP& op,const int n,float* const c,const int cs,const float* const a,const int as,const float* const b,const int bs)
+{
+	for(int i=0;i<n;++i)
+		c[(ptrdiff_t)i*cs] = op(a[(ptrdiff_t)i*as],b[(ptrdiff_t)i*bs]);
+}
+
+
+// Contiguous unary row, 8 elements at a time.
+//	The tail is masked so every element gets the same (vector) version of the operation.
+//
+template<typename OP>
+TARGET_AVX2
+static void elementwise_row_avx2(const OP& op,const int n,float* const c,const float* const a)
+{
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(c+i,op.vector(_mm256_loadu_ps(a+i)));
+	if(i<n)
+	{
+		const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n-i),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+		_mm256_maskstore_ps(c+i,mask,op.vector(_mm256_maskload_ps(a+i,mask)));
+	}
+}
+
+
+// Contiguous unary row, 16 elements at a time.
+//
+template<typename OP>
+TARGET_AVX512
+static void elementwise_row_avx512(const OP& op,const int n,float* const c,const float* const a)
+{
+	int i = 0;
+	for(;i+16<=n;i+=16)
+		_mm512_storeu_ps(c+i,op.vector(_mm512_loadu_ps(a+i)));
+	if(i<n)
+	{
+		const __mmask16 mask = (__mmask16)((1u<<(n-i))-1);
+		_mm512_mask_storeu_ps(c+i,mask,op.vector(_mm512_maskz_loadu_ps(mask,a+i)));
+	}
+}
+
+
+// Contiguous binary row, 8 elements at a time.
+//	An operand flagged as scalar is a single value broadcast along the row.
+//
+template<typename OP,bool A_SCALAR,bool B_SCALAR>
+TARGET_AVX2
+static void elementwise_row_avx2(const OP& op,const int n,float* const c,const float* const a,const float* const b)
+{
+	const __m256 a_scalar = _mm256_set1_ps(*a);
+	const __m256 b_scalar = _mm256_set1_ps(*b);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+	{
+		const __m256 va = A_SCALAR?a_scalar:_mm256_loadu_ps(a+i);
+		const __m256 vb = B_SCALAR?b_scalar:_mm256_loadu_ps(b+i);
+		_mm256_storeu_ps(c+i,op.vector(va,vb));
+	}
+	for(;i<n;++i)
+		c[i] = op(A_SCALAR?*a:a[i],B_SCALAR?*b:b[i]);
+}
+
+
+// Runs the row kernel for the strides of a unary row.
+//
+template<typename OP>
+static void elementwise_row(const OP& op,const elementwise_isa isa,const int n,float* const c,const int cs,const float* const a,const int as)
+{
+	if(cs==1&&as==1)
+	{
+		if constexpr(OP::avx512)
+		{
+			if(isa==elementwise_isa::avx512)
+				return elementwise_row_avx512(op,n,c,a);
+		}
+		if constexpr(OP::avx2)
+		{
+			if(isa!=elementwise_isa::generic)
+				return elementwise_row_avx2(op,n,c,a);
+		}
+	}
+	elementwise_row_generic(op,n,c,cs,a,as);
+}
+
+
+// Runs the row kernel for the strides of a binary row.
+//
+template<typename OP>
+static void elementwise_row(const OP& op,const elementwise_isa isa,const int n,float* const c,const int cs,const float* const a,const int as,const float* const b,const int bs)
+{
+	if constexpr(OP::avx2)
+	{
+		if(isa!=elementwise_isa::generic&&cs==1)
+		{
+			if(as==1&&bs==1)
+				return elementwise_row_avx2<OP,false,false>(op,n,c,a,b);
+			if(as==1&&bs==0)
+				return elementwise_row_avx2<OP,false,true>(op,n,c,a,b);
+			if(as==0&&bs==1)
+				return elementwise_row_avx2<OP,true,false>(op,n,c,a,b);
+		}
+	}
+	elementwise_row_generic(op,n,c,cs,a,as,b,bs);
+}
+
+
+// Dimensions of 'N' operands of the same shape after dropping unit dimensions and merging neighbouring dimensions that are contiguous
+// in every operand, the last being the rows. A layout has no dimensions if the shape has no elements.
+//
+template<int N>
+struct elementwise_layout
+{
+	int	dims;
+	int	length[NDShape::MaxDims+1];
+	int	stride[N][NDShape::MaxDims+1];
+};
+
+template<int N>
+static elementwise_layout<N> elementwise_coalesce(const NDShape& shape,const NDShape (&strides)[N])
+{
+	elementwise_layout<N> layout;
+	int& dims = layout.dims;
+	dims = 0;
+	for(int dim=0;dim<shape.size();++dim)
+	{
+		if(shape[dim]==1)
+			continue;
+		bool merge = dims>0;
+		for(int k=0;k<N&&merge;++k)
+			merge = layout.stride[k][dims-1]==strides[k][dim]*shape[dim];
+		if(merge)
+		{
+			layout.length[dims-1] *= shape[dim];
+			for(int k=0;k<N;++k)
+				layout.stride[k][dims-1] = strides[k][dim];
+		}
+		else
+		{
+			layout.length[dims] = shape[dim];
+			for(int k=0;k<N;++k)
+				layout.stride[k][dims] = strides[k][dim];
+			++dims;
+		}
+	}
+	if(dims==0)
+	{
+		// Single element.
+		layout.length[0] = 1;
+		for(int k=0;k<N;++k)
+			layout.stride[k][0] = 0;
+		dims = 1;
+	}
+	for(int dim=0;dim<dims;++dim)
+		if(layout.length[dim]==0)
+			dims = 0;
+	return layout;
+}
+
+
+// Iterates the rows of 'N' operands of the same shape in order on the calling thread, calling 'row(n,data,stride)' as
+// elementwise_for_each_row does. For operations that aren't pure functions of the element values.
+//
+template<int N,typename ROW>
+static void elementwise_for_each_row_serial(const NDShape& shape,float* const (&data)[N],const NDShape (&strides)[N],const ROW& row)
+{
+	const elementwise_layout<N> layout = elementwise_coalesce<N>(shape,strides);
+	const int dims = layout.dims;
+	if(dims==0)
+		return;
+
+	const int n = layout.length[dims-1];
+	int inner[N];
+	float* ptr[N];
+	for(int k=0;k<N;++k)
+	{
+		inner[k] = layout.stride[k][dims-1];
+		ptr[k] = data[k];
+	}
+	int offsets[NDShape::MaxDims+1] = {};
+	for(;;)
+	{
+		row(n,ptr,inner);
+
+		// Next row, carrying into more significant dimensions.
+		int dim = dims-2;
+		for(;dim>=0;--dim)
+		{
+			for(int k=0;k<N;++k)
+				ptr[k] += layout.stride[k][dim];
+			if(++offsets[dim]<layout.length[dim])
+				break;
+			for(int k=0;k<N;++k)
+				ptr[k] -= (ptrdiff_t)layout.length[dim]*layout.stride[k][dim];
+			offsets[dim] = 0;
+		}
+		if(dim<0)
+			return;
+	}
+}
+
+
+// Iterates the rows of 'N' operands of the same shape, calling 'row(n,data,stride)' with the length of each row, the address of the row
+// in each operand and the stride of each operand along the row. Rows are split across the thread pool in blocks of 'elementwise_grain'.
+// Operand 0 is the result.
+//
+template<int N,typename ROW>
+static void elementwise_for_each_row(const NDShape& shape,float* const (&data)[N],const NDShape (&strides)[N],const ROW& row)
+{
+	const elementwise_layout<N> layout = elementwise_coalesce<N>(shape,strides);
+	const int dims = layout.dims;
+	const int (&length)[NDShape::MaxDims+1] = layout.length;
+	const int (&stride)[N][NDShape::MaxDims+1] = layout.stride;
+	if(dims==0)
+		return;
+
+	// Inner row.
+	const int n = length[dims-1];
+	int inner[N];
+	for(int k=0;k<N;++k)
+		inner[k] = stride[k][dims-1];
+
+	// Outer rows.
+	const int outer_dims = dims-1;
+	long long rows = 1;
+	for(int dim=0;dim<outer_dims;++dim)
+		rows *= length[dim];
+
+	// A result with a repeated (zero stride) dimension writes the same elements from several rows, so it can't be split.
+	bool overlapping = false;
+	for(int dim=0;dim<dims;++dim)
+		overlapping |= stride[0][dim]==0;
+
+	if(rows==1)
+	{
+		// One row, split it into blocks.
+		const int blocks = (n+elementwise_grain-1)/elementwise_grain;
+		NDThreadPool::ParallelFor(0,blocks,overlapping?blocks:1,[&](const int block)
+		{
+			const int first = block*elementwise_grain;
+			float* ptr[N];
+			for(int k=0;k<N;++k)
+				ptr[k] = data[k]+(ptrdiff_t)first*inner[k];
+			row((std::min)(elementwise_grain,n-first),ptr,inner);
+		});
+		return;
+	}
+
+	// Blocks of rows.
+	const int rows_per_block = (std::max)(elementwise_grain/n,1);
+	const int blocks = (int)((rows+rows_per_block-1)/rows_per_block);
+	NDThreadPool::ParallelFor(0,blocks,overlapping?blocks:1,[&](const int block)
+	{
+		const long long first = (long long)block*rows_per_block;
+		const long long last = (std::min)(first+rows_per_block,rows);
+
+		// Position of the first row.
+		int offsets[NDShape::MaxDims+1];
+		float* ptr[N];
+		for(int k=0;k<N;++k)
+			ptr[k] = data[k];
+		long long remainder = first;
+		for(int dim=outer_dims-1;dim>=0;--dim)
+		{
+			offsets[dim] = (int)(remainder%length[dim]);
+			remainder /= length[dim];
+			for(int k=0;k<N;++k)
+				ptr[k] += (ptrdiff_t)offsets[dim]*stride[k][dim];
+		}
+
+		for(long long r=first;r<last;++r)
+		{
+			row(n,ptr,inner);
+
+			// Next row, carrying into more significant dimensions.
+			for(int dim=outer_dims-1;dim>=0;--dim)
+			{
+				for(int k=0;k<N;++k)
+					ptr[k] += stride[k][dim];
+				if(++offsets[dim]<length[dim])
+					break;
+				for(int k=0;k<N;++k)
+					ptr[k] -= (ptrdiff_t)length[dim]*stride[k][dim];
+				offsets[dim] = 0;
+			}
+		}
+	});
+}
+
+
+// c = op(a), all operands have 'shape' and are addressed through their strides. 'c' may alias 'a' with the same strides.
+//
+template<typename OP>
+static void elementwise_unary(const OP& op,const NDShape& shape,float* const c,const NDShape& c_stride,const float* const a,const NDShape& a_stride)
+{
+	const elementwise_isa isa = elementwise_select_isa<OP>();
+	float* const data[2] = {c,const_cast<float*>(a)};
+	const NDShape strides[2] = {c_stride,a_stride};
+	elementwise_for_each_row<2>(shape,data,strides,[&op,isa](const int n,float* const (&ptr)[2],const int (&stride)[2])
+	{
+		elementwise_row(op,isa,n,ptr[0],stride[0],ptr[1],stride[1]);
+	});
+}
+
+
+// c = op(a,b), all operands have 'shape' and are addressed through their strides. 'c' may alias 'a' or 'b' with the same strides.
+//
+template<typename OP>
+static void elementwise_binary(const OP& op,const NDShape& shape,float* const c,const NDShape& c_stride,const float* const a,const NDShape& a_stride,const float* const b,const NDShape& b_stride)
+{
+	const elementwise_isa isa = elementwise_select_isa<OP>();
+	float* const data[3] = {c,const_cast<float*>(a),const_cast<float*>(b)};
+	const NDShape strides[3] = {c_stride,a_stride,b_stride};
+	elementwise_for_each_row<3>(shape,data,strides,[&op,isa](const int n,float* const (&ptr)[3],const int (&stride)[3])
+	{
+		elementwise_row(op,isa,n,ptr[0],stride[0],ptr[1],stride[1],ptr[2],stride[2]);
+	});
+}
+
+
+// c = e for an expression 'e' (see NDBinaryExpression in NDArray.h) of the 'N-1' operands after 'c', all with 'shape' and addressed
+// through their strides. Rows whose result has unit stride and whose operands have unit or zero stride are computed 8 elements at a
+// time if every operation of the expression has an AVX2 version.
+//
+template<typename E,int N>
+TARGET_AVX2
+static void elementwise_expression_row_avx2(const E& e,const int n,float* const (&ptr)[N],const int (&stride)[N])
+{
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(ptr[0]+i,e.template Vector<1>(ptr,stride,i));
+	for(;i<n;++i)
+		ptr[0][i] = e.template Scalar<1>(ptr,stride,i);
+}
+
+template<typename E,int N>
+static void elementwise_expression(const E& e,const NDShape& shape,float* const (&data)[N],const NDShape (&strides)[N])
+{
+	const bool avx2 = E::avx2&&cpu_has_avx2();
+	elementwise_for_each_row<N>(shape,data,strides,[&e,avx2](const int n,float* const (&ptr)[N],const int (&stride)[N])
+	{
+		bool vector = avx2&&stride[0]==1;
+		for(int k=1;k<N&&vector;++k)
+			vector = stride[k]==0||stride[k]==1;
+		if(vector)
+			elementwise_expression_row_avx2(e,n,ptr,stride);
+		else
+		{
+			for(int i=0;i<n;++i)
+				ptr[0][(ptrdiff_t)i*stride[0]] = e.template Scalar<1>(ptr,stride,i);
+		}
+	});
+}
@@ -10,15 +10,18 @@ class Embedding : public Layer
 	const TensorPtr _weight;
 
 public:
-	static EmbeddingPtr New(const int vocabSize,const int embeddingSize,const std::string& name="Embedding")
+	// A sparse embedding has a sparse gradient of just the rows selected, see Tensor::SparseGradient.
+	//
+	static EmbeddingPtr New(const int vocabSize,const int embeddingSize,const std::string& name="Embedding",const bool sparse=false)
 	{
-		return std::make_shared<Embedding>(vocabSize,embeddingSize,name);
+		return std::make_shared<Embedding>(vocabSize,embeddingSize,name,sparse);
 	}
 
-	Embedding(const int vocabSize,const int embeddingSize,const std::string& name) :
+	Embedding(const int vocabSize,const int embeddingSize,const std::string& name,const bool sparse=false) :
 		_weight(Tensor::New(NDData::RandN({vocabSize,embeddingSize})*sqrt(FP(2.0)/FP(vocabSize)),true))	// He initialization.
 	{
 		_weight->Name(name+".weight");
+		_weight->Sparse(sparse);
 	}
 
 	const Tensors Forward(const TensorPtr& indices) const override
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "ElementwiseKernels.h"
+
+
+// Fused kernels.
+// ==============
+//
+// Runs a chain of elementwise operations, built at run time (i.e. from the kernels of a captured Graph), in one pass over its inputs
+// rather than one pass and one temporary array per operation.
+//
+// A program has 'inputs' registers holding its inputs followed by a register for the result of each instruction, the last being the
+// result of the program. The rows of the inputs (elementwise_for_each_row) are cut into tiles of 'fused_tile' elements, each instruction
+// runs on a whole tile (vectorised by the elementwise operations) and the registers of a tile stay in the L1 cache until the result is
+// written. Contiguous inputs are read in place, broadcast and strided ones are copied to a tile first.
+//
+// Backward recomputes the registers of each tile from the inputs and then passes the gradient back through the instructions in reverse,
+// so only the inputs are kept between the passes.
+//
+
+
+// Elements per tile.
+constexpr int fused_tile = 256;
+
+// Largest program.
+constexpr int fused_max_inputs = 8;
+constexpr int fused_max_instructions = 16;
+constexpr int fused_max_registers = fused_max_inputs+fused_max_instructions;
+
+
+enum class fused_op
+{
+	add,		// a+b
+	sub,		// a-b
+	mul,		// a*b
+	div,		// a/b
+	negate,		// -a
+	exp,
+	log,
+	pow,		// a^exponent
+	tanh,
+	relu		// max(a,0)
+};
+
+
+struct fused_instruction
+{
+	fused_op	op;
+	int			a;			// Register of the first operand.
+	int			b;			// Register of the second operand, -1 if unary.
+	float		exponent;	// Pow only.
+};
+
+
+struct fused_program
+{
+	int								inputs;
+	std::vector<fused_instruction>	code;
+
+	int Registers() const
+	{
+		return inputs+(int)code.size();
+	}
+
+	// Returns 'true' if the gradient doesn't depend on the values of the inputs (only sums and differences).
+	bool Linear() const
+	{
+		for(const fused_instruction& ins:code)
+			if(ins.op!=fused_op::add&&ins.op!=fused_op::sub&&ins.op!=fused_op::negate)
+				return false;
+		return true;
+	}
+};
+
+
+// Returns 'n' elements of a strided row, copied to 'tile' unless they're contiguous.
+//
+static const float* fused_load(const float* const ptr,const int stride,const int n,float* const tile)
+{
+	if(stride==1)
+		return ptr;
+	if(stride==0)
+		std::fill(tile,tile+n,*ptr);
+	else
+	{
+		for(int i=0;i<n;++i)
+			tile[i] = ptr[(ptrdiff_t)i*stride];
+	}
+	return tile;
+}
+
+
+template<typename OP>
+static void fused_unary(const OP& op,const int n,float* const c,const float* const a)
+{
+	elementwise_row(op,elementwise_select_isa<OP>(),n,c,1,a,1);
+}
+
+
+template<typename OP>
+static void fused_binary(const OP& op,const int n,float* const c,const float* const a,const float* const b)
+{
+	elementwise_row(op,elementwise_select_isa<OP>(),n,c,1,a,1,b,1);
+}
+
+
+// Runs the instructions on a tile of 'n' elements, the input registers already point at the inputs. Each result is written to its
+// register's row of 'tile'.
+//
+static void fused_execute(const fused_program& program,const bool fast,const int n,const float** const reg,float (*const tile)[fused_tile])
+{
+	for(size_t i=0;i<program.code.size();++i)
+	{
+		const fused_instruction& ins = program.code[i];
+		float* const c = tile[program.inputs+i];
+		const float* const a = reg[ins.a];
+		const float* const b = ins.b>=0?reg[ins.b]:nullptr;
+		switch(ins.op)
+		{
+		case fused_op::add:
+			fused_binary(elementwise_add(),n,c,a,b);
+			break;
+		case fused_op::sub:
+			fused_binary(elementwise_sub(),n,c,a,b);
+			break;
+		case fused_op::mul:
+			fused_binary(elementwise_mul(),n,c,a,b);
+			break;
+		case fused_op::div:
+			fused_binary(elementwise_div(),n,c,a,b);
+			break;
+		case fused_op::negate:
+			fused_unary(elementwise_negate(),n,c,a);
+			break;
+		case fused_op::exp:
+			if(fast)
+				fused_unary(elementwise_fast_exp(),n,c,a);
+			else
+				fused_unary(elementwise_exp(),n,c,a);
+			break;
+		case fused_op::log:
+			if(fast)
+				fused_unary(elementwise_fast_log(),n,c,a);
+			else
+				fused_unary(elementwise_log(),n,c,a);
+			break;
+		case fused_op::pow:
+			if(ins.exponent==2.0f)
+				fused_unary(elementwise_square(),n,c,a);
+			else if(fast)
+				fused_unary(elementwise_fast_pow{ins.exponent},n,c,a);
+			else
+				fused_unary(elementwise_pow{ins.exponent},n,c,a);
+			break;
+		case fused_op::tanh:
+			if(fast)
+				fused_unary(elementwise_fast_tanh(),n,c,a);
+			else
+				fused_unary(elementwise_tanh(),n,c,a);
+			break;
+		case fused_op::relu:
+			for(int j=0;j<n;++j)
+				c[j] = a[j]>0?a[j]:0.0f;
+			break;
+		}
+		reg[program.inputs+i] = c;
+	}
+}
+
+
+// Passes the gradient of the result of the program ('grad' of its last register) back to every register, the registers holding the
+// values computed by fused_execute. Registers other than the last start with a zero gradient.
+//
+static void fused_gradient(const fused_program& program,const int n,const float* const* const reg,float (*const grad)[fused_tile])
+{
+	const int last = program.Registers()-1;
+	for(int r=0;r<last;++r)
+		std::fill(grad[r],grad[r]+n,0.0f);
+
+	for(int i=(int)program.code.size()-1;i>=0;--i)
+	{
+		const fused_instruction& ins = program.code[i];
+		const float* const g = grad[program.inputs+i];
+		const float* const y = reg[program.inputs+i];
+		const float* const a = reg[ins.a];
+		const float* const b = ins.b>=0?reg[ins.b]:nullptr;
+		float* const ga = grad[ins.a];
+		float* const gb = ins.b>=0?grad[ins.b]:nullptr;
+		switch(ins.op)
+		{
+		case fused_op::add:
+			for(int j=0;j<n;++j)
+			{
+				ga[j] += g[j];
+				gb[j] += g[j];
+			}
+			break;
+		case fused_op::sub:
+			for(int j=0;j<n;++j)
+			{
+				ga[j] += g[j];
+				gb[j] -= g[j];
+			}
+			break;
+		case fused_op::mul:
+			for(int j=0;j<n;++j)
+			{
+				ga[j] += g[j]*b[j];
+				gb[j] += g[j]*a[j];
+			}
+			break;
+		case fused_op::div:
+			for(int j=0;j<n;++j)
+			{
+				ga[j] += g[j]/b[j];
+				gb[j] -= g[j]*y[j]/b[j];		// d(a/b)/db = -a/b^2 = -y/b
+			}
+			break;
+		case fused_op::negate:
+			for(int j=0;j<n;++j)
+				ga[j] -= g[j];
+			break;
+		case fused_op::exp:
+			for(int j=0;j<n;++j)
+				ga[j] += g[j]*y[j];
+			break;
+		case fused_op::log:
+			for(int j=0;j<n;++j)
+				ga[j] += g[j]/a[j];
+			break;
+		case fused_op::pow:
+			if(ins.exponent==2.0f)
+			{
+				for(int j=0;j<n;++j)
+					ga[j] += g[j]*2.0f*a[j];
+			}
+			else
+			{
+				for(int j=0;j<n;++j)
+					ga[j] += g[j]*ins.exponent*std::pow(a[j],ins.exponent-1.0f);
+			}
+			break;
+		case fused_op::tanh:
+			for(int j=0;j<n;++j)
+				ga[j] += g[j]*(1.0f-y[j]*y[j]);
+			break;
+		case fused_op::relu:
+			for(int j=0;j<n;++j)
+				ga[j] += a[j]>0?g[j]:0.0f;
+			break;
+		}
+	}
+}
+
+
+// c = program(inputs), all operands have 'shape' and are addressed through their strides, 'data[0]' and 'strides[0]' are the result
+// and the rest the inputs (unused ones are ignored). If 'accumulate' the result is added to 'c', which may repeat elements (zero
+// strides) to sum over dimensions.
+//
+static void fused_forward(const fused_program& program,const bool fast,const NDShape& shape,float* const (&data)[fused_max_inputs+1],const NDShape (&strides)[fused_max_inputs+1],const bool accumulate)
+{
+	constexpr int N = fused_max_inputs+1;
+	const int last = program.Registers()-1;
+	elementwise_for_each_row<N>(shape,data,strides,[&](const int n,float* const (&ptr)[N],const int (&stride)[N])
+	{
+		alignas(64) float tile[fused_max_registers][fused_tile];
+		const float* reg[fused_max_registers];
+		for(int first=0;first<n;first+=fused_tile)
+		{
+			const int count = (std::min)(fused_tile,n-first);
+			for(int k=0;k<program.inputs;++k)
+				reg[k] = fused_load(ptr[k+1]+(ptrdiff_t)first*stride[k+1],stride[k+1],count,tile[k]);
+			fused_execute(program,fast,count,reg,tile);
+
+			const float* const y = reg[last];
+			float* const c = ptr[0]+(ptrdiff_t)first*stride[0];
+			if(!accumulate)
+			{
+				for(int j=0;j<count;++j)
+					c[(ptrdiff_t)j*stride[0]] = y[j];
+			}
+			else if(stride[0]==0)
+			{
+				double sum = 0;
+				for(int j=0;j<count;++j)
+					sum += y[j];
+				*c += float(sum);
+			}
+			else
+			{
+				for(int j=0;j<count;++j)
+					c[(ptrdiff_t)j*stride[0]] += y[j];
+			}
+		}
+	});
+}
+
+
+// Gradient of program(inputs) WRT each input, 'scale' times the gradient of the result. The operands all have 'shape' and are addressed
+// through their strides: 'data[0..inputs-1]' are the gradients of the inputs (which mustn't repeat elements), 'data[fused_max_inputs]'
+// the gradient of the result (which may repeat elements) and 'data[fused_max_inputs+1..]' the inputs.
+//
+static void fused_backward(const fused_program& program,const bool fast,const float scale,const NDShape& shape,float* const (&data)[2*fused_max_inputs+1],const NDShape (&strides)[2*fused_max_inputs+1])
+{
+	constexpr int N = 2*fused_max_inputs+1;
+	constexpr int G = fused_max_inputs;
+	const int last = program.Registers()-1;
+	const bool linear = program.Linear();	// The inputs aren't read.
+	elementwise_for_each_row<N>(shape,data,strides,[&](const int n,float* const (&ptr)[N],const int (&stride)[N])
+	{
+		alignas(64) float tile[fused_max_registers][fused_tile];
+		alignas(64) float grad[fused_max_registers][fused_tile];
+		const float* reg[fused_max_registers] = {};
+		for(int first=0;first<n;first+=fused_tile)
+		{
+			const int count = (std::min)(fused_tile,n-first);
+			if(!linear)
+			{
+				for(int k=0;k<program.inputs;++k)
+					reg[k] = fused_load(ptr[G+1+k]+(ptrdiff_t)first*stride[G+1+k],stride[G+1+k],count,tile[k]);
+				fused_execute(program,fast,count,reg,tile);
+			}
+
+			const float* const g = ptr[G]+(ptrdiff_t)first*stride[G];
+			for(int j=0;j<count;++j)
+				grad[last][j] = scale*g[(ptrdiff_t)j*stride[G]];
+			fused_gradient(program,count,reg,grad);
+
+			for(int k=0;k<program.inputs;++k)
+			{
+				float* const c = ptr[k]+(ptrdiff_t)first*stride[k];
+				for(int j=0;j<count;++j)
+					c[(ptrdiff_t)j*stride[k]] = grad[k][j];
+			}
+		}
+	});
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "Tensor.h"
+#include "KoFused.h"
+
+
+typedef std::shared_ptr<class Graph> GraphPtr;
+
+// Captured training step.
+//
+// Capture runs a step (forward to a loss, then backward) once, recording every tensor created by a kernel and the order backward
+// passes gradients. Replay runs the same kernels on the same tensors with new input data, so a step with fixed shapes doesn't
+// construct a graph: no new Tensors or kernels, no children to track and no topological sort.
+//
+// Only operations with kernels are replayed. Anything else computed during capture (masks, constants and tensors computed directly
+// from data) keeps its captured value, as do arguments given to kernels that aren't creators (i.e. Gather indices) unless they're the
+// data of an input tensor, which is replaced in place.
+//
+class Graph
+{
+public:
+	// Memory of a node in the captured step, recorded before backward releases it.
+	struct NodeMemory
+	{
+		NDShape				shape;		// Shape of the output.
+		int					size;		// Elements in the output.
+		int					owner;		// Node whose memory holds the output, itself unless it's a view of another node, -1 if it's a view of an array outside the graph.
+		std::vector<int>	keeps;		// Nodes whose outputs the kernel keeps for backward (possibly itself).
+		std::vector<int>	saved;		// Elements of each other array the kernel keeps for backward.
+	};
+
+	// Array Replay writes the output of a node into, computed by an elementwise program.
+	struct Placement
+	{
+		fused_program	program;
+		NDArray			output;
+	};
+
+private:
+	const std::vector<TensorPtr>	_inputs;	// Tensors whose data is replaced by each replay.
+	std::vector<TensorPtr>			_nodes;		// Tensors created by kernels, in forward order.
+	std::vector<NodeMemory>			_memory;	// Memory of each of '_nodes'.
+	TensorPtr						_loss;
+	std::vector<Tensor*>			_order;		// Backward order, the loss first.
+	std::vector<int>				_pending;	// Gradients passed back to each tensor in '_order'.
+	std::map<int,Placement>			_placed;	// Placed outputs, by node.
+
+	// Records the memory of each node, arrays are views of the same memory if they have the same data owner.
+	//
+	void RecordMemory()
+	{
+		// Owner of the memory of each node, and of each creator that isn't a node (-1).
+		std::unordered_map<const NDData*,int> owners;
+		const std::unordered_set<TensorPtr> nodes(_nodes.begin(),_nodes.end());
+		for(auto& node:_nodes)
+			for(auto& creator:node->_creators)
+				if(nodes.count(creator)==0)
+					owners[(*creator->_data).DataOwner().get()] = -1;
+		auto owner = [&owners](const NDArray& array,const int unowned)
+		{
+			const auto i = owners.find((*array).DataOwner().get());
+			return i==owners.end()?unowned:i->second;
+		};
+
+		for(int i=0;i<(int)_nodes.size();++i)
+		{
+			const NDArray& data = _nodes[i]->_data;
+			NodeMemory memory;
+			memory.shape = data.Shape();
+			memory.size = data.Size();
+			memory.owner = owner(data,i);		// An array not seen before, possibly a view of a temporary, is this node's memory.
+			if(memory.owner==i)
+				owners[(*data).DataOwner().get()] = i;
+			for(const NDArray& saved:_nodes[i]->_kernel->Saved())
+			{
+				const int node = owner(saved,-2);		// Not a node or outside the graph, a new array.
+				if(node>=0)
+					memory.keeps.emplace_back(node);
+				else if(node==-2)
+					memory.saved.emplace_back(saved.Size());
+			}
+			_memory.emplace_back(memory);
+		}
+	}
+
+	// Private class to prevent constructor being called directly.
+	class P
+	{
+	};
+
+public:
+	// Captures the graph built by 'step' from 'inputs' and returns it, 'step' returns the loss. The captured step is run including
+	// backward (if the loss has autograd).
+	//
+	static GraphPtr Capture(const std::vector<TensorPtr>& inputs,const std::function<TensorPtr()>& step)
+	{
+		return std::make_shared<Graph>(P(),inputs,step);
+	}
+
+	Graph(const P&,const std::vector<TensorPtr>& inputs,const std::function<TensorPtr()>& step) :
+		_inputs(inputs)
+	{
+		// Forward, recording every tensor created by a kernel.
+		std::vector<TensorPtr>* const previous = Tensor::_capture;
+		Tensor::_capture = &_nodes;
+		try
+		{
+			_loss = step();
+		}
+		catch(...)
+		{
+			Tensor::_capture = previous;
+			throw;
+		}
+		Tensor::_capture = previous;
+		RecordMemory();
+
+		// Backward as normal, which also checks the graph, then record the order it took.
+		if(_loss->_autograd)
+		{
+			_loss->Backward();
+			_order = _loss->TopologicalOrder();
+			for(Tensor* const tensor:_order)
+				_pending.emplace_back(tensor->_pending);
+		}
+	}
+
+	// Runs the captured step with new data for each input (the same shapes as captured), returns the loss.
+	//
+	const TensorPtr& Replay(const NDArrays& inputs)
+	{
+		if(inputs.size()!=_inputs.size())
+			throw Exception("Graph has "+std::to_string(_inputs.size())+" inputs.");
+		for(size_t i=0;i<inputs.size();++i)
+			_inputs[i]->_data = inputs[i];
+
+		// Forward, placed outputs are written where they were placed.
+		for(int i=0;i<(int)_nodes.size();++i)
+		{
+			const TensorPtr& node = _nodes[i];
+			const auto placed = _placed.find(i);
+			if(placed!=_placed.end())
+			{
+				NDData::Fused(placed->second.program,Tensor::Arrays(node->_creators),placed->second.output);
+				node->_data._Attach(placed->second.output);
+			}
+			else
+				node->_data._Attach(node->_kernel->Forward(Tensor::Arrays(node->_creators)));
+		}
+
+		// Backward.
+		if(_loss->_autograd)
+		{
+			_loss->_gradient.reset();
+			_loss->Accumulate(_loss->_data.Ones());
+			for(size_t i=0;i<_order.size();++i)
+				_order[i]->_pending = _pending[i];
+			Tensor::BackwardOrder(_order,false);
+		}
+		return _loss;
+	}
+
+	// Sets the program computing the output of a node from its creators and returns 'true' if its kernel is elementwise (an elementwise
+	// kernel or a fused chain without a reduction).
+	//
+	bool Program(const int node,fused_program& program) const
+	{
+		const TensorPtr& tensor = _nodes[node];
+		fused_instruction instruction;
+		if(tensor->_kernel->Elementwise(instruction))
+		{
+			program.inputs = (int)tensor->_creators.size();
+			instruction.a = 0;
+			instruction.b = program.inputs>1?1:-1;
+			program.code.assign(1,instruction);
+			return true;
+		}
+		const KoFused* const fused = dynamic_cast<const KoFused*>(tensor->_kernel.get());
+		if(fused&&!fused->Reduces())
+		{
+			program = fused->Program();
+			return true;
+		}
+		return false;
+	}
+
+	// Places the output of a node with an elementwise kernel (Program), Replay then runs its program into 'output' (of the node's shape)
+	// rather than allocating a new array. Placed outputs may share memory (i.e. a slab planned by MemoryPlanner::Apply) so only the
+	// loss is certain to be kept after Replay.
+	//
+	void Place(const int node,const NDArray& output)
+	{
+		fused_program program;
+		if(!Program(node,program))
+			throw Exception("Node "+std::to_string(node)+" isn't elementwise.");
+		if(output.Shape()!=_memory[node].shape)
+			throw IncompatibleShape(output.Shape(),_memory[node].shape);
+		_placed.erase(node);
+		_placed.emplace(node,Placement{program,output});		// NDArray assignment copies elements, so construct in place.
+	}
+
+	// Fuses each chain of elementwise kernels (Kernel::Elementwise), and a sum or mean ending one (Kernel::Reduction), into a single
+	// kernel (KoFused) so Replay runs the chain in one pass and keeps only its inputs for backward. A chain grows back from its last
+	// kernel through creators used by no other kernel, the loss is always a chain's last. Tensors inside a chain are no longer computed
+	// by Replay. Placed outputs (Place) are dropped. Returns the number of kernels removed.
+	//
+	int Fuse()
+	{
+		const int count = (int)_nodes.size();
+		std::unordered_map<const Tensor*,int> index;
+		for(int i=0;i<count;++i)
+			index[_nodes[i].get()] = i;
+		auto node = [&index](const TensorPtr& tensor)
+		{
+			const auto i = index.find(tensor.get());
+			return i==index.end()?-1:i->second;
+		};
+
+		// Kernels using each node's output.
+		std::vector<int> uses(count,0);
+		for(auto& n:_nodes)
+			for(auto& creator:n->_creators)
+				if(node(creator)>=0)
+					uses[node(creator)]++;
+		if(node(_loss)>=0)
+			uses[node(_loss)]++;
+
+		std::vector<bool> removed(count,false);
+		std::vector<bool> fused(count,false);
+		for(int i=count-1;i>=0;--i)
+		{
+			if(removed[i])
+				continue;
+			const TensorPtr& root = _nodes[i];
+
+			// A reduction starts the chain at its input.
+			int dim;
+			bool keepDims,mean;
+			fused_instruction instruction;
+			const bool reduction = root->_kernel->Reduction(dim,keepDims,mean);
+			const TensorPtr& last = reduction?root->_creators[0]:root;
+			const int l = node(last);
+			if(l<0||removed[l]||(reduction&&uses[l]!=1)||!last->_kernel->Elementwise(instruction))
+				continue;
+
+			// Program of the chain, inputs are numbered from -1 down until the registers are known.
+			fused_program program = {0};
+			std::vector<TensorPtr> inputs;
+			std::vector<int> chain;
+			std::function<int(const TensorPtr&,bool)> emit = [&](const TensorPtr& tensor,const bool first)
+			{
+				const int n = node(tensor);
+				fused_instruction instruction;
+				if(!first&&(n<0||removed[n]||uses[n]!=1||!tensor->_kernel->Elementwise(instruction)))
+				{
+					const auto input = std::find(inputs.begin(),inputs.end(),tensor);
+					if(input!=inputs.end())
+						return -1-(int)(input-inputs.begin());
+					inputs.emplace_back(tensor);
+					return -(int)inputs.size();
+				}
+				tensor->_kernel->Elementwise(instruction);
+				instruction.a = emit(tensor->_creators[0],false);
+				instruction.b = tensor->_creators.size()>1?emit(tensor->_creators[1],false):-1;
+				program.code.emplace_back(instruction);
+				chain.emplace_back(n);
+				return (int)program.code.size()-1;
+			};
+			emit(last,true);
+			if((int)program.code.size()+reduction<2||(int)inputs.size()>fused_max_inputs||(int)program.code.size()>fused_max_instructions)
+				continue;
+
+			// Inputs take the first registers.
+			program.inputs = (int)inputs.size();
+			auto reg = [&program](const int r)
+			{
+				return r<0?-1-r:program.inputs+r;
+			};
+			for(fused_instruction& ins:program.code)
+			{
+				ins.a = reg(ins.a);
+				if(ins.b!=-1)
+					ins.b = reg(ins.b);
+			}
+			for(const int n:chain)
+				removed[n] = true;
+			removed[i] = false;
+			fused[i] = true;
+			root->_kernel = reduction?NDAllocator::MakeShared<KoFused>(program,dim,keepDims,mean):NDAllocator::MakeShared<KoFused>(program);
+			root->_creators.swap(inputs);		// The chain is released with 'inputs'.
+		}
+
+		// Remove the chains.
+		std::vector<TensorPtr> nodes;
+		std::vector<NodeMemory> memory;
+		std::vector<int> renumber(count,-1);
+		for(int i=0;i<count;++i)
+		{
+			if(removed[i])
+				continue;
+			renumber[i] = (int)nodes.size();
+			nodes.emplace_back(_nodes[i]);
+			memory.emplace_back(_memory[i]);
+		}
+		for(int i=0;i<count;++i)
+		{
+			if(removed[i])
+				continue;
+			NodeMemory& m = memory[renumber[i]];
+			if(m.owner>=0)
+				m.owner = renumber[m.owner]>=0?renumber[m.owner]:renumber[i];
+			if(fused[i])
+			{
+				m.keeps.clear();		// KoFused keeps nothing but its inputs.
+				m.saved.clear();
+			}
+			std::vector<int> keeps;
+			for(const int n:m.keeps)
+				if(renumber[n]>=0)
+					keeps.emplace_back(renumber[n]);
+			m.keeps.swap(keeps);
+		}
+
+		// Backward order without the chains, each tensor is passed a gradient by each use of it.
+		std::vector<Tensor*> order;
+		for(Tensor* const tensor:_order)
+		{
+			const auto n = index.find(tensor);
+			if(n==index.end()||!removed[n->second])
+				order.emplace_back(tensor);
+		}
+		std::unordered_map<const Tensor*,int> pending;
+		for(Tensor* const tensor:order)
+			for(auto& creator:tensor->_creators)
+				if(creator->_autograd)
+					pending[creator.get()]++;
+		_pending.clear();
+		for(Tensor* const tensor:order)
+			_pending.emplace_back(pending[tensor]);
+
+		const int removals = count-(int)nodes.size();
+		_placed.clear();
+		_order.swap(order);
+		_memory.swap(memory);
+		_nodes.swap(nodes);
+		return removals;
+	}
+
+	const std::vector<TensorPtr>& Inputs() const
+	{
+		return _inputs;
+	}
+
+	const std::vector<TensorPtr>& Nodes() const
+	{
+		return _nodes;
+	}
+
+	const std::vector<NodeMemory>& Memory() const
+	{
+		return _memory;
+	}
+
+	const TensorPtr& Loss() const
+	{
+		return _loss;
+	}
+
+	// Backward order, the loss first.
+	//
+	const std::vector<Tensor*>& Order() const
+	{
+		return _order;
+	}
+};
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "NDArray.h"
+#include "SparseRows.h"
 
 
 typedef std::shared_ptr<class Kernel> KernelPtr;
@@ -10,4 +11,43 @@ class Kernel
 public:
 	virtual NDArray		Forward(const NDArrays& input) = 0;
 	virtual NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) = 0;
+
+	// Gradient WRT a single input as sparse rows, for kernels that only touch some rows of their input (null if not supported).
+	virtual SparseRowsPtr	SparseBackward(const NDArray& gradient,const NDArrays& inputs)
+	{
+		return nullptr;
+	}
+
+	// Arrays kept from Forward for use in Backward (other than inputs), may include the output.
+	virtual NDArrays	Saved() const
+	{
+		return NDArrays();
+	}
+
+	// Returns 'false' if Backward only needs the shapes of its inputs, not their values.
+	virtual bool		ReadsInputs() const
+	{
+		return true;
+	}
+
+	// Returns 'true' if the output of Forward could be written over its first input (when the shapes are the same), each output element
+	// depending only on the same element of the input.
+	virtual bool		InPlace() const
+	{
+		return false;
+	}
+
+	// Sets the operation (and its constant) of a fused program instruction (FusedKernels.h) for the kernel, returns 'false' if the kernel
+	// isn't an elementwise operation that can be fused.
+	virtual bool		Elementwise(fused_instruction& instruction) const
+	{
+		return false;
+	}
+
+	// Sets the dimension ('-1' for all) of a sum or mean (if 'mean') that can end a fused program, returns 'false' if the kernel isn't
+	// one.
+	virtual bool		Reduction(int& dim,bool& keepDims,bool& mean) const
+	{
+		return false;
+	}
 };
\ No newline at end of file
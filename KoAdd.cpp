@@ -15,4 +15,23 @@ NDArrays KoAdd::Backward(const NDArray& gradient,const NDArrays& inputs)
 		NDData::ReverseBroadcast(gradient,inputs[0].Shape()),
 		NDData::ReverseBroadcast(gradient,inputs[1].Shape())
 	};
+}
+
+
+bool KoAdd::ReadsInputs() const
+{
+	return false;	// Only the shapes are needed to reverse the broadcast.
+}
+
+
+bool KoAdd::InPlace() const
+{
+	return true;
+}
+
+
+bool KoAdd::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::add;
+	return true;
 }
\ No newline at end of file
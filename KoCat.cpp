@@ -41,4 +41,10 @@ NDArrays KoCat::Backward(const NDArray& gradient,const NDArrays& inputs)
 		catSlice[0] = catSlice[1];							// Next creator slice after this slice.
 	}
 	return gradients;
+}
+
+
+bool KoCat::ReadsInputs() const
+{
+	return false;	// Gradient is sliced by the shapes of the inputs.
 }
\ No newline at end of file
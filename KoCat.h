@@ -11,4 +11,5 @@ public:
 				KoCat(const int dim);
 	NDArray		Forward(const NDArrays& inputs) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
 };
\ No newline at end of file
@@ -1,8 +1,10 @@
 #include "KoCrossEntropy.h"
 
 
-KoCrossEntropy::KoCrossEntropy(const NDArray& targets) :
-	_targets(targets)
+KoCrossEntropy::KoCrossEntropy(const NDArray& targets,const FP smoothing,const int ignoreIndex) :
+	_targets(targets),
+	_smoothing(smoothing),
+	_ignoreIndex(ignoreIndex)
 {
 }
 
@@ -11,27 +13,25 @@ NDArray KoCrossEntropy::Forward(const NDArrays& inputs)
 {
 	const NDArray& logits = inputs[0];
 
-	// 1-hot encode the target indices (the correct labels).
-	_targetsOH._Attach(NDData::Eye(logits.Shape()[1])[_targets]);
-
-	// Convert logits to log probabilities.
-	_logp._Attach(logits.LogSoftmax(-1));
-
-	// Compute cross-entropy (aka negative log likelihood) per sample and then average.
-	return -(_logp*_targetsOH).Sum(1,false).Mean(false);
+	// Cross-entropy (aka negative log likelihood) per sample and then average, computed from the target indices directly rather than
+	// 1-hot encoding them. Only the log-sum-exp of each row is stored for Backward.
+	return logits.CrossEntropy(_targets,_lse,_smoothing,_ignoreIndex);
 }
 
 
 NDArrays KoCrossEntropy::Backward(const NDArray& gradient,const NDArrays& inputs)
 {
-	// Reconstitue softmax values from stored log probabilities.
-	const NDArray softmax = _logp.Exp();
-
 	return
 	{
 		// Differential WRT input is the activation of correct output -1 (see LSTM document you wrote for full math explanation!).
-		// Here softmaxOutput is the predicted p-dist over the outputs and targetDist is the identity matrix row for the correct output i.e. 1.
-		// The derivative is softmax(x)-target(x) and then divided by the number of samples to account for taking the mean.
-		gradient*((softmax-_targetsOH)/FP(_targetsOH.Shape()[0]))
+		// Here softmaxOutput is the predicted p-dist over the outputs and targetDist is 1 for the correct output (less any smoothing).
+		// The derivative is softmax(x)-target(x) and then divided by the number of counted samples to account for taking the mean.
+		inputs[0].CrossEntropyGradient(_targets,_lse,gradient,_smoothing,_ignoreIndex)
 	};
+}
+
+
+NDArrays KoCrossEntropy::Saved() const
+{
+	return {_lse};
 }
\ No newline at end of file
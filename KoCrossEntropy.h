@@ -5,13 +5,15 @@
 
 class KoCrossEntropy : public Kernel
 {
-	NDArray	_targets;
+	NDArray		_targets;		// Class index for each sample.
+	const FP	_smoothing;		// Label smoothing, the probability spread evenly over all classes.
+	const int	_ignoreIndex;	// Samples with this target do not contribute to the loss.
 
-	NDArray	_targetsOH;		// One hot encoded targets.
-	NDArray	_logp;			// Log probability of logits.
+	NDArray		_lse;			// Log-sum-exp of each row of logits.
 
 public:
-				KoCrossEntropy(const NDArray& targets);
+				KoCrossEntropy(const NDArray& targets,const FP smoothing=0,const int ignoreIndex=-100);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	NDArrays	Saved() const override;
 };
\ No newline at end of file
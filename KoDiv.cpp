@@ -15,4 +15,17 @@ NDArrays KoDiv::Backward(const NDArray& gradient,const NDArrays& inputs)
 		NDData::ReverseBroadcast(gradient*inputs[1].Pow(-1),inputs[0].Shape()),					// y=x/c =x.c^-1, y'=c^-1
 		NDData::ReverseBroadcast(gradient*-1.0*inputs[0]*inputs[1].Pow(-2),inputs[1].Shape())	// y=c/x =c.x^-1, y'=-1.c.x^-2
 	};
+}
+
+
+bool KoDiv::InPlace() const
+{
+	return true;
+}
+
+
+bool KoDiv::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::div;
+	return true;
 }
\ No newline at end of file
@@ -10,12 +10,22 @@ NDArray KoDot::Forward(const NDArrays& inputs)
 NDArrays KoDot::Backward(const NDArray& gradient,const NDArrays& input)
 {
 	// Differential WRT each term is the other term, backprop [1].gradient to branch [0] and [0].gradient to branch [1].
-	return
-	{
-		// Gradient WRT _creator[0] is _creator[1] chained with the incoming gradient.
-		NDData::ReverseBroadcast(gradient.Dot(input[1].Transpose()),input[0].Shape()),
+	// The transposed terms are passed as flags to the matrix multiply so they're never copied.
+
+	// Gradient WRT _creator[0] is _creator[1] chained with the incoming gradient.
+	const NDArray gradient0 = NDData::ReverseBroadcast(gradient.Dot(input[1],false,true),input[0].Shape());
 
-		// Gradient WRT _creator[1] is _creator[0] chained with the incoming gradient.
-		NDData::ReverseBroadcast(input[0].Transpose().Dot(gradient),input[1].Shape())
-	};
+	// Gradient WRT _creator[1] is _creator[0] chained with the incoming gradient.
+	const NDShape& shape0 = input[0].Shape();
+	const NDShape& shape1 = input[1].Shape();
+	if(shape0.size()>2&&shape1.size()==2)
+	{
+		// 2D weights, (B,T,C) @ (C,H). Combine the batch dimensions so the weight gradient is a single (B*T,C)T @ (B*T,H) product,
+		// rather than a product per batch which is then summed.
+		const NDArray input0 = input[0].Reshape({-1,shape0[shape0.size()-1]});
+		const NDArray gradient2D = gradient.Reshape({-1,gradient.Shape()[gradient.Shape().size()-1]});
+		return {gradient0,input0.Dot(gradient2D,true,false)};
+	}
+	else
+		return {gradient0,NDData::ReverseBroadcast(input[0].Dot(gradient,true,false),shape1)};
 }
\ No newline at end of file
@@ -21,4 +21,22 @@ NDArrays KoDropout::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differentiation required, pass gradient scaled by dropout.
 		gradient*_dropout
 	};
+}
+
+
+NDArrays KoDropout::Saved() const
+{
+	return {_dropout};
+}
+
+
+bool KoDropout::ReadsInputs() const
+{
+	return false;	// Uses the dropout multiplier.
+}
+
+
+bool KoDropout::InPlace() const
+{
+	return true;
 }
\ No newline at end of file
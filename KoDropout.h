@@ -13,4 +13,7 @@ public:
 				KoDropout(const FP p);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	NDArrays	Saved() const override;
+	bool		ReadsInputs() const override;
+	bool		InPlace() const override;
 };
\ No newline at end of file
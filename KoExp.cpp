@@ -14,4 +14,17 @@ NDArrays KoExp::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// Derivative of y=e^x is y'=e^x.
 		gradient*inputs[0].Exp()
 	};
+}
+
+
+bool KoExp::InPlace() const
+{
+	return true;
+}
+
+
+bool KoExp::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::exp;
+	return true;
 }
\ No newline at end of file
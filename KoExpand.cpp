@@ -0,0 +1,30 @@
+#include "KoExpand.h"
+
+
+KoExpand::KoExpand(const NDShape& shape) :
+	_shape(shape)
+{
+}
+
+
+NDArray KoExpand::Forward(const NDArrays& inputs)
+{
+	// A view of the input, expanded dimensions have a zero stride.
+	return inputs[0].Expand(_shape);
+}
+
+
+NDArrays KoExpand::Backward(const NDArray& gradient,const NDArrays& inputs)
+{
+	return
+	{
+		// No differentiation required, sum the gradient over the dimensions that were expanded or added.
+		NDData::ReverseBroadcast(gradient,inputs[0].Shape())
+	};
+}
+
+
+bool KoExpand::ReadsInputs() const
+{
+	return false;	// Only the shape is used.
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Kernel.h"
+
+
+class KoExpand : public Kernel
+{
+	const NDShape	_shape;
+
+public:
+				KoExpand(const NDShape& shape);
+	NDArray		Forward(const NDArrays& input) override;
+	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
+};
\ No newline at end of file
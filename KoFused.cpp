@@ -0,0 +1,70 @@
+#include "KoFused.h"
+
+
+KoFused::KoFused(const fused_program& program) :
+	_program(program),
+	_reduce(false),
+	_dim(-1),
+	_keepDims(true),
+	_mean(false)
+{
+}
+
+
+KoFused::KoFused(const fused_program& program,const int dim,const bool keepDims,const bool mean) :
+	_program(program),
+	_reduce(true),
+	_dim(dim),
+	_keepDims(keepDims),
+	_mean(mean)
+{
+}
+
+
+int KoFused::Mask(const NDArrays& inputs) const
+{
+	if(!_reduce)
+		return 0;
+	if(_dim>=0)
+		return 1<<_dim;
+
+	// Every dimension of the inputs broadcast together.
+	int dims = 0;
+	for(const NDArray& input:inputs)
+		dims = (std::max)(dims,(int)input.Shape().size());
+	return (1<<dims)-1;
+}
+
+
+NDArray KoFused::Forward(const NDArrays& inputs)
+{
+	const int mask = Mask(inputs);
+	const NDArray r = NDData::Fused(_program,inputs,mask,_mean);
+	_reduced = r.Shape();
+	return _keepDims?r:NDData::DropDims(r,mask);
+}
+
+
+NDArrays KoFused::Backward(const NDArray& gradient,const NDArrays& inputs)
+{
+	// The gradient of a reduction is spread over the dimensions it reduced.
+	return NDData::FusedGradient(_program,inputs,Mask(inputs),_mean,_keepDims?gradient:gradient.Reshape(_reduced));
+}
+
+
+bool KoFused::ReadsInputs() const
+{
+	return !_program.Linear();	// Gradients of sums and differences don't depend on the values.
+}
+
+
+const fused_program& KoFused::Program() const
+{
+	return _program;
+}
+
+
+bool KoFused::Reduces() const
+{
+	return _reduce;
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Kernel.h"
+
+
+// Chain of elementwise kernels, optionally ending with a sum or mean, run as a single fused program (FusedKernels.h). Made by
+// Graph::Fuse from the kernels it replaces.
+//
+class KoFused : public Kernel
+{
+	const fused_program	_program;
+	const bool			_reduce;		// Sum or mean of the result of the program.
+	const int			_dim;			// Dimension reduced, -1 for all.
+	const bool			_keepDims;
+	const bool			_mean;
+
+	NDShape				_reduced;		// Shape of the reduction with its dimensions kept.
+
+	int			Mask(const NDArrays& inputs) const;
+
+public:
+				KoFused(const fused_program& program);
+				KoFused(const fused_program& program,const int dim,const bool keepDims,const bool mean);
+	NDArray		Forward(const NDArrays& inputs) override;
+	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
+
+	const fused_program&	Program() const;
+	bool					Reduces() const;
+};
\ No newline at end of file
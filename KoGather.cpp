@@ -24,4 +24,10 @@ NDArrays KoGather::Backward(const NDArray& gradient,const NDArrays& inputs)
 	{
 		inputs[0].Scatter(_dim,_indices,gradient)	// Scatter gradients over input.
 	};
+}
+
+
+bool KoGather::ReadsInputs() const
+{
+	return false;	// Gradient is scattered over zeros the shape of the input.
 }
\ No newline at end of file
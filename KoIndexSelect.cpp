@@ -19,4 +19,17 @@ NDArrays KoIndexSelect::Backward(const NDArray& gradient,const NDArrays& inputs)
 	{
 		inputs[0].UnindexSelect(_indices,gradient)
 	};
+}
+
+
+SparseRowsPtr KoIndexSelect::SparseBackward(const NDArray& gradient,const NDArrays& inputs)
+{
+	// Only the selected rows of the input have a gradient.
+	return SparseRows::New(inputs[0],_indices,gradient);
+}
+
+
+bool KoIndexSelect::ReadsInputs() const
+{
+	return false;	// Gradient rows are summed into zeros the shape of the input.
 }
\ No newline at end of file
@@ -11,4 +11,6 @@ public:
 				KoIndexSelect(const NDArray& indices);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
+	SparseRowsPtr	SparseBackward(const NDArray& gradient,const NDArrays& inputs) override;
 };
\ No newline at end of file
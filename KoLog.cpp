@@ -14,4 +14,17 @@ NDArrays KoLog::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// Derivative of ln(x) is 1/x. Differentiate WRT creator and pass backward using chain rule.
 		gradient*(inputs[0].Ones()/inputs[0])
 	};
+}
+
+
+bool KoLog::InPlace() const
+{
+	return true;
+}
+
+
+bool KoLog::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::log;
+	return true;
 }
\ No newline at end of file
@@ -8,4 +8,6 @@ class KoLog : public Kernel
 public:
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		InPlace() const override;
+	bool		Elementwise(fused_instruction& instruction) const override;
 };
\ No newline at end of file
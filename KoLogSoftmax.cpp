@@ -0,0 +1,37 @@
+#include "KoLogSoftmax.h"
+
+
+KoLogSoftmax::KoLogSoftmax(const int dim) :
+	_dim(dim)
+{
+}
+
+
+NDArray KoLogSoftmax::Forward(const NDArrays& inputs)
+{
+	_output._Attach(inputs[0].LogSoftmax(_dim));	// Store the log softmax for use in Backward.
+	return _output;
+}
+
+
+NDArrays KoLogSoftmax::Backward(const NDArray& gradient,const NDArrays& inputs)
+{
+	_ASSERT_EXPR(inputs.size()==1,"KoLogSoftmax::Backward: inputs.size() must be 1");
+	return
+	{
+		// Differential of x[i]-log(sum(e^x)) WRT x[j] is 1(i==j)-softmax(x)[j], multiplied by the gradient this is g-softmax(x)*sum(g) per row.
+		_output.LogSoftmaxGradient(gradient,_dim)
+	};
+}
+
+
+NDArrays KoLogSoftmax::Saved() const
+{
+	return {_output};
+}
+
+
+bool KoLogSoftmax::ReadsInputs() const
+{
+	return false;	// Uses the output.
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Kernel.h"
+
+
+class KoLogSoftmax : public Kernel
+{
+	const int	_dim;		// Dimension to normalise over.
+	NDArray		_output;	// Store the log softmax for use in Backward.
+
+public:
+				KoLogSoftmax(const int dim);
+	NDArray		Forward(const NDArrays& inputs) override;
+	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	NDArrays	Saved() const override;
+	bool		ReadsInputs() const override;
+};
\ No newline at end of file
@@ -21,4 +21,16 @@ NDArrays KoMaskedFill::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differation required, masked gradients must be zeroed (achieved by multiplying by the inverse of the mask).
 		gradient*(_mask==_mask.Zeros())
 	};
+}
+
+
+bool KoMaskedFill::ReadsInputs() const
+{
+	return false;	// Uses the mask.
+}
+
+
+bool KoMaskedFill::InPlace() const
+{
+	return true;
 }
\ No newline at end of file
@@ -12,4 +12,6 @@ public:
 				KoMaskedFill(const NDArray& mask,const FP value);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
+	bool		InPlace() const override;
 };
\ No newline at end of file
@@ -9,14 +9,16 @@ KoMax::KoMax(const int dim) :
 
 NDArray KoMax::Forward(const NDArrays& inputs)
 {
-	_argmax._Attach(inputs[0].ArgMax(_dim));		// Store the argmax for use in Backward.
-	NDArray max_a = inputs[0].Gather(_dim,_argmax);	// Gather the maximum values along the specified dimension.
-	NDArray max_b = inputs[0].Max(_dim);
+	NDArray max_a = inputs[0].Max(_dim,_argmax);	// Maximum values along the specified dimension, and the argmax for use in Backward.
+#ifdef _DEBUG
+	// Cross check against gathering the argmax.
+	NDArray max_b = inputs[0].Gather(_dim,_argmax);
 	if(!max_a.IsEqualTo(max_b))
 	{
 		// If the max values are not equal, this is a bug.
 		throw IncompatibleShape(max_a.Shape(),max_b.Shape());
 	}
+#endif
 	return max_a;
 }
 
@@ -29,4 +31,16 @@ NDArrays KoMax::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differentiation required, pass gradient where the input was the maximum.
 		inputs[0].Scatter(_dim,_argmax,gradient)
 	};
+}
+
+
+NDArrays KoMax::Saved() const
+{
+	return {_argmax};
+}
+
+
+bool KoMax::ReadsInputs() const
+{
+	return false;	// Gradient is scattered over zeros the shape of the input.
 }
\ No newline at end of file
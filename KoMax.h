@@ -12,4 +12,6 @@ public:
 				KoMax(const int dim);
 	NDArray		Forward(const NDArrays& inputs) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	NDArrays	Saved() const override;
+	bool		ReadsInputs() const override;
 };
\ No newline at end of file
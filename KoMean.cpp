@@ -63,4 +63,19 @@ NDArrays KoMean::Backward(const NDArray& gradient,const NDArrays& inputs)
 		return Scalar_Backward(gradient,inputs);
 	else
 		return OneDim_Backward(gradient,inputs);
+}
+
+
+bool KoMean::ReadsInputs() const
+{
+	return false;	// Gradient is spread over the shape of the input.
+}
+
+
+bool KoMean::Reduction(int& dim,bool& keepDims,bool& mean) const
+{
+	dim = _dim;
+	keepDims = _keepDims;
+	mean = true;
+	return true;
 }
\ No newline at end of file
@@ -15,4 +15,17 @@ NDArrays KoMul::Backward(const NDArray& gradient,const NDArrays& inputs)
 		NDData::ReverseBroadcast(gradient*inputs[1],inputs[0].Shape()),
 		NDData::ReverseBroadcast(gradient*inputs[0],inputs[1].Shape())
 	};
+}
+
+
+bool KoMul::InPlace() const
+{
+	return true;
+}
+
+
+bool KoMul::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::mul;
+	return true;
 }
\ No newline at end of file
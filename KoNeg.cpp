@@ -14,4 +14,23 @@ NDArrays KoNeg::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// Negate the gradient and backprop.
 		-gradient
 	};
+}
+
+
+bool KoNeg::ReadsInputs() const
+{
+	return false;	// Gradient is only negated.
+}
+
+
+bool KoNeg::InPlace() const
+{
+	return true;
+}
+
+
+bool KoNeg::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::negate;
+	return true;
 }
\ No newline at end of file
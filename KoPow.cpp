@@ -20,4 +20,18 @@ NDArrays KoPow::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// Power rule WRT creator n.x^y --> y.n.x^(y-1).
 		gradient*(inputs[0].Pow(_exponent-1)*_exponent)
 	};
+}
+
+
+bool KoPow::InPlace() const
+{
+	return true;
+}
+
+
+bool KoPow::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::pow;
+	instruction.exponent = _exponent;
+	return true;
 }
\ No newline at end of file
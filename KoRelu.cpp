@@ -13,4 +13,17 @@ NDArrays KoRelu::Backward(const NDArray& gradient,const NDArrays& inputs)
 	{
 		(inputs[0]>0)*gradient
 	};
+}
+
+
+bool KoRelu::InPlace() const
+{
+	return true;
+}
+
+
+bool KoRelu::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::relu;
+	return true;
 }
\ No newline at end of file
@@ -21,4 +21,10 @@ NDArrays KoRepeat::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differentiation required, sum the gradient along the dimension that was expanded and backprop.
 		gradient.Sum(_dim,true)		// KeepDim because Expand does not add a dimension.
 	};
+}
+
+
+bool KoRepeat::ReadsInputs() const
+{
+	return false;	// Gradient is summed.
 }
\ No newline at end of file
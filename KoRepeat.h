@@ -12,4 +12,5 @@ public:
 				KoRepeat(const int dim,const int copies);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
 };
\ No newline at end of file
@@ -21,4 +21,10 @@ NDArrays KoReshape::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differentiation required, restore original shape.
 		gradient.Reshape(std::initializer_list(shape.data(),shape.data()+shape.size()))
 	};
+}
+
+
+bool KoReshape::ReadsInputs() const
+{
+	return false;	// Only the shape is restored.
 }
\ No newline at end of file
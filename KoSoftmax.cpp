@@ -0,0 +1,37 @@
+#include "KoSoftmax.h"
+
+
+KoSoftmax::KoSoftmax(const int dim) :
+	_dim(dim)
+{
+}
+
+
+NDArray KoSoftmax::Forward(const NDArrays& inputs)
+{
+	_output._Attach(inputs[0].Softmax(_dim));	// Store the softmax for use in Backward.
+	return _output;
+}
+
+
+NDArrays KoSoftmax::Backward(const NDArray& gradient,const NDArrays& inputs)
+{
+	_ASSERT_EXPR(inputs.size()==1,"KoSoftmax::Backward: inputs.size() must be 1");
+	return
+	{
+		// Jacobian of softmax is diag(y)-y.y^T, multiplied by the gradient this collapses to y*(g-sum(g*y)) per row.
+		_output.SoftmaxGradient(gradient,_dim)
+	};
+}
+
+
+NDArrays KoSoftmax::Saved() const
+{
+	return {_output};
+}
+
+
+bool KoSoftmax::ReadsInputs() const
+{
+	return false;	// Uses the output.
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Kernel.h"
+
+
+class KoSoftmax : public Kernel
+{
+	const int	_dim;		// Dimension to normalise over.
+	NDArray		_output;	// Store the softmax for use in Backward.
+
+public:
+				KoSoftmax(const int dim);
+	NDArray		Forward(const NDArrays& inputs) override;
+	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	NDArrays	Saved() const override;
+	bool		ReadsInputs() const override;
+};
\ No newline at end of file
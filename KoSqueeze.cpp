@@ -9,20 +9,22 @@ KoSqueeze::KoSqueeze(const int dim) :
 
 NDArray KoSqueeze::Forward(const NDArrays& inputs)
 {
-	// Remove dimension.
-	NDShape shape = inputs[0].Shape();
-	shape.erase(shape.begin()+_dim);
-	return inputs[0].Reshape(shape);
+	// Remove dimension, a view of the input.
+	return inputs[0].Squeeze(_dim);
 }
 
 
 NDArrays KoSqueeze::Backward(const NDArray& gradient,const NDArrays& inputs)
 {
 	// No differentiation equired, add dimension that was removed from the shape.
-	NDShape newShape(gradient.Shape());
-	newShape.insert(newShape.begin()+_dim,1);
 	return
 	{
-		gradient.Reshape(newShape)
+		gradient.Unsqueeze(_dim)
 	};
+}
+
+
+bool KoSqueeze::ReadsInputs() const
+{
+	return false;	// Only the shape is restored.
 }
\ No newline at end of file
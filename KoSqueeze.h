@@ -11,4 +11,5 @@ public:
 				KoSqueeze(const int dim);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
 };
\ No newline at end of file
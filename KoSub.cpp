@@ -15,4 +15,23 @@ NDArrays KoSub::Backward(const NDArray& gradient,const NDArrays& inputs)
 		NDData::ReverseBroadcast(gradient,inputs[0].Shape()),
 		NDData::ReverseBroadcast(-gradient,inputs[1].Shape())
 	};
+}
+
+
+bool KoSub::ReadsInputs() const
+{
+	return false;	// Only the shapes are needed to reverse the broadcast.
+}
+
+
+bool KoSub::InPlace() const
+{
+	return true;
+}
+
+
+bool KoSub::Elementwise(fused_instruction& instruction) const
+{
+	instruction.op = fused_op::sub;
+	return true;
 }
\ No newline at end of file
@@ -22,4 +22,19 @@ NDArrays KoSum::Backward(const NDArray& gradient,const NDArrays& inputs)
 		(_keepDims?gradient:gradient.Unsqueeze(_dim))		// Optionally reinstate dimension that was removed.
 			.Repeat_Numpy(_dim,inputs[0].Shape()[_dim])		// Expand gradient along the dimension the sum was performed.
 	};
+}
+
+
+bool KoSum::ReadsInputs() const
+{
+	return false;	// Gradient is repeated to the shape of the input.
+}
+
+
+bool KoSum::Reduction(int& dim,bool& keepDims,bool& mean) const
+{
+	dim = _dim;
+	keepDims = _keepDims;
+	mean = false;
+	return true;
 }
\ No newline at end of file
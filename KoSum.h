@@ -12,4 +12,6 @@ public:
 				KoSum(const int dim,const bool keepDims);
 	NDArray		Forward(const NDArrays& input) override;
 	NDArrays	Backward(const NDArray& gradient,const NDArrays& inputs) override;
+	bool		ReadsInputs() const override;
+	bool		Reduction(int& dim,bool& keepDims,bool& mean) const override;
 };
\ No newline at end of file
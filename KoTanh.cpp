@@ -9,9 +9,23 @@ NDArray KoTanh::Forward(const NDArrays& inputs)
 
 NDArrays KoTanh::Backward(const NDArray& gradient,const NDArrays& inputs)
 {
+        const NDArray y = inputs[0].Tanh();
         return
         {
                 // Differential of tanh(x) WRT x is 1 - tanh(x)^2; multiply this by the gradient and backprop.
-                (gradient.Ones()-(inputs[0].Tanh()*inputs[0].Tanh()))*gradient
+                (gradient.Ones()-y*y)*gradient
         };
+}
+
+
+bool KoTanh::InPlace() const
+{
+        return true;
+}
+
+
+bool KoTanh::Elementwise(fused_instruction& instruction) const
+{
+        instruction.op = fused_op::tanh;
+        return true;
 }
\ No newline at end of file
@@ -14,4 +14,10 @@ NDArrays KoTranspose::Backward(const NDArray& gradient,const NDArrays& inputs)
 		// No differentiation required, last two dimensions must be transposed.
 		gradient.Transpose()
 	};
+}
+
+
+bool KoTranspose::ReadsInputs() const
+{
+	return false;	// Gradient is only transposed.
 }
\ No newline at end of file
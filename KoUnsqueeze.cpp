@@ -16,10 +16,14 @@ NDArray KoUnsqueeze::Forward(const NDArrays& inputs)
 NDArrays KoUnsqueeze::Backward(const NDArray& gradient,const NDArrays& inputs)
 {
 	// No differentiation required, remove the extra dimension that was added to the shape.
-	NDShape shape(gradient.Shape());
-	shape.erase(shape.begin()+_dim);	// Should now be the same shape as the creator, so could have just used as a short	
 	return
 	{
-		gradient.Reshape(shape)
+		gradient.Squeeze(_dim)
 	};
+}
+
+
+bool KoUnsqueeze::ReadsInputs() const
+{
+	return false;	// Only the shape is restored.
 }
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "MatMulDispatcher.h"
+#include "TiledMatMul.h"
+#include "PackedMatMul.h"
+#include "Tools.h"
+
+
+#ifdef AUTOGRAD_CUDA
+
+void CudaMatMul(const float* const h_A,const float* const h_B,float* const h_C,const unsigned int M,const unsigned int K,const unsigned int N);
+
+
+// C(m,n) = A(m,k) @ B(k,n) on the GPU.
+//	The CUDA kernel expects contiguous row major matrices, so strided operands and results are staged through row major buffers.
+//
+static void cuda_gemm(
+	const int m,const int n,const int k,
+	const float* const a,const int a_rs,const int a_cs,
+	const float* const b,const int b_rs,const int b_cs,
+	float* const c,const int ldc)
+{
+	if(m==0||n==0)
+		return;
+	if(k==0)
+	{
+		for(int i=0;i<m;++i)
+			memset(c+i*ldc,0,n*sizeof(float));
+		return;
+	}
+
+	float* const a_copy = a_rs==k&&a_cs==1?nullptr:copy_to_row_major(a,m,k,a_rs,a_cs);
+	float* const b_copy = b_rs==n&&b_cs==1?nullptr:copy_to_row_major(b,k,n,b_rs,b_cs);
+	float* const c_copy = ldc==n?nullptr:mem.Alloc<float>((size_t)m*n);
+
+	CudaMatMul(a_copy?a_copy:a,b_copy?b_copy:b,c_copy?c_copy:c,m,k,n);
+
+	if(c_copy)
+	{
+		for(int i=0;i<m;++i)
+			memcpy(c+i*ldc,c_copy+i*n,n*sizeof(float));
+		mem.Free(c_copy);
+	}
+	if(a_copy)
+		mem.Free(a_copy);
+	if(b_copy)
+		mem.Free(b_copy);
+}
+
+#endif
+
+
+MatMulDispatcher MatMulDispatcher::_dispatcher;
+
+
+MatMulDispatcher::MatMulDispatcher() :
+	_selected(nullptr)
+{
+	// Built-in backends - the packed GEMM handles everything that isn't large enough to amortise the host-device copies.
+	Register("tiled",tiled_gemm,nullptr,-1);
+	Register("packed",gemm,gemm_batched,0);
+#ifdef AUTOGRAD_CUDA
+	Register("cuda",cuda_gemm,nullptr,512LL*512*512);
+#endif
+
+	// Startup override, an unknown backend is reported rather than thrown (there's nothing to catch it during static initialisation).
+	const std::string name = GetEnv("AUTOGRAD_MATMUL");
+	if(!name.empty())
+	{
+		if(name=="auto"||_Find(name))
+			_Select(name);
+		else
+			std::cerr<<"Unknown matmul backend '"<<name<<"' in AUTOGRAD_MATMUL, using automatic selection."<<std::endl;
+	}
+}
\ No newline at end of file
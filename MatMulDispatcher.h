@@ -0,0 +1,303 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Exceptions.h"
+
+
+// Matrix multiplication backend registry.
+// =======================================
+//
+// Every backend implements the same strided GEMM, C(m,n) = A(m,k) @ B(k,n), and is registered with the size of product (multiply-adds)
+// from which it should be chosen automatically. By default the backend with the largest threshold not exceeding the size of the product
+// is used, so small products stay on the CPU and only large products pay the cost of copying to a device.
+//
+// The backend can be forced for all calls by name with Select() or with the AUTOGRAD_MATMUL environment variable (e.g. "tiled", "packed",
+// "cuda" or "auto"), or per call by passing the name to MatMul().
+//
+// Each backend counts its calls, floating point operations and time so Print() shows where matrix multiplication time goes.
+//
+// Backends may be registered and selected while other threads multiply: the list of backends is locked, the selection is atomic and a
+// replaced backend is kept (retired) so a call already using it can finish.
+//
+class MatMulDispatcher
+{
+public:
+	// Strided GEMM.
+	//	A and B are addressed through row and column strides, C is row major with row stride 'ldc' and is overwritten.
+	//
+	typedef void (*Function)(
+		const int m,const int n,const int k,
+		const float* const a,const int a_rs,const int a_cs,
+		const float* const b,const int b_rs,const int b_cs,
+		float* const c,const int ldc);
+
+	// Strided batched GEMM, C[i] = A[i] @ B[i] where matrix i of each operand starts 'i*x_bs' elements after the first.
+	//
+	typedef void (*BatchedFunction)(
+		const int batch,const int m,const int n,const int k,
+		const float* const a,const int a_bs,const int a_rs,const int a_cs,
+		const float* const b,const int b_bs,const int b_rs,const int b_cs,
+		float* const c,const int c_bs,const int ldc);
+
+	class Backend
+	{
+		const std::string		_name;
+		const Function			_function;
+		const BatchedFunction	_batchedFunction;	// Optional, otherwise '_function' is called for each matrix in the batch.
+		const long long			_autoThreshold;	// Minimum multiply-adds for automatic selection, negative if only used when selected by name.
+		std::atomic<long long>	_calls;
+		std::atomic<long long>	_flops;
+		std::atomic<long long>	_nanoseconds;
+
+	public:
+		Backend(const std::string& name,const Function function,const BatchedFunction batchedFunction,const long long autoThreshold) :
+			_name(name),
+			_function(function),
+			_batchedFunction(batchedFunction),
+			_autoThreshold(autoThreshold),
+			_calls(0),
+			_flops(0),
+			_nanoseconds(0)
+		{
+		}
+
+		const std::string& Name() const
+		{
+			return _name;
+		}
+
+		long long AutoThreshold() const
+		{
+			return _autoThreshold;
+		}
+
+		long long Calls() const
+		{
+			return _calls;
+		}
+
+		long long Flops() const
+		{
+			return _flops;
+		}
+
+		double Seconds() const
+		{
+			return _nanoseconds*1e-9;
+		}
+
+		void ResetCounters()
+		{
+			_calls = 0;
+			_flops = 0;
+			_nanoseconds = 0;
+		}
+
+		// Runs the GEMM and updates the counters.
+		//
+		void Run(
+			const int m,const int n,const int k,
+			const float* const a,const int a_rs,const int a_cs,
+			const float* const b,const int b_rs,const int b_cs,
+			float* const c,const int ldc)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			_function(m,n,k,a,a_rs,a_cs,b,b_rs,b_cs,c,ldc);
+			const auto end = std::chrono::steady_clock::now();
+
+			++_calls;
+			_flops += 2LL*m*n*k;
+			_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
+		}
+
+		// Runs the batched GEMM and updates the counters (one call per batch).
+		//
+		void RunBatched(
+			const int batch,const int m,const int n,const int k,
+			const float* const a,const int a_bs,const int a_rs,const int a_cs,
+			const float* const b,const int b_bs,const int b_rs,const int b_cs,
+			float* const c,const int c_bs,const int ldc)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			if(_batchedFunction)
+				_batchedFunction(batch,m,n,k,a,a_bs,a_rs,a_cs,b,b_bs,b_rs,b_cs,c,c_bs,ldc);
+			else
+			{
+				for(int i=0;i<batch;++i)
+					_function(m,n,k,a+(size_t)i*a_bs,a_rs,a_cs,b+(size_t)i*b_bs,b_rs,b_cs,c+(size_t)i*c_bs,ldc);
+			}
+			const auto end = std::chrono::steady_clock::now();
+
+			++_calls;
+			_flops += 2LL*batch*m*n*k;
+			_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
+		}
+	};
+
+private:
+	static MatMulDispatcher	_dispatcher;
+
+	mutable std::mutex						_lock;		// Protects '_backends' and '_retired'.
+	std::vector<std::unique_ptr<Backend>>	_backends;
+	std::vector<std::unique_ptr<Backend>>	_retired;	// Backends replaced by Register, which may still be running.
+	std::atomic<Backend*>					_selected;	// Backend used for all calls, nullptr for automatic selection.
+
+	MatMulDispatcher();
+
+	Backend* _Find(const std::string& name) const
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		for(const auto& backend:_backends)
+			if(backend->Name()==name)
+				return backend.get();
+		return nullptr;
+	}
+
+	// Returns the backend for a product of 'work' multiply-adds.
+	//
+	Backend& _Choose(const long long work) const
+	{
+		Backend* const selected = _selected;
+		if(selected)
+			return *selected;
+
+		std::unique_lock<std::mutex> lock(_lock);
+		Backend* chosen = nullptr;
+		for(const auto& backend:_backends)
+		{
+			const long long threshold = backend->AutoThreshold();
+			if(threshold>=0&&threshold<=work&&(!chosen||threshold>chosen->AutoThreshold()))
+				chosen = backend.get();
+		}
+		if(!chosen)
+			throw Exception("No matmul backend available.");
+		return *chosen;
+	}
+
+	void _Select(const std::string& name)
+	{
+		if(name.empty()||name=="auto")
+		{
+			_selected = nullptr;
+			return;
+		}
+		Backend* const backend = _Find(name);
+		if(!backend)
+			throw Exception("Unknown matmul backend '"+name+"'.");
+		_selected = backend;
+	}
+
+public:
+	// Registers a backend, replacing any existing backend with the same name.
+	//	'batchedFunction' is optional.
+	//
+	static void Register(const std::string& name,const Function function,const BatchedFunction batchedFunction,const long long autoThreshold)
+	{
+		std::unique_lock<std::mutex> lock(_dispatcher._lock);
+		auto& backends = _dispatcher._backends;
+		for(auto& backend:backends)
+		{
+			if(backend->Name()==name)
+			{
+				Backend* selected = backend.get();
+				_dispatcher._selected.compare_exchange_strong(selected,nullptr);
+				_dispatcher._retired.emplace_back(std::move(backend));
+				backend.reset(new Backend(name,function,batchedFunction,autoThreshold));
+				return;
+			}
+		}
+		backends.emplace_back(new Backend(name,function,batchedFunction,autoThreshold));
+	}
+
+	// Forces the named backend for all calls, "auto" restores selection by size.
+	//
+	static void Select(const std::string& name)
+	{
+		_dispatcher._Select(name);
+	}
+
+	// Returns 'true' if the named backend is registered (e.g. "cuda" is only registered in CUDA builds).
+	//
+	static bool IsAvailable(const std::string& name)
+	{
+		return _dispatcher._Find(name)!=nullptr;
+	}
+
+	// C(m,n) = A(m,k) @ B(k,n) using the selected backend, or the named backend if 'name' is not null.
+	//
+	static void MatMul(
+		const int m,const int n,const int k,
+		const float* const a,const int a_rs,const int a_cs,
+		const float* const b,const int b_rs,const int b_cs,
+		float* const c,const int ldc,
+		const char* const name=nullptr)
+	{
+		Backend* backend = nullptr;
+		if(name)
+		{
+			backend = _dispatcher._Find(name);
+			if(!backend)
+				throw Exception(std::string("Unknown matmul backend '")+name+"'.");
+		}
+		else
+			backend = &_dispatcher._Choose((long long)m*n*k);
+
+		backend->Run(m,n,k,a,a_rs,a_cs,b,b_rs,b_cs,c,ldc);
+	}
+
+	// C[i](m,n) = A[i](m,k) @ B[i](k,n) for i in [0,batch) using the selected backend, or the named backend if 'name' is not null.
+	//	The backend is chosen from the size of the whole batch.
+	//
+	static void MatMulBatched(
+		const int batch,const int m,const int n,const int k,
+		const float* const a,const int a_bs,const int a_rs,const int a_cs,
+		const float* const b,const int b_bs,const int b_rs,const int b_cs,
+		float* const c,const int c_bs,const int ldc,
+		const char* const name=nullptr)
+	{
+		Backend* backend = nullptr;
+		if(name)
+		{
+			backend = _dispatcher._Find(name);
+			if(!backend)
+				throw Exception(std::string("Unknown matmul backend '")+name+"'.");
+		}
+		else
+			backend = &_dispatcher._Choose((long long)batch*m*n*k);
+
+		backend->RunBatched(batch,m,n,k,a,a_bs,a_rs,a_cs,b,b_bs,b_rs,b_cs,c,c_bs,ldc);
+	}
+
+	static void ResetCounters()
+	{
+		std::unique_lock<std::mutex> lock(_dispatcher._lock);
+		for(auto& backend:_dispatcher._backends)
+			backend->ResetCounters();
+	}
+
+	// Prints the counters of each backend.
+	//
+	static void Print(std::ostream& os)
+	{
+		const Backend* const selected = _dispatcher._selected;
+		os<<"MatMul backends ("<<(selected?selected->Name():"auto")<<")"<<std::endl;
+		std::unique_lock<std::mutex> lock(_dispatcher._lock);
+		for(const auto& backend:_dispatcher._backends)
+		{
+			const double seconds = backend->Seconds();
+			os<<"  "<<std::left<<std::setw(8)<<backend->Name()<<std::right
+				<<" calls "<<std::setw(10)<<backend->Calls()
+				<<" GFLOP "<<std::setw(12)<<std::fixed<<std::setprecision(3)<<backend->Flops()*1e-9
+				<<" seconds "<<std::setw(10)<<seconds
+				<<" GFLOP/s "<<std::setw(8)<<(seconds>0.0?backend->Flops()*1e-9/seconds:0.0)
+				<<std::defaultfloat<<std::endl;
+		}
+	}
+};
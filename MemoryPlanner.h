@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include "Graph.h"
+
+
+typedef std::shared_ptr<class MemoryPlanner> MemoryPlannerPtr;
+
+// Activation memory plan for a captured step.
+//
+// Every array the step holds between operations (the outputs of kernels, arrays kernels keep for backward and the gradients of
+// outputs) has a lifetime: the steps from the one that creates it to the last that reads it. Forward steps are numbered by node,
+// then backward steps follow in the order recorded by the Graph. An output lives until the last of its children has run forward
+// and, if the child's kernel reads its inputs (Kernel::ReadsInputs), backward. A view lives in the memory of the array it's a view of.
+// A gradient lives from the first child passing it back to its own backward step.
+//
+// Arrays whose lifetimes don't overlap share memory. Each is given an offset into a single slab, the largest first, at the lowest
+// offset clear of every array already placed that is live at the same time. The output of an in-place kernel (Kernel::InPlace) takes
+// the memory of its first input when the input is last used by that kernel (and isn't also another of its inputs).
+//
+// The inputs, parameters and their gradients are outside the plan. Apply places the outputs of elementwise kernels in a slab so Replay
+// writes them there, the rest of the plan is only reported.
+//
+class MemoryPlanner
+{
+public:
+	static const int Alignment = 64/sizeof(FP);		// Elements in 64 bytes.
+
+	enum class Kind
+	{
+		Output,
+		Saved,
+		Gradient
+	};
+
+	struct Buffer
+	{
+		Kind	kind;
+		int		node;		// Node the array belongs to.
+		int		size;		// Elements.
+		int		first;		// First step the array is live.
+		int		last;		// Last step the array is live.
+		int		offset;		// Elements from the start of the slab.
+	};
+
+private:
+	const GraphPtr		_graph;
+	std::vector<Buffer>	_buffers;
+	std::vector<int>	_outputs;	// Buffer holding the output of each node, -1 if it's a view of an array outside the graph.
+	int					_steps;		// Forward then backward steps.
+	int					_naive;		// Elements with every array in its own memory.
+	int					_live;		// Elements live at the busiest step.
+	int					_size;		// Elements in the slab.
+
+	// Private class to prevent constructor being called directly.
+	class P
+	{
+	};
+
+	// Lowest offset for 'buffer' clear of the placed buffers live at the same time.
+	//
+	int Place(const Buffer& buffer,const std::vector<const Buffer*>& placed) const
+	{
+		std::vector<const Buffer*> live;
+		for(const Buffer* other:placed)
+			if(other->first<=buffer.last&&buffer.first<=other->last)
+				live.push_back(other);
+		std::sort(live.begin(),live.end(),[](const Buffer* a,const Buffer* b){return a->offset<b->offset;});
+		int offset = 0;
+		for(const Buffer* other:live)
+		{
+			if(offset+buffer.size<=other->offset)
+				break;
+			offset = (std::max)(offset,(other->offset+other->size+Alignment-1)/Alignment*Alignment);
+		}
+		return offset;
+	}
+
+public:
+	static MemoryPlannerPtr New(const GraphPtr& graph)
+	{
+		return std::make_shared<MemoryPlanner>(P(),graph);
+	}
+
+	MemoryPlanner(const P&,const GraphPtr& graph) :
+		_graph(graph),
+		_naive(0),
+		_live(0),
+		_size(0)
+	{
+		const std::vector<TensorPtr>& nodes = graph->Nodes();
+		const std::vector<Graph::NodeMemory>& memory = graph->Memory();
+		const std::vector<Tensor*>& order = graph->Order();
+		const int count = (int)nodes.size();
+		_steps = count+(int)order.size();
+
+		std::unordered_map<const Tensor*,int> index;
+		for(int i=0;i<count;++i)
+			index[nodes[i].get()] = i;
+		auto node = [&index](const TensorPtr& tensor)
+		{
+			const auto i = index.find(tensor.get());
+			return i==index.end()?-1:i->second;
+		};
+
+		// Backward step of each node, -1 if it has none.
+		std::vector<int> backward(count,-1);
+		for(int i=0;i<(int)order.size();++i)
+		{
+			const auto j = index.find(order[i]);
+			if(j!=index.end())
+				backward[j->second] = count+i;
+		}
+
+		// Last step reading the memory of each node's output, and the first gradient passed back to it.
+		std::vector<int> last(count);
+		std::vector<int> gradient(count,_steps);
+		for(int i=0;i<count;++i)
+			last[i] = i;
+		auto use = [&](const int n,const int step)
+		{
+			if(n>=0&&memory[n].owner>=0)
+				last[memory[n].owner] = (std::max)(last[memory[n].owner],step);
+		};
+		for(int i=0;i<count;++i)
+		{
+			use(i,i);
+			for(auto& creator:nodes[i]->_creators)
+			{
+				const int n = node(creator);
+				use(n,i);
+				if(backward[i]>=0)
+				{
+					if(nodes[i]->_kernel->ReadsInputs())
+						use(n,backward[i]);
+					if(n>=0)
+						gradient[n] = (std::min)(gradient[n],backward[i]);
+				}
+			}
+			for(const int n:memory[i].keeps)
+				use(n,(std::max)(i,backward[i]));
+		}
+		const int loss = node(graph->Loss());
+		use(loss,_steps-1);		// Returned.
+		if(loss>=0)
+			gradient[loss] = count;
+
+		// Buffers, an in-place output takes the buffer of its first input if that's not read afterwards.
+		_outputs.assign(count,-1);
+		for(int i=0;i<count;++i)
+		{
+			const int size = memory[i].size;
+			if(memory[i].owner==i)
+			{
+				_naive += size;
+				const int input = nodes[i]->_creators.empty()?-1:node(nodes[i]->_creators[0]);
+				const bool aliased = input>=0&&std::any_of(nodes[i]->_creators.begin()+1,nodes[i]->_creators.end(),[&](const TensorPtr& creator)
+				{
+					const int n = node(creator);
+					return n>=0&&memory[n].owner==input;
+				});
+				if(nodes[i]->_kernel->InPlace()&&input>=0&&memory[input].owner==input&&last[input]==i&&!aliased&&_buffers[_outputs[input]].size>=size)
+				{
+					_outputs[i] = _outputs[input];
+					_buffers[_outputs[i]].last = last[i];
+				}
+				else
+				{
+					_outputs[i] = (int)_buffers.size();
+					_buffers.push_back({Kind::Output,i,size,i,last[i],0});
+				}
+			}
+			for(const int saved:memory[i].saved)
+			{
+				_naive += saved;
+				_buffers.push_back({Kind::Saved,i,saved,i,(std::max)(i,backward[i]),0});
+			}
+			if(backward[i]>=0&&gradient[i]<_steps)
+			{
+				_naive += size;
+				_buffers.push_back({Kind::Gradient,i,size,gradient[i],i==loss?_steps-1:backward[i],0});
+			}
+		}
+		for(int i=0;i<count;++i)
+			if(memory[i].owner>=0&&memory[i].owner!=i)
+				_outputs[i] = _outputs[memory[i].owner];
+
+		// Elements live at each step.
+		std::vector<int> live(_steps,0);
+		for(const Buffer& buffer:_buffers)
+			for(int step=buffer.first;step<=buffer.last;++step)
+				live[step] += buffer.size;
+		_live = live.empty()?0:*std::max_element(live.begin(),live.end());
+
+		// Place the largest first, then the earliest.
+		std::vector<Buffer*> sorted;
+		for(Buffer& buffer:_buffers)
+			sorted.push_back(&buffer);
+		std::sort(sorted.begin(),sorted.end(),[](const Buffer* a,const Buffer* b)
+		{
+			return a->size!=b->size?a->size>b->size:a->first<b->first;
+		});
+		std::vector<const Buffer*> placed;
+		for(Buffer* buffer:sorted)
+		{
+			buffer->offset = Place(*buffer,placed);
+			_size = (std::max)(_size,buffer->offset+buffer->size);
+			placed.push_back(buffer);
+		}
+	}
+
+	const std::vector<Buffer>& Buffers() const
+	{
+		return _buffers;
+	}
+
+	// Buffer holding the output of a node (or the array it's a view of), -1 if it's outside the graph.
+	//
+	int OutputBuffer(const int node) const
+	{
+		return _outputs[node];
+	}
+
+	int Steps() const
+	{
+		return _steps;
+	}
+
+	// Elements needed with every array in its own memory for the whole step.
+	//
+	int Naive() const
+	{
+		return _naive;
+	}
+
+	// Elements live at the busiest step, no plan of these lifetimes needs less.
+	//
+	int Live() const
+	{
+		return _live;
+	}
+
+	// Elements in the slab, the planned peak.
+	//
+	int Size() const
+	{
+		return _size;
+	}
+
+	// Returns a new slab, a single allocation for every buffer.
+	//
+	NDArray Slab() const
+	{
+		return NDData::New({_size},0.0f);
+	}
+
+	// Returns the memory planned for a buffer in 'slab', as an array of the given shape (of at most the buffer's size).
+	//
+	NDArray View(const NDArray& slab,const int buffer,const NDShape& shape) const
+	{
+		int size = 1;
+		for(int i=0;i<shape.size();++i)
+			size *= shape[i];
+		if(size>_buffers[buffer].size)
+			throw IncompatibleShape(shape,NDShape({_buffers[buffer].size}));
+		return NDData::New(*slab,_buffers[buffer].offset,shape);
+	}
+
+	// Places the output of each node with an elementwise kernel (Graph::Program) in its buffer of a new slab, so Replay writes it there
+	// rather than allocating it. Returns the slab.
+	//
+	NDArray Apply() const
+	{
+		const NDArray slab = Slab();
+		const std::vector<Graph::NodeMemory>& memory = _graph->Memory();
+		for(int i=0;i<(int)memory.size();++i)
+		{
+			fused_program program;
+			if(memory[i].owner==i&&_graph->Program(i,program))
+				_graph->Place(i,View(slab,_outputs[i],memory[i].shape));
+		}
+		return slab;
+	}
+
+	// Planned and naive peaks.
+	//
+	void Print(std::ostream& out) const
+	{
+		out<<"Memory plan: "<<_buffers.size()<<" buffers over "<<_steps<<" steps, planned peak "<<_size*sizeof(FP)<<" bytes, live peak "
+			<<_live*sizeof(FP)<<" bytes, naive peak "<<_naive*sizeof(FP)<<" bytes."<<std::endl;
+	}
+};
\ No newline at end of file
@@ -3,10 +3,13 @@
 #include <initializer_list>
 #include <vector>
 #include "Layer.h"
+#include "ParameterArena.h"
 
 
 class Model : public Layer
 {
+	ParameterArenaPtr	_arena;
+
 protected:
 	Model()
 	{
@@ -26,6 +29,23 @@ public:
 		return parameters;
 	}
 
+	// Moves the parameters into a flat ParameterArena, GetParameters still returns the same tensors. Parameters added to the model
+	// afterwards aren't in the arena.
+	//
+	const ParameterArenaPtr& FlattenParameters()
+	{
+		if(!_arena)
+			_arena = ParameterArena::New(GetParameters());
+		return _arena;
+	}
+
+	// Parameter arena if FlattenParameters has been called, otherwise null.
+	//
+	const ParameterArenaPtr& Arena() const
+	{
+		return _arena;
+	}
+
 	void SetMode(const Layer::Mode mode) override
 	{
 		for(auto& layer:GetLayers())
@@ -1,113 +1,452 @@
 #pragma once
 
-#include <concurrent_queue.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <vector>
+#include "NDArena.h"
+#ifdef _WIN32
 #include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 
+// Allocator for array data.
+//
+// Blocks come in four size classes per power of two, so at most a fifth of a block is unused. Each block starts with a 64 byte header
+// (its allocator and class) so the data is 64 byte aligned. Freed blocks are kept for reuse rather than returned to the system: in a
+// cache for the thread that freed them, which needs no lock, with batches moved to and from a shared pool for each class when a cache
+// is full or empty. Trim returns pooled blocks to the system.
+//
+// Blocks of 2MB or more are aligned to 2MB and, on Linux, marked for transparent huge pages.
+//
+// Statistics are kept for monitoring: bytes in use, bytes cached, the high-water mark of bytes in use and, for each class, the number of
+// allocations served from a cache or pool (hits) and by the system (misses).
+//
+// Threads should stop using the allocator before it's destroyed, blocks still in the caches of running threads are freed then.
+//
+// While a thread has an NDArena scope open its blocks come from the arena instead (see NDArena.h).
+//
 class NDAllocator
 {
-	static const size_t MaxAllocators = 32;
+	static const int	MinBits = 6;								// Smallest block, a header.
+	static const int	MaxBits = 48;
+	static const int	ClassesPerDoubling = 4;
+	static const int	ClassCount = 1+(MaxBits-MinBits)*ClassesPerDoubling;
+	static const size_t	CacheBytes = 1<<20;							// Bytes of blocks of each class a thread keeps.
+	static const size_t	HugePage = 1<<21;
 
-	class Allocator
+	struct BlockHeader
+	{
+		NDAllocator*		_allocator;		// Allocator that allocated this block.
+		NDArena::Region*	_region;		// Arena region of the block, null if it's from a size class.
+		int					_class;			// Size class of the block.
+		char				_padding[44];	// Padding to ensure _data is 64-byte aligned.
+		#pragma warning(suppress:4200)
+		unsigned char	_data[];
+	};
+	static_assert(sizeof(BlockHeader) % 64 == 0,"BlockHeader must be 64-byte aligned");
+
+	// Shared pool of free blocks of a size class.
+	struct Class
 	{
-		size_t									_size;
-		size_t									_allocationCount;
-		concurrency::concurrent_queue<void*>	_allocations;
+		std::mutex				_lock;
+		std::vector<void*>		_blocks;
+		std::atomic<size_t>		_hits = 0;
+		std::atomic<size_t>		_misses = 0;
+	};
 
+	// Free blocks kept by a thread, returned to the pools when the thread exits.
+	class ThreadCache
+	{
 	public:
-		Allocator() :
-			_size(0),
-			_allocationCount(0)
+		std::atomic<NDAllocator*>	_owner = nullptr;	// Null until first used, or once the allocator has been destroyed.
+		std::vector<void*>			_blocks[ClassCount];
+
+		~ThreadCache()
 		{
+			if(NDAllocator* const owner=_owner.load())
+				owner->Release(*this);
 		}
+	};
+
+	Class						_classes[ClassCount];
+	std::mutex					_cachesLock;
+	std::vector<ThreadCache*>	_caches;
+	std::atomic<size_t>			_inUse = 0;
+	std::atomic<size_t>			_cached = 0;
+	std::atomic<size_t>			_highWater = 0;
+
+	// Returns the smallest class holding 'size' bytes.
+	//
+	static int SizeClass(const size_t size)
+	{
+		if(size<=(1ULL<<MinBits))
+			return 0;
+		int msb = MinBits;
+		while((1ULL<<(msb+1))<=size-1)
+			++msb;
+		if(msb>=MaxBits)
+			throw std::bad_alloc();
+		const int quarter = (int)((size-1)>>(msb-2))&(ClassesPerDoubling-1);
+		return 1+(msb-MinBits)*ClassesPerDoubling+quarter;
+	}
+
+	static size_t ClassSize(const int sizeClass)
+	{
+		if(sizeClass==0)
+			return 1ULL<<MinBits;
+		const int msb = MinBits+(sizeClass-1)/ClassesPerDoubling;
+		const int quarter = (sizeClass-1)%ClassesPerDoubling;
+		return (1ULL<<msb)+(quarter+1)*(1ULL<<(msb-2));
+	}
 
-		void Initialise(const size_t size)
+	// Blocks of a class a thread cache holds before returning half to the pool. Blocks larger than the cache aren't cached, they go
+	// straight to the pool where Trim can release them.
+	//
+	static size_t CacheLimit(const int sizeClass)
+	{
+		const size_t size = ClassSize(sizeClass);
+		if(size>CacheBytes)
+			return 0;
+		return (std::max)(size_t(2),CacheBytes/size);
+	}
+
+	static void* SystemAlloc(const size_t size)
+	{
+		const size_t alignment = size>=HugePage?HugePage:64;
+#ifdef _WIN32
+		void* const block = _aligned_malloc(size,alignment);
+#else
+		void* block = nullptr;
+		if(posix_memalign(&block,alignment,size)!=0)
+			block = nullptr;
+#ifdef MADV_HUGEPAGE
+		if(block&&alignment==HugePage)
+			madvise(block,size/HugePage*HugePage,MADV_HUGEPAGE);		// Whole huge pages in the block.
+#endif
+#endif
+		if(!block)
+			throw std::bad_alloc();
+		return block;
+	}
+
+	static void SystemFree(void* const block)
+	{
+#ifdef _WIN32
+		_aligned_free(block);
+#else
+		free(block);
+#endif
+	}
+
+	// Cache of the calling thread, null if it's caching for another allocator.
+	//
+	ThreadCache* Cache()
+	{
+		static thread_local ThreadCache cache;
+		NDAllocator* const owner = cache._owner.load(std::memory_order_relaxed);
+		if(owner==this)
+			return &cache;
+		if(owner)
+			return nullptr;
+		std::unique_lock<std::mutex> lock(_cachesLock);
+		_caches.push_back(&cache);
+		cache._owner = this;
+		return &cache;
+	}
+
+	// Returns the blocks of an exiting thread's cache to the pools.
+	//
+	void Release(ThreadCache& cache)
+	{
+		for(int c=0;c<ClassCount;++c)
 		{
-			_size = size;
+			if(cache._blocks[c].empty())
+				continue;
+			std::unique_lock<std::mutex> lock(_classes[c]._lock);
+			_classes[c]._blocks.insert(_classes[c]._blocks.end(),cache._blocks[c].begin(),cache._blocks[c].end());
+			cache._blocks[c].clear();
 		}
+		std::unique_lock<std::mutex> lock(_cachesLock);
+		_caches.erase(std::find(_caches.begin(),_caches.end(),&cache));
+		cache._owner = nullptr;
+	}
 
-		void Uninitialise()
+	void* Allocate(const int sizeClass)
+	{
+		Class& pool = _classes[sizeClass];
+		const size_t size = ClassSize(sizeClass);
+		void* block = nullptr;
+		if(ThreadCache* const cache=CacheLimit(sizeClass)>0?Cache():nullptr)
 		{
-			void* allocation = nullptr;
-			while(_allocations.try_pop(allocation))
+			std::vector<void*>& blocks = cache->_blocks[sizeClass];
+			if(blocks.empty())
 			{
-				_aligned_free(allocation);
-				--_allocationCount;
+				// Refill with a batch from the pool.
+				std::unique_lock<std::mutex> lock(pool._lock);
+				const size_t n = (std::min)(pool._blocks.size(),CacheLimit(sizeClass)/2);
+				blocks.insert(blocks.end(),pool._blocks.end()-n,pool._blocks.end());
+				pool._blocks.resize(pool._blocks.size()-n);
+			}
+			if(!blocks.empty())
+			{
+				block = blocks.back();
+				blocks.pop_back();
+			}
+		}
+		else
+		{
+			std::unique_lock<std::mutex> lock(pool._lock);
+			if(!pool._blocks.empty())
+			{
+				block = pool._blocks.back();
+				pool._blocks.pop_back();
 			}
-			_size = 0;
 		}
 
-        void* Allocate()
-        {
-            void* allocation = nullptr;
-            if(!_allocations.try_pop(allocation))
+		if(block)
+		{
+			++pool._hits;
+			_cached -= size;
+		}
+		else
+		{
+			block = SystemAlloc(size);
+			++pool._misses;
+		}
+		const size_t inUse = _inUse += size;
+		size_t highWater = _highWater.load(std::memory_order_relaxed);
+		while(inUse>highWater&&!_highWater.compare_exchange_weak(highWater,inUse,std::memory_order_relaxed))
+		{
+		}
+		return block;
+	}
+
+	void Deallocate(BlockHeader* const block)
+	{
+		const int sizeClass = block->_class;
+		Class& pool = _classes[sizeClass];
+		const size_t size = ClassSize(sizeClass);
+		_inUse -= size;
+		_cached += size;
+		if(ThreadCache* const cache=CacheLimit(sizeClass)>0?Cache():nullptr)
+		{
+			std::vector<void*>& blocks = cache->_blocks[sizeClass];
+			blocks.push_back(block);
+			const size_t limit = CacheLimit(sizeClass);
+			if(blocks.size()>limit)
 			{
-                allocation = _aligned_malloc(_size,64);
-				++_allocationCount;
+				// Return a batch to the pool.
+				std::unique_lock<std::mutex> lock(pool._lock);
+				pool._blocks.insert(pool._blocks.end(),blocks.end()-limit/2,blocks.end());
+				blocks.resize(blocks.size()-limit/2);
 			}
-            return allocation;
-        }
-
-        void Free(void* allocation)
-        {
-            _allocations.push(allocation);
-        }
-
-        size_t Size() const
-        {
-            return _size;
-        }
-    };
-
-	Allocator _allocators[MaxAllocators];
-	
-	Allocator& GetAllocator(const size_t size)
-	{
-		_ASSERT(size<=(1ULL<<MaxAllocators));
-		size_t msb = 0;
-		while((1ULL<<msb)<size)
-			++msb;
-		_ASSERT(size<=_allocators[msb].Size());
-		return _allocators[msb];
+		}
+		else
+		{
+			std::unique_lock<std::mutex> lock(pool._lock);
+			pool._blocks.push_back(block);
+		}
 	}
 
-	struct BlockHeader
+public:
+	struct Statistics
 	{
-		Allocator*		_allocator;		// Pointer to the allocator that allocated this block.
-		char			_padding[56];	// Padding to ensure _data is 64-byte aligned.
-		#pragma warning(suppress:4200)
-		unsigned char	_data[];
+		struct Class
+		{
+			size_t	size;		// Bytes in a block, including the header.
+			size_t	hits;		// Allocations served by a cache or pool.
+			size_t	misses;		// Allocations served by the system.
+
+			double HitRate() const
+			{
+				return hits+misses>0?double(hits)/double(hits+misses):0;
+			}
+		};
+
+		size_t				inUse;		// Bytes of allocated blocks.
+		size_t				cached;		// Bytes of freed blocks kept for reuse.
+		size_t				highWater;	// Most bytes in use at once.
+		std::vector<Class>	classes;	// Each class that has been used.
 	};
-	static_assert(sizeof(BlockHeader) % 64 == 0,"BlockHeader must be 64-byte aligned");
 
-public:
 	NDAllocator()
 	{
-		for(int i=0;i<MaxAllocators;++i)
-			_allocators[i].Initialise(1ULL<<i);
 	}
 
+	NDAllocator(const NDAllocator&) = delete;
+
 	~NDAllocator()
 	{
-		for(int i=0;i<MaxAllocators;++i)
-			_allocators[i].Uninitialise();
+		{
+			std::unique_lock<std::mutex> lock(_cachesLock);
+			for(ThreadCache* const cache:_caches)
+			{
+				for(auto& blocks:cache->_blocks)
+				{
+					for(void* const block:blocks)
+						SystemFree(block);
+					blocks.clear();
+				}
+				cache->_owner = nullptr;
+			}
+			_caches.clear();
+		}
+		for(auto& pool:_classes)
+			for(void* const block:pool._blocks)
+				SystemFree(block);
 	}
 
+	// Standard allocator for objects made by MakeShared.
+	//
+	template<typename T>
+	struct Of
+	{
+		typedef T value_type;
+
+		Of()
+		{
+		}
+
+		template<typename U>
+		Of(const Of<U>&)
+		{
+		}
+
+		T*		allocate(const size_t n);
+		void	deallocate(T* const p,const size_t n);
+
+		template<typename U>
+		bool operator==(const Of<U>&) const
+		{
+			return true;
+		}
+
+		template<typename U>
+		bool operator!=(const Of<U>&) const
+		{
+			return false;
+		}
+	};
+
+	// std::make_shared with the object and its control block in a block of the allocator, so in the step arena while one is open.
+	//
+	template<typename T,typename... Args>
+	static std::shared_ptr<T> MakeShared(Args&&... args);
+
 	template<typename T>
 	T* Alloc(const size_t size)
 	{
-		Allocator& allocator = GetAllocator(sizeof(BlockHeader)+(size*sizeof(T)));
-		BlockHeader* const block = (BlockHeader*)allocator.Allocate();
-		block->_allocator = &allocator;
+		const size_t bytes = sizeof(BlockHeader)+(size*sizeof(T));
+		BlockHeader* block;
+		if(NDArena* const arena=NDArena::Active())
+		{
+			NDArena::Region* region;
+			block = (BlockHeader*)arena->Allocate(bytes,region);
+			block->_region = region;
+			block->_class = -1;
+		}
+		else
+		{
+			const int sizeClass = SizeClass(bytes);
+			block = (BlockHeader*)Allocate(sizeClass);
+			block->_region = nullptr;
+			block->_class = sizeClass;
+		}
+		block->_allocator = this;
 		return (T*)block->_data;
 	}
 
+	// Returns 'true' if the block holding 'data' (returned by Alloc) is in a step arena.
+	//
+	static bool InArena(const void* const data)
+	{
+		return (((const BlockHeader*)data)-1)->_region!=nullptr;
+	}
+
 	void Free(void* const data)
 	{
-		BlockHeader* const blockHeader = ((BlockHeader*)data)-1;
-		blockHeader->_allocator->Free(blockHeader);
+		BlockHeader* const block = ((BlockHeader*)data)-1;
+		if(block->_region)
+			NDArena::Release(block->_region);
+		else
+			block->_allocator->Deallocate(block);
+	}
+
+	// Returns the blocks in the pools and the calling thread's cache to the system, returns the number of bytes released. Blocks
+	// cached by other threads (at most CacheBytes of each class up to that size) are kept.
+	//
+	size_t Trim()
+	{
+		size_t released = 0;
+		ThreadCache* const cache = Cache();
+		for(int c=0;c<ClassCount;++c)
+		{
+			std::vector<void*> blocks;
+			if(cache)
+				blocks.swap(cache->_blocks[c]);
+			{
+				std::unique_lock<std::mutex> lock(_classes[c]._lock);
+				blocks.insert(blocks.end(),_classes[c]._blocks.begin(),_classes[c]._blocks.end());
+				_classes[c]._blocks.clear();
+			}
+			for(void* const block:blocks)
+				SystemFree(block);
+			released += blocks.size()*ClassSize(c);
+		}
+		_cached -= released;
+		return released;
+	}
+
+	Statistics Stats() const
+	{
+		Statistics stats;
+		stats.inUse = _inUse;
+		stats.cached = _cached;
+		stats.highWater = _highWater;
+		for(int c=0;c<ClassCount;++c)
+		{
+			const size_t hits = _classes[c]._hits;
+			const size_t misses = _classes[c]._misses;
+			if(hits+misses>0)
+				stats.classes.push_back({ClassSize(c),hits,misses});
+		}
+		return stats;
+	}
+
+	void Print(std::ostream& out) const
+	{
+		const Statistics stats = Stats();
+		out<<"In use "<<stats.inUse<<" bytes, cached "<<stats.cached<<" bytes, high-water "<<stats.highWater<<" bytes."<<std::endl;
+		for(auto& c:stats.classes)
+			out<<"  "<<c.size<<" bytes: "<<c.hits<<" hits, "<<c.misses<<" misses, hit rate "<<c.HitRate()<<std::endl;
 	}
 };
 
 
-extern NDAllocator mem;
\ No newline at end of file
+extern NDAllocator mem;
+
+
+template<typename T>
+T* NDAllocator::Of<T>::allocate(const size_t n)
+{
+	return mem.Alloc<T>(n);
+}
+
+template<typename T>
+void NDAllocator::Of<T>::deallocate(T* const p,const size_t)
+{
+	mem.Free(p);
+}
+
+template<typename T,typename... Args>
+std::shared_ptr<T> NDAllocator::MakeShared(Args&&... args)
+{
+	return std::allocate_shared<T>(Of<T>(),std::forward<Args>(args)...);
+}
\ No newline at end of file
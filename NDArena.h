@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+// Step-scoped arena for the intermediates of a training step.
+//
+// While a Scope is open on a thread, NDAllocator bump-allocates that thread's blocks (array data, and the NDData, Tensor and kernel
+// objects made by NDAllocator::MakeShared) from a region of the arena rather than from its size classes, and freeing them only counts
+// them. When the scope closes and every block of the region has been freed, the region is reset in one go and reused by the next step.
+// A block that outlives the step (i.e. a loss kept by the caller) is safe: it keeps its region until it's freed, and the next step uses
+// another region.
+//
+// Parameters and optimiser state stay on the persistent allocator, Tensor suspends the arena (Suspend) to make them. Other threads (the
+// workers of the thread pool) allocate from the persistent allocator. An arena is used by one thread at a time, and must outlive the
+// blocks allocated from it.
+//
+class NDArena
+{
+public:
+	class Region
+	{
+		friend class NDArena;
+
+		NDArena*			_arena;
+		char*				_base;
+		size_t				_size;
+		size_t				_used;
+		std::atomic<size_t>	_references;	// Blocks not yet freed, plus one while the region is being allocated from.
+	};
+
+private:
+	static const size_t Alignment = 64;
+
+	static inline thread_local NDArena*	_active = nullptr;	// Arena of the thread's open scope.
+
+	const size_t			_regionSize;
+	std::mutex				_lock;
+	std::vector<Region*>	_regions;		// Every region.
+	std::vector<Region*>	_free;			// Regions with no blocks.
+	Region*					_current;		// Region being allocated from, null if none.
+
+	// Starts allocating from a free region of at least 'size' bytes, or a new region.
+	//
+	void Open(const size_t size)
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		for(auto i=_free.begin();i!=_free.end();++i)
+		{
+			if((*i)->_size>=size)
+			{
+				_current = *i;
+				_free.erase(i);
+				_current->_references = 1;
+				return;
+			}
+		}
+		Region* const region = new Region();
+		region->_arena = this;
+		region->_size = (std::max)(_regionSize,size);
+		region->_base = (char*)::operator new(region->_size,std::align_val_t(Alignment));
+		region->_used = 0;
+		region->_references = 1;
+		_regions.push_back(region);
+		_current = region;
+	}
+
+	// Stops allocating from the current region, it's reset once its blocks are freed.
+	//
+	void Close()
+	{
+		if(_current)
+		{
+			Region* const region = _current;
+			_current = nullptr;
+			Release(region);
+		}
+	}
+
+public:
+	class Scope
+	{
+		NDArena&		_arena;
+		NDArena* const	_previous;
+
+	public:
+		Scope(NDArena& arena) :
+			_arena(arena),
+			_previous(_active)
+		{
+			_active = &arena;
+		}
+
+		Scope(const Scope&) = delete;
+
+		~Scope()
+		{
+			_arena.Close();
+			_active = _previous;
+		}
+	};
+
+	// Allocates from the persistent allocator, on this thread, while in scope (if 'suspend').
+	//
+	class Suspend
+	{
+		NDArena* const	_previous;
+
+	public:
+		Suspend(const bool suspend=true) :
+			_previous(_active)
+		{
+			if(suspend)
+				_active = nullptr;
+		}
+
+		Suspend(const Suspend&) = delete;
+
+		~Suspend()
+		{
+			_active = _previous;
+		}
+	};
+
+	NDArena(const size_t regionSize=64<<20) :
+		_regionSize(regionSize),
+		_current(nullptr)
+	{
+	}
+
+	NDArena(const NDArena&) = delete;
+
+	~NDArena()
+	{
+		for(Region* const region:_regions)
+		{
+			::operator delete(region->_base,std::align_val_t(Alignment));
+			delete region;
+		}
+	}
+
+	// Arena of the calling thread's open scope, null if none.
+	//
+	static NDArena* Active()
+	{
+		return _active;
+	}
+
+	// Returns 'size' bytes, 64 byte aligned, and the region they're in.
+	//
+	void* Allocate(size_t size,Region*& region)
+	{
+		size = (size+Alignment-1)/Alignment*Alignment;
+		if(!_current||_current->_used+size>_current->_size)
+		{
+			Close();
+			Open(size);
+		}
+		void* const block = _current->_base+_current->_used;
+		_current->_used += size;
+		++_current->_references;
+		region = _current;
+		return block;
+	}
+
+	// Frees a block of a region, from any thread. The region is reset when its last block is freed.
+	//
+	static void Release(Region* const region)
+	{
+		if(--region->_references==0)
+		{
+			NDArena* const arena = region->_arena;
+			std::unique_lock<std::mutex> lock(arena->_lock);
+			region->_used = 0;
+			arena->_free.push_back(region);
+		}
+	}
+
+	// Bytes of every region.
+	//
+	size_t Reserved()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		size_t reserved = 0;
+		for(Region* const region:_regions)
+			reserved += region->_size;
+		return reserved;
+	}
+
+	// Regions holding blocks that haven't been freed, or being allocated from.
+	//
+	size_t RegionsInUse()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		return _regions.size()-_free.size();
+	}
+
+	// Returns the free regions to the system.
+	//
+	void Trim()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		for(Region* const region:_free)
+		{
+			::operator delete(region->_base,std::align_val_t(Alignment));
+			delete region;
+			_regions.erase(std::find(_regions.begin(),_regions.end(),region));
+		}
+		_free.clear();
+	}
+};
\ No newline at end of file
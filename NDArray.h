@@ -4,7 +4,12 @@
 #include "Exceptions.h"
 #include "NDAllocator.h"
 #include "NDThreadPool.h"
-#include "TiledMatMul.h"
+#include "MatMulDispatcher.h"
+#include "ElementwiseKernels.h"
+#include "SoftmaxKernels.h"
+#include "ReductionKernels.h"
+#include "OptimiserKernels.h"
+#include "FusedKernels.h"
 #include <ppl.h>
 #include <sstream>
 #include <fstream>
@@ -15,9 +20,7 @@
 #include <ranges>
 #include <algorithm>
 #include <execution>
-
-
-void CudaMatMul(const float* const h_A,const float* const h_B,float* const h_C,const unsigned int M,const unsigned int K,const unsigned int N);
+#include <unordered_map>
 
 
 // Terminology
@@ -100,65 +103,81 @@ public:
 	}
 
 	inline void				operator=(const NDArray& v);
+	template<typename E,int=E::leaves>
+	inline void				operator=(const E& e);
 	inline NDArray			operator==(const NDArray& v) const;
 	inline NDArray			operator!=(const NDArray& v) const;
-	inline NDArray			operator+(const NDArray& v) const;
 	inline void				operator+=(const NDArray& v);
-	inline NDArray			operator-() const;
-	inline NDArray			operator-(const NDArray& v) const;
 	inline void				operator-=(const NDArray& v) const;
-	inline NDArray			operator*(const NDArray& v) const;
 	inline void				operator*=(const NDArray& v);
-	inline NDArray			operator/(const NDArray& v) const;
 	inline NDArray			operator>(const FP v) const;
 	inline FP&				operator[](const std::initializer_list<int>& indices);
 	inline const FP&		operator[](const std::initializer_list<int>& indices) const;
 	inline NDArray			operator[](const NDArray& indices) const;
 
+	inline void				_AddRows(const std::vector<int>& rows,const NDArray& values);
 	inline void				_Attach(const NDArray& v);
 	inline void				_Reset();
+	inline void				_SetRows(const std::vector<int>& rows,const NDArray& values);
 
 	inline int				ArgMax() const;
 	inline NDArray			ArgMax(const int dim) const;
 	inline void				_ClipNorm(const FP clipNorm) const;
+	inline NDArray			CoalesceRows(const NDArray& indices,const NDArray& source,std::vector<int>& rows) const;
+	inline NDArray			Contiguous() const;
+	inline NDArray			CrossEntropy(const NDArray& targets,NDArray& lse,const FP smoothing=0,const int ignoreIndex=-100,const MathPolicy policy=MathPolicy::Default) const;
+	inline NDArray			CrossEntropyGradient(const NDArray& targets,const NDArray& lse,const NDArray& gradient,const FP smoothing=0,const int ignoreIndex=-100,const MathPolicy policy=MathPolicy::Default) const;
 	inline NDArray			Dot(const NDArray& v) const;
+	inline NDArray			Dot(const NDArray& v,const bool transA,const bool transB) const;
 	inline NDArray			Dropout(const FP p) const;
 	inline NDArray			Entropy() const;
-	inline NDArray			Exp() const;
+	inline NDArray			Exp(const MathPolicy policy=MathPolicy::Default) const;
+	inline NDArray			Expand(const NDShape& shape) const;
 	inline NDArray			Flatten() const;
 	inline NDArray			Gather(const int dim,const NDArray& indices) const;
 	inline bool				IsEqualTo(const NDArray& other) const;
 	inline bool				IsScalar() const;
-	inline NDArray			Log() const;
-	inline NDArray			LogSoftmax(const int dim) const;
+	inline NDArray			Log(const MathPolicy policy=MathPolicy::Default) const;
+	inline NDArray			LogSoftmax(const int dim,const MathPolicy policy=MathPolicy::Default) const;
+	inline NDArray			LogSoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy=MathPolicy::Default) const;
 	inline NDArray			MaskedFill(const NDArray& mask,const FP value) const;
+	inline NDArray			MatMul(const NDArray& v,const char* const backend=nullptr) const;
 	inline NDArray			Max(const int dim) const;
-	inline NDArray			Mean(const bool keepdims) const;
+	inline NDArray			Max(const int dim,NDArray& argmax) const;
+	inline NDArray			Mean(const bool keepdims,const SumPrecision precision=SumPrecision::Pairwise) const;
 	inline NDArray			Mean(const int dim,const bool keepDims) const;
+	inline NDArray			Mean(const std::initializer_list<int>& dims,const bool keepDims) const;
+	inline FP				Norm(const SumPrecision precision=SumPrecision::Pairwise) const;
 	inline NDArray			Ones() const;
-	inline NDArray			Pow(const FP v) const;
+	inline NDArray			Pow(const FP v,const MathPolicy policy=MathPolicy::Default) const;
 	inline NDArray			Repeat_Numpy(const int dim,const int copies) const;
 	inline NDArray			Repeat_Torch(const std::initializer_list<int>& sizes) const;
 	inline NDArray			Reshape(const std::initializer_list<int>& shape) const;
 	inline NDArray			Reshape(const NDShape& shape) const;
 	inline void				Save(const std::string& filename) const;
 	inline NDArray			Scatter(const int dim,const NDArray& indices,const NDArray& source) const;
+	inline NDArray			SelectRows(const std::vector<int>& rows) const;
 	inline int				Size() const;
 	inline const NDShape&	Shape() const;
 	inline NDArray			Slice(const std::initializer_list<std::initializer_list<int>>& slices);
 	inline const NDArray	Slice(const std::initializer_list<std::initializer_list<int>>& slices) const;
-	inline NDArray			Softmax(const int dim) const;
+	inline NDArray			Softmax(const int dim,const MathPolicy policy=MathPolicy::Default) const;
+	inline NDArray			SoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy=MathPolicy::Default) const;
 	inline NDArray			Sqrt() const;
-	inline NDArray			StdDev() const;
-	inline NDArray			Sum() const;
+	inline NDArray			Squeeze(const int dim) const;
+	inline NDArray			StdDev(const SumPrecision precision=SumPrecision::Pairwise) const;
+	inline NDArray			Sum(const SumPrecision precision=SumPrecision::Pairwise) const;
 	inline NDArray			Sum(const int dim,const bool keepDims) const;
-	inline NDArray			Tanh() const;
+	inline NDArray			Sum(const std::initializer_list<int>& dims,const bool keepDims) const;
+	inline NDArray			Tanh(const MathPolicy policy=MathPolicy::Default) const;
 	inline NDArray			Transpose() const;
 	inline NDArray			Tril() const;
 	inline NDArray			UnindexSelect(const NDArray& indices,const NDArray& source) const;
+
 	inline NDArray			Unsqueeze(const int dim) const;
-	inline NDArray			Var() const;
+	inline NDArray			Var(const SumPrecision precision=SumPrecision::Pairwise) const;
 	inline NDArray			Var(const int dim,const bool keepDims) const;
+	inline NDArray			Var(const int dim,const bool keepDims,const int correction,NDArray& mean) const;
 	inline NDArray			Zeros() const;
 
 	inline void				Print(std::ostream& out) const;
@@ -166,6 +185,240 @@ public:
 typedef std::vector<NDArray> NDArrays;
 
 
+// Elementwise expressions.
+// ========================
+//
+// The arithmetic operators (+, -, *, / and negation) of arrays and scalars don't compute anything, they return an expression of their
+// operands. An expression is computed when it's converted to an NDArray, or assigned to one, in a single pass over all its operands
+// (ElementwiseKernels.h - elementwise_expression) so a chain of operators makes no temporary arrays. Array operands are broadcast to a
+// common shape, as by the operators one at a time.
+//
+// Expressions hold their operands by value (arrays are shared, not copied) so they can outlive the arrays they were made from.
+//
+// An expression has 'leaves' array operands and 'avx2' if all its operations have an AVX2 version. Scalar<K>/Vector<K> compute one or
+// eight consecutive elements from the operands' rows, 'ptr[K]' and 'stride[K]' being those of the expression's first array operand.
+//
+
+// Array operand.
+//
+struct NDLeaf
+{
+	static constexpr int	leaves = 1;
+	static constexpr bool	avx2 = true;
+
+	NDArray	array;
+
+	void Arrays(const NDArray** const arrays) const
+	{
+		*arrays = &array;
+	}
+
+	template<int K,int N>
+	float Scalar(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return ptr[K][(ptrdiff_t)i*stride[K]];
+	}
+
+	// Rows of vectorised operands have unit stride or, if broadcast, zero stride.
+	template<int K,int N>
+	TARGET_AVX2 __m256 Vector(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return stride[K]?_mm256_loadu_ps(ptr[K]+i):_mm256_set1_ps(*ptr[K]);
+	}
+};
+
+// Scalar operand.
+//
+struct NDScalar
+{
+	static constexpr int	leaves = 0;
+	static constexpr bool	avx2 = true;
+
+	float	value;
+
+	void Arrays(const NDArray** const) const
+	{
+	}
+
+	template<int K,int N>
+	float Scalar(float* const (&)[N],const int (&)[N],const int) const
+	{
+		return value;
+	}
+
+	template<int K,int N>
+	TARGET_AVX2 __m256 Vector(float* const (&)[N],const int (&)[N],const int) const
+	{
+		return _mm256_set1_ps(value);
+	}
+};
+
+// Unary operation (ElementwiseKernels.h) of an expression.
+//
+template<typename OP,typename A>
+struct NDUnaryExpression
+{
+	static constexpr int	leaves = A::leaves;
+	static constexpr bool	avx2 = OP::avx2&&A::avx2;
+
+	OP	op;
+	A	a;
+
+	inline operator NDArray() const;
+
+	void Arrays(const NDArray** const arrays) const
+	{
+		a.Arrays(arrays);
+	}
+
+	template<int K,int N>
+	float Scalar(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return op(a.template Scalar<K>(ptr,stride,i));
+	}
+
+	template<int K,int N>
+	TARGET_AVX2 __m256 Vector(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return op.vector(a.template Vector<K>(ptr,stride,i));
+	}
+};
+
+// Binary operation (ElementwiseKernels.h) of two expressions.
+//
+template<typename OP,typename A,typename B>
+struct NDBinaryExpression
+{
+	static constexpr int	leaves = A::leaves+B::leaves;
+	static constexpr bool	avx2 = OP::avx2&&A::avx2&&B::avx2;
+
+	OP	op;
+	A	a;
+	B	b;
+
+	inline operator NDArray() const;
+
+	void Arrays(const NDArray** const arrays) const
+	{
+		a.Arrays(arrays);
+		b.Arrays(arrays+A::leaves);
+	}
+
+	template<int K,int N>
+	float Scalar(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return op(a.template Scalar<K>(ptr,stride,i),b.template Scalar<K+A::leaves>(ptr,stride,i));
+	}
+
+	template<int K,int N>
+	TARGET_AVX2 __m256 Vector(float* const (&ptr)[N],const int (&stride)[N],const int i) const
+	{
+		return op.vector(a.template Vector<K>(ptr,stride,i),b.template Vector<K+A::leaves>(ptr,stride,i));
+	}
+};
+
+// Expression of each type of operand: arrays, arithmetic scalars and expressions.
+//
+template<typename T,typename=void>
+struct NDOperand
+{
+	static constexpr bool	operand = false;
+	static constexpr bool	scalar = false;
+};
+
+template<>
+struct NDOperand<NDArray>
+{
+	static constexpr bool	operand = true;
+	static constexpr bool	scalar = false;
+	typedef NDLeaf			Type;
+
+	static NDLeaf Make(const NDArray& v)
+	{
+		return {v};
+	}
+};
+
+template<typename T>
+struct NDOperand<T,std::enable_if_t<std::is_arithmetic_v<T>>>
+{
+	static constexpr bool	operand = true;
+	static constexpr bool	scalar = true;
+	typedef NDScalar		Type;
+
+	static NDScalar Make(const T v)
+	{
+		return {float(v)};
+	}
+};
+
+template<typename OP,typename A>
+struct NDOperand<NDUnaryExpression<OP,A>>
+{
+	static constexpr bool			operand = true;
+	static constexpr bool			scalar = false;
+	typedef NDUnaryExpression<OP,A>	Type;
+
+	static const Type& Make(const Type& v)
+	{
+		return v;
+	}
+};
+
+template<typename OP,typename A,typename B>
+struct NDOperand<NDBinaryExpression<OP,A,B>>
+{
+	static constexpr bool				operand = true;
+	static constexpr bool				scalar = false;
+	typedef NDBinaryExpression<OP,A,B>	Type;
+
+	static const Type& Make(const Type& v)
+	{
+		return v;
+	}
+};
+
+// Operands of a binary operator, at least one not a scalar.
+template<typename A,typename B>
+constexpr bool NDOperands = NDOperand<A>::operand&&NDOperand<B>::operand&&!(NDOperand<A>::scalar&&NDOperand<B>::scalar);
+
+template<typename OP,typename A,typename B>
+inline NDBinaryExpression<OP,typename NDOperand<A>::Type,typename NDOperand<B>::Type> NDBinary(const A& a,const B& b)
+{
+	return {OP(),NDOperand<A>::Make(a),NDOperand<B>::Make(b)};
+}
+
+template<typename A,typename B,typename=std::enable_if_t<NDOperands<A,B>>>
+inline auto operator+(const A& a,const B& b)
+{
+	return NDBinary<elementwise_add>(a,b);
+}
+
+template<typename A,typename B,typename=std::enable_if_t<NDOperands<A,B>>>
+inline auto operator-(const A& a,const B& b)
+{
+	return NDBinary<elementwise_sub>(a,b);
+}
+
+template<typename A,typename B,typename=std::enable_if_t<NDOperands<A,B>>>
+inline auto operator*(const A& a,const B& b)
+{
+	return NDBinary<elementwise_mul>(a,b);
+}
+
+template<typename A,typename B,typename=std::enable_if_t<NDOperands<A,B>>>
+inline auto operator/(const A& a,const B& b)
+{
+	return NDBinary<elementwise_div>(a,b);
+}
+
+template<typename A,typename=std::enable_if_t<NDOperand<A>::operand&&!NDOperand<A>::scalar>>
+inline NDUnaryExpression<elementwise_negate,typename NDOperand<A>::Type> operator-(const A& a)
+{
+	return {elementwise_negate(),NDOperand<A>::Make(a)};
+}
+
+
 class NDData : public std::enable_shared_from_this<NDData>
 {
 	NDShape				_shape;		// Shape {i,j,k} most significant dimension at position 0 due to initialisation-list construction.
@@ -175,6 +428,8 @@ class NDData : public std::enable_shared_from_this<NDData>
 	
 	const NDDataPtrC	_parent;	// Ponter to parent if data is not owned (i.e. this is a view).
 
+	static inline FP	_unused = 0;	// Operand of fused kernels with fewer inputs than the most they take, never read or written.
+
 	// Shape iterator - iterates every dimension value combination.
 	//
 	class NDIterator
@@ -349,7 +604,6 @@ class NDData : public std::enable_shared_from_this<NDData>
 		// Isolate shapes and strides of non-aggregate dimensions.
 		NDShape srcShape(_shape.size()-1);
 		NDShape srcStride(_stride.size()-1);
-		NDShape dstShape(dst->_shape.size()-1);
 		NDShape dstStride(dst->_stride.size()-1);
 		for(int i=0,j=0;i<_shape.size();++i)
 		{
@@ -358,28 +612,31 @@ class NDData : public std::enable_shared_from_this<NDData>
 			{
 				srcShape[j] = _shape[i];
 				srcStride[j] = _stride[i];
-				dstShape[j] = dst->_shape[i];
 				dstStride[j] = dst->_stride[i];
 				++j;
 			}
 		}
 
-		// Iterate over non-fixed dimensions.
+		// Iterate over the rows of the merged non-fixed dimensions.
 		const int srcDimStride = _stride[dim];
-		const int dstDimStride = dst->_stride[dim];
 		const int dimLength = _shape[dim];
-		for(NDIterator2 srcIter(srcShape,srcStride,_data),dstIter(dstShape,dstStride,dst->_data);srcIter!=srcIter.end();++srcIter,++dstIter)
+		float* const data[2] = {_data,dst->_data};
+		const NDShape strides[2] = {srcStride,dstStride};
+		elementwise_for_each_row_serial<2>(srcShape,data,strides,[&](const int n,float* const (&ptr)[2],const int (&stride)[2])
 		{
-			// Iterate the aggregate dimension.
-			const FP* srcData = &*srcIter;
-			FP acc = 0.0;
-			for(int i=0;i<dimLength;++i)
+			for(int j=0;j<n;++j)
 			{
-				foo(acc,*srcData);
-				srcData += srcDimStride;
+				// Iterate the aggregate dimension.
+				const FP* srcData = ptr[0]+(ptrdiff_t)j*stride[0];
+				FP acc = 0.0;
+				for(int i=0;i<dimLength;++i)
+				{
+					foo(acc,*srcData);
+					srcData += srcDimStride;
+				}
+				ptr[1][(ptrdiff_t)j*stride[1]] = acc;
 			}
-			*dstIter = acc;
-		}
+		});
 	}
 
 	// Execute the lambda for every data value.
@@ -564,20 +821,7 @@ class NDData : public std::enable_shared_from_this<NDData>
 	template<typename OP>
 	inline void Elementwise(const OP& op)
 	{
-		if(HasNaturalStride())
-		{
-			// Raw data.			
-			const FP* const end = _data+_size;
-			for(FP* iter=_data;iter!=end;++iter)
-				op(*iter);
-		}
-		else
-		{
-			// Source iterator.
-			for(NDIterator2 iter=Iter();iter!=iter.end();++iter)
-				op(*iter);
-		}
-		DebugRangeCheck();
+		const_cast<const NDData*>(this)->Elementwise(op);
 	}
 
 	// Template method for applying the inplace operation 'op' to each element of the arrays.
@@ -594,9 +838,14 @@ class NDData : public std::enable_shared_from_this<NDData>
 		}
 		else
 		{
-			// Source iterator.
-			for(NDIterator2 iter=Iter();iter!=iter.end();++iter)
-				op(*iter);
+			// Rows of the merged dimensions, in order.
+			float* const data[1] = {_data};
+			const NDShape strides[1] = {_stride};
+			elementwise_for_each_row_serial<1>(_shape,data,strides,[&op](const int n,float* const (&ptr)[1],const int (&stride)[1])
+			{
+				for(int i=0;i<n;++i)
+					op(ptr[0][(ptrdiff_t)i*stride[0]]);
+			});
 		}
 		DebugRangeCheck();
 	}
@@ -610,43 +859,116 @@ class NDData : public std::enable_shared_from_this<NDData>
 		if(v_->_shape!=_shape)
 			throw IncompatibleShape();
 
-		if(HasNaturalStride())
+		if(HasNaturalStride()&&v_->HasNaturalStride())
 		{
-			if(v_->HasNaturalStride())
-			{
-				// No iterator.
-				FP* const dst = _data;
-				const FP* src = v_->_data;
-				for(int i=0;i<_size;++i)
-					op(dst[i],src[i]);
-			}
-			else
-			{
-				// Source iterator.
-				FP* dst = _data;
-				for(NDIterator2 src=v_->Iter();src!=src.end();++dst,++src)
-					op(*dst,*src);
-			}
+			// No iterator.
+			FP* const dst = _data;
+			const FP* src = v_->_data;
+			for(int i=0;i<_size;++i)
+				op(dst[i],src[i]);
 		}
 		else
 		{
-			if(v_->HasNaturalStride())
-			{
-				// Destination iterator.
-				const FP* src = v_->_data;
-				for(NDIterator2 dst=Iter();dst!=dst.end();++dst,++src)
-					op(*dst,*src);
-			}
-			else
+			// Rows of the dimensions merged in both, in order.
+			float* const data[2] = {_data,v_->_data};
+			const NDShape strides[2] = {_stride,v_->_stride};
+			elementwise_for_each_row_serial<2>(_shape,data,strides,[&op](const int n,float* const (&ptr)[2],const int (&stride)[2])
 			{
-				// Source and destination iterator.
-				for(NDIterator2 dst=Iter(),src=v_->Iter();dst!=dst.end();++dst,++src)
-					op(*dst,*src);
-			}
+				for(int i=0;i<n;++i)
+					op(ptr[0][(ptrdiff_t)i*stride[0]],ptr[1][(ptrdiff_t)i*stride[1]]);
+			});
+		}
+		DebugRangeCheck();
+	}
+
+	// Kernel methods - apply an operation from ElementwiseKernels.h (vectorised and parallel).
+	//	Unlike the Elementwise lambdas, the operation must be a pure function of the element values.
+
+	// Inplace 'this = op(this)'.
+	//
+	template<typename OP>
+	inline void Apply(const OP& op)
+	{
+		elementwise_unary(op,_shape,_data,_stride,_data,_stride);
+		DebugRangeCheck();
+	}
+
+	// 'this = op(a)' where 'a' has the same shape as this array.
+	//
+	template<typename OP>
+	inline void Apply(const OP& op,const NDData& a)
+	{
+		_ASSERT(a._shape==_shape);
+		elementwise_unary(op,_shape,_data,_stride,a._data,a._stride);
+		DebugRangeCheck();
+	}
+
+	// 'this = op(a,b)' where 'a' and 'b' have the same shape as this array.
+	//
+	template<typename OP>
+	inline void Apply(const OP& op,const NDData& a,const NDData& b)
+	{
+		_ASSERT(a._shape==_shape&&b._shape==_shape);
+		elementwise_binary(op,_shape,_data,_stride,a._data,a._stride,b._data,b._stride);
+		DebugRangeCheck();
+	}
+
+	// Inplace 'this = op(this,v)' where 'v' is broadcast to the shape of this array.
+	//
+	template<typename OP>
+	inline void ApplyBroadcast(const OP& op,const NDDataPtrC& v)
+	{
+		const NDArray v_ = v->Broadcast(Self());
+		if(v_->_shape!=_shape)
+			throw IncompatibleShape();
+		Apply(op,*this,*v_);
+	}
+
+	// 'this = e' where the array operands of the expression 'e' are broadcast to the shape of this array.
+	//
+	template<typename E>
+	inline void Compute(const E& e,const NDArray* const (&arrays)[E::leaves])
+	{
+		NDArray operands[E::leaves];
+		float* data[E::leaves+1] = {_data};
+		NDShape strides[E::leaves+1] = {_stride};
+		for(int k=0;k<E::leaves;++k)
+		{
+			operands[k]._Attach((*arrays[k])->Broadcast(Self()));
+			if(operands[k]->_shape!=_shape)
+				throw IncompatibleShape();
+			data[k+1] = operands[k]->_data;
+			strides[k+1] = operands[k]->_stride;
 		}
+		elementwise_expression(e,_shape,data,strides);
 		DebugRangeCheck();
 	}
 
+	// Returns 'op(this)'.
+	//
+	template<typename OP>
+	inline NDArray Unary(const OP& op) const
+	{
+		NDArray r = NDData::New(_shape);
+		r->Apply(op,*this);
+		return r;
+	}
+
+	// Returns 'op(this,v)' where both operands are broadcast to a common shape.
+	//
+	template<typename OP>
+	inline NDArray Binary(const OP& op,const NDArray& v) const
+	{
+		const NDArray a = Broadcast(v._data);
+		const NDArray b = v->Broadcast(a._data);
+		if(a->_shape!=b->_shape)
+			throw IncompatibleShape();
+
+		NDArray r = NDData::New(a->_shape);
+		r->Apply(op,*a,*b);
+		return r;
+	}
+
 	static void print(const NDArray& a)
 	{
 		a.Print(std::cout);
@@ -679,10 +1001,8 @@ public:	// Constructors must be public to use make_shared.
 		}
 		else
 		{
-			// Use iterator for source.
-			FP* cell = _data;
-			for(NDIterator2 iter=data.Iter();iter!=iter.end();++iter)
-				*cell++ = *iter;
+			// Copy the rows of the merged dimensions.
+			elementwise_unary(elementwise_copy(),_shape,_data,_stride,data._data,data._stride);
 		}
 	}
 
@@ -757,6 +1077,13 @@ public:	// Constructors must be public to use make_shared.
 			return Self();
 	}
 
+	// Returns 'true' if the data was allocated in a step arena (see NDArena).
+	//
+	bool InArena() const
+	{
+		return NDAllocator::InArena(DataOwner()->_data);
+	}
+
 	// Slice constructor.
 	//
 	NDData(const P&,const NDDataPtr& parent,const std::initializer_list<std::initializer_list<int>>& slicer) :
@@ -866,6 +1193,19 @@ public:	// Constructors must be public to use make_shared.
 			throw InvalidSlice();
 	}
 
+	// Sub-array constructor - a view of 'shape' elements from 'offset' in a parent with the natural stride.
+	//
+	NDData(const P&,const NDDataPtr& parent,const int offset,const NDShape& shape) :
+		_shape(shape),
+		_size(0),
+		_data(parent->_data+offset),
+		_parent(parent->DataOwner())
+	{
+		InitialiseSizeAndStride();
+		if(!parent->HasNaturalStride()||offset<0||offset+_size>parent->_size)
+			throw InvalidSlice();
+	}
+
 	~NDData()
 	{
 		if(!_parent)
@@ -880,56 +1220,56 @@ public:
 	//
 	static NDArray New(const std::initializer_list<int>& shape)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end());
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end());
 	}
 
 	// Vector shape and uninitialised data - is this needed?
 	//
 	static NDArray New(const NDShape& shape)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end());
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end());
 	}
 
 	// Vector shape and default value.
 	//
 	static NDArray New(const NDShape& shape,const FP data)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end(),data);
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end(),data);
 	}
 
 	// List shape and default value.
 	//
 	static NDArray New(const std::initializer_list<int>& shape,const FP data)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end(),data);
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end(),data);
 	}
 
 	// List shape, vector of values.
 	//
 	static NDArray New(const std::initializer_list<int>& shape,const std::vector<FP>& data)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end(),data.begin(),data.end());
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end(),data.begin(),data.end());
 	}
 
 	// Vector shape, vector of values.
 	//
 	static NDArray New(const std::vector<int>& shape,const std::vector<FP>& data)
 	{
-		return std::make_shared<NDData>(P(),shape.begin(),shape.end(),data.begin(),data.end());
+		return NDAllocator::MakeShared<NDData>(P(),shape.begin(),shape.end(),data.begin(),data.end());
 	}
 
 	// Deep-copy constructor.
 	//
 	static NDArray New(const NDData& data)
 	{
-		return std::make_shared<NDData>(P(),data);
+		return NDAllocator::MakeShared<NDData>(P(),data);
 	}
 
 	// View constructor.
 	//
 	static NDArray New(const NDDataPtrC& data)
 	{
-		return std::make_shared<NDData>(P(),data);
+		return NDAllocator::MakeShared<NDData>(P(),data);
 	}
 
 	// Slice constructor.
@@ -937,7 +1277,7 @@ public:
 	static NDArray New(const NDData& data,const std::initializer_list<std::initializer_list<int>>& slicer)
 	{
 		// TODO: Eliminate const-cast.
-		return std::make_shared<NDData>(P(),const_cast<NDData&>(data).shared_from_this(),slicer);
+		return NDAllocator::MakeShared<NDData>(P(),const_cast<NDData&>(data).shared_from_this(),slicer);
 	}
 
 	// Reshape constructor.
@@ -947,7 +1287,7 @@ public:
 		if(data.HasNaturalStride())
 		{
 			// TODO: Eliminate const-cast.
-			return std::make_shared<NDData>(P(),const_cast<NDData&>(data).shared_from_this(),shape);
+			return NDAllocator::MakeShared<NDData>(P(),const_cast<NDData&>(data).shared_from_this(),shape);
 		}
 		else
 		{
@@ -956,6 +1296,14 @@ public:
 		}
 	}
 
+	// Sub-array constructor.
+	//
+	static NDArray New(const NDData& data,const int offset,const NDShape& shape)
+	{
+		// TODO: Eliminate const-cast.
+		return NDAllocator::MakeShared<NDData>(P(),const_cast<NDData&>(data).shared_from_this(),offset,shape);
+	}
+
 	// Constructor for a sequence of integers.
 	static NDArray Arrange(const int size)
 	{
@@ -1147,54 +1495,205 @@ public:
 		return shapedGradient;
 	}
 
-	// Elementwise assignment to 'this' from 'v'.
+	// Computes an elementwise expression (see NDBinaryExpression) of arrays broadcast to a common shape.
 	//
-	void Assign(const NDArray& v)
+	template<typename E>
+	static NDArray Evaluate(const E& e)
 	{
-		if(_shape!=v->_shape)
-			throw IncompatibleShape();
+		const NDArray* arrays[E::leaves];
+		e.Arrays(arrays);
+		NDArray r = NDData::New(BroadcastShape(arrays,E::leaves)->_shape);
+		r->Compute(e,arrays);
+		return r;
+	}
 
-		if(_stride==v->_stride)
-		{
-			// Memory layout is identical.
-			memcpy(_data,v->_data,_size*sizeof(FP));
-		}
-		else
+	// Returns a view of the first array with the shape all 'count' arrays broadcast to, broadcasting the shapes together as binary
+	// operations do one at a time.
+	//
+	static NDArray BroadcastShape(const NDArray* const* const arrays,const int count)
+	{
+		NDArray shape = *arrays[0];
+		for(int k=1;k<count;++k)
 		{
-			// Assign each value in the shape - there's an implicit transposition.
-			for(NDIterator2 i=Iter(),j=v->Iter();i!=i.end();++i,++j)
-				*i = *j;
+			const NDArray a = shape->Broadcast(arrays[k]->_data);
+			const NDArray b = (*arrays[k])->Broadcast(a._data);
+			if(a->_shape!=b->_shape)
+				throw IncompatibleShape();
+			shape._Attach(a);
 		}
+		return shape;
 	}
 
-	// Returns a non-const shared pointer this.
+	// Runs a fused elementwise program (FusedKernels.h) on 'inputs' broadcast to a common shape. The result is summed over the
+	// dimensions in 'mask' (kept with length 1) if it isn't 0, and divided by the number of elements summed into each if 'mean'.
 	//
-	inline NDDataPtr Self()
+	static NDArray Fused(const fused_program& program,const NDArrays& inputs,const int mask,const bool mean)
 	{
-		return shared_from_this();
+		const NDArray* arrays[fused_max_inputs];
+		for(int k=0;k<program.inputs;++k)
+			arrays[k] = &inputs[k];
+		const NDArray shape = BroadcastShape(arrays,program.inputs);
+
+		NDArray r = mask?NDData::New(shape->ReducedShape(mask),0.0f):NDData::New(shape->_shape);
+		const NDArray result = r->Broadcast(shape._data);		// Repeats each sum along the reduced dimensions.
+		NDArray operands[fused_max_inputs];
+		float* data[fused_max_inputs+1] = {result->_data};
+		NDShape strides[fused_max_inputs+1] = {result->_stride};
+		FusedOperands(shape,inputs,operands,data+1,strides+1);
+		fused_forward(program,math_fast(MathPolicy::Default),shape->_shape,data,strides,mask!=0);
+		if(mean)
+			r->_Mul(FP(r->_size)/shape->_size);
+		return r;
 	}
 
-	// Returns a const shared pointer this.
+	// Runs a fused elementwise program into 'result', which has the shape of the inputs broadcast together. The result may be (the same
+	// elements of) one of the inputs.
 	//
-	inline NDDataPtrC Self() const
+	static void Fused(const fused_program& program,const NDArrays& inputs,const NDArray& result)
 	{
-		return shared_from_this();
+		const NDArray* arrays[fused_max_inputs];
+		for(int k=0;k<program.inputs;++k)
+			arrays[k] = &inputs[k];
+		const NDArray shape = BroadcastShape(arrays,program.inputs);
+		if(result->_shape!=shape->_shape)
+			throw IncompatibleShape(result->_shape,shape->_shape);
+
+		NDArray operands[fused_max_inputs];
+		float* data[fused_max_inputs+1] = {result->_data};
+		NDShape strides[fused_max_inputs+1] = {result->_stride};
+		FusedOperands(shape,inputs,operands,data+1,strides+1);
+		fused_forward(program,math_fast(MathPolicy::Default),shape->_shape,data,strides,false);
 	}
 
-	// Returns shape of array. Most significant dimension [0] to least significant dimension [n-1].
+	// Gradient of Fused WRT each of its inputs, given the gradient of its result (with reduced dimensions kept).
 	//
-	inline const NDShape& Shape() const
+	static NDArrays FusedGradient(const fused_program& program,const NDArrays& inputs,const int mask,const bool mean,const NDArray& gradient)
 	{
-		return _shape;
+		const NDArray* arrays[fused_max_inputs];
+		for(int k=0;k<program.inputs;++k)
+			arrays[k] = &inputs[k];
+		const NDArray shape = BroadcastShape(arrays,program.inputs);
+		const NDArray g = gradient->Broadcast(shape._data);
+		if(g->_shape!=shape->_shape)
+			throw IncompatibleShape(g->_shape,shape->_shape);
+
+		// Gradients with the broadcast shape, then reduced to the shape of each input.
+		NDArrays gradients;
+		float* data[2*fused_max_inputs+1] = {};
+		NDShape strides[2*fused_max_inputs+1];
+		for(int k=0;k<fused_max_inputs;++k)
+		{
+			if(k<program.inputs)
+			{
+				gradients.emplace_back(NDData::New(shape->_shape));
+				data[k] = gradients[k]->_data;
+				strides[k] = gradients[k]->_stride;
+			}
+			else
+			{
+				data[k] = &_unused;
+				strides[k] = NDShape(shape->_shape.size());
+			}
+		}
+		data[fused_max_inputs] = g->_data;
+		strides[fused_max_inputs] = g->_stride;
+		NDArray operands[fused_max_inputs];
+		FusedOperands(shape,inputs,operands,data+fused_max_inputs+1,strides+fused_max_inputs+1);
+		const FP scale = mean?FP(gradient->_size)/shape->_size:FP(1);
+		fused_backward(program,math_fast(MathPolicy::Default),scale,shape->_shape,data,strides);
+
+		for(int k=0;k<program.inputs;++k)
+			gradients[k]._Attach(ReverseBroadcast(gradients[k],inputs[k].Shape()));
+		return gradients;
 	}
 
-	// Returns number of values in the array.
+	// Data and strides of each input broadcast to 'shape', padded to 'fused_max_inputs' with unused operands.
 	//
-	inline int Size() const
+	static void FusedOperands(const NDArray& shape,const NDArrays& inputs,NDArray* const operands,float** const data,NDShape* const strides)
 	{
-		return _size;
-	}
-
+		for(int k=0;k<fused_max_inputs;++k)
+		{
+			if(k<(int)inputs.size())
+			{
+				operands[k]._Attach(inputs[k]->Broadcast(shape._data));
+				data[k] = operands[k]->_data;
+				strides[k] = operands[k]->_stride;
+			}
+			else
+			{
+				data[k] = &_unused;
+				strides[k] = NDShape(shape->_shape.size());
+			}
+		}
+	}
+
+	// Elementwise assignment to 'this' from an expression, computed in place unless an array operand is another view of the same memory.
+	//
+	template<typename E>
+	void AssignExpression(const E& e)
+	{
+		const NDArray* arrays[E::leaves];
+		e.Arrays(arrays);
+		const NDDataPtrC owner = DataOwner();
+		for(const NDArray* const array:arrays)
+		{
+			const NDData& operand = **array;
+			if((operand._data!=_data||operand._stride!=_stride)&&operand.DataOwner()==owner)
+			{
+				Assign(Evaluate(e));
+				return;
+			}
+		}
+		Compute(e,arrays);
+	}
+
+	// Elementwise assignment to 'this' from 'v'.
+	//
+	void Assign(const NDArray& v)
+	{
+		if(_shape!=v->_shape)
+			throw IncompatibleShape();
+
+		if(HasNaturalStride()&&v->HasNaturalStride())
+		{
+			// Memory layout is identical and contiguous.
+			memcpy(_data,v->_data,_size*sizeof(FP));
+		}
+		else
+		{
+			// Assign each value in the shape - there's an implicit transposition.
+			elementwise_unary(elementwise_copy(),_shape,_data,_stride,v->_data,v->_stride);
+		}
+	}
+
+	// Returns a non-const shared pointer this.
+	//
+	inline NDDataPtr Self()
+	{
+		return shared_from_this();
+	}
+
+	// Returns a const shared pointer this.
+	//
+	inline NDDataPtrC Self() const
+	{
+		return shared_from_this();
+	}
+
+	// Returns shape of array. Most significant dimension [0] to least significant dimension [n-1].
+	//
+	inline const NDShape& Shape() const
+	{
+		return _shape;
+	}
+
+	// Returns number of values in the array.
+	//
+	inline int Size() const
+	{
+		return _size;
+	}
+
 	// Returns a non-const pointer to the data element specified by indices.
 	//
 	FP* const DataPtr(const std::initializer_list<int> indices)
@@ -1289,74 +1788,24 @@ public:
 	// 
 	NDArray ArgMax(const int dim) const
 	{
-		// NOTE: The following code was copied from Mean as a starting point for ArgMax.
-		// Added because I needed Max for adding a correction bias to Softmax that was numerically unstable when using fp32.
-		_ASSERT(dim>=0&&dim<_shape.size());
-
-		// Create the new shape and result data where the aggregation dimension is 1.
-		NDShape newShape(_shape);
-		newShape[dim] = 1;
-		NDArray r = NDData::New(newShape);
-
-		// Iterate reduced shape.
-		const int dimSize = _shape[dim];
-		for(NDIterator2 iter=r->Iter();iter!=iter.end();++iter)
-		{
-			// ArgMax along the aggregation dimension.
-			NDShape indices(iter);
-			const std::initializer_list<int> index(indices.data(),indices.data()+indices.size());
-					
-			// Assume first value.
-			int max_i = 0;
-			FP max_v = (*this)[index];
-
-			// Iterate remaining values.
-			for(int i=0;i<dimSize;++i)
-			{
-				indices[dim] = i;
-				const FP v = (*this)[index];
-				if(v>max_v)
-				{
-					max_v = v;
-					max_i = i;
-				}
-			}
-
-			// Store index of max value.
-			*iter = FP(max_i);
-		}
-
-		const bool keepDims = true;
-		if(!keepDims)
-		{
-			newShape.erase(newShape.begin()+dim);
-			return r.Reshape(newShape);
-		}
-		else
-			return r;
+		NDArray r = NDData::New(ReducedShape(ReduceMask({dim})));
+		const NDDataPtrC x = WithNaturalStride();
+		reduce_max_argmax(ReduceLayout(ReduceMask({dim})),x->_data,nullptr,r->_data);
+		return r;
 	}
 
 	// Elementwise inplace addition.
 	//
 	void _Add(const NDArray& v)
 	{
-		Elementwise(v._data,[](FP& a,const FP b)
-		{
-			a += b;
-		});
+		ApplyBroadcast(elementwise_add(),v._data);
 	}
 
 	// Elementwise addition.
 	//
 	NDArray Add(const NDArray& v) const
 	{
-		// Broadcast to create result.
-		auto [r,v_] = Broadcast(Self(),v);
-
-		// Inplace operation on result.
-		r._data->_Add(v_);
-
-		return r;
+		return Binary(elementwise_add(),v);
 	}
 
 	// Clips values relative to the norm (vector length).
@@ -1365,19 +1814,53 @@ public:
 		// Scale values if the array exceeds the clipping value.
 		const FP norm = Norm();
 		if(clipNorm<norm)
+			_Mul(NDData::New({},clipNorm/norm));
+	}
+
+	// Fused inplace optimiser update (see OptimiserKernels.h) of every parameter 'tensors[i][0]' from its gradient 'tensors[i][1]' and
+	// moments 'tensors[i][2...]', zeroing the gradients if 'zero'. Parameters and moments must have the natural stride, they're updated
+	// in place. The parameters are updated in parallel so a parameter listed more than once (the same data and gradient) is updated once,
+	// parameters sharing data but not gradients are an error.
+	//
+	template<typename OP>
+	static void _OptimiserStep(const OP& op,const std::vector<NDArrays>& tensors,const bool zero)
+	{
+		std::vector<optimiser_tensor> t;
+		std::unordered_map<const FP*,const NDData*> updated;	// Gradient of each parameter's data.
+		NDArrays gradients;		// Strided gradients copied so the kernel can read them.
+		for(size_t i=0;i<tensors.size();++i)
 		{
-			if(HasNaturalStride())
+			const NDArrays& arrays = tensors[i];
+			const auto [parameter,first] = updated.emplace(arrays[0]->_data,arrays[1]._data.get());
+			if(!first)
 			{
-				FP* const rData = _data;
-				for(int i=0;i<_size;++i)
-					rData[i] = rData[i]*clipNorm/norm;
+				if(parameter->second!=arrays[1]._data.get()&&(parameter->second->_data!=arrays[1]->_data||parameter->second->_stride!=arrays[1]->_stride))
+					throw Exception("Parameters share data but not gradients.");
+				continue;
 			}
-			else
+			if((int)arrays.size()<2+OP::moments)
+				throw Exception("Missing optimiser state.");
+			for(int j=0;j<2+OP::moments;++j)
+			{
+				if(arrays[j]->_shape!=arrays[0]->_shape)
+					throw IncompatibleShape(arrays[j]->_shape,arrays[0]->_shape);
+				if(j!=1&&!arrays[j]->HasNaturalStride())
+					throw Exception("Optimiser state must have the natural stride.");
+			}
+			NDDataPtr g = arrays[1]._data;
+			if(!g->HasNaturalStride())
 			{
-				for(NDIterator2 iter=Iter();iter!=iter.end();++iter)
-					*iter = *iter*clipNorm/norm;
+				gradients.push_back(NDData::New(*g));
+				g = gradients.back()._data;
 			}
+			t.push_back({arrays[0]->_data,g->_data,OP::moments>0?arrays[2]->_data:nullptr,OP::moments>1?arrays[3]->_data:nullptr,arrays[0]->_size});
 		}
+		optimiser_step(op,t,zero&&gradients.empty());
+
+		// Strided gradients are zeroed by the slow path.
+		if(zero&&!gradients.empty())
+			for(const NDArrays& arrays:tensors)
+				arrays[1]->_Mul(NDData::New({},0.0f));
 	}
 
 
@@ -1404,26 +1887,167 @@ public:
 		return r;
 	}
 
+	// Returns the row layout for a softmax over dimension 'dim'.
+	//
+	softmax_layout SoftmaxLayout(int dim) const
+	{
+		if(dim<0)
+			dim += _shape.size();
+		if(dim<0||dim>=_shape.size())
+			throw InvalidDimension();
+		softmax_layout layout = {1,_shape[dim],1};
+		for(int i=0;i<dim;++i)
+			layout.outer *= _shape[i];
+		for(int i=dim+1;i<_shape.size();++i)
+			layout.inner *= _shape[i];
+		return layout;
+	}
+
+	// Returns a bit for each dimension in 'dims' (negative dimensions count from the end).
+	//
+	int ReduceMask(const std::initializer_list<int>& dims) const
+	{
+		int mask = 0;
+		for(int dim:dims)
+		{
+			if(dim<0)
+				dim += _shape.size();
+			if(dim<0||dim>=_shape.size())
+				throw InvalidDimension();
+			mask |= 1<<dim;
+		}
+		return mask;
+	}
+
+	// Returns the shape with the dimensions in 'mask' reduced to 1.
+	//
+	NDShape ReducedShape(const int mask) const
+	{
+		NDShape shape(_shape);
+		for(int i=0;i<_shape.size();++i)
+			if(mask&(1<<i))
+				shape[i] = 1;
+		return shape;
+	}
+
+	// Returns the layout for reducing the dimensions in 'mask', which must be neighbours.
+	//
+	reduce_layout ReduceLayout(const int mask) const
+	{
+		reduce_layout layout = {1,1,1};
+		for(int i=0;i<_shape.size();++i)
+		{
+			if(mask&(1<<i))
+				layout.n *= _shape[i];
+			else if(mask>>i)
+				layout.outer *= _shape[i];		// Reduced dimensions follow.
+			else
+				layout.inner *= _shape[i];
+		}
+		return layout;
+	}
+
+	// Reduces the dimensions in 'mask' with 'op', keeping them with length 1. Each run of neighbouring dimensions is one pass of the
+	// reduction kernel, innermost first.
+	//
+	template<typename OP>
+	NDArray Reduce(const OP& op,int mask) const
+	{
+		if(!mask)
+			return New(*this);
+
+		NDDataPtrC x = WithNaturalStride();
+		NDArray r;
+		while(mask)
+		{
+			// Innermost run of reduced dimensions.
+			int last = (int)_shape.size()-1;
+			while(!(mask&(1<<last)))
+				--last;
+			int run = 0;
+			for(int i=last;i>=0&&(mask&(1<<i));--i)
+				run |= 1<<i;
+			mask &= ~run;
+
+			r._Attach(NDData::New(x->ReducedShape(run)));
+			reduce(op,x->ReduceLayout(run),x->_data,r->_data);
+			x = r._data;
+		}
+		return r;
+	}
+
+	// Returns the sum of op(x) over every value, independent of the number of threads.
+	//
+	template<typename OP>
+	double SumOf(const OP& op,const SumPrecision precision) const
+	{
+		const NDDataPtrC x = WithNaturalStride();
+		return reduce_full(op,_size,x->_data,precision);
+	}
+
+	// Returns 'r' without the dimensions in 'mask'.
+	//
+	static NDArray DropDims(const NDArray& r,const int mask)
+	{
+		NDShape shape;
+		for(int i=0;i<r.Shape().size();++i)
+			if(!(mask&(1<<i)))
+				shape.emplace_back(r.Shape()[i]);
+		return r.Reshape(shape);
+	}
+
+	// Returns a view of this if it has natural strides, otherwise a copy with natural strides, for kernels that need dense memory.
+	//
+	NDArray Contiguous() const
+	{
+		if(HasNaturalStride())
+			return New(Self());
+		return New(*this);
+	}
+
+	// As Contiguous, but returns this rather than a view of it.
+	//
+	NDDataPtrC WithNaturalStride() const
+	{
+		if(HasNaturalStride())
+			return Self();
+		return New(*this)._data;
+	}
+
 	// Softmax over dimension 'dim'.
 	// 
 	//	softmax(x) = e^x/sum(e^x).
 	//
-	NDArray Softmax(int dim) const
+	// Numerically stable version.
+	//	    e^x[i]		        e^(x[i]-m)
+	//  --------------- = ----------------------- = same as scaling top and bottom by some e^m.
+	//  e^x[0]...e^x[j]   e^(x[0]-m)...(e^x[j]-m)
+	//
+	// Fused, the max and sum are found in a single pass over each row - see SoftmaxKernels.h.
+	//
+	NDArray Softmax(const int dim,const MathPolicy policy=MathPolicy::Default) const
+	{
+		const softmax_layout layout = SoftmaxLayout(dim);
+		const NDDataPtrC x = WithNaturalStride();
+		NDArray r = NDData::New(_shape);
+		softmax_forward(layout,x->_data,r->_data,false,math_fast(policy));
+		return r;
+	}
+
+	// Gradient of Softmax over dimension 'dim' where this is the output of the softmax.
+	//
+	//	dx = y*(g-sum(g*y))
+	//
+	NDArray SoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy=MathPolicy::Default) const
 	{
-		// Vanilla version.
-		/*
-		NDArray temp = Exp();				// e^x for each value.
-		return temp/temp.Sum(dim,true);		// e^x/sum(e^x) for each row/sample.
-		*/
-		// Numerically stable version.
-		//	    e^x[i]		        e^(x[i]-m)
-		//  --------------- = ----------------------- = same as scaling top and bottom by some e^m.
-		//  e^x[0]...e^x[j]   e^(x[0]-m)...(e^x[j]-m)
-		const NDArray z = Sub(Max(dim));	// Subtract maximum value for each row to reduce x.
-		const NDArray exps = z.Exp();		// e^x for each value.
-		NDArray denom = exps.Sum(dim,true);	// sum(e^x) for each row.
-		denom = denom + 1e-12f;				// Add some small epsilon to avoid div 0.
-		return exps/denom;					// e^x/sum(e^x) for each row/sample.
+		if(gradient.Shape()!=_shape)
+			throw IncompatibleShape(gradient.Shape(),_shape);
+		const softmax_layout layout = SoftmaxLayout(dim);
+		const NDDataPtrC y = WithNaturalStride();
+		const NDDataPtrC g = gradient->WithNaturalStride();
+		NDArray r = NDData::New(_shape);
+		softmax_backward(layout,y->_data,g->_data,r->_data,false,math_fast(policy));
+		return r;
 	}
 
 	// LogSoftmax over dimension 'dim' - numerically stable compared to log(softmax(x)).
@@ -1432,74 +2056,103 @@ public:
 	// log ---------------  = log(e^x[i]) - log(e^x[0]...e^x[j]) = x[i] - log(e^x[0]...e^x[j])
 	//     e^x[0]...e^x[j]
 	// 
-	NDArray LogSoftmax(const int dim) const
+	NDArray LogSoftmax(const int dim,const MathPolicy policy=MathPolicy::Default) const
 	{
-		const NDArray z = Sub(Max(dim));					// Subtract maximum value for each row to reduce x.
-		const NDArray lse = z.Exp().Sum(dim,true).Log();	// log(sum(e^x)) for each row.
-		return z-lse;										// z - log(sum(e^x)) for each row.
+		const softmax_layout layout = SoftmaxLayout(dim);
+		const NDDataPtrC x = WithNaturalStride();
+		NDArray r = NDData::New(_shape);
+		softmax_forward(layout,x->_data,r->_data,true,math_fast(policy));
+		return r;
 	}
 
-	// Elementwise inplace division.
+	// Gradient of LogSoftmax over dimension 'dim' where this is the output of the log softmax.
 	//
-	void _Div(const NDArray& v)
+	//	dx = g-e^y*sum(g)
+	//
+	NDArray LogSoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy=MathPolicy::Default) const
 	{
-		Elementwise(v._data,[](FP& a,const FP b)
-		{
-			a /= b;
-		});
+		if(gradient.Shape()!=_shape)
+			throw IncompatibleShape(gradient.Shape(),_shape);
+		const softmax_layout layout = SoftmaxLayout(dim);
+		const NDDataPtrC y = WithNaturalStride();
+		const NDDataPtrC g = gradient->WithNaturalStride();
+		NDArray r = NDData::New(_shape);
+		softmax_backward(layout,y->_data,g->_data,r->_data,true,math_fast(policy));
+		return r;
 	}
 
-	// Elementwise division.
+	// Returns the class indices in 'targets' for cross entropy over the rows of this.
 	//
-	NDArray Div(const NDArray& v) const
+	std::vector<int> CrossEntropyTargets(const NDArray& targets,const int ignoreIndex) const
 	{
-		NDArray r = NDData::New(*this);
-		r->_Div(v);		
-		return r;
+		// Must be one target 'index' for each row of logits.
+		if(_shape.size()!=2||targets.Shape().size()!=1||targets.Shape()[0]!=_shape[0])
+			throw IncompatibleShape(targets.Shape(),_shape);
+
+		std::vector<int> indices(_shape[0]);
+		for(int i=0;i<_shape[0];++i)
+		{
+			const int target = (int)targets[{i}];
+			if(target!=ignoreIndex&&(target<0||target>=_shape[1]))
+				throw IndexOutOfBounds();
+			indices[i] = target;
+		}
+		return indices;
 	}
 
+	// Mean cross entropy of the rows of logits (this) against class indices 'targets', with optional label smoothing. Targets equal to
+	// 'ignoreIndex' are excluded from the loss and the mean. The log-sum-exp of each row is returned in 'lse' for the gradient.
+	//
+	// Fused, no one hot targets are created - see SoftmaxKernels.h.
+	//
+	NDArray CrossEntropy(const NDArray& targets,NDArray& lse,const FP smoothing=0,const int ignoreIndex=-100,const MathPolicy policy=MathPolicy::Default) const
+	{
+		const std::vector<int> indices = CrossEntropyTargets(targets,ignoreIndex);
+		const NDDataPtrC x = WithNaturalStride();
+		const int rows = _shape[0];
+		lse._Attach(NDData::New({rows}));
+		const NDArray loss = NDData::New({rows});
+		cross_entropy_forward(rows,_shape[1],x->_data,indices.data(),ignoreIndex,smoothing,lse->_data,loss->_data,math_fast(policy));
+
+		const int count = (int)std::count_if(indices.begin(),indices.end(),[ignoreIndex](const int i){return i!=ignoreIndex;});
+		double total = 0.0;
+		for(int i=0;i<rows;++i)
+			total += loss->_data[i];
+		return NDData::New({},count?FP(total/count):FP(0));	// Nothing counted has no loss rather than 0/0.
+	}
 
-	NDArray GpuMatMul(const NDArray& v) const
+	// Gradient of CrossEntropy WRT the logits (this) given the scalar loss 'gradient' and the 'lse' from the forward pass.
+	//
+	NDArray CrossEntropyGradient(const NDArray& targets,const NDArray& lse,const NDArray& gradient,const FP smoothing=0,const int ignoreIndex=-100,
+		const MathPolicy policy=MathPolicy::Default) const
 	{
-		// Both arrays must be 2D.
-		if(_shape.size()!=2||v->_shape.size()!=2)
+		const std::vector<int> indices = CrossEntropyTargets(targets,ignoreIndex);
+		if(gradient.Size()!=1)
 			throw IncompatibleShape();
+		const NDDataPtrC x = WithNaturalStride();
+		const int rows = _shape[0];
+		const int count = (int)std::count_if(indices.begin(),indices.end(),[ignoreIndex](const int i){return i!=ignoreIndex;});
+		NDArray r = NDData::New(_shape);
+		const FP scale = count?gradient->_data[0]/count:FP(0);		// Mean over the counted rows.
+		cross_entropy_backward(rows,_shape[1],x->_data,indices.data(),ignoreIndex,smoothing,lse->_data,scale,r->_data,math_fast(policy));
+		return r;
+	}
 
-		// TODO: Move transposition into CUDA kernal.
-		// Conditional load for A and B depending on orientation.
-
-		// Cache matrix dimensions.
-		const bool aRowMajor = HasNaturalStride();		// Make a copy if memory layout is not row major and contiguous.
-		const NDArray a = aRowMajor?NDArray(const_cast<NDData*>(this)->shared_from_this()):NDArray(NDData::New(*this));
-		const int aRows = a->_shape[0];
-		const int aCols = a->_shape[1];
-		const int aRowStride = a->_stride[0];
-		const int aColStride = a->_stride[1];
-		_ASSERT(aColStride==1);
-
-		const bool bRowMajor = v->HasNaturalStride();	// Make a copy if memory layout is not row major and contiguous.
-		const NDArray b = bRowMajor?NDArray(v):NDArray(NDData::New(*v));
-		const int bRows = b->_shape[0];
-		const int bCols = b->_shape[1];
-		const int bRowStride = b->_stride[0];
-		const int bColStride = b->_stride[1];
-		_ASSERT(bColStride==1);
-
-		// Create output shape.
-		NDShape shape(_shape);
-		shape[1] = bCols;
-		NDArray c = NDData::New(shape,0.0);
-		const int cRows = c->_shape[0];
-		const int cCols = c->_shape[1];
-		const int cRowStride = c->_stride[0];
-		const int cColStride = c->_stride[1];
-		_ASSERT(cColStride==1);
-
-		CudaMatMul(a->_data,b->_data,c->_data,aRows,aCols,bCols);
+	// Elementwise inplace division.
+	//
+	void _Div(const NDArray& v)
+	{
+		ApplyBroadcast(elementwise_div(),v._data);
+	}
 
-		return c;
+	// Elementwise division.
+	//
+	NDArray Div(const NDArray& v) const
+	{
+		return Binary(elementwise_div(),v);
 	}
 
+
 	// Matrix multiplication.
 	//
 	// Sum of row*column a(ij).b(xy)=c(iy) where j=x...
@@ -1507,114 +2160,46 @@ public:
 	//  a11 a12   b11 b12   a11*b11+a12*b21 a11*b12+a12*b22
 	//  a21 a22 . b21 b22 = a21*b11+a22*b21 a12*b12+a22*b22
 	//
-	NDArray CpuMatMul(const NDArray& v) const
+	//	op(x) is x, or the transpose of x when the corresponding 'trans' flag is set (like BLAS sgemm). Transposition only swaps the
+	//	strides passed to the backend, so neither operand is copied.
+	//	The backend is chosen by MatMulDispatcher from the size of the product unless 'backend' names one (e.g. "packed").
+	//
+	NDArray MatMul(const NDArray& v,const bool transA,const bool transB,const char* const backend=nullptr) const
 	{
 		// Both arrays must be 2D.
 		if(_shape.size()!=2||v->_shape.size()!=2)
 			throw IncompatibleShape();
 
-		// Cache matrix dimensions.
-		const bool aRowMajor = _stride[1]==1;	// Make a copy if not row major, so copying tiles from matrix is cache friendly.
-		const NDArray a = aRowMajor?NDArray(const_cast<NDData*>(this)->shared_from_this()):NDArray(NDData::New(*this));
-		const int aRows = a->_shape[0];
-		const int aCols = a->_shape[1];
-		const int aRowStride = a->_stride[0];
-		const int aColStride = a->_stride[1];
-		_ASSERT(aColStride==1);
-		const int bRows = v->_shape[0];
-		const int bCols = v->_shape[1];
-		const int bRowStride = v->_stride[0];
-		const int bColStride = v->_stride[1];
+		// Dimensions and strides of op(a) and op(b).
+		const int m = _shape[transA?1:0];
+		const int k = _shape[transA?0:1];
+		const int a_rs = _stride[transA?1:0];
+		const int a_cs = _stride[transA?0:1];
+		const int n = v->_shape[transB?0:1];
+		const int b_rs = v->_stride[transB?1:0];
+		const int b_cs = v->_stride[transB?0:1];
 
 		// LHS columns must equal RHS rows.
-		if(aCols!=bRows)
+		if(k!=v->_shape[transB?1:0])
 			throw IncompatibleShape();
 
-		// Expect at least one stride to be 1.
-		if(aRowStride!=1&&aColStride!=1||bRowStride!=1&&bColStride!=1)
-			throw IncompatibleShape();
+		// Create output shape, every element is written by the backend.
+		NDArray c = NDData::New({m,n});
 
-		// Create output shape.
-		NDShape shape(_shape);
-		shape[1] = bCols;
-		NDArray c = NDData::New(shape,0.0);
-		const int cRows = c->_shape[0];
-		const int cCols = c->_shape[1];
-		const int cRowStride = c->_stride[0];
-		const int cColStride = c->_stride[1];
-		_ASSERT(cColStride==1);
-
-		// Dimensions of the output matrix in tile
-		const int tile_rows = ((aRows-1)/tile_size)+1;
-		const int tile_cols = ((bCols-1)/tile_size)+1;
-		const int inner_tiles = ((aCols-1)/tile_size)+1;
-
-		// Transpose the RHS matrix so that the tiles are aligned for multiplication.
-		const bool bColMajor = bRowStride==1;	// Make a copy if not column major, so copying tiles from matrix is cache friendly.
-		const NDArray bT = bColMajor?v->Transpose():NDArray(NDData::New(*(v->Transpose())));
-		const int bTRows = bT->_shape[0];
-		const int bTCols = bT->_shape[1];
-		const int bTRowStride = bT->_stride[0];
-		const int bTColStride = bT->_stride[1];
-		_ASSERT(bTColStride==1);
-
-		{// Scoped TaskGroup.
-			NDThreadPool::TaskGroup taskGroup;
-
-			// Iterate over the tiles of the output matrix.		
-			for(int tile_row=0;tile_row<tile_rows;++tile_row)
-			{
-				for(int tile_col=0;tile_col<tile_cols;++tile_col)
-				{
-					// Compute the output tile - run independent output tile as task - better parallelism than parallel for.
-					taskGroup.Run([
-						&a,aRows,aCols,aRowStride,
-						&bT,bTRows,bTCols,bTRowStride,
-						&c,cRows,cCols,cRowStride,
-						tile_row,tile_col,inner_tiles
-					]()
-					{
-						// Reserve tile buffers per thread - these are held in L1 cache.
-						alignas(64) float x[tile_size][tile_size];
-						alignas(64) float y[tile_size][tile_size];
-						alignas(64) float z[tile_size][tile_size];
-						for(int p=0;p<inner_tiles;++p)
-						{
-							// Copy p-th inner tile from tile row a.
-							copy_to_tile(
-								&x[0][0],											// Destination tile matrix.
-								a->_data,aRows,aCols,aRowStride,						// Source matrix description.
-								tile_row*tile_size,p*tile_size);					// Source tile row and column.
-
-							// Copy p-th inner tile from tile row bT.
-							copy_to_tile(
-								&y[0][0],											// Destination tile matrix.
-								bT->_data,bTRows,bTCols,bTRowStride,				// Source matrix description.
-								tile_col*tile_size,p*tile_size);					// Source tile row and column.
-
-							// Multiply the two tiles a@bT.
-							matmul_tile(&x[0][0],&y[0][0],&z[0][0]);
-
-							// Add the result tile to the output matrix.
-							add_from_tile(
-								&z[0][0],											// Source tile matrix (row major).
-								c->_data,cRows,cCols,cRowStride,					// Destination matrix decription (row major).
-								tile_row*tile_size,tile_col*tile_size);				// Destination tile row and column.
-						}
-					});
-				}
-			}
-		} // Waits for TaskGroup.
+		MatMulDispatcher::MatMul(
+			m,n,k,
+			_data,a_rs,a_cs,
+			v->_data,b_rs,b_cs,
+			c->_data,c->_stride[0],
+			backend);
 
 		c->DebugRangeCheck();
 		return c;
 	}
 
-
-	NDArray MatMul(const NDArray& v) const
+	NDArray MatMul(const NDArray& v,const char* const backend=nullptr) const
 	{
-		return GpuMatMul(v);
-		//return CpuMatMul(v);
+		return MatMul(v,false,false,backend);
 	}
 
 
@@ -1626,83 +2211,110 @@ public:
 	//  Each sample in the batch, and each timestep is treated as an dependant matrix multiplication with the weights.
 	//
 	NDArray Dot(const NDArray& v) const
+	{
+		return Dot(v,false,false);
+	}
+
+	// Dot product of optionally transposed arrays, op(A) @ op(B), where op() swaps the last two dimensions when the 'trans' flag is set.
+	//	Equivalent to A.Transpose().Dot(B) etc. without copying the transposed operand.
+	//
+	NDArray Dot(const NDArray& v,const bool transA,const bool transB) const
 	{
 		if(_shape.size()<2||v->_shape.size()<2)
 			throw NotImplemented();
 
-		// If the RHS has more than 2 dimensions then perform a batch matrix multiply.
-		// This does a 2D matrix multiply for each batch dimension.
-		if(v->_shape.size()>2)
+		// If the RHS is 2D and the LHS rows are not transposed then batch dimensions can be combined to create a 2D matrix.
+		// E.g. (B,T,C) @ (C,H) reshape to (B*T,C) @ (C,H) = (B*T,H) reshape to result (B,T,H).
+		if(v->_shape.size()==2&&!transA)
 		{
-			// Only implemented for 1 batch dimension.
-			if(_shape.size()>3||v->_shape.size()>3)
-				throw NotImplemented();
-
-			// Broadcast 'this' to v - ensuring the shape has the same size and batch dimensions match (batch,i,k)@(batch,k,j).
-			const NDArray self = Broadcast(v._data,2);	// Don't touch the 2D matrix dimensions.
-			//self->Print(std::cout);
-			
-			// Create result shape - all dimensions from self and last dimension from v.
-			NDShape shape(self->_shape);
-			shape[shape.size()-1] = v->_shape[v->_shape.size()-1];
-
-			// Allocate uninitialised result array.
-			NDArray r(NDData::New(shape));
-
-			// Multiply the corresponding pair of 2D arrays in the batch.
-			//for(int b=0;b<v->_shape[0];++b)
-			//const auto rng = std::views::iota(0,v->_shape[0]);
-			//std::for_each(std::execution::par_unseq,rng.begin(),rng.end(),[&v,&self,&r](const int b)
-			//concurrency::affinity_partitioner ap;
-			//concurrency::parallel_for(0,v->_shape[0],[&v,&self,&r](const int b)
-			NDThreadPool::ForEach(0,v->_shape[0],[&v,&self,&r](const int b)
+			if(_shape.size()==2)
 			{
-				/*
-				const NDArrayC vb = v.Slice({{b}});			// 2D slice of v.
-				print("vb:");
-				print(vb);
-				const NDArrayC sb = self->Slice({{b}});		// 2D slice of self.
-				print("sb:");
-				print(sb);
-				const NDArrayC v = sb->MatMul(vb);			// 2D @ 2D.
-				print("=");
-				print(v);
-				r->Slice({{b}}) = v;						// Assign 2D result.
-				*/
-				r->Slice({{b}}) = self->Slice({{b}})->MatMul(v.Slice({{b}}));
-			});/*,concurrency::static_partitioner());*/
-			return r;
+				// 2D @ 2D matrix multiply.
+				return MatMul(v,transA,transB);
+			}
+
+			// Compute length of new row dimension.
+			int i = _shape[0];
+			for(int n=1;n<_shape.size()-1;++n)
+				i *= _shape[n];
+
+			// Reshape as 2D array.
+			NDArray lhs = Reshape({i,_shape[_shape.size()-1]});
+
+			// 2D @ 2D multiply.
+			NDArray r = lhs->MatMul(v,false,transB);
+
+			// Reshape result.
+			NDShape shape(_shape);
+			shape[shape.size()-1] = r->_shape[1];
+			return r->Reshape(shape);
 		}
-		else
+
+		// Batch matrix multiply, a 2D matrix multiply for each element of the leading (batch) dimensions.
+		// Broadcast the batch dimensions of each array to the other - don't touch the 2D matrix dimensions.
+		const NDArray self = Broadcast(v._data,2);
+		const NDArray other = v->Broadcast(self._data,2);
+		const int dims = (int)self->_shape.size();
+		if(other->_shape.size()!=dims)
+			throw IncompatibleShape();
+		int batch = 1;
+		for(int i=0;i<dims-2;++i)
 		{
-			// RHS is 2D.
+			if(self->_shape[i]!=other->_shape[i])
+				throw IncompatibleShape();
+			batch *= self->_shape[i];
+		}
+
+		// Matrices must be addressable with a single batch stride, otherwise use a copy.
+		const NDArray a = self->BatchStride()>=0?self:NDData::New(*self);
+		const NDArray b = other->BatchStride()>=0?other:NDData::New(*other);
+
+		// Dimensions and strides of op(a) and op(b).
+		const int m = a->_shape[transA?dims-1:dims-2];
+		const int k = a->_shape[transA?dims-2:dims-1];
+		const int a_rs = a->_stride[transA?dims-1:dims-2];
+		const int a_cs = a->_stride[transA?dims-2:dims-1];
+		const int n = b->_shape[transB?dims-2:dims-1];
+		const int b_rs = b->_stride[transB?dims-1:dims-2];
+		const int b_cs = b->_stride[transB?dims-2:dims-1];
+		if(k!=b->_shape[transB?dims-1:dims-2])
+			throw IncompatibleShape();
 
-			// If LHS is >2D then batch dimensions can be combined to create a 2D matrix.
-			// E.g. (B,T,C) @ (C,H) reshape to (B*T,C) @ (C,H) = (B*T,H) reshape to result (B,T,H).
-			if(_shape.size()>2)
-			{
-				// Compute length of new row dimension.
-				int i = _shape[0];
-				for(int n=1;n<_shape.size()-1;++n)
-					i *= _shape[n];
+		// Create result shape - batch dimensions, rows of op(a) and columns of op(b).
+		NDShape shape(a->_shape);
+		shape[dims-2] = m;
+		shape[dims-1] = n;
 
-				// Reshape as 2D array.
-				NDArray lhs = Reshape({i,_shape[_shape.size()-1]});
+		// Allocate uninitialised result array, each matrix is written directly by the batched GEMM.
+		NDArray r(NDData::New(shape));
+		MatMulDispatcher::MatMulBatched(
+			batch,m,n,k,
+			a->_data,a->BatchStride(),a_rs,a_cs,
+			b->_data,b->BatchStride(),b_rs,b_cs,
+			r->_data,m*n,n);
 
-				// 2D @ 2D multiply.
-				NDArray r = lhs->MatMul(v);
+		r->DebugRangeCheck();
+		return r;
+	}
 
-				// Reshape result.
-				NDShape shape(_shape);
-				shape[shape.size()-1] = v->_shape[v->_shape.size()-1];
-				return r->Reshape(shape);
-			}
-			else
-			{
-				// 2D @ 2D matrix multiply.
-				return MatMul(v);
-			}
+	// Returns the stride between consecutive matrices (last 2 dimensions) when the leading dimensions can be iterated with a
+	// single stride, otherwise -1. Broadcast dimensions have a stride of 0.
+	//
+	int BatchStride() const
+	{
+		int stride = 0;
+		int expected = -1;	// Stride required of the next more significant dimension.
+		for(int i=(int)_shape.size()-3;i>=0;--i)
+		{
+			if(_shape[i]==1)
+				continue;
+			if(expected<0)
+				stride = _stride[i];
+			else if(_stride[i]!=expected)
+				return -1;
+			expected = _stride[i]*_shape[i];
 		}
+		return stride;
 	}
 
 	// Entropy.
@@ -1756,21 +2368,51 @@ public:
 
 	// Inplace elementwise exponential.
 	//
-	void _Exp()
+	void _Exp(const MathPolicy policy=MathPolicy::Default)
 	{
-		Elementwise([](FP& v)
-		{
-			v = exp(v);
-		});
-		DebugRangeCheck();
+		if(math_fast(policy))
+			Apply(elementwise_fast_exp());
+		else
+			Apply(elementwise_exp());
 	}
 
 	// Elementwise exponential.
 	//
-	NDArray Exp() const
+	NDArray Exp(const MathPolicy policy=MathPolicy::Default) const
 	{
-		NDArray r = NDData::New(*this);
-		r->_Exp();
+		if(math_fast(policy))
+			return Unary(elementwise_fast_exp());
+		else
+			return Unary(elementwise_exp());
+	}
+
+	// Returns a view repeating unit length dimensions to 'shape' without copying (their stride is zero), dimensions may also be added
+	// to the left. A length of -1 keeps the length of the dimension.
+	//
+	NDArray Expand(const NDShape& shape) const
+	{
+		if(shape.size()<_shape.size())
+			throw IncompatibleShape(_shape,shape);
+		const int added = (int)(shape.size()-_shape.size());
+
+		NDArray r = NDData::New(Self());
+		for(int i=0;i<added;++i)
+		{
+			r->_shape.insert(r->_shape.begin(),1);
+			r->_stride.insert(r->_stride.begin(),0);
+		}
+		r->_size = 1;
+		for(int i=0;i<(int)shape.size();++i)
+		{
+			if(shape[i]!=r->_shape[i]&&!(shape[i]==-1&&i>=added))
+			{
+				if(r->_shape[i]!=1||shape[i]<0)
+					throw IncompatibleShape(_shape,shape);
+				r->_shape[i] = shape[i];
+				r->_stride[i] = 0;
+			}
+			r->_size *= r->_shape[i];
+		}
 		return r;
 	}
 
@@ -1788,10 +2430,9 @@ public:
 	//
 	NDArray Flatten() const
 	{
-		_ASSERT(HasNaturalStride());
-
+		const NDDataPtrC data = WithNaturalStride();
 		NDArray r = NDData::New({_size});
-		memcpy(r->_data,_data,_size*sizeof(FP));
+		memcpy(r->_data,data->_data,_size*sizeof(FP));
 		return r;
 	}
 
@@ -1869,21 +2510,22 @@ public:
 
 	// Elementwise inplace log.
 	//
-	void _Log()
+	void _Log(const MathPolicy policy=MathPolicy::Default)
 	{
-		Elementwise([](FP& v)
-		{
-			v = log(v);
-		});
+		if(math_fast(policy))
+			Apply(elementwise_fast_log());
+		else
+			Apply(elementwise_log());
 	}
 
 	// Elementwise log.
 	//
-	NDArray Log() const
+	NDArray Log(const MathPolicy policy=MathPolicy::Default) const
 	{
-		NDArray r = NDData::New(*this);
-		r->_Log();
-		return r;
+		if(math_fast(policy))
+			return Unary(elementwise_fast_log());
+		else
+			return Unary(elementwise_log());
 	}
 
 	// Returns Y values on the log curve which are evently spaced along the X axis.
@@ -1935,115 +2577,56 @@ public:
 
 	// Max value along dimension.
 	//
-	NDArray Max(int dim) const
+	NDArray Max(const int dim) const
 	{
-		if(dim<0)
-			dim += _shape.size();
-		if(dim>=_shape.size())
-			throw InvalidDimension();
-
-		// Create the new shape and result data where the aggregation dimension is 1.
-		NDShape newShape(_shape);
-		newShape[dim] = 1;
-		NDArray r = NDData::New(newShape);
-
-		// Iterate reduced shape.
-		const int dimSize = _shape[dim];
-		for(NDIterator2 iter=r->Iter();iter!=iter.end();++iter)
-		{
-			// Max along the aggregation dimension.
-			NDShape indices(iter);
-			const std::initializer_list<int> index(indices.data(),indices.data()+indices.size());
-					
-			// Assume first value, and iterate over the rest.
-			FP max_v = (*this)[index];
-			for(int i=0;i<dimSize;++i)
-			{
-				indices[dim] = i;
-				const FP v = (*this)[index];
-				if(v>max_v)
-					max_v = v;
-			}
-
-			// Store max value.
-			*iter = max_v;
-		}
+		return Reduce(reduce_max(),ReduceMask({dim}));
+	}
 
-		const bool keepDims = true;
-		if(!keepDims)
-		{
-			newShape.erase(newShape.begin()+dim);
-			return r.Reshape(newShape);
-		}
-		else
-			return r;
+	// Max value along dimension and the index of the first max in 'argmax', found in one pass.
+	//
+	NDArray Max(const int dim,NDArray& argmax) const
+	{
+		const int mask = ReduceMask({dim});
+		NDArray r = NDData::New(ReducedShape(mask));
+		argmax._Attach(NDData::New(ReducedShape(mask)));
+		const NDDataPtrC x = WithNaturalStride();
+		reduce_max_argmax(ReduceLayout(mask),x->_data,r->_data,argmax->_data);
+		return r;
 	}
 
 	// Compute mean for dimension, where that dimension collapses to 1 value.
 	//
 	NDArray Mean(const int dim,const bool keepDims) const
 	{
-		_ASSERT(dim>=0&&dim<_shape.size());
-
-		// Create the new shape and result data where the aggregation dimension is 1.
-		NDShape newShape(_shape);
-		newShape[dim] = 1;
-		NDArray r = NDData::New(newShape);
-
-		// Iterate reduced shape.
-		const int dimSize = _shape[dim];
-		for(NDIterator2 iter=r->Iter();iter!=iter.end();++iter)
-		{
-			// Sum along the aggregation dimension.
-			NDShape indices(iter);
-			const std::initializer_list<int> index(indices.data(),indices.data()+indices.size());
-			FP sum = 0.0;
-			for(int i=0;i<dimSize;++i)
-			{
-				indices[dim] = i;
-				sum += (*this)[index];
-			}
-
-			// Store output mean.
-			*iter = sum/dimSize;
-		}
+		return Mean({dim},keepDims);
+	}
 
-		if(!keepDims)
-		{
-			newShape.erase(newShape.begin()+dim);
-			return r.Reshape(newShape);
-		}
-		else
-			return r;
+	// Compute mean over dimensions, where those dimensions collapse to 1 value.
+	//
+	NDArray Mean(const std::initializer_list<int>& dims,const bool keepDims) const
+	{
+		const int mask = ReduceMask(dims);
+		NDArray r = Reduce(reduce_sum(),mask);
+		const FP scale = FP(r->_size)/_size;	// 1/(number of values reduced into each).
+		for(int i=0;i<r->_size;++i)
+			r->_data[i] *= scale;
+		return keepDims?r:DropDims(r,mask);
 	}
 
-	// Scalar mean value - should be deprecated when other 'Mean' can accept a list of 'dims'.
+	// Mean of every value, summed with 'precision' (SumOf) and kept with unit length dimensions if 'keepDims', otherwise a scalar.
 	//
-	NDArray Mean(const bool keepDims) const
+	NDArray Mean(const bool keepDims,const SumPrecision precision=SumPrecision::Pairwise) const
 	{
 		// Result either same dimensionality as this or a scalar.
 		NDShape shape;
 		if(keepDims)
 		{
 			shape.reserve(_shape.size());
-			for(size_t i=0;i<_shape.size();++i)
-				shape.emplace_back(1);
-		}
-		NDArray r = NDData::New(shape);
-
-		FP sum = 0.0;
-		if(HasNaturalStride())
-		{
-			for(int i=0;i<_size;++i)
-				sum += _data[i];
-		}
-		else
-		{
-			for(NDIterator2 iter=Iter();iter!=iter.end();++iter)
-				sum += *iter;
+			for(size_t i=0;i<_shape.size();++i)
+				shape.emplace_back(1);
 		}
-		r->_data[0] = sum/_size;
-
+		NDArray r = NDData::New(shape);
+		r->_data[0] = FP(SumOf(elementwise_copy(),precision)/_size);
 		return r;
 	}
 
@@ -2051,67 +2634,44 @@ public:
 	//
 	void _Mul(const NDArray& v)
 	{
-		Elementwise(v._data,[](FP& a,const FP b)
-		{
-			a *= b;
-		});
+		ApplyBroadcast(elementwise_mul(),v._data);
 	}
 
 	// Elementwise multiply by nd-array.
 	//
 	NDArray Mul(const NDArray& v) const
 	{
-		// Broadcast to create result.
-		auto [r,v_] = Broadcast(Self(),v);
-
-		// Inplace operation on result.
-		r->_Mul(v_);
-
-		return r;
+		return Binary(elementwise_mul(),v);
 	}
 
 	// Elementwise negation.
 	//
 	NDArray Negate() const
 	{
-		NDArray r = NDData::New(_shape);
-		r->Elementwise(Self(),[](FP& a,const FP b)
-		{
-			a = -b;
-		});
-		return r;
+		return Unary(elementwise_negate());
 	}
 
 	// Returns the Euclidean norm. 
 	//  The length of the vector/distance of the point from the origin. 
 	//  i.e. Extendion of Pythagorean theorem to n dimensions, square root of sum of squares.
 	//
-	FP Norm() const
+	FP Norm(const SumPrecision precision=SumPrecision::Pairwise) const
 	{
-		FP ss = 0.0;
-		if(HasNaturalStride())
-		{
-			FP* const rData = _data;
-			for(int i=0;i<_size;++i)
-				ss += pow(rData[i],FP(2));
-		}
-		else
-		{
-			for(NDIterator2 iter=Iter();iter!=iter.end();++iter)
-				ss += pow(*iter,FP(2));
-		}
-		return sqrt(ss);
+		return FP(std::sqrt(SumOf(elementwise_square(),precision)));
 	}
 
 	// Elementwise not equal, returns boolean array of same shape.
 	//
 	NDArray NotEqual(const NDArray& v) const
 	{
-		_ASSERT(HasNaturalStride());
+		if(_shape!=v->_shape)
+			throw IncompatibleShape(v->_shape,_shape);
 
+		const NDDataPtrC a = WithNaturalStride();
+		const NDDataPtrC b = v->WithNaturalStride();
 		NDArray r = NDData::New(_shape);
-		const FP* const data = _data;
-		const FP* const vData = v->_data;
+		const FP* const data = a->_data;
+		const FP* const vData = b->_data;
 		FP* const rData = r->_data;
 		for(int i=0;i<_size;++i)
 			rData[i] = data[i]!=vData[i];
@@ -2127,29 +2687,24 @@ public:
 
 	// Elementwise power.
 	//
-	void _Pow(const FP exponent)
+	void _Pow(const FP exponent,const MathPolicy policy=MathPolicy::Default)
 	{
 		if(exponent==2.0)
-		{
-			Elementwise([](FP& v)
-			{
-				v *= v;
-			});
-		}
+			Apply(elementwise_square());
+		else if(math_fast(policy))
+			Apply(elementwise_fast_pow{exponent});
 		else
-		{
-			Elementwise([exponent](FP& v)
-			{
-				v = pow(v,exponent);
-			});
-		}
+			Apply(elementwise_pow{exponent});
 	}
 
-	NDArray Pow(const FP exponent) const
+	NDArray Pow(const FP exponent,const MathPolicy policy=MathPolicy::Default) const
 	{
-		NDArray r = NDData::New(*this);
-		r->_Pow(exponent);
-		return r;
+		if(exponent==2.0)
+			return Unary(elementwise_square());
+		else if(math_fast(policy))
+			return Unary(elementwise_fast_pow{exponent});
+		else
+			return Unary(elementwise_pow{exponent});
 	}
 
 	// Repeat values in dimension 'dim' 'copies' times.
@@ -2157,76 +2712,29 @@ public:
 	NDArray Repeat_Numpy(const int dim,const int repeats) const
 	{
 		// If the repeat dimension of the source is 1 then copy can be avoided by setting the stride to 0 - thus the dimension never increments.
+		NDShape shape(_shape);
 		if(_shape[dim]==1)
 		{
-			// Make a copy of this and apply non-copying repeat.
-			NDArray r = NDData::New(NDDataPtrC(shared_from_this()));
-			r->_shape[dim] = repeats;
-			r->_stride[dim] = 0;
-			return r;
+			shape[dim] = repeats;
+			return Expand(shape);
 		}
-		else
-		{
-			// Make a result with each item of the repeat dimension 'repeats' times.
-			NDShape newShape(_shape);
-			newShape[dim] *= repeats;
-			NDArray r = NDData::New(newShape);
-
-			// Build slicer for output.
-			int outDimSlice = 0;
-			std::vector<std::initializer_list<int>> outSlices;
-			for(size_t i=0;i<newShape.size();++i)
-			{
-				if(i==dim)
-					outSlices.emplace_back(&outDimSlice,&outDimSlice+1);
-				else
-					outSlices.emplace_back();
-			}
-			std::initializer_list<std::initializer_list<int>> outSlicer(outSlices.data(),outSlices.data()+outSlices.size());
-
-			// Build slicer for source.
-			int srcDimSlice = 0;
-			std::vector<std::initializer_list<int>> srcSlices;
-			for(size_t i=0;i<newShape.size();++i)
-			{
-				if(i==dim)
-					srcSlices.emplace_back(&srcDimSlice,&srcDimSlice+1);
-				else
-					srcSlices.emplace_back();
-			}
-			std::initializer_list<std::initializer_list<int>> srcSlicer(srcSlices.data(),srcSlices.data()+srcSlices.size());
-
-			// Iterate each element in the repeat dimension any copy to the output array repeat times.
-			for(int i=0;i<_shape[dim];++i)
-			{
-				srcDimSlice = i;
-				for(int j=0;j<repeats;++j)
-				{
-					outDimSlice = (i*repeats)+j;
-					r.Slice(outSlicer) = Slice(srcSlicer);
-				}
-			}
 
-			return r;
-		}
+		// Otherwise each item of the repeat dimension is repeated in a new dimension after it, then the two are merged (one copy).
+		shape.insert(shape.begin()+dim+1,repeats);
+		const NDArray r = Unsqueeze(dim+1).Expand(shape);
+		shape[dim] *= repeats;
+		shape.erase(shape.begin()+dim+1);
+		return r.Reshape(shape);
 	}
 
+	// Repeats the whole array in new dimensions of 'sizes' added to the left, a view without copying.
+	//
 	NDArray Repeat_Torch(const std::initializer_list<int>& sizes) const
 	{
 		NDShape shape(sizes);
-		NDIterator iter(shape);
-
 		for(auto i:_shape)
 			shape.emplace_back(i);
-
-		NDArray r = NDData::New(shape);
-
-		for(;!iter.end();++iter)
-		{
-			r.Slice(iter) = Slice({});
-		}
-
-		return r;
+		return Expand(shape);
 	}
 
 	// Reshape (without moving elements).
@@ -2236,7 +2744,6 @@ public:
 	template<class iter>
 	NDArray Reshape(const iter& begin,const iter& end) const
 	{
-		_ASSERT(!HasRepeatedDimensions());
 		NDShape shape;
 
 		// Compute size.
@@ -2274,18 +2781,55 @@ public:
 		if(size!=_size)
 			throw IncompatibleShape();
 
-		// Copy elements to new array with new shape.
+		// A view of the same elements if the strides allow, otherwise copy elements to new array with new shape.
 		if(HasNaturalStride())
-		{
 			return NDData::New(*this,shape);
-		}
-		else
+		NDShape stride;
+		if(ViewStride(shape,stride))
 		{
-			NDArray r = NDData::New(shape);
-			for(NDIterator2 src=Iter(),dst=r->Iter();src!=src.end();++src,++dst)
-				*dst = *src;
+			NDArray r = NDData::New(Self());
+			r->_shape = shape;
+			r->_stride = stride;
 			return r;
 		}
+		return Contiguous().Reshape(shape);
+	}
+
+	// Computes the strides that address this array's elements, in order, with 'shape' (of the same size). Returns 'false' if there
+	// are none, when the elements of a group of dimensions merged or split by 'shape' aren't evenly spaced.
+	//
+	// Works back from the least significant dimension through chunks of dimensions that are contiguous with each other, each chunk
+	// must be exactly covered by dimensions of 'shape', which take strides from the chunk's least significant stride.
+	//
+	bool ViewStride(const NDShape& shape,NDShape& stride) const
+	{
+		stride.resize(shape.size());
+		int view = (int)shape.size()-1;
+		int base = _stride.size()>0?_stride[_stride.size()-1]:1;
+		int chunkElements = 1;
+		int viewElements = 1;
+		for(int dim=(int)_shape.size()-1;dim>=0;--dim)
+		{
+			chunkElements *= _shape[dim];
+			if(dim==0||(_shape[dim-1]!=1&&_stride[dim-1]!=chunkElements*base))
+			{
+				while(view>=0&&(viewElements<chunkElements||shape[view]==1))
+				{
+					stride[view] = viewElements*base;
+					viewElements *= shape[view];
+					--view;
+				}
+				if(viewElements!=chunkElements)
+					return false;
+				if(dim>0)
+				{
+					base = _stride[dim-1];
+					chunkElements = 1;
+					viewElements = 1;
+				}
+			}
+		}
+		return view<0;
 	}
 
 	NDArray Reshape(const std::initializer_list<int>& shape) const
@@ -2327,21 +2871,30 @@ public:
 
 	NDArray Sqrt() const
 	{
-		_ASSERT(HasNaturalStride());
+		return Unary(elementwise_sqrt());
+	}
 
-		NDArray r = NDData::New(*this);
-		FP* const rData = r->_data;
-		for(int i=0;i<_size;++i)
-			rData[i] = sqrt(rData[i]);
+	// Returns a view without dimension 'dim', which must have length 1.
+	//
+	NDArray Squeeze(int dim) const
+	{
+		// Negative dim implies position from end.
+		if(dim<0)
+			dim += (int)_shape.size();
+		if(dim<0||dim>=(int)_shape.size()||_shape[dim]!=1)
+			throw IncompatibleShape("Only a dimension of length 1 can be squeezed.");
+
+		NDArray r = NDData::New(Self());
+		r->_shape.erase(r->_shape.begin()+dim);
+		r->_stride.erase(r->_stride.begin()+dim);
 		return r;
 	}
 
 	NDArray Softmax() const
 	{
-		_ASSERT(HasNaturalStride());
-
+		const NDDataPtrC a = WithNaturalStride();
 		NDArray r = NDData::New(_shape);
-		FP* const data = _data;
+		const FP* const data = a->_data;
 		FP* const rData = r->_data;
 		FP sum = 0.0;
 		for(int i=0;i<_size;++i)
@@ -2354,86 +2907,51 @@ public:
 		return r;
 	}
 
-	NDArray StdDev() const
+	NDArray StdDev(const SumPrecision precision=SumPrecision::Pairwise) const
 	{
-		_ASSERT(HasNaturalStride());
-
-		const FP mean = Mean(false)[{}];
-		FP se = 0.0;
-		for(int i=0;i<_size;++i)
-			se += pow(_data[i]-mean,FP(2));
-		const FP mse = se/_size;
-
-		NDArray stddev = NDData::New({1},sqrt(mse));
+		NDArray stddev = NDData::New({1},sqrt(Var(precision)[{}]));
 		return stddev;
 	}
 
 	void _Sub(const NDArray& v)
 	{
-		Elementwise(v._data,[](FP& a,const FP b)
-		{
-			a -= b;
-		});
+		ApplyBroadcast(elementwise_sub(),v._data);
 	}
 
 	NDArray Sub(const NDArray& v) const
 	{
-		NDArray r = NDData::New(*this);
-		r->_Sub(v);
-		return r;
+		return Binary(elementwise_sub(),v);
 	}
 
-	NDArray Sum() const
+	NDArray Sum(const SumPrecision precision=SumPrecision::Pairwise) const
 	{
-		NDArray r = NDData::New({1},0.0);
-		FP& rData = r->_data[0];
-		Elementwise([&rData](FP& v)
-		{
-			rData += v;
-		});
-		return r;
+		return NDData::New({1},FP(SumOf(elementwise_copy(),precision)));
 	}
 
 	// Compute sum for dimension, where that dimension collapses to 1 value.
 	//
-	NDArray Sum(int dim,const bool keepDims) const
+	NDArray Sum(const int dim,const bool keepDims) const
 	{
-		if(dim<0)
-			dim += _shape.size();
-		if(dim>=_shape.size())
-			throw InvalidDimension();
-
-		// Create the new shape and result data where the aggregation dimension is 1.
-		NDShape newShape(_shape);
-		newShape[dim] = 1;
-		NDArray r = NDData::New(newShape,0.0f);
-
-		// Aggreate along the dimension.
-		Aggregate(r,dim,[](FP& acc,const FP& value)
-		{
-			acc += value;
-		});
-
-		// Remove aggregation dimension if not kept.
-		if(!keepDims)
-		{
-			newShape.erase(newShape.begin()+dim);
-			return r.Reshape(newShape);
-		}
+		return Sum({dim},keepDims);
+	}
 
-		return r;
+	// Compute sum over dimensions, where those dimensions collapse to 1 value.
+	//
+	NDArray Sum(const std::initializer_list<int>& dims,const bool keepDims) const
+	{
+		const int mask = ReduceMask(dims);
+		NDArray r = Reduce(reduce_sum(),mask);
+		return keepDims?r:DropDims(r,mask);
 	}
 
 	// Elementwise tanh.
 	//
-	NDArray Tanh() const
+	NDArray Tanh(const MathPolicy policy=MathPolicy::Default) const
 	{
-		_ASSERT(HasNaturalStride());
-
-		NDArray r = NDData::New(_shape);
-		for(int i=0;i<_size;++i)
-			r->_data[i] = tanh(_data[i]);
-		return r;
+		if(math_fast(policy))
+			return Unary(elementwise_fast_tanh());
+		else
+			return Unary(elementwise_tanh());
 	}
 
 	void _Transpose()
@@ -2482,18 +3000,20 @@ public:
 		return r;
 	}
 
-	// Returns a new array with a dimension inserted at the specified position.
+	// Returns a view with a dimension of length 1 inserted at the specified position.
 	//
 	NDArray Unsqueeze(int dim) const
 	{
 		// Negative dim implies position from end.
 		if(dim<0)
 			dim += (int)_shape.size()+1;	// +1 is needed here because 'vector::insert' inserts to the left of the index.
+		if(dim<0||dim>(int)_shape.size())
+			throw IncompatibleShape("Dimension out of range.");
 
-		NDArray r = NDData::New(*this);
+		// The stride of a unit length dimension is never used, the natural stride keeps natural arrays natural.
+		NDArray r = NDData::New(Self());
 		r->_shape.insert(r->_shape.begin()+dim,1);
-		r->_stride.insert(r->_stride.begin()+dim,r->_stride.size()>0?r->_stride[0]:1);
-
+		r->_stride.insert(r->_stride.begin()+dim,dim<(int)_stride.size()?_stride[dim]*_shape[dim]:1);
 		return r;
 	}
 
@@ -2533,32 +3053,153 @@ public:
 		}
 
 		// Create the ouput gradient from rows from the input gradient selected by the indices.
+		// Gradients are added because indices aren't unique, which indicates multiple calculation paths.
+		std::vector<int> rows;
+		const NDArray values = CoalesceRows(indices,source,rows);
 		NDArray r = Zeros();
-		for(NDIterator iter=indices.Shape();!iter.end();++iter)
-			r.Slice({{(int)indices[iter]}}) += source.Slice(iter);	// Add gradients because indices aren't unique, which indicates multiple calculation paths.
+		r->_AddRows(rows,values);
+		return r;
+	}
+
+	// Sums the slices of 'source' (created from 'indices' by IndexSelect on this) that came from the same row of this. Returns the sums,
+	// one per row selected, and the sorted row numbers in 'rows'.
+	//
+	NDArray CoalesceRows(const NDArray& indices,const NDArray& source,std::vector<int>& rows) const
+	{
+		const int n = indices.Size();
+		const int columns = _size/_shape[0];
+		if(source.Size()!=n*columns)
+			throw IncompatibleShape(source.Shape(),indices.Shape());
+
+		// Order the source slices by row, a stable sort keeps duplicates in source order so the sums are deterministic.
+		const NDDataPtrC indices_ = indices->WithNaturalStride();
+		std::vector<std::pair<int,int>> order(n);		// Row, source slice.
+		for(int i=0;i<n;++i)
+		{
+			const int row = (int)indices_->_data[i];
+			if(row<0||row>=_shape[0])
+				throw IndexOutOfBounds();
+			order[i] = {row,i};
+		}
+		std::stable_sort(order.begin(),order.end(),[](const std::pair<int,int>& a,const std::pair<int,int>& b)
+		{
+			return a.first<b.first;
+		});
+
+		// First entry of each distinct row.
+		std::vector<int> starts;
+		rows.clear();
+		for(int i=0;i<n;++i)
+		{
+			if(i==0||order[i].first!=order[i-1].first)
+			{
+				starts.emplace_back(i);
+				rows.emplace_back(order[i].first);
+			}
+		}
+		starts.emplace_back(n);
+
+		NDShape shape(_shape);
+		shape[0] = (int)rows.size();
+		NDArray r = NDData::New(shape,0.0f);
+		const NDDataPtrC source_ = source->WithNaturalStride();
+		const FP* const src = source_->_data;
+		FP* const dst = r->_data;
+		NDThreadPool::ParallelFor(0,(int)rows.size(),(std::max)(elementwise_grain/(std::max)(columns,1),1),[&order,&starts,src,dst,columns](const int u)
+		{
+			FP* const d = dst+(ptrdiff_t)u*columns;
+			for(int i=starts[u];i<starts[u+1];++i)
+			{
+				const FP* const s = src+(ptrdiff_t)order[i].second*columns;
+				for(int j=0;j<columns;++j)
+					d[j] += s[j];
+			}
+		});
+		return r;
+	}
 
+	// Returns the listed rows (slices of the most significant dimension) of this.
+	//
+	NDArray SelectRows(const std::vector<int>& rows) const
+	{
+		NDShape shape(_shape);
+		shape[0] = (int)rows.size();
+		NDArray r = NDData::New(shape);
+		const NDDataPtrC x = WithNaturalStride();
+		const int columns = _size/_shape[0];
+		NDThreadPool::ParallelFor(0,(int)rows.size(),(std::max)(elementwise_grain/(std::max)(columns,1),1),[&rows,&x,&r,columns](const int i)
+		{
+			std::copy_n(x->_data+(ptrdiff_t)rows[i]*columns,columns,r->_data+(ptrdiff_t)i*columns);
+		});
 		return r;
 	}
 
-	NDArray Var() const
+	// Inplace 'this[rows[i]] = values[i]', the reciprocal of SelectRows.
+	//
+	void _SetRows(const std::vector<int>& rows,const NDArray& values)
 	{
-		_ASSERT(HasNaturalStride());
+		_RowsApply(rows,values,[](FP& a,const FP b){a = b;});
+	}
 
-		const FP mean = Mean(false)[{}];
-		FP se = 0.0;
-		for(int i=0;i<_size;++i)
-			se += pow(_data[i]-mean,FP(2));
-		return NDData::New({},se/_size);
+	// Inplace 'this[rows[i]] += values[i]' for distinct rows.
+	//
+	void _AddRows(const std::vector<int>& rows,const NDArray& values)
+	{
+		_RowsApply(rows,values,[](FP& a,const FP b){a += b;});
+	}
+
+	template<typename F>
+	void _RowsApply(const std::vector<int>& rows,const NDArray& values,const F& foo)
+	{
+		if(!HasNaturalStride())
+		{
+			// Rows of a contiguous copy, written back through the strides.
+			const NDArray copy = New(*this);
+			copy->_RowsApply(rows,values,foo);
+			Assign(copy);
+			return;
+		}
+
+		const int columns = _size/_shape[0];
+		if(values.Size()!=(int)rows.size()*columns)
+			throw IncompatibleShape(values.Shape(),_shape);
+		const NDDataPtrC v = values->WithNaturalStride();
+		FP* const data = _data;
+		NDThreadPool::ParallelFor(0,(int)rows.size(),(std::max)(elementwise_grain/(std::max)(columns,1),1),[&rows,&v,&foo,data,columns](const int i)
+		{
+			FP* const d = data+(ptrdiff_t)rows[i]*columns;
+			const FP* const s = v->_data+(ptrdiff_t)i*columns;
+			for(int j=0;j<columns;++j)
+				foo(d[j],s[j]);
+		});
+	}
+
+	NDArray Var(const SumPrecision precision=SumPrecision::Pairwise) const
+	{
+		// Two passes, the squared deviations from the mean do not cancel.
+		const FP mean = Mean(false,precision)[{}];
+		return NDData::New({},FP(SumOf(reduce_squared_deviation{mean},precision)/_size));
 	}
 
 	NDArray Var(const int dim,const bool keepDim,const int correction=1/*Bessel's correction*/) const
-	{		
-		_ASSERT(dim>=0&&dim<_shape.size());
-		NDArray tmp = this->Sub(Mean(dim,true));
-		tmp._data->_Pow(2.0);
-		NDArray r = tmp.Sum(dim,keepDim);
-		r._data->_Div(NDData::New({},_shape[dim]-FP(correction)));
-		return r;
+	{
+		NDArray mean;
+		return Var(dim,keepDim,correction,mean);
+	}
+
+	// Variance along dimension and the mean in 'mean' (with the same shape), found in one pass.
+	//
+	NDArray Var(const int dim,const bool keepDim,const int correction,NDArray& mean) const
+	{
+		const int mask = ReduceMask({dim});
+		NDArray r = NDData::New(ReducedShape(mask));
+		mean._Attach(NDData::New(ReducedShape(mask)));
+		const NDDataPtrC x = WithNaturalStride();
+		reduce_moments(ReduceLayout(mask),x->_data,mean->_data,r->_data,correction);
+		if(keepDim)
+			return r;
+		mean._Attach(DropDims(mean,mask));
+		return DropDims(r,mask);
 	}
 
 
@@ -3008,6 +3649,11 @@ NDArray::NDArray(const FP v) :
 {
 }
 
+void NDArray::_AddRows(const std::vector<int>& rows,const NDArray& values)
+{
+	_data->_AddRows(rows,values);
+}
+
 void NDArray::_Attach(const NDArray& v)
 {
 	_data = v._data;
@@ -3018,39 +3664,47 @@ void NDArray::_Reset()
 	_data.reset();
 }
 
+void NDArray::_SetRows(const std::vector<int>& rows,const NDArray& values)
+{
+	_data->_SetRows(rows,values);
+}
+
 void NDArray::operator=(const NDArray& v)
 {
 	_data->Assign(v);
 }
 
-NDArray NDArray::operator==(const NDArray& v) const
+template<typename E,int>
+void NDArray::operator=(const E& e)
 {
-	return _data->Equal(v);
+	_data->AssignExpression(e);
 }
 
-NDArray NDArray::operator!=(const NDArray& v) const
+template<typename OP,typename A>
+NDUnaryExpression<OP,A>::operator NDArray() const
 {
-	return _data->NotEqual(v);
+	return NDData::Evaluate(*this);
 }
 
-NDArray NDArray::operator+(const NDArray& v) const
+template<typename OP,typename A,typename B>
+NDBinaryExpression<OP,A,B>::operator NDArray() const
 {
-	return _data->Add(v);
+	return NDData::Evaluate(*this);
 }
 
-void NDArray::operator+=(const NDArray& v)
+NDArray NDArray::operator==(const NDArray& v) const
 {
-	_data->_Add(v);
+	return _data->Equal(v);
 }
 
-NDArray NDArray::operator-() const
+NDArray NDArray::operator!=(const NDArray& v) const
 {
-	return _data->Negate();
+	return _data->NotEqual(v);
 }
 
-NDArray NDArray::operator-(const NDArray& v) const
+void NDArray::operator+=(const NDArray& v)
 {
-	return _data->Sub(v);
+	_data->_Add(v);
 }
 
 void NDArray::operator-=(const NDArray& v) const
@@ -3058,21 +3712,11 @@ void NDArray::operator-=(const NDArray& v) const
 	_data->_Sub(v);
 }
 
-NDArray NDArray::operator*(const NDArray& v) const
-{
-	return _data->Mul(v);
-}
-
 void NDArray::operator*=(const NDArray& v)
 {
 	return _data->_Mul(v);
 }
 
-NDArray NDArray::operator/(const NDArray& v) const
-{
-	return _data->Div(v);
-}
-
 NDArray NDArray::operator>(const FP v) const
 {
 	return _data->Greater(v);
@@ -3113,19 +3757,49 @@ NDArray NDArray::Dot(const NDArray& v) const
 	return _data->Dot(v);
 }
 
+NDArray NDArray::Dot(const NDArray& v,const bool transA,const bool transB) const
+{
+	return _data->Dot(v,transA,transB);
+}
+
 NDArray NDArray::Dropout(const FP p) const
 {
 	return _data->Dropout(p);
 }
 
+NDArray NDArray::CoalesceRows(const NDArray& indices,const NDArray& source,std::vector<int>& rows) const
+{
+	return _data->CoalesceRows(indices,source,rows);
+}
+
+NDArray NDArray::Contiguous() const
+{
+	return _data->Contiguous();
+}
+
+NDArray NDArray::CrossEntropy(const NDArray& targets,NDArray& lse,const FP smoothing,const int ignoreIndex,const MathPolicy policy) const
+{
+	return _data->CrossEntropy(targets,lse,smoothing,ignoreIndex,policy);
+}
+
+NDArray NDArray::CrossEntropyGradient(const NDArray& targets,const NDArray& lse,const NDArray& gradient,const FP smoothing,const int ignoreIndex,const MathPolicy policy) const
+{
+	return _data->CrossEntropyGradient(targets,lse,gradient,smoothing,ignoreIndex,policy);
+}
+
 NDArray NDArray::Entropy() const
 {
 	return _data->Entropy();
 }
 
-NDArray NDArray::Exp() const
+NDArray NDArray::Exp(const MathPolicy policy) const
+{
+	return _data->Exp(policy);
+}
+
+NDArray NDArray::Expand(const NDShape& shape) const
 {
-	return _data->Exp();
+	return _data->Expand(shape);
 }
 
 NDArray NDArray::Flatten() const
@@ -3148,14 +3822,19 @@ bool NDArray::IsScalar() const
 	return _data->IsScalar();
 }
 
-NDArray NDArray::Log() const
+NDArray NDArray::Log(const MathPolicy policy) const
+{
+	return _data->Log(policy);
+}
+
+NDArray NDArray::LogSoftmax(const int dim,const MathPolicy policy) const
 {
-	return _data->Log();
+	return _data->LogSoftmax(dim,policy);
 }
 
-NDArray NDArray::LogSoftmax(const int dim) const
+NDArray NDArray::LogSoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy) const
 {
-	return _data->LogSoftmax(dim);
+	return _data->LogSoftmaxGradient(gradient,dim,policy);
 }
 
 NDArray NDArray::MaskedFill(const NDArray& mask,const FP value) const
@@ -3163,14 +3842,24 @@ NDArray NDArray::MaskedFill(const NDArray& mask,const FP value) const
 	return _data->MaskedFill(mask,value);
 }
 
+NDArray NDArray::MatMul(const NDArray& v,const char* const backend) const
+{
+	return _data->MatMul(v,backend);
+}
+
 NDArray NDArray::Max(const int dim) const
 {
 	return _data->Max(dim);
 }
 
-NDArray NDArray::Mean(const bool keepDims) const
+NDArray NDArray::Max(const int dim,NDArray& argmax) const
 {
-	return _data->Mean(keepDims);
+	return _data->Max(dim,argmax);
+}
+
+NDArray NDArray::Mean(const bool keepDims,const SumPrecision precision) const
+{
+	return _data->Mean(keepDims,precision);
 }
 
 NDArray NDArray::Mean(const int dim,const bool keepDims) const
@@ -3178,14 +3867,24 @@ NDArray NDArray::Mean(const int dim,const bool keepDims) const
 	return _data->Mean(dim,keepDims);
 }
 
+NDArray NDArray::Mean(const std::initializer_list<int>& dims,const bool keepDims) const
+{
+	return _data->Mean(dims,keepDims);
+}
+
+FP NDArray::Norm(const SumPrecision precision) const
+{
+	return _data->Norm(precision);
+}
+
 NDArray NDArray::Ones() const
 {
 	return _data->Ones();
 }
 
-NDArray NDArray::Pow(const FP v) const
+NDArray NDArray::Pow(const FP v,const MathPolicy policy) const
 {
-	return _data->Pow(v);
+	return _data->Pow(v,policy);
 }
 
 NDArray NDArray::Repeat_Numpy(const int dim,const int copies) const
@@ -3233,14 +3932,24 @@ const NDArray NDArray::Slice(const std::initializer_list<std::initializer_list<i
 	return _data->Slice(indices);
 }
 
+NDArray NDArray::SelectRows(const std::vector<int>& rows) const
+{
+	return _data->SelectRows(rows);
+}
+
 int NDArray::Size() const
 {
 	return _data->Size();
 }
 
-NDArray NDArray::Softmax(const int dim) const
+NDArray NDArray::Softmax(const int dim,const MathPolicy policy) const
 {
-	return _data->Softmax(dim);
+	return _data->Softmax(dim,policy);
+}
+
+NDArray NDArray::SoftmaxGradient(const NDArray& gradient,const int dim,const MathPolicy policy) const
+{
+	return _data->SoftmaxGradient(gradient,dim,policy);
 }
 
 NDArray NDArray::Sqrt() const
@@ -3248,14 +3957,19 @@ NDArray NDArray::Sqrt() const
 	return _data->Sqrt();
 }
 
-NDArray NDArray::StdDev() const
+NDArray NDArray::Squeeze(const int dim) const
+{
+	return _data->Squeeze(dim);
+}
+
+NDArray NDArray::StdDev(const SumPrecision precision) const
 {
-	return _data->StdDev();
+	return _data->StdDev(precision);
 }
 
-NDArray NDArray::Sum() const
+NDArray NDArray::Sum(const SumPrecision precision) const
 {
-	return _data->Sum();
+	return _data->Sum(precision);
 }
 
 NDArray NDArray::Sum(const int dim,const bool keepDims) const
@@ -3263,9 +3977,14 @@ NDArray NDArray::Sum(const int dim,const bool keepDims) const
 	return _data->Sum(dim,keepDims);
 }
 
-NDArray NDArray::Tanh() const
+NDArray NDArray::Sum(const std::initializer_list<int>& dims,const bool keepDims) const
+{
+	return _data->Sum(dims,keepDims);
+}
+
+NDArray NDArray::Tanh(const MathPolicy policy) const
 {
-	return _data->Tanh();
+	return _data->Tanh(policy);
 }
 
 NDArray NDArray::Transpose() const
@@ -3288,9 +4007,9 @@ NDArray NDArray::Unsqueeze(const int dim) const
 	return _data->Unsqueeze(dim);
 }
 
-NDArray NDArray::Var() const
+NDArray NDArray::Var(const SumPrecision precision) const
 {
-	return _data->Var();
+	return _data->Var(precision);
 }
 
 NDArray NDArray::Var(const int dim,const bool keepDim) const
@@ -3298,6 +4017,11 @@ NDArray NDArray::Var(const int dim,const bool keepDim) const
 	return _data->Var(dim,keepDim);
 }
 
+NDArray NDArray::Var(const int dim,const bool keepDim,const int correction,NDArray& mean) const
+{
+	return _data->Var(dim,keepDim,correction,mean);
+}
+
 NDArray NDArray::Zeros() const
 {
 	return _data->Zeros();
@@ -7,7 +7,7 @@
 class NDShape
 {
 public:
-	static const int MaxDims = 3;
+	static const int MaxDims = 8;
 
 private:
 	int _size;
@@ -1,5 +1,285 @@
 #include "NDThreadPool.h"
+#include "Tools.h"
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <tuple>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 NDThreadPool NDThreadPool::_pool;
-thread_local int NDThreadPool::_currentThreadNumber;
\ No newline at end of file
+thread_local int NDThreadPool::_currentThreadNumber = -1;
+
+
+#ifdef _WIN32
+
+// Windows topology from the logical processor information of the current processor group (up to 64 logical processors).
+//
+std::vector<NDThreadPool::Processor> NDThreadPool::DetectTopology()
+{
+	std::vector<Processor> processors;
+
+	DWORD_PTR processMask = 0;
+	DWORD_PTR systemMask = 0;
+	if(!GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask))
+		processMask = ~DWORD_PTR(0);
+
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr,&length);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length/sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if(info.empty()||!GetLogicalProcessorInformation(info.data(),&length))
+		return processors;
+
+	// Core and package of each logical processor.
+	int core = 0;
+	int package = 0;
+	std::vector<Processor> all(sizeof(DWORD_PTR)*8,Processor{-1,0,0,0});
+	for(const auto& entry:info)
+	{
+		for(int cpu=0;cpu<(int)all.size();++cpu)
+		{
+			if(!(entry.ProcessorMask&(DWORD_PTR(1)<<cpu)))
+				continue;
+			switch(entry.Relationship)
+			{
+				case RelationProcessorCore:		all[cpu].cpu = cpu; all[cpu].core = core; break;
+				case RelationProcessorPackage:	all[cpu].package = package; break;
+				case RelationNumaNode:			all[cpu].node = (int)entry.NumaNode.NodeNumber; break;
+				default: break;
+			}
+		}
+		if(entry.Relationship==RelationProcessorCore)
+			++core;
+		else if(entry.Relationship==RelationProcessorPackage)
+			++package;
+	}
+
+	for(const auto& processor:all)
+		if(processor.cpu>=0&&(processMask&(DWORD_PTR(1)<<processor.cpu)))
+			processors.emplace_back(processor);
+	return processors;
+}
+
+
+void NDThreadPool::PinCurrentThread(const int cpu)
+{
+	if(cpu<0)
+	{
+		DWORD_PTR processMask = 0;
+		DWORD_PTR systemMask = 0;
+		if(GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask))
+			SetThreadAffinityMask(GetCurrentThread(),processMask);
+	}
+	else if(cpu<(int)sizeof(DWORD_PTR)*8)
+		SetThreadAffinityMask(GetCurrentThread(),DWORD_PTR(1)<<cpu);
+}
+
+
+int NDThreadPool::ThreadProcessorCount()
+{
+	// There's no query for a thread's mask, setting it returns the previous one.
+	DWORD_PTR processMask = 0;
+	DWORD_PTR systemMask = 0;
+	if(!GetProcessAffinityMask(GetCurrentProcess(),&processMask,&systemMask))
+		return 0;
+	const DWORD_PTR mask = SetThreadAffinityMask(GetCurrentThread(),processMask);
+	SetThreadAffinityMask(GetCurrentThread(),mask);
+	int count = 0;
+	for(DWORD_PTR bits=mask;bits;bits&=bits-1)
+		++count;
+	return count;
+}
+
+#else
+
+// Reads the first integer from a sysfs file, returns 'fallback' if the file can't be read.
+//
+static int read_sysfs_int(const std::string& path,const int fallback)
+{
+	std::ifstream file(path);
+	int value = 0;
+	return (file>>value)?value:fallback;
+}
+
+
+// Parses a sysfs cpu list (e.g. "0-3,8-11") and calls 'op(cpu)' for each cpu.
+//
+template<typename OP>
+static void parse_cpu_list(const std::string& list,const OP& op)
+{
+	size_t start = 0;
+	while(start<list.size())
+	{
+		size_t end = list.find(',',start);
+		if(end==std::string::npos)
+			end = list.size();
+		const std::string range = list.substr(start,end-start);
+		const size_t dash = range.find('-');
+		const int first = atoi(range.c_str());
+		const int last = dash==std::string::npos?first:atoi(range.c_str()+dash+1);
+		for(int cpu=first;cpu<=last;++cpu)
+			op(cpu);
+		start = end+1;
+	}
+}
+
+
+// Affinity mask of the process (e.g. taskset or cgroup cpusets), read once when the pool is first started. Linux only has a mask per
+// thread, so once the main thread is pinned (it's worker 0) it and every thread it starts would otherwise see only its processor.
+//
+static const cpu_set_t& process_affinity()
+{
+	static const cpu_set_t allowed = []()
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(sched_getaffinity(0,sizeof(set),&set)!=0)
+			CPU_ZERO(&set);
+		return set;
+	}();
+	return allowed;
+}
+
+
+// Linux topology from sysfs, restricted to the affinity mask of the process.
+//
+std::vector<NDThreadPool::Processor> NDThreadPool::DetectTopology()
+{
+	std::vector<Processor> processors;
+
+	const cpu_set_t& allowed = process_affinity();
+	if(CPU_COUNT(&allowed)==0)
+		return processors;
+
+	// NUMA node of each cpu.
+	std::vector<int> nodes(CPU_SETSIZE,0);
+	for(int node=0;;++node)
+	{
+		std::ifstream file("/sys/devices/system/node/node"+std::to_string(node)+"/cpulist");
+		if(!file)
+			break;
+		std::string list;
+		std::getline(file,list);
+		parse_cpu_list(list,[&nodes,node](const int cpu)
+		{
+			if(cpu<CPU_SETSIZE)
+				nodes[cpu] = node;
+		});
+	}
+
+	for(int cpu=0;cpu<CPU_SETSIZE;++cpu)
+	{
+		if(!CPU_ISSET(cpu,&allowed))
+			continue;
+		const std::string topology = "/sys/devices/system/cpu/cpu"+std::to_string(cpu)+"/topology/";
+		const int package = read_sysfs_int(topology+"physical_package_id",0);
+		const int core = read_sysfs_int(topology+"core_id",cpu);
+		processors.emplace_back(Processor{cpu,package*65536+core,package,nodes[cpu]});	// Core ids are only unique within a package.
+	}
+	return processors;
+}
+
+
+void NDThreadPool::PinCurrentThread(const int cpu)
+{
+	if(cpu<0)
+	{
+		if(CPU_COUNT(&process_affinity())>0)
+			pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&process_affinity());
+		return;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu,&set);
+	pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+}
+
+
+int NDThreadPool::ThreadProcessorCount()
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(pthread_getaffinity_np(pthread_self(),sizeof(set),&set)!=0)
+		return 0;
+	return CPU_COUNT(&set);
+}
+
+#endif
+
+
+void NDThreadPool::Start(int workers)
+{
+	// Logical processors ordered by node, package and core.
+	std::vector<Processor> processors = DetectTopology();
+	if(processors.empty())
+	{
+		// Unknown topology, assume every hardware thread is a core.
+		const int count = (std::max)((int)std::thread::hardware_concurrency(),1);
+		for(int cpu=0;cpu<count;++cpu)
+			processors.emplace_back(Processor{cpu,cpu,0,0});
+	}
+	std::stable_sort(processors.begin(),processors.end(),[](const Processor& a,const Processor& b)
+	{
+		return std::tie(a.node,a.package,a.core,a.cpu)<std::tie(b.node,b.package,b.core,b.cpu);
+	});
+
+	// One processor per physical core first, hyperthread siblings last.
+	std::vector<Processor> order;
+	std::vector<Processor> siblings;
+	for(size_t i=0;i<processors.size();++i)
+	{
+		const bool sibling = i>0&&processors[i].core==processors[i-1].core&&processors[i].package==processors[i-1].package;
+		(sibling?siblings:order).emplace_back(processors[i]);
+	}
+	const int physicalCores = (int)order.size();
+	order.insert(order.end(),siblings.begin(),siblings.end());
+
+	// Number of workers - argument, environment, or one per physical core.
+	if(workers<=0)
+		workers = atoi(GetEnv("AUTOGRAD_THREADS").c_str());
+	if(workers<=0)
+		workers = physicalCores;
+
+	// Workers beyond the number of logical processors are not pinned.
+	const bool pin = GetEnv("AUTOGRAD_PIN")!="0";
+	std::vector<Processor> assigned;
+	for(int i=0;i<workers;++i)
+	{
+		Processor processor = order[i%order.size()];
+		if(!pin||i>=(int)order.size())
+			processor.cpu = -1;
+		assigned.emplace_back(processor);
+	}
+
+	// Group workers by NUMA node so each node's workers are contiguous.
+	std::stable_sort(assigned.begin(),assigned.end(),[](const Processor& a,const Processor& b)
+	{
+		return a.node<b.node;
+	});
+	_numWorkers = workers;
+	_numaAware = GetEnv("AUTOGRAD_NUMA")!="0"&&assigned.front().node!=assigned.back().node;
+
+	// Create all worker contexts before any thread can steal from them.
+	for(int i=0;i<workers;++i)
+	{
+		int nodeBegin = i;
+		while(nodeBegin>0&&assigned[nodeBegin-1].node==assigned[i].node)
+			--nodeBegin;
+		int nodeEnd = i+1;
+		while(nodeEnd<workers&&assigned[nodeEnd].node==assigned[i].node)
+			++nodeEnd;
+		_workerContexts.emplace_back(new WorkerThreadContext(i,assigned[i].cpu,assigned[i].node,nodeBegin,nodeEnd));
+	}
+
+	// This thread is the first worker.
+	SetCurrentThreadNumber(0);
+
+	// Start n more worker threads.
+	for(int i=1;i<workers;++i)
+		_workerThreads.emplace_back(WorkerThreadEntryPoint,i);
+}
\ No newline at end of file
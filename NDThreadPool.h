@@ -1,19 +1,63 @@
 #pragma once
 
-#include <Windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <thread>
 #include <vector>
-#include <queue>
 #include <iostream>
-
-
-
+#include "WorkStealingDeque.h"
+
+
+
+// Work-stealing thread pool.
+//
+// Each worker owns a Chase-Lev deque. Tasks created on a worker are pushed to the bottom of its own deque and popped LIFO, idle
+// workers steal FIFO from the top of a randomly chosen victim, so uneven or nested work spreads to every core.
+// A thread waiting for a TaskGroup keeps running tasks (its own first, then stolen ones) until the group is complete.
+// Threads that aren't part of the pool queue tasks through a shared injection queue.
+// Workers only sleep when there are no queued tasks anywhere.
+//
+// The pool is sized and pinned from the detected topology. By default there's one worker per physical core the process may run on
+// (hyperthread siblings are only used when more workers are requested), workers are ordered by NUMA node and steal from their own
+// node before any other. The thread that constructs the pool (the main thread) is worker 0.
+//
+//	AUTOGRAD_THREADS=n	Number of workers (also NDThreadPool::Resize).
+//	AUTOGRAD_PIN=0		Don't pin workers to logical processors.
+//	AUTOGRAD_NUMA=0		Steal from any worker regardless of NUMA node.
+//
 class NDThreadPool
 {
-    static const int    _numHardwareCores = 32;
     static NDThreadPool _pool;
 
 public:
+    // Loop scheduling for ParallelFor.
+    enum class Schedule
+    {
+        Static,
+        Dynamic,
+        Guided
+    };
+
+    // Logical processor and its place in the machine topology.
+    struct Processor
+    {
+        int cpu;        // Logical processor number used for pinning.
+        int core;       // Physical core, shared by hyperthread siblings.
+        int package;    // Socket.
+        int node;       // NUMA node.
+    };
+
+    // Returns the logical processors this process may run on (NDThreadPool.cpp).
+    static std::vector<Processor> DetectTopology();
+
+    // Pins the calling thread to a logical processor, or if 'cpu'<0 lets it run on any the process may (NDThreadPool.cpp).
+    static void PinCurrentThread(const int cpu);
+
+    // Returns the number of logical processors the calling thread may run on (NDThreadPool.cpp).
+    static int ThreadProcessorCount();
+
     // Base interface class for a queueable task.
     class Task
     {
@@ -52,23 +96,6 @@ public:
         };
 
     private:
-        // Uncounted task to signal/wake the potentially waiting creation thread.
-        class CompletionTask : public Task
-        {
-            bool& _taskGroupComplete;
-
-            void Invoke() const override
-            {
-                _taskGroupComplete = true;
-            }
-
-        public:
-            CompletionTask(bool& taskGroupComplete) :
-			    _taskGroupComplete(taskGroupComplete)
-            {
-		    }
-        };
-
 		// Task to run a lambda function.
         template<typename T>
         class LambdaTask : public CountedTask
@@ -88,18 +115,14 @@ public:
             }
 	    };
 
-		const int           _creatorWorkerNumber;   // Worker thread that created this group.
 		std::atomic<int>    _taskCounter;           // Number of tasks remaining.
-		bool    			_taskGroupComplete;     // Flag to indicate all tasks have completed and the group can be destroyed.
-		CompletionTask      _completionTask;        // Task to signal completion of the group.
-    
+		std::atomic<bool>   _taskGroupComplete;     // Flag to indicate all tasks have completed and the group can be destroyed.
+
     public:
         TaskGroup() :
-            _creatorWorkerNumber(NDThreadPool::_pool.GetCurrentWorkerNumber()),
 			_taskCounter(1),    // Count creation task to prevent counter dipping to 0 before the taskgroup wait.
-			_taskGroupComplete(false),
-			_completionTask(_taskGroupComplete)
-        {            
+			_taskGroupComplete(false)
+        {
 		}
 
 		// Destructor, waits for all tasks in this group to complete.
@@ -107,10 +130,9 @@ public:
         {
             // Release creation task to allow task counter to reach 0.
             ReleaseTask();
-            
-            // Process work from the queue until all tasks in this group are complete.
-            while(!_taskGroupComplete)
-                _pool.ServiceWorkQueue();
+
+            // Run queued work (this group's or any other) until all tasks in this group are complete.
+            _pool.WaitUntil(_taskGroupComplete);
         }
 
 		// Add a counted task to this group - work queued.
@@ -122,9 +144,13 @@ public:
 		// Release a counted task in this group - work completed.
 		void ReleaseTask()
         {
-			// When all tasks have complete post a completion task to wake the creator thread (this thread can be the creator).
+			// When all tasks have completed wake the creator thread if it's sleeping (this thread can be the creator).
+            // The group can be destroyed as soon as the flag is set, so it mustn't be touched afterwards.
             if(--_taskCounter==0)
-                _pool.GetWorkerContext(_creatorWorkerNumber).Enqueue(&_completionTask);
+            {
+                _taskGroupComplete = true;
+                _pool.WakeAll();
+            }
         }
 
 		// Run a task in this group.
@@ -137,89 +163,80 @@ public:
 
     class WorkerThreadContext
     {
-		const int				_threadNumber;      // Thread number associated with this context (debugging).
-		int                     _nextWorkerNumber;  // Next worker to queue work with (round-robin).
-
-        // Thread local work queue.
-        std::mutex              _workMutex;
-        std::condition_variable _workCondition;
-        std::queue<Task*>	    _workQueue;
+		const int				    _threadNumber;      // Thread number associated with this context.
+        const int                   _cpu;               // Logical processor the worker is pinned to, -1 if not pinned.
+        const int                   _node;              // NUMA node of the worker.
+        const int                   _nodeBegin;         // Workers [_nodeBegin,_nodeEnd) share the NUMA node (workers are ordered by node).
+        const int                   _nodeEnd;
+        uint32_t                    _random;            // Victim selection state (xorshift).
+        WorkStealingDeque<Task*>    _deque;             // Work created by this thread.
+
+        uint32_t NextRandom()
+        {
+            _random ^= _random<<13;
+            _random ^= _random>>17;
+            _random ^= _random<<5;
+            return _random;
+        }
 
     public:
-        WorkerThreadContext(const int threadNumber) :
+        WorkerThreadContext(const int threadNumber,const int cpu,const int node,const int nodeBegin,const int nodeEnd) :
             _threadNumber(threadNumber),
-            _nextWorkerNumber(threadNumber)
+            _cpu(cpu),
+            _node(node),
+            _nodeBegin(nodeBegin),
+            _nodeEnd(nodeEnd),
+            _random(0x9e3779b9u*(threadNumber+1))
         {
-            // Wait for main thread to release before signalling.
-			std::unique_lock<std::mutex> lk(_pool._workersMutex);           
-            lk.unlock();
-			_pool._workersCondition.notify_one();
         }
 
-        int GetNextWorkerNumber()
+        int GetCpu() const
         {
-            _nextWorkerNumber = (_nextWorkerNumber+1)%_numHardwareCores;
-			return _nextWorkerNumber;
+            return _cpu;
         }
 
-        bool ServiceWorkQueue()
+        int GetNode() const
         {
-            Task* task = nullptr;
-
-            // Wait for work to be added to the queue - blocking.
-            {
-                std::unique_lock<std::mutex> lk(_workMutex);                // Take work lock before waiting on the queue.
-                _workCondition.wait(lk,[this]()                             // Release lock and suspend this thread until notified. When notified this thread will own the lock again.
-                {
-                    return !_workQueue.empty()||NDThreadPool::_pool._stop;  // Don't enter wait if either of these conditions are true.
-                });     
-                if(!_workQueue.empty()&&!NDThreadPool::_pool._stop)
-                {
-                    task = _workQueue.front();
-                    _workQueue.pop();
-                }
-            } // Release '_workMutex'.
-
-            // Run work popped from the queue.
-            if(task)
-            {
-                // Run user task.
-			    task->Run();
-                return true;
-            }
-            else
-                return false;
+            return _node;
         }
 
+        // Returns a random worker other than this one, from the same NUMA node if 'local' is set.
+        int GetVictimNumber(const bool local)
+        {
+            const int begin = local?_nodeBegin:0;
+            const int end = local?_nodeEnd:_pool._numWorkers;
+            if(end-begin<2)
+                return _threadNumber;
+            const int victim = begin+(int)(NextRandom()%(end-begin-1));
+            return victim>=_threadNumber?victim+1:victim;
+        }
 
-        // Process work until stopped.
-        //
-        void ServiceQueueUntilStopped()
+        // Owner only.
+        void Push(Task* const task)
         {
-            while(!_pool._stop)
-                _pool.GetCurrentWorkerContext().ServiceWorkQueue();
+            _deque.Push(task);
         }
 
-        void Wake()
+        // Owner only.
+        bool Pop(Task*& task)
         {
-            std::unique_lock<std::mutex> lk(_workMutex);
-            _workCondition.notify_one();
+            return _deque.Pop(task);
         }
 
-        void Enqueue(Task* const task)
+        // Any thread.
+        bool Steal(Task*& task)
         {
-            std::unique_lock<std::mutex> lk(_workMutex);
-		    _workQueue.push(task);
-            _workCondition.notify_one();
+            return _deque.Steal(task);
         }
     };
 
-    static thread_local int _currentThreadNumber;
+    static thread_local int _currentThreadNumber;   // Worker number of this thread, -1 if the thread isn't part of the pool.
     void SetCurrentThreadNumber(const int threadNumber)
     {
-		// Set per-thread thread number and thread affinity.
+		// Set per-thread thread number and thread affinity, an unpinned worker may run on any processor (not just that of the thread
+		// that started it).
 		_currentThreadNumber = threadNumber;
-        SetThreadAffinityMask(GetCurrentThread(),0x1ULL<<threadNumber);
+        PinCurrentThread(GetWorkerContext(threadNumber).GetCpu());
     }
 
     int GetCurrentWorkerNumber() const
@@ -238,11 +255,24 @@ public:
 	}
 
 private:
-    std::mutex                          _workersMutex;
-    std::condition_variable             _workersCondition;
+    int                                 _numWorkers;
+    bool                                _numaAware;     // Steal from the same NUMA node first.
     std::vector<std::thread>            _workerThreads;
     std::vector<WorkerThreadContext*>   _workerContexts;
-    bool                                _stop;
+    std::atomic<bool>                   _stop;
+
+    // Count of tasks in all deques and the injection queue, used to decide when to sleep.
+    std::atomic<int>                    _queuedTasks;
+
+    // Sleeping threads.
+    std::mutex                          _sleepMutex;
+    std::condition_variable             _sleepCondition;
+    std::atomic<int>                    _sleepingThreads;
+
+    // Tasks queued by threads outside the pool.
+    std::mutex                          _injectionMutex;
+    std::deque<Task*>                   _injectionQueue;
+    std::atomic<int>                    _injectedTasks;
 
 	// Task to run a lambda function for each value in a range.
 	template<typename T>
@@ -269,93 +299,341 @@ private:
 		}
     };
 
-    bool ServiceWorkQueue()
+    // Returns a queued task, or nullptr if none could be found.
+    //
+    Task* FindTask()
     {
-		// Service thread work queue.
-		return GetCurrentWorkerContext().ServiceWorkQueue();
+        Task* task = nullptr;
+        const int threadNumber = _currentThreadNumber;
+
+        // Most recent work created by this thread.
+        if(threadNumber>=0&&GetWorkerContext(threadNumber).Pop(task))
+        {
+            --_queuedTasks;
+            return task;
+        }
+
+        // Work from threads outside the pool.
+        if(_injectedTasks>0)
+        {
+            std::unique_lock<std::mutex> lk(_injectionMutex);
+            if(!_injectionQueue.empty())
+            {
+                task = _injectionQueue.front();
+                _injectionQueue.pop_front();
+                --_injectedTasks;
+                --_queuedTasks;
+                return task;
+            }
+        }
+
+        // Steal the oldest work from random victims.
+        if(_queuedTasks>0)
+        {
+            static thread_local uint32_t random = 0x2545f491u;
+            for(int attempt=0;attempt<2*_numWorkers;++attempt)
+            {
+                int victim;
+                if(threadNumber>=0)
+                    victim = GetWorkerContext(threadNumber).GetVictimNumber(_numaAware&&attempt<_numWorkers);
+                else
+                {
+                    random ^= random<<13;
+                    random ^= random>>17;
+                    random ^= random<<5;
+                    victim = (int)(random%_numWorkers);
+                }
+                if(GetWorkerContext(victim).Steal(task))
+                {
+                    --_queuedTasks;
+                    return task;
+                }
+            }
+        }
+
+        return nullptr;
     }
 
-	// Create a new worker context for the calling thread.
+    // Sleeps until work is queued, the pool stops or 'condition' is set.
     //
-    void CreateThreadWorkerContext()
+    void SleepUntilWork(const std::atomic<bool>* const condition)
     {
-		const int threadNumber = (int)_workerContexts.size();
-        _pool.SetCurrentThreadNumber(threadNumber);
-        _workerContexts.emplace_back(new WorkerThreadContext(threadNumber));
+        std::unique_lock<std::mutex> lk(_sleepMutex);
+        ++_sleepingThreads;     // Published before testing the predicate so a producer can't miss this thread.
+        _sleepCondition.wait(lk,[this,condition]()
+        {
+            return _queuedTasks>0||_stop||(condition&&*condition);
+        });
+        --_sleepingThreads;
+    }
+
+    // Wakes a sleeping thread after queuing work.
+    //
+    void WakeOne()
+    {
+        if(_sleepingThreads>0)
+        {
+            std::unique_lock<std::mutex> lk(_sleepMutex);
+            _sleepCondition.notify_one();
+        }
     }
 
 	// Entry point for a new worker thread.
     //
-    static void WorkerThreadEntryPoint(void*)
+    static void WorkerThreadEntryPoint(const int threadNumber)
     {
-		// Associate this thread with a worker context.
-		_pool.CreateThreadWorkerContext();
-    
+		// Associate this thread with its worker context.
+		_pool.SetCurrentThreadNumber(threadNumber);
+
         // Process work until stopped.
-        _pool.GetCurrentWorkerContext().ServiceQueueUntilStopped();
+        while(!_pool._stop)
+        {
+            if(Task* const task = _pool.FindTask())
+                task->Run();
+            else
+                _pool.SleepUntilWork(nullptr);
+        }
     }
 
+    // Runs 'body(part)' for each part in [0,parts), part 0 on the calling thread, and waits for all parts.
+    //
     template<typename T>
-    void _ForEach(const int begin,const int end,const T& lambda)
+    void _Distribute(const int parts,const T& body)
     {
-        // Split range.
-        const int subRange = (std::max)((end-begin+_numHardwareCores-1)/_numHardwareCores,1);
-        const int taskCount = (std::min)((end-begin)+subRange-1/subRange,_numHardwareCores);
-        if(subRange*taskCount<(end-begin))
-            throw "Error!";
-		
         {// Scoped TaskGroup.
 		    TaskGroup taskGroup;
 
             // Enqueue tasks.
-            for(int i=0;i<taskCount;++i)
-			    Run(new ForEachTask<T>(taskGroup,i*subRange,(std::min)((i+1)*subRange,end),lambda));
+            for(int part=1;part<parts;++part)
+			    Run(new ForEachTask<T>(taskGroup,part,part+1,body));
+
+            // Work on the first part rather than waiting.
+            body(0);
 		}// Waits for TaskGroup.
     }
 
-public:
-    NDThreadPool() :
-        _stop(false)
+    template<typename T>
+    void _ParallelFor(const int begin,const int end,int grain,const T& lambda,const Schedule schedule)
     {
-        // Create the first worker context for this thread.
-        CreateThreadWorkerContext();
+        const int length = end-begin;
+        if(length<=0)
+            return;
+        grain = (std::max)(grain,1);
 
-        // Start n more worker threads.
-        for(int i=1;i<_numHardwareCores;++i)
+        // Not worth distributing.
+        if(length<=grain||_numWorkers<2)
         {
-            std::unique_lock<std::mutex> lk(_workersMutex);
-            _workerThreads.emplace_back(WorkerThreadEntryPoint,nullptr);    // Create a new thread running the WorkerLoop.
-            _workersCondition.wait(lk);                                     // Wait for the new worker to signal it's running.
+            for(int i=begin;i<end;++i)
+                lambda(i);
+            return;
+        }
+
+        // No more parts than workers or grains.
+        const int grains = (length+grain-1)/grain;
+        const int parts = (std::min)(grains,_numWorkers);
+
+        switch(schedule)
+        {
+            case Schedule::Static:
+            {
+                // Equal contiguous ranges, rounded to the grain.
+                const int chunk = ((grains+parts-1)/parts)*grain;
+                _Distribute(parts,[begin,end,chunk,&lambda](const int part)
+                {
+                    const int first = begin+part*chunk;
+                    const int last = (std::min)(first+chunk,end);
+                    for(int i=first;i<last;++i)
+                        lambda(i);
+                });
+                break;
+            }
+            case Schedule::Dynamic:
+            {
+                // Each part claims one grain at a time.
+                std::atomic<int> next = begin;
+                _Distribute(parts,[end,grain,&next,&lambda](const int)
+                {
+                    for(int first=next.fetch_add(grain);first<end;first=next.fetch_add(grain))
+                    {
+                        const int last = (std::min)(first+grain,end);
+                        for(int i=first;i<last;++i)
+                            lambda(i);
+                    }
+                });
+                break;
+            }
+            case Schedule::Guided:
+            {
+                // Each part claims a share of what remains, shrinking to the grain.
+                std::atomic<int> next = begin;
+                _Distribute(parts,[end,grain,parts,&next,&lambda](const int)
+                {
+                    int first = next;
+                    while(first<end)
+                    {
+                        const int chunk = (std::max)((end-first)/(2*parts),grain);
+                        const int last = (std::min)(first+chunk,end);
+                        if(!next.compare_exchange_weak(first,last))
+                            continue;   // 'first' reloaded.
+                        for(int i=first;i<last;++i)
+                            lambda(i);
+                        first = next;
+                    }
+                });
+                break;
+            }
         }
     }
 
-    ~NDThreadPool()
+    // Creates the worker contexts and starts the worker threads, 'workers'<=0 sizes the pool from the environment or topology.
+    //
+    void Start(int workers);
+
+    // Stops and joins the worker threads and deletes the worker contexts.
+    //
+    void Stop()
     {
         // Wake all worker threads.
-        for(auto& worker:_workerContexts)
-            worker->Wake();
+        _stop = true;
+        WakeAll();
 
         // Wait for all worker threads to stop.
         for(auto& workerThread:_workerThreads)
             workerThread.join();
+        _workerThreads.clear();
 
 		// Delete all worker contexts.
         for(auto& worker:_workerContexts)
             delete worker;
+        _workerContexts.clear();
+        _stop = false;
+    }
+
+public:
+    NDThreadPool() :
+        _numWorkers(0),
+        _numaAware(false),
+        _stop(false),
+        _queuedTasks(0),
+        _sleepingThreads(0),
+        _injectedTasks(0)
+    {
+        Start(0);
+    }
+
+    ~NDThreadPool()
+    {
+        Stop();
+    }
+
+    // Number of worker threads, including the main thread.
+    //
+    static int WorkerCount()
+    {
+        return _pool._numWorkers;
+    }
+
+    // Worker number of the calling thread, -1 if it isn't part of the pool.
+    //
+    static int CurrentWorker()
+    {
+        return _currentThreadNumber;
+    }
+
+    // Restarts the pool with 'workers' threads, 'workers'<=0 restores the default.
+    //	Must be called from the main thread while no tasks are running.
+    //
+    static void Resize(const int workers)
+    {
+        _pool.Stop();
+        _pool.Start(workers);
     }
 
 	void Run(Task* const task)
     {
-		// Queue the task with the next worker.
-		const int threadNumber = GetCurrentWorkerContext().GetNextWorkerNumber();
-        GetWorkerContext(threadNumber).Enqueue(task);
+		// Queue the task with this worker, idle workers will steal it.
+        const int threadNumber = _currentThreadNumber;
+        if(threadNumber>=0)
+            GetWorkerContext(threadNumber).Push(task);
+        else
+        {
+            std::unique_lock<std::mutex> lk(_injectionMutex);
+            _injectionQueue.push_back(task);
+            ++_injectedTasks;
+        }
+        ++_queuedTasks;
+        WakeOne();
     }
 
+    // Runs queued tasks until 'condition' is set, sleeping when there's nothing to run.
+    //
+    void WaitUntil(const std::atomic<bool>& condition)
+    {
+        while(!condition)
+        {
+            if(Task* const task = FindTask())
+                task->Run();
+            else
+                SleepUntilWork(&condition);
+        }
+    }
+
+    // Wakes every sleeping thread (stop or TaskGroup completion).
+    //
+    void WakeAll()
+    {
+        if(_sleepingThreads>0||_stop)
+        {
+            std::unique_lock<std::mutex> lk(_sleepMutex);
+            _sleepCondition.notify_all();
+        }
+    }
+
+    // Calls 'lambda(i)' for each i in [begin,end), one part per worker.
+    //
     template<typename T>
     static void ForEach(const int begin,const int end,const T& lambda)
     {
         // Call instance method.
-		_pool._ForEach(begin,end,lambda);
+		_pool._ParallelFor(begin,end,1,lambda,Schedule::Static);
+    }
+
+    // Calls 'lambda(i)' for each i in [begin,end).
+    //	Ranges of at most 'grain' values run on the calling thread, larger ranges are split into multiples of 'grain':
+    //		Static	- one equal contiguous range per worker, lowest overhead for uniform work.
+    //		Dynamic	- workers claim one grain at a time, balances irregular work.
+    //		Guided	- workers claim a share of the remaining range that shrinks towards the grain.
+    //
+    template<typename T>
+    static void ParallelFor(const int begin,const int end,const int grain,const T& lambda,const Schedule schedule=Schedule::Static)
+    {
+        _pool._ParallelFor(begin,end,grain,lambda,schedule);
     }
-};
 
+    // Calls 'lambda(i,j)' for each i in [rowBegin,rowEnd) and j in [colBegin,colEnd).
+    //	The grid is split into (rowGrain,colGrain) blocks which are scheduled as a ParallelFor, within a block 'j' varies fastest.
+    //
+    template<typename T>
+    static void ParallelFor2D(
+        const int rowBegin,const int rowEnd,const int rowGrain,
+        const int colBegin,const int colEnd,const int colGrain,
+        const T& lambda,const Schedule schedule=Schedule::Dynamic)
+    {
+        if(rowEnd<=rowBegin||colEnd<=colBegin)
+            return;
+        const int rowStep = (std::max)(rowGrain,1);
+        const int colStep = (std::max)(colGrain,1);
+        const int rowBlocks = (rowEnd-rowBegin+rowStep-1)/rowStep;
+        const int colBlocks = (colEnd-colBegin+colStep-1)/colStep;
+        _pool._ParallelFor(0,rowBlocks*colBlocks,1,[=,&lambda](const int block)
+        {
+            const int rowFirst = rowBegin+(block/colBlocks)*rowStep;
+            const int colFirst = colBegin+(block%colBlocks)*colStep;
+            const int rowLast = (std::min)(rowFirst+rowStep,rowEnd);
+            const int colLast = (std::min)(colFirst+colStep,colEnd);
+            for(int i=rowFirst;i<rowLast;++i)
+                for(int j=colFirst;j<colLast;++j)
+                    lambda(i,j);
+        },schedule);
+    }
+};
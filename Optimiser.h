@@ -1,14 +1,52 @@
 #pragma once
 
+#include <set>
+#include "ParameterArena.h"
+
 
 class Optimiser
 {
 protected:
 	const std::vector<TensorPtr>	_parameters;
+	const ParameterArenaPtr			_arena;			// Optional flat storage for the parameters.
+
+	// Returns 'true' if the parameter is updated as part of the arena.
+	//
+	bool InArena(const TensorPtr& p) const
+	{
+		return _arena&&_arena->Contains(p);
+	}
+
+	// Appends the arena to the operands of NDData::_OptimiserStep, the arena is updated as a single parameter.
+	//
+	void AddArena(std::vector<NDArrays>& dense) const
+	{
+		if(_arena)
+			dense.push_back({_arena->Data(),_arena->Gradient(),_arena->Momentum(),_arena->Momentum2()});
+	}
+
+	// Returns the parameters with each listed once, as by ParameterArena (i.e. a layer shared by a model is listed for each use), so
+	// each is stepped once.
+	//
+	static std::vector<TensorPtr> Unique(const std::vector<TensorPtr>& parameters)
+	{
+		std::vector<TensorPtr> unique;
+		std::set<const Tensor*> listed;
+		for(auto& p:parameters)
+			if(listed.insert(p.get()).second)
+				unique.emplace_back(p);
+		return unique;
+	}
 
 public:
 	Optimiser(const std::vector<TensorPtr>& parameters) :
-		_parameters(parameters)
+		_parameters(Unique(parameters))
+	{
+	}
+
+	Optimiser(const ParameterArenaPtr& arena) :
+		_parameters(Unique(arena->Parameters())),
+		_arena(arena)
 	{
 	}
 
@@ -18,19 +56,73 @@ public:
 	{
 		for(auto& p:_parameters)
 		{
+			p->MergeSparseGradient();
 			const TensorPtr& gradient = p->Gradient();
 			if(gradient)
 				gradient->Data()._ClipNorm(clipNorm);
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse&&!sparse->Empty())
+				sparse->Values()._ClipNorm(clipNorm);
+		}
+	}
+
+	// Clip the gradients of every parameter together, scaling them all if their total norm (as one vector) exceeds 'clipNorm'.
+	// Returns the total norm.
+	//
+	FP ClipGradNorm(const FP clipNorm)
+	{
+		double sum = 0;
+		auto add = [&sum](const FP norm)
+		{
+			sum += double(norm)*norm;
+		};
+		if(_arena)
+			add(_arena->GradNorm());
+		for(auto& p:_parameters)
+		{
+			p->MergeSparseGradient();		// Rows in both gradients are added before the norm is taken.
+			const TensorPtr& gradient = p->Gradient();
+			if(gradient&&!InArena(p))
+				add(gradient->Data().Norm());
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse&&!sparse->Empty())
+				add(sparse->Values().Norm());
 		}
+
+		const FP norm = FP(sqrt(sum));
+		if(clipNorm<norm)
+		{
+			const FP scale = clipNorm/norm;
+			if(_arena)
+			{
+				NDArray gradient = _arena->Gradient();
+				gradient *= scale;
+			}
+			for(auto& p:_parameters)
+			{
+				const TensorPtr& gradient = p->Gradient();
+				if(gradient&&!InArena(p))
+					gradient->Data() *= scale;
+				const SparseRowsPtr& sparse = p->SparseGradient();
+				if(sparse&&!sparse->Empty())
+					sparse->Values() *= scale;
+			}
+		}
+		return norm;
 	}
 
 	void ZeroGrad()
 	{
+		if(_arena)
+			_arena->ZeroGrad();
 		for(auto& p:_parameters)
 		{
 			const TensorPtr& gradient = p->Gradient();
-			if(gradient)
+			if(gradient&&!InArena(p))
 				gradient->Data() *= 0.0;
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse)
+				sparse->Clear();
 		}
 	}
 
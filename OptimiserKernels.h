@@ -0,0 +1,184 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cmath>
+#include <vector>
+#include "CpuFeatures.h"
+#include "NDThreadPool.h"
+
+
+// Optimiser kernels.
+// ==================
+//
+// Fused parameter updates. Every element of a parameter, its gradient and its optimiser state (moments) is read once and written once,
+// and the gradient is zeroed in the same pass, rather than building a chain of temporary arrays from NDArray operators.
+//
+// All the parameters of an optimiser are updated by a single thread pool dispatch. Each parameter is split into blocks of
+// 'optimiser_grain' elements and the blocks of every parameter are scheduled together, so many small parameters (biases) and a few
+// large ones (weights) balance across the workers.
+//
+// An update is a functor with a 'moments' member (the number of state arrays it uses, 0 to 2), a scalar operator() and a TARGET_AVX2
+// 'vector' method on 8 lanes, both updating the parameter and moments in place from the gradient.
+//
+
+
+// Elements per task.
+constexpr int optimiser_grain = 16384;
+
+
+// Parameter and the arrays updated with it, all with 'n' contiguous elements.
+//
+struct optimiser_tensor
+{
+	float*	p;	// Parameter.
+	float*	g;	// Gradient.
+	float*	m;	// First moment, or null if the update has none.
+	float*	v;	// Second moment, or null if the update has fewer than two.
+	int		n;
+};
+
+
+// p -= alpha*g
+//
+struct optimiser_sgd
+{
+	static constexpr int moments = 0;
+
+	float	alpha;
+
+	void operator()(float& p,const float g,float&,float&) const
+	{
+		p -= alpha*g;
+	}
+
+	TARGET_AVX2 void vector(__m256& p,const __m256 g,__m256&,__m256&) const
+	{
+		p = _mm256_fnmadd_ps(_mm256_set1_ps(alpha),g,p);
+	}
+};
+
+
+// m = beta*m + (1-beta)*g*g
+// p -= alpha*g/(sqrt(m)+eps)
+//
+struct optimiser_rmsprop
+{
+	static constexpr int moments = 1;
+
+	float	alpha;
+	float	beta;
+	float	eps;
+
+	void operator()(float& p,const float g,float& m,float&) const
+	{
+		m = beta*m + (1-beta)*g*g;
+		p -= alpha*g/(std::sqrt(m)+eps);
+	}
+
+	TARGET_AVX2 void vector(__m256& p,const __m256 g,__m256& m,__m256&) const
+	{
+		m = _mm256_fmadd_ps(_mm256_set1_ps(beta),m,_mm256_mul_ps(_mm256_set1_ps(1-beta),_mm256_mul_ps(g,g)));
+		const __m256 d = _mm256_add_ps(_mm256_sqrt_ps(m),_mm256_set1_ps(eps));
+		p = _mm256_sub_ps(p,_mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(alpha),g),d));
+	}
+};
+
+
+// m = beta1*m + (1-beta1)*g
+// v = beta2*v + (1-beta2)*g*g
+// p -= alpha*decay*p								(decoupled weight decay, AdamW)
+// p -= alpha*(m*c1)/(sqrt(v*c2)+eps)				(c1 and c2 are the bias corrections 1/(1-beta^t) for step t)
+//
+struct optimiser_adam
+{
+	static constexpr int moments = 2;
+
+	float	alpha;
+	float	beta1;
+	float	beta2;
+	float	eps;
+	float	c1;
+	float	c2;
+	float	decay;
+
+	void operator()(float& p,const float g,float& m,float& v) const
+	{
+		m = beta1*m + (1-beta1)*g;
+		v = beta2*v + (1-beta2)*g*g;
+		p -= alpha*decay*p;
+		p -= alpha*(m*c1)/(std::sqrt(v*c2)+eps);
+	}
+
+	TARGET_AVX2 void vector(__m256& p,const __m256 g,__m256& m,__m256& v) const
+	{
+		m = _mm256_fmadd_ps(_mm256_set1_ps(beta1),m,_mm256_mul_ps(_mm256_set1_ps(1-beta1),g));
+		v = _mm256_fmadd_ps(_mm256_set1_ps(beta2),v,_mm256_mul_ps(_mm256_set1_ps(1-beta2),_mm256_mul_ps(g,g)));
+		p = _mm256_fnmadd_ps(_mm256_set1_ps(alpha*decay),p,p);
+		const __m256 d = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(v,_mm256_set1_ps(c2))),_mm256_set1_ps(eps));
+		p = _mm256_sub_ps(p,_mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(alpha*c1),m),d));
+	}
+};
+
+
+// Updates 'n' elements from 'first' of a parameter.
+//
+template<typename OP>
+static void optimiser_block_generic(const OP& op,const optimiser_tensor& t,const int first,const int n,const bool zero)
+{
+	float unused = 0;
+	for(int i=first;i<first+n;++i)
+	{
+		op(t.p[i],t.g[i],OP::moments>0?t.m[i]:unused,OP::moments>1?t.v[i]:unused);
+		if(zero)
+			t.g[i] = 0;
+	}
+}
+
+template<typename OP>
+TARGET_AVX2
+static void optimiser_block_avx2(const OP& op,const optimiser_tensor& t,const int first,const int n,const bool zero)
+{
+	const int end = first+n;
+	int i = first;
+	for(;i+8<=end;i+=8)
+	{
+		__m256 p = _mm256_loadu_ps(t.p+i);
+		const __m256 g = _mm256_loadu_ps(t.g+i);
+		__m256 m = OP::moments>0?_mm256_loadu_ps(t.m+i):_mm256_setzero_ps();
+		__m256 v = OP::moments>1?_mm256_loadu_ps(t.v+i):_mm256_setzero_ps();
+		op.vector(p,g,m,v);
+		_mm256_storeu_ps(t.p+i,p);
+		if(OP::moments>0)
+			_mm256_storeu_ps(t.m+i,m);
+		if(OP::moments>1)
+			_mm256_storeu_ps(t.v+i,v);
+		if(zero)
+			_mm256_storeu_ps(t.g+i,_mm256_setzero_ps());
+	}
+	optimiser_block_generic(op,t,i,end-i,zero);
+}
+
+
+// Applies the update to every parameter, zeroing the gradients if 'zero'.
+//
+template<typename OP>
+static void optimiser_step(const OP& op,const std::vector<optimiser_tensor>& tensors,const bool zero)
+{
+	// Blocks of the parameters as (parameter,first element).
+	std::vector<std::pair<int,int>> blocks;
+	for(int i=0;i<(int)tensors.size();++i)
+		for(int first=0;first<tensors[i].n;first+=optimiser_grain)
+			blocks.emplace_back(i,first);
+
+	const bool avx2 = cpu_has_avx2();
+	NDThreadPool::ParallelFor(0,(int)blocks.size(),1,[&](const int block)
+	{
+		const optimiser_tensor& t = tensors[blocks[block].first];
+		const int first = blocks[block].second;
+		const int n = (std::min)(optimiser_grain,t.n-first);
+		if(avx2)
+			optimiser_block_avx2(op,t,first,n,zero);
+		else
+			optimiser_block_generic(op,t,first,n,zero);
+	});
+}
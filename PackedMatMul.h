@@ -0,0 +1,491 @@
+#pragma once
+
+#include <immintrin.h>
+#include <algorithm>
+#include "CpuFeatures.h"
+#include "NDAllocator.h"
+#include "NDThreadPool.h"
+
+
+// Packed panel matrix multiplication (GotoBLAS/BLIS style).
+// ==========================================================
+//
+// C(m,n) = A(m,k) @ B(k,n) is computed by blocking the operands so that each level of the loop nest works out of a level of cache.
+//
+//	jc loop:	nc columns of B and C.
+//	pc loop:	kc deep slice of A and B - the B block (kc,nc) is packed once into micro-panels of 'nr' columns (L3).
+//	ic loop:	mc rows of A and C - the A block (mc,kc) is packed into micro-panels of 'mr' rows (L2), each ic block is a task.
+//	jr/ir loop:	the micro-kernel multiplies an (mr,kc) A micro-panel by a (kc,nr) B micro-panel (L1) holding the (mr,nr) C block in registers.
+//
+// Packing reads A and B through arbitrary row and column strides, so transposed views never need to be copied before multiplying.
+// The micro-kernel is selected at runtime from the instruction sets supported by the CPU.
+//
+
+// Micro-kernel signature.
+//	Multiplies packed micro-panels 'a' (kc,mr) and 'b' (kc,nr) and writes the top-left (m,n) corner of the result to 'c'.
+//	'c' is row major with row stride 'ldc'. The result is added to 'c' when 'accumulate' is set, otherwise it overwrites 'c'.
+//
+typedef void (*gemm_micro_kernel)(const int kc,const float* a,const float* b,float* const c,const int ldc,const int m,const int n,const bool accumulate);
+
+
+// Micro-kernel and the block sizes tuned for it.
+//
+struct gemm_kernel
+{
+	const char*			name;
+	int					mr;		// Rows of C held in registers.
+	int					nr;		// Columns of C held in registers.
+	int					mc;		// Rows of A packed per block (multiple of mr).
+	int					kc;		// Depth of A and B packed per block.
+	int					nc;		// Columns of B packed per block (multiple of nr).
+	gemm_micro_kernel	micro_kernel;
+};
+
+
+// Below this many multiply-adds the product is computed on the calling thread.
+constexpr long long gemm_parallel_threshold = 64*64*64;
+
+
+// Copies the (m,n) result block 't' (row stride 'ldt') to 'c', adding to it if 'accumulate' is set.
+//	Used for edge blocks that are smaller than the micro-kernel.
+//
+static void gemm_store_partial(const float* const t,const int ldt,float* const c,const int ldc,const int m,const int n,const bool accumulate)
+{
+	for(int i=0;i<m;++i)
+	{
+		const float* const src = t+i*ldt;
+		float* const dst = c+i*ldc;
+		if(accumulate)
+		{
+			for(int j=0;j<n;++j)
+				dst[j] += src[j];
+		}
+		else
+		{
+			for(int j=0;j<n;++j)
+				dst[j] = src[j];
+		}
+	}
+}
+
+
+// Portable micro-kernel (4x16) for CPUs without AVX2 - the compiler vectorises the inner loop.
+//
+static void gemm_micro_kernel_generic(const int kc,const float* a,const float* b,float* const c,const int ldc,const int m,const int n,const bool accumulate)
+{
+	constexpr int mr = 4;
+	constexpr int nr = 16;
+	alignas(64) float t[mr][nr] = {};
+	for(int p=0;p<kc;++p)
+	{
+		for(int i=0;i<mr;++i)
+		{
+			const float ai = a[i];
+			for(int j=0;j<nr;++j)
+				t[i][j] += ai*b[j];
+		}
+		a += mr;
+		b += nr;
+	}
+	gemm_store_partial(&t[0][0],nr,c,ldc,m,n,accumulate);
+}
+
+
+// AVX2 micro-kernel (6x16), 12 ymm accumulators, 2 loads of B and 6 broadcasts of A per 12 fused multiply adds.
+//
+TARGET_AVX2
+static void gemm_micro_kernel_avx2(const int kc,const float* a,const float* b,float* const c,const int ldc,const int m,const int n,const bool accumulate)
+{
+	__m256 c00 = _mm256_setzero_ps(),c01 = _mm256_setzero_ps();
+	__m256 c10 = _mm256_setzero_ps(),c11 = _mm256_setzero_ps();
+	__m256 c20 = _mm256_setzero_ps(),c21 = _mm256_setzero_ps();
+	__m256 c30 = _mm256_setzero_ps(),c31 = _mm256_setzero_ps();
+	__m256 c40 = _mm256_setzero_ps(),c41 = _mm256_setzero_ps();
+	__m256 c50 = _mm256_setzero_ps(),c51 = _mm256_setzero_ps();
+
+	for(int p=0;p<kc;++p)
+	{
+		const __m256 b0 = _mm256_load_ps(b);
+		const __m256 b1 = _mm256_load_ps(b+8);
+		__m256 ai;
+		ai = _mm256_broadcast_ss(a+0); c00 = _mm256_fmadd_ps(ai,b0,c00); c01 = _mm256_fmadd_ps(ai,b1,c01);
+		ai = _mm256_broadcast_ss(a+1); c10 = _mm256_fmadd_ps(ai,b0,c10); c11 = _mm256_fmadd_ps(ai,b1,c11);
+		ai = _mm256_broadcast_ss(a+2); c20 = _mm256_fmadd_ps(ai,b0,c20); c21 = _mm256_fmadd_ps(ai,b1,c21);
+		ai = _mm256_broadcast_ss(a+3); c30 = _mm256_fmadd_ps(ai,b0,c30); c31 = _mm256_fmadd_ps(ai,b1,c31);
+		ai = _mm256_broadcast_ss(a+4); c40 = _mm256_fmadd_ps(ai,b0,c40); c41 = _mm256_fmadd_ps(ai,b1,c41);
+		ai = _mm256_broadcast_ss(a+5); c50 = _mm256_fmadd_ps(ai,b0,c50); c51 = _mm256_fmadd_ps(ai,b1,c51);
+		a += 6;
+		b += 16;
+	}
+
+	if(m==6&&n==16)
+	{
+		// Whole block, write straight to C.
+		const __m256 r[6][2] = {{c00,c01},{c10,c11},{c20,c21},{c30,c31},{c40,c41},{c50,c51}};
+		for(int i=0;i<6;++i)
+		{
+			float* const ci = c+i*ldc;
+			if(accumulate)
+			{
+				_mm256_storeu_ps(ci,_mm256_add_ps(_mm256_loadu_ps(ci),r[i][0]));
+				_mm256_storeu_ps(ci+8,_mm256_add_ps(_mm256_loadu_ps(ci+8),r[i][1]));
+			}
+			else
+			{
+				_mm256_storeu_ps(ci,r[i][0]);
+				_mm256_storeu_ps(ci+8,r[i][1]);
+			}
+		}
+	}
+	else
+	{
+		// Edge block, spill to a temporary and copy the valid area.
+		alignas(64) float t[6][16];
+		_mm256_store_ps(&t[0][0],c00); _mm256_store_ps(&t[0][8],c01);
+		_mm256_store_ps(&t[1][0],c10); _mm256_store_ps(&t[1][8],c11);
+		_mm256_store_ps(&t[2][0],c20); _mm256_store_ps(&t[2][8],c21);
+		_mm256_store_ps(&t[3][0],c30); _mm256_store_ps(&t[3][8],c31);
+		_mm256_store_ps(&t[4][0],c40); _mm256_store_ps(&t[4][8],c41);
+		_mm256_store_ps(&t[5][0],c50); _mm256_store_ps(&t[5][8],c51);
+		gemm_store_partial(&t[0][0],16,c,ldc,m,n,accumulate);
+	}
+}
+
+
+// AVX-512 micro-kernel (6x32), 12 zmm accumulators, 2 loads of B and 6 broadcasts of A per 12 fused multiply adds.
+//
+TARGET_AVX512
+static void gemm_micro_kernel_avx512(const int kc,const float* a,const float* b,float* const c,const int ldc,const int m,const int n,const bool accumulate)
+{
+	__m512 c00 = _mm512_setzero_ps(),c01 = _mm512_setzero_ps();
+	__m512 c10 = _mm512_setzero_ps(),c11 = _mm512_setzero_ps();
+	__m512 c20 = _mm512_setzero_ps(),c21 = _mm512_setzero_ps();
+	__m512 c30 = _mm512_setzero_ps(),c31 = _mm512_setzero_ps();
+	__m512 c40 = _mm512_setzero_ps(),c41 = _mm512_setzero_ps();
+	__m512 c50 = _mm512_setzero_ps(),c51 = _mm512_setzero_ps();
+
+	for(int p=0;p<kc;++p)
+	{
+		const __m512 b0 = _mm512_load_ps(b);
+		const __m512 b1 = _mm512_load_ps(b+16);
+		__m512 ai;
+		ai = _mm512_set1_ps(a[0]); c00 = _mm512_fmadd_ps(ai,b0,c00); c01 = _mm512_fmadd_ps(ai,b1,c01);
+		ai = _mm512_set1_ps(a[1]); c10 = _mm512_fmadd_ps(ai,b0,c10); c11 = _mm512_fmadd_ps(ai,b1,c11);
+		ai = _mm512_set1_ps(a[2]); c20 = _mm512_fmadd_ps(ai,b0,c20); c21 = _mm512_fmadd_ps(ai,b1,c21);
+		ai = _mm512_set1_ps(a[3]); c30 = _mm512_fmadd_ps(ai,b0,c30); c31 = _mm512_fmadd_ps(ai,b1,c31);
+		ai = _mm512_set1_ps(a[4]); c40 = _mm512_fmadd_ps(ai,b0,c40); c41 = _mm512_fmadd_ps(ai,b1,c41);
+		ai = _mm512_set1_ps(a[5]); c50 = _mm512_fmadd_ps(ai,b0,c50); c51 = _mm512_fmadd_ps(ai,b1,c51);
+		a += 6;
+		b += 32;
+	}
+
+	if(m==6&&n==32)
+	{
+		// Whole block, write straight to C.
+		const __m512 r[6][2] = {{c00,c01},{c10,c11},{c20,c21},{c30,c31},{c40,c41},{c50,c51}};
+		for(int i=0;i<6;++i)
+		{
+			float* const ci = c+i*ldc;
+			if(accumulate)
+			{
+				_mm512_storeu_ps(ci,_mm512_add_ps(_mm512_loadu_ps(ci),r[i][0]));
+				_mm512_storeu_ps(ci+16,_mm512_add_ps(_mm512_loadu_ps(ci+16),r[i][1]));
+			}
+			else
+			{
+				_mm512_storeu_ps(ci,r[i][0]);
+				_mm512_storeu_ps(ci+16,r[i][1]);
+			}
+		}
+	}
+	else
+	{
+		// Edge block, spill to a temporary and copy the valid area.
+		alignas(64) float t[6][32];
+		_mm512_store_ps(&t[0][0],c00); _mm512_store_ps(&t[0][16],c01);
+		_mm512_store_ps(&t[1][0],c10); _mm512_store_ps(&t[1][16],c11);
+		_mm512_store_ps(&t[2][0],c20); _mm512_store_ps(&t[2][16],c21);
+		_mm512_store_ps(&t[3][0],c30); _mm512_store_ps(&t[3][16],c31);
+		_mm512_store_ps(&t[4][0],c40); _mm512_store_ps(&t[4][16],c41);
+		_mm512_store_ps(&t[5][0],c50); _mm512_store_ps(&t[5][16],c51);
+		gemm_store_partial(&t[0][0],32,c,ldc,m,n,accumulate);
+	}
+}
+
+
+// Returns the fastest micro-kernel supported by this CPU (selected once).
+//
+inline const gemm_kernel& gemm_select_kernel()
+{
+	static const gemm_kernel avx512	= {"avx512",6,32,144,256,4096,gemm_micro_kernel_avx512};
+	static const gemm_kernel avx2	= {"avx2",6,16,144,256,2048,gemm_micro_kernel_avx2};
+	static const gemm_kernel generic	= {"generic",4,16,128,256,2048,gemm_micro_kernel_generic};
+	static const gemm_kernel& selected = cpu_has_avx512()?avx512:cpu_has_avx2()?avx2:generic;
+	return selected;
+}
+
+
+// Packs an (mc,kc) block of A into micro-panels of 'mr' rows.
+//	Each micro-panel is stored column by column (kc,mr) so the micro-kernel reads it sequentially. Missing rows are zero padded.
+//
+static void gemm_pack_a(const int mr,const int mc,const int kc,const float* const a,const int a_rs,const int a_cs,float* packed)
+{
+	for(int ir=0;ir<mc;ir+=mr)
+	{
+		const int rows = (std::min)(mr,mc-ir);
+		const float* const panel = a+ir*a_rs;
+		if(a_cs==1)
+		{
+			// Row major - each row of the panel is contiguous.
+			for(int p=0;p<kc;++p)
+			{
+				int i = 0;
+				for(;i<rows;++i)
+					*packed++ = panel[i*a_rs+p];
+				for(;i<mr;++i)
+					*packed++ = 0.0f;
+			}
+		}
+		else
+		{
+			// Arbitrary stride (e.g. transposed view) - each column of the panel is contiguous when a_rs is 1.
+			for(int p=0;p<kc;++p)
+			{
+				const float* const col = panel+p*a_cs;
+				int i = 0;
+				for(;i<rows;++i)
+					*packed++ = col[i*a_rs];
+				for(;i<mr;++i)
+					*packed++ = 0.0f;
+			}
+		}
+	}
+}
+
+
+// Packs a (kc,nc) block of B into micro-panels of 'nr' columns.
+//	Each micro-panel is stored row by row (kc,nr) so the micro-kernel reads it sequentially. Missing columns are zero padded.
+//
+static void gemm_pack_b(const int nr,const int kc,const int nc,const float* const b,const int b_rs,const int b_cs,float* packed)
+{
+	for(int jr=0;jr<nc;jr+=nr)
+	{
+		const int cols = (std::min)(nr,nc-jr);
+		const float* const panel = b+jr*b_cs;
+		for(int p=0;p<kc;++p)
+		{
+			const float* const row = panel+p*b_rs;
+			int j = 0;
+			if(b_cs==1)
+			{
+				// Row major - copy the contiguous row segment.
+				memcpy(packed,row,cols*sizeof(float));
+				j = cols;
+			}
+			else
+			{
+				// Arbitrary stride (e.g. transposed view).
+				for(;j<cols;++j)
+					packed[j] = row[j*b_cs];
+			}
+			for(;j<nr;++j)
+				packed[j] = 0.0f;
+			packed += nr;
+		}
+	}
+}
+
+
+// Multiplies the packed B block by rows [ic,ic+mc) of A for the B micro-panels [jr_begin,jr_end) of the block.
+//	Packs the A block into a buffer owned by the calling thread.
+//
+static void gemm_block(
+	const gemm_kernel& kernel,
+	const int ic,const int mc,const int kc,
+	const float* const a,const int a_rs,const int a_cs,
+	const float* const b_packed,const int jr_begin,const int jr_end,const int nc,
+	float* const c,const int ldc,
+	const bool accumulate)
+{
+	const int mr = kernel.mr;
+	const int nr = kernel.nr;
+	const int mc_padded = ((mc+mr-1)/mr)*mr;
+	float* const a_packed = mem.Alloc<float>(mc_padded*kc);
+	gemm_pack_a(mr,mc,kc,a+ic*a_rs,a_rs,a_cs,a_packed);
+
+	for(int jr=jr_begin;jr<jr_end;jr+=nr)
+	{
+		const int n = (std::min)(nr,nc-jr);
+		const float* const b_panel = b_packed+jr*kc;
+		for(int ir=0;ir<mc;ir+=mr)
+		{
+			const int m = (std::min)(mr,mc-ir);
+			kernel.micro_kernel(kc,a_packed+ir*kc,b_panel,c+(ic+ir)*ldc+jr,ldc,m,n,accumulate);
+		}
+	}
+
+	mem.Free(a_packed);
+}
+
+
+// C(m,n) = A(m,k) @ B(k,n).
+//	A and B are addressed through row and column strides, C is row major with row stride 'ldc' and is overwritten.
+//
+static void gemm(
+	const int m,const int n,const int k,
+	const float* const a,const int a_rs,const int a_cs,
+	const float* const b,const int b_rs,const int b_cs,
+	float* const c,const int ldc)
+{
+	if(m==0||n==0)
+		return;
+
+	// Empty inner dimension, result is zero.
+	if(k==0)
+	{
+		for(int i=0;i<m;++i)
+			memset(c+i*ldc,0,n*sizeof(float));
+		return;
+	}
+
+	const gemm_kernel& kernel = gemm_select_kernel();
+	const int nr = kernel.nr;
+
+	// Small products are not worth distributing.
+	const bool parallel = (long long)m*n*k>=gemm_parallel_threshold;
+
+	for(int jc=0;jc<n;jc+=kernel.nc)
+	{
+		const int nc = (std::min)(kernel.nc,n-jc);
+		const int nc_padded = ((nc+nr-1)/nr)*nr;
+
+		// Split the columns of the block into groups of micro-panels so narrow A (few rows) still produces enough tasks.
+		const int jr_step = parallel?nr*8:nc_padded;
+
+		for(int pc=0;pc<k;pc+=kernel.kc)
+		{
+			const int kc = (std::min)(kernel.kc,k-pc);
+			const bool accumulate = pc>0;	// First slice of K overwrites C.
+
+			// Pack the B block once, it is shared by every task.
+			float* const b_packed = mem.Alloc<float>(nc_padded*kc);
+			gemm_pack_b(nr,kc,nc,b+pc*b_rs+jc*b_cs,b_rs,b_cs,b_packed);
+
+			const float* const a_slice = a+pc*a_cs;
+			float* const c_block = c+jc;
+			if(!parallel)
+			{
+				for(int ic=0;ic<m;ic+=kernel.mc)
+					gemm_block(kernel,ic,(std::min)(kernel.mc,m-ic),kc,a_slice,a_rs,a_cs,b_packed,0,nc,nc,c_block,ldc,accumulate);
+			}
+			else
+			{// Scoped TaskGroup.
+				NDThreadPool::TaskGroup taskGroup;
+				for(int ic=0;ic<m;ic+=kernel.mc)
+				{
+					for(int jr=0;jr<nc;jr+=jr_step)
+					{
+						// Each task owns a disjoint (mc,jr_step) area of C.
+						taskGroup.Run([&kernel,ic,m,kc,a_slice,a_rs,a_cs,b_packed,jr,jr_step,nc,c_block,ldc,accumulate]()
+						{
+							gemm_block(kernel,ic,(std::min)(kernel.mc,m-ic),kc,a_slice,a_rs,a_cs,b_packed,jr,(std::min)(jr+jr_step,nc),nc,c_block,ldc,accumulate);
+						});
+					}
+				}
+			} // Waits for TaskGroup.
+
+			mem.Free(b_packed);
+		}
+	}
+}
+
+
+// Computes the (mc,nc) block of C at (ic,jc) over the whole K dimension, packing its own B slices.
+//	Used by the batched GEMM where each task owns a block of one matrix in the batch.
+//
+static void gemm_tile(
+	const gemm_kernel& kernel,
+	const int ic,const int mc,const int jc,const int nc,const int k,
+	const float* const a,const int a_rs,const int a_cs,
+	const float* const b,const int b_rs,const int b_cs,
+	float* const c,const int ldc)
+{
+	const int nr = kernel.nr;
+	const int nc_padded = ((nc+nr-1)/nr)*nr;
+	float* const b_packed = mem.Alloc<float>((size_t)nc_padded*(std::min)(kernel.kc,k));
+	for(int pc=0;pc<k;pc+=kernel.kc)
+	{
+		const int kc = (std::min)(kernel.kc,k-pc);
+		gemm_pack_b(nr,kc,nc,b+pc*b_rs+jc*b_cs,b_rs,b_cs,b_packed);
+		gemm_block(kernel,ic,mc,kc,a+pc*a_cs,a_rs,a_cs,b_packed,0,nc,nc,c+jc,ldc,pc>0);
+	}
+	mem.Free(b_packed);
+}
+
+
+// Batched GEMM, C[i](m,n) = A[i](m,k) @ B[i](k,n) for i in [0,batch).
+//	Matrix i of each operand starts 'i*x_bs' elements after the first, a batch stride of 0 broadcasts one matrix to the whole batch.
+//	Results are written directly into C. Every (mc,nc) block of every matrix is a task so small matrices (e.g. attention heads)
+//	are distributed across the batch, and large ones across their blocks.
+//
+static void gemm_batched(
+	const int batch,const int m,const int n,const int k,
+	const float* const a,const int a_bs,const int a_rs,const int a_cs,
+	const float* const b,const int b_bs,const int b_rs,const int b_cs,
+	float* const c,const int c_bs,const int ldc)
+{
+	if(batch==0||m==0||n==0)
+		return;
+
+	const gemm_kernel& kernel = gemm_select_kernel();
+	const int row_blocks = (m+kernel.mc-1)/kernel.mc;
+	const int col_blocks = (n+kernel.nc-1)/kernel.nc;
+	const long long work = (long long)batch*m*n*k;
+
+	// Few large matrices are better split by the single GEMM, which shares packed B between tasks.
+	if(batch==1||((long long)batch*row_blocks*col_blocks<16&&(long long)m*n*k>=gemm_parallel_threshold))
+	{
+		for(int i=0;i<batch;++i)
+			gemm(m,n,k,a+(size_t)i*a_bs,a_rs,a_cs,b+(size_t)i*b_bs,b_rs,b_cs,c+(size_t)i*c_bs,ldc);
+		return;
+	}
+
+	// Empty inner dimension, results are zero.
+	if(k==0)
+	{
+		for(int i=0;i<batch;++i)
+			for(int r=0;r<m;++r)
+				memset(c+(size_t)i*c_bs+r*ldc,0,n*sizeof(float));
+		return;
+	}
+
+	const auto tile = [&kernel,m,n,k,a,a_bs,a_rs,a_cs,b,b_bs,b_rs,b_cs,c,c_bs,ldc](const int i,const int ic,const int jc)
+	{
+		gemm_tile(
+			kernel,ic,(std::min)(kernel.mc,m-ic),jc,(std::min)(kernel.nc,n-jc),k,
+			a+(size_t)i*a_bs,a_rs,a_cs,
+			b+(size_t)i*b_bs,b_rs,b_cs,
+			c+(size_t)i*c_bs,ldc);
+	};
+
+	// Small batches are not worth distributing.
+	if(work<gemm_parallel_threshold)
+	{
+		for(int i=0;i<batch;++i)
+			for(int ic=0;ic<m;ic+=kernel.mc)
+				for(int jc=0;jc<n;jc+=kernel.nc)
+					tile(i,ic,jc);
+		return;
+	}
+
+	{// Scoped TaskGroup.
+		NDThreadPool::TaskGroup taskGroup;
+		for(int i=0;i<batch;++i)
+			for(int ic=0;ic<m;ic+=kernel.mc)
+				for(int jc=0;jc<n;jc+=kernel.nc)
+					taskGroup.Run([&tile,i,ic,jc]()
+					{
+						tile(i,ic,jc);
+					});
+	} // Waits for TaskGroup.
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <set>
+#include <vector>
+#include "Tensor.h"
+
+
+typedef std::shared_ptr<class ParameterArena> ParameterArenaPtr;
+
+// Flat storage for the parameters of a model. The data, gradient and optimiser moments of every parameter are views of four contiguous
+// arrays (one each for data, gradients, first and second moments), each parameter starting on a 64 byte boundary. Zeroing gradients,
+// their norm and the optimiser update are then a single pass over one array, and a checkpoint is a single write.
+//
+// Parameters with sparse gradients (see Tensor::Sparse) keep their own storage.
+//
+class ParameterArena
+{
+	static const int Alignment = 64/sizeof(FP);		// Elements in 64 bytes.
+
+	const std::vector<TensorPtr>	_parameters;	// Every parameter given, including those not in the arena.
+	std::set<const Tensor*>			_members;		// Parameters in the arena.
+	NDArray							_data;
+	NDArray							_gradient;
+	NDArray							_momentum;
+	NDArray							_momentum2;
+
+	// Private class to prevent constructor being called directly.
+	class P
+	{
+	};
+
+public:
+	static ParameterArenaPtr New(const std::vector<TensorPtr>& parameters)
+	{
+		return std::make_shared<ParameterArena>(P(),parameters);
+	}
+
+	ParameterArena(const P&,const std::vector<TensorPtr>& parameters) :
+		_parameters(parameters)
+	{
+		// Offset of each parameter, a parameter listed more than once is only placed once.
+		std::vector<std::pair<TensorPtr,int>> placed;
+		int size = 0;
+		for(auto& p:parameters)
+		{
+			if(p->Sparse()||!_members.insert(p.get()).second)
+				continue;
+			placed.emplace_back(p,size);
+			size += (p->Data().Size()+Alignment-1)/Alignment*Alignment;
+		}
+
+		// Padding is zero and stays zero, its gradient is never set.
+		_data._Attach(NDData::New({size},0.0f));
+		_gradient._Attach(NDData::New({size},0.0f));
+		_momentum._Attach(NDData::New({size},0.0f));
+		_momentum2._Attach(NDData::New({size},0.0f));
+		for(auto& [p,offset]:placed)
+		{
+			const NDShape& shape = p->Data().Shape();
+			p->Bind(
+				NDData::New(*_data,offset,shape),
+				NDData::New(*_gradient,offset,shape),
+				NDData::New(*_momentum,offset,shape),
+				NDData::New(*_momentum2,offset,shape));
+		}
+	}
+
+	const std::vector<TensorPtr>& Parameters() const
+	{
+		return _parameters;
+	}
+
+	// Returns 'true' if the parameter's data, gradient and moments are in the arena.
+	//
+	bool Contains(const TensorPtr& parameter) const
+	{
+		return _members.count(parameter.get())>0;
+	}
+
+	const NDArray& Data() const
+	{
+		return _data;
+	}
+
+	const NDArray& Gradient() const
+	{
+		return _gradient;
+	}
+
+	const NDArray& Momentum() const
+	{
+		return _momentum;
+	}
+
+	const NDArray& Momentum2() const
+	{
+		return _momentum2;
+	}
+
+	// Norm of the gradients of every parameter in the arena (as one vector).
+	//
+	FP GradNorm() const
+	{
+		return _gradient.Norm();
+	}
+
+	void ZeroGrad()
+	{
+		_gradient *= 0.0f;
+	}
+
+	// Writes the data of every parameter in the arena.
+	//
+	void Save(const std::string& filename) const
+	{
+		_data.Save(filename);
+	}
+
+	// Reads the data of every parameter saved by an arena of the same parameters.
+	//
+	void Load(const std::string& filename)
+	{
+		_data = NDData::Load(filename);
+	}
+};
\ No newline at end of file
@@ -18,16 +18,40 @@ public:
 	{
 	}
 
+	RMSProp(const ParameterArenaPtr& arena,double alpha) :
+		Optimiser(arena),
+		_alpha(alpha),
+		_beta(0.99)
+	{
+	}
+
 	void Step(bool zero=true)
 	{
+		std::vector<NDArrays> dense;
 		for(auto& p:_parameters)
 		{
-			// Reduce data by fraction of gradient to steer loss toward 0.
-			p->Momentum()->Data() = p->Momentum()->Data()*_beta + (p->Gradient()->Data()*p->Gradient()->Data())*(1.0-_beta);
-			//p->Momentum()->Print();
-			p->Data() -= (p->Gradient()->Data()/(p->Momentum()->Data().Sqrt()+1e-08))*_alpha;
-			if(zero)
-				p->Gradient()->Data() *= 0.0;
+			p->MergeSparseGradient();		// Both sparse and dense gradients are stepped as dense.
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse&&!p->Gradient())
+			{
+				// Lazy update, the mean square of rows without a gradient is not decayed.
+				if(!sparse->Empty())
+				{
+					const std::vector<int>& rows = sparse->Rows();
+					const NDArray& g = sparse->Values();
+					const NDArray v = p->Momentum()->Data().SelectRows(rows)*_beta + (g*g)*(1.0-_beta);
+					p->Momentum()->Data()._SetRows(rows,v);
+					p->Data()._AddRows(rows,(g/(v.Sqrt()+1e-08))*(-_alpha));
+				}
+				if(zero)
+					sparse->Clear();
+			}
+			else if(p->Gradient()&&!InArena(p))
+				dense.push_back({p->Data(),p->Gradient()->Data(),p->Momentum()->Data()});
 		}
+		AddArena(dense);
+
+		// Reduce data by fraction of gradient to steer loss toward 0.
+		NDData::_OptimiserStep(optimiser_rmsprop{FP(_alpha),FP(_beta),FP(1e-08)},dense,zero);
 	}
 };
\ No newline at end of file
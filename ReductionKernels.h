@@ -0,0 +1,649 @@
+#pragma once
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "CpuFeatures.h"
+#include "NDThreadPool.h"
+#include "ElementwiseKernels.h"
+
+
+// Reduction kernels.
+// ==================
+//
+// Reduces one run of neighbouring dimensions of a row major array, viewed as 'outer' blocks of 'n' reduced values of 'inner' elements:
+// output (o,i) reduces x[o*n*inner+k*inner+i] for k in [0,n). Reductions over dimensions that are not neighbours are made one run at a
+// time by the caller.
+//
+// The layout picks the strategy:
+//
+//	inner==1	contiguous		each output reduces a contiguous row, vectorised along the row with several accumulators.
+//	inner>1		strided			the reduced values are 'inner' apart, so the output is vectorised across 'inner' instead: a block of
+//								neighbouring outputs is accumulated together, each step loading one contiguous run of every block.
+//
+// Outputs are split across the thread pool in blocks of roughly 'elementwise_grain' input values.
+//
+// A reduction is a functor with an 'identity', a scalar operator() that combines an accumulator with a value, and a TARGET_AVX2
+// 'vector' method doing the same on 8 lanes. Fused reductions (max with argmax, mean with variance) have their own kernels.
+//
+
+
+// Outputs accumulated together along a strided reduction, 4 vectors.
+constexpr int reduce_block = 32;
+
+
+// Layout of the reduced dimensions.
+//
+struct reduce_layout
+{
+	int	outer;		// Product of the dimensions before the reduced dimensions.
+	int	n;			// Product of the reduced dimensions.
+	int	inner;		// Product of the dimensions after the reduced dimensions.
+};
+
+
+// Reductions.
+//
+struct reduce_sum
+{
+	static constexpr float identity = 0.0f;
+	float operator()(const float acc,const float v) const { return acc+v; }
+	TARGET_AVX2 __m256 vector(const __m256 acc,const __m256 v) const { return _mm256_add_ps(acc,v); }
+};
+
+struct reduce_max
+{
+	// Values that do not compare greater (NaN) are skipped.
+	static constexpr float identity = -INFINITY;
+	float operator()(const float acc,const float v) const { return v>acc?v:acc; }
+	TARGET_AVX2 __m256 vector(const __m256 acc,const __m256 v) const { return _mm256_max_ps(v,acc); }
+};
+
+struct reduce_min
+{
+	static constexpr float identity = INFINITY;
+	float operator()(const float acc,const float v) const { return v<acc?v:acc; }
+	TARGET_AVX2 __m256 vector(const __m256 acc,const __m256 v) const { return _mm256_min_ps(v,acc); }
+};
+
+
+// Combines the 8 lanes of 'v'.
+//
+template<typename OP>
+TARGET_AVX2
+inline float reduce_horizontal_avx2(const OP& op,const __m256 v)
+{
+	alignas(32) float lanes[8];
+	_mm256_store_ps(lanes,v);
+	float acc = lanes[0];
+	for(int i=1;i<8;++i)
+		acc = op(acc,lanes[i]);
+	return acc;
+}
+
+
+// Reduces a contiguous row.
+//
+template<typename OP>
+static float reduce_row_generic(const OP& op,const int n,const float* const x)
+{
+	float acc = OP::identity;
+	for(int k=0;k<n;++k)
+		acc = op(acc,x[k]);
+	return acc;
+}
+
+template<typename OP>
+TARGET_AVX2
+static float reduce_row_avx2(const OP& op,const int n,const float* const x)
+{
+	// Independent accumulators hide the latency of the operation.
+	__m256 acc0 = _mm256_set1_ps(OP::identity);
+	__m256 acc1 = acc0;
+	__m256 acc2 = acc0;
+	__m256 acc3 = acc0;
+	int k = 0;
+	for(;k+32<=n;k+=32)
+	{
+		acc0 = op.vector(acc0,_mm256_loadu_ps(x+k));
+		acc1 = op.vector(acc1,_mm256_loadu_ps(x+k+8));
+		acc2 = op.vector(acc2,_mm256_loadu_ps(x+k+16));
+		acc3 = op.vector(acc3,_mm256_loadu_ps(x+k+24));
+	}
+	for(;k+8<=n;k+=8)
+		acc0 = op.vector(acc0,_mm256_loadu_ps(x+k));
+	float acc = reduce_horizontal_avx2(op,op.vector(op.vector(acc0,acc1),op.vector(acc2,acc3)));
+	for(;k<n;++k)
+		acc = op(acc,x[k]);
+	return acc;
+}
+
+
+// Reduces 'width' neighbouring outputs whose values are 'stride' apart.
+//
+template<typename OP>
+static void reduce_columns_generic(const OP& op,const int n,const int width,const float* const x,const int stride,float* const y)
+{
+	for(int i=0;i<width;++i)
+		y[i] = OP::identity;
+	for(int k=0;k<n;++k)
+	{
+		const float* const row = x+(ptrdiff_t)k*stride;
+		for(int i=0;i<width;++i)
+			y[i] = op(y[i],row[i]);
+	}
+}
+
+template<typename OP>
+TARGET_AVX2
+static void reduce_columns_avx2(const OP& op,const int n,const int width,const float* const x,const int stride,float* const y)
+{
+	if(width==reduce_block)
+	{
+		__m256 acc0 = _mm256_set1_ps(OP::identity);
+		__m256 acc1 = acc0;
+		__m256 acc2 = acc0;
+		__m256 acc3 = acc0;
+		for(int k=0;k<n;++k)
+		{
+			const float* const row = x+(ptrdiff_t)k*stride;
+			acc0 = op.vector(acc0,_mm256_loadu_ps(row));
+			acc1 = op.vector(acc1,_mm256_loadu_ps(row+8));
+			acc2 = op.vector(acc2,_mm256_loadu_ps(row+16));
+			acc3 = op.vector(acc3,_mm256_loadu_ps(row+24));
+		}
+		_mm256_storeu_ps(y,acc0);
+		_mm256_storeu_ps(y+8,acc1);
+		_mm256_storeu_ps(y+16,acc2);
+		_mm256_storeu_ps(y+24,acc3);
+		return;
+	}
+
+	// Partial block at the end of 'inner', whole vectors then scalars.
+	int i = 0;
+	for(;i+8<=width;i+=8)
+	{
+		__m256 acc = _mm256_set1_ps(OP::identity);
+		for(int k=0;k<n;++k)
+			acc = op.vector(acc,_mm256_loadu_ps(x+(ptrdiff_t)k*stride+i));
+		_mm256_storeu_ps(y+i,acc);
+	}
+	if(i<width)
+		reduce_columns_generic(op,n,width-i,x+i,stride,y+i);
+}
+
+
+// Runs 'task(o,i,width)' for every block of outputs of the layout in parallel, where 'width' outputs from (o,i) are reduced together.
+//
+template<typename TASK>
+static void reduce_for_each_block(const reduce_layout& layout,const TASK& task)
+{
+	const int width = layout.inner==1?1:reduce_block;
+	const int blocks = (layout.inner+width-1)/width;
+	const int grain = (std::max)(elementwise_grain/((std::max)(layout.n,1)*width),1);
+	NDThreadPool::ParallelFor(0,layout.outer*blocks,grain,[&layout,&task,width,blocks](const int b)
+	{
+		const int o = b/blocks;
+		const int i = b%blocks*width;
+		task(o,i,(std::min)(width,layout.inner-i));
+	});
+}
+
+
+// y(o,i) = reduction of x over the layout.
+//
+template<typename OP>
+static void reduce(const OP& op,const reduce_layout& layout,const float* const x,float* const y)
+{
+	const bool avx2 = cpu_has_avx2();
+	reduce_for_each_block(layout,[&op,&layout,x,y,avx2](const int o,const int i,const int width)
+	{
+		const float* const src = x+(ptrdiff_t)o*layout.n*layout.inner+i;
+		float* const dst = y+(ptrdiff_t)o*layout.inner+i;
+		if(layout.inner==1)
+			*dst = avx2?reduce_row_avx2(op,layout.n,src):reduce_row_generic(op,layout.n,src);
+		else if(avx2)
+			reduce_columns_avx2(op,layout.n,width,src,layout.inner,dst);
+		else
+			reduce_columns_generic(op,layout.n,width,src,layout.inner,dst);
+	});
+}
+
+
+// Max and the index of the first max along a strided row.
+//
+static void reduce_max_argmax_generic(const int n,const float* const x,const int stride,float& max,float& argmax)
+{
+	float m = x[0];
+	int index = 0;
+	for(int k=1;k<n;++k)
+	{
+		const float v = x[(ptrdiff_t)k*stride];
+		if(v>m)
+		{
+			m = v;
+			index = k;
+		}
+	}
+	max = m;
+	argmax = float(index);
+}
+
+
+// Max and the index of the first max along a contiguous row, each lane tracking its own max and index.
+//
+TARGET_AVX2
+static void reduce_max_argmax_avx2(const int n,const float* const x,float& max,float& argmax)
+{
+	if(n<16)
+	{
+		reduce_max_argmax_generic(n,x,1,max,argmax);
+		return;
+	}
+
+	__m256 vmax = _mm256_loadu_ps(x);
+	__m256i vindex = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+	__m256i index = vindex;
+	const __m256i eight = _mm256_set1_epi32(8);
+	int k = 8;
+	for(;k+8<=n;k+=8)
+	{
+		index = _mm256_add_epi32(index,eight);
+		const __m256 v = _mm256_loadu_ps(x+k);
+		const __m256 greater = _mm256_cmp_ps(v,vmax,_CMP_GT_OQ);
+		vmax = _mm256_blendv_ps(vmax,v,greater);
+		vindex = _mm256_blendv_epi8(vindex,index,_mm256_castps_si256(greater));
+	}
+
+	// Lanes hold the first max of their own values, take the greatest and on a tie the lowest index.
+	alignas(32) float lanes[8];
+	alignas(32) int indices[8];
+	_mm256_store_ps(lanes,vmax);
+	_mm256_store_si256((__m256i*)indices,vindex);
+	float m = lanes[0];
+	int best = indices[0];
+	for(int i=1;i<8;++i)
+	{
+		if(lanes[i]>m||lanes[i]==m&&indices[i]<best)
+		{
+			m = lanes[i];
+			best = indices[i];
+		}
+	}
+	for(;k<n;++k)
+	{
+		if(x[k]>m)
+		{
+			m = x[k];
+			best = k;
+		}
+	}
+	max = m;
+	argmax = float(best);
+}
+
+
+// Max and the index of the first max for 8 neighbouring outputs whose values are 'stride' apart.
+//
+TARGET_AVX2
+static void reduce_max_argmax_columns_avx2(const int n,const float* const x,const int stride,float* const max,float* const argmax)
+{
+	__m256 vmax = _mm256_loadu_ps(x);
+	__m256 vindex = _mm256_setzero_ps();
+	for(int k=1;k<n;++k)
+	{
+		const __m256 v = _mm256_loadu_ps(x+(ptrdiff_t)k*stride);
+		const __m256 greater = _mm256_cmp_ps(v,vmax,_CMP_GT_OQ);
+		vmax = _mm256_blendv_ps(vmax,v,greater);
+		vindex = _mm256_blendv_ps(vindex,_mm256_set1_ps(float(k)),greater);
+	}
+	_mm256_storeu_ps(max,vmax);
+	_mm256_storeu_ps(argmax,vindex);
+}
+
+
+// Max and argmax over the layout, either output may be null.
+//
+static void reduce_max_argmax(const reduce_layout& layout,const float* const x,float* const max,float* const argmax)
+{
+	const bool avx2 = cpu_has_avx2();
+	reduce_for_each_block(layout,[&layout,x,max,argmax,avx2](const int o,const int i,const int width)
+	{
+		const float* const src = x+(ptrdiff_t)o*layout.n*layout.inner+i;
+		const ptrdiff_t dst = (ptrdiff_t)o*layout.inner+i;
+		for(int j=0;j<width;)
+		{
+			// 8 outputs at a time when they are neighbours, otherwise 1.
+			const int lanes = layout.inner>1&&avx2&&j+8<=width?8:1;
+			float m[8],index[8];
+			if(lanes==8)
+				reduce_max_argmax_columns_avx2(layout.n,src+j,layout.inner,m,index);
+			else if(layout.inner==1&&avx2)
+				reduce_max_argmax_avx2(layout.n,src+j,m[0],index[0]);
+			else
+				reduce_max_argmax_generic(layout.n,src+j,layout.inner,m[0],index[0]);
+			for(int l=0;l<lanes;++l)
+			{
+				if(max)
+					max[dst+j+l] = m[l];
+				if(argmax)
+					argmax[dst+j+l] = index[l];
+			}
+			j += lanes;
+		}
+	});
+}
+
+
+// Sums of x-shift and (x-shift)^2 along a contiguous row.
+//
+TARGET_AVX2
+static void reduce_moments_row_avx2(const int n,const float* const x,const float shift,float& sum,float& squares)
+{
+	const __m256 vshift = _mm256_set1_ps(shift);
+	__m256 vsum = _mm256_setzero_ps();
+	__m256 vsquares = _mm256_setzero_ps();
+	int k = 0;
+	for(;k+8<=n;k+=8)
+	{
+		const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x+k),vshift);
+		vsum = _mm256_add_ps(vsum,d);
+		vsquares = _mm256_fmadd_ps(d,d,vsquares);
+	}
+	sum = reduce_horizontal_avx2(reduce_sum(),vsum);
+	squares = reduce_horizontal_avx2(reduce_sum(),vsquares);
+	for(;k<n;++k)
+	{
+		const float d = x[k]-shift;
+		sum += d;
+		squares += d*d;
+	}
+}
+
+
+// Sums of x-shift and (x-shift)^2 for 8 neighbouring outputs whose values are 'stride' apart.
+//
+TARGET_AVX2
+static void reduce_moments_columns_avx2(const int n,const float* const x,const int stride,const float* const shift,float* const sum,float* const squares)
+{
+	const __m256 vshift = _mm256_loadu_ps(shift);
+	__m256 vsum = _mm256_setzero_ps();
+	__m256 vsquares = _mm256_setzero_ps();
+	for(int k=0;k<n;++k)
+	{
+		const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x+(ptrdiff_t)k*stride),vshift);
+		vsum = _mm256_add_ps(vsum,d);
+		vsquares = _mm256_fmadd_ps(d,d,vsquares);
+	}
+	_mm256_storeu_ps(sum,vsum);
+	_mm256_storeu_ps(squares,vsquares);
+}
+
+
+// Mean and variance over the layout in one pass.
+//
+// Sums of x-s and (x-s)^2 are accumulated where the shift 's' is the first value of each output, which is close enough to the mean that
+// the subtraction in var = (sum((x-s)^2)-sum(x-s)^2/n)/(n-correction) does not cancel catastrophically.
+//
+static void reduce_moments(const reduce_layout& layout,const float* const x,float* const mean,float* const var,const int correction)
+{
+	const bool avx2 = cpu_has_avx2();
+	reduce_for_each_block(layout,[&layout,x,mean,var,correction,avx2](const int o,const int i,const int width)
+	{
+		const float* const src = x+(ptrdiff_t)o*layout.n*layout.inner+i;
+		const ptrdiff_t dst = (ptrdiff_t)o*layout.inner+i;
+		const int n = layout.n;
+		const int stride = layout.inner;
+		for(int j=0;j<width;)
+		{
+			// 8 outputs at a time when they are neighbours, otherwise 1.
+			const int lanes = stride>1&&avx2&&j+8<=width?8:1;
+			float sum[8] = {};
+			float squares[8] = {};
+			float shift[8];
+			for(int l=0;l<lanes;++l)
+				shift[l] = src[j+l];
+			if(lanes==8)
+				reduce_moments_columns_avx2(n,src+j,stride,shift,sum,squares);
+			else if(stride==1&&avx2)
+				reduce_moments_row_avx2(n,src+j,shift[0],sum[0],squares[0]);
+			else
+			{
+				for(int k=0;k<n;++k)
+				{
+					const float d = src[(ptrdiff_t)k*stride+j]-shift[0];
+					sum[0] += d;
+					squares[0] += d*d;
+				}
+			}
+			for(int l=0;l<lanes;++l)
+			{
+				const float m = sum[l]/n;
+				if(mean)
+					mean[dst+j+l] = shift[l]+m;
+				if(var)
+					var[dst+j+l] = (squares[l]-sum[l]*m)/(n-correction);
+			}
+			j += lanes;
+		}
+	});
+}
+
+
+// Full reductions.
+// ================
+//
+// Sum of op(x) over a whole contiguous array, for Sum, Mean, Norm and Var. The array is cut into fixed blocks of 'reduce_sum_block'
+// values whose partial sums are found in parallel and then combined in block order, so the result depends only on the data and not on
+// the number of threads.
+//
+//	Pairwise	8 lane float accumulators within a block, partial sums combined as a binary tree. Error grows with log(n) rather than n.
+//	Kahan		compensated float accumulators within a block, partial sums combined with compensation. Error independent of n.
+//	Double		double accumulators, partial sums combined in double.
+//
+// 'op' is a unary elementwise operation (see ElementwiseKernels.h) applied to each value before it is summed.
+//
+
+
+// Compensated sums must not be reassociated by /fp:fast.
+#ifdef _MSC_VER
+#pragma float_control(precise,on,push)
+#endif
+
+
+// Accumulation used by full reductions.
+//
+enum class SumPrecision
+{
+	Pairwise,
+	Kahan,
+	Double
+};
+
+
+// Values per block of a full reduction.
+constexpr int reduce_sum_block = 4096;
+
+
+// op(x) - mean squared, for variance.
+//
+struct reduce_squared_deviation
+{
+	static constexpr bool avx2 = true;
+	static constexpr bool avx512 = false;
+	float mean;
+	float operator()(const float a) const { const float d = a-mean; return d*d; }
+	TARGET_AVX2 __m256 vector(const __m256 a) const { const __m256 d = _mm256_sub_ps(a,_mm256_set1_ps(mean)); return _mm256_mul_ps(d,d); }
+};
+
+
+// Kahan step, adds 'v' to 'sum' carrying the lost low order bits in 'compensation'.
+//
+template<typename T>
+inline void reduce_kahan_add(T& sum,T& compensation,const T v)
+{
+	const T y = v-compensation;
+	const T t = sum+y;
+	compensation = (t-sum)-y;
+	sum = t;
+}
+
+
+// Sum of op(x) over a block.
+//
+template<typename OP>
+static double reduce_block_generic(const OP& op,const int n,const float* const x,const SumPrecision precision)
+{
+	if(precision==SumPrecision::Double)
+	{
+		double sum = 0.0;
+		for(int i=0;i<n;++i)
+			sum += op(x[i]);
+		return sum;
+	}
+	if(precision==SumPrecision::Kahan)
+	{
+		float sum = 0.0f;
+		float compensation = 0.0f;
+		for(int i=0;i<n;++i)
+			reduce_kahan_add(sum,compensation,op(x[i]));
+		return sum;
+	}
+	float lanes[8] = {};
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		for(int l=0;l<8;++l)
+			lanes[l] += op(x[i+l]);
+	for(;i<n;++i)
+		lanes[i%8] += op(x[i]);
+	return ((lanes[0]+lanes[1])+(lanes[2]+lanes[3]))+((lanes[4]+lanes[5])+(lanes[6]+lanes[7]));
+}
+
+template<typename OP>
+TARGET_AVX2
+static double reduce_block_avx2(const OP& op,const int n,const float* const x,const SumPrecision precision)
+{
+	const int vector_n = n&~7;
+	alignas(32) float lanes[8];
+	if(precision==SumPrecision::Double)
+	{
+		__m256d lo = _mm256_setzero_pd();
+		__m256d hi = _mm256_setzero_pd();
+		for(int i=0;i<vector_n;i+=8)
+		{
+			const __m256 v = op.vector(_mm256_loadu_ps(x+i));
+			lo = _mm256_add_pd(lo,_mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+			hi = _mm256_add_pd(hi,_mm256_cvtps_pd(_mm256_extractf128_ps(v,1)));
+		}
+		alignas(32) double sums[4];
+		_mm256_store_pd(sums,_mm256_add_pd(lo,hi));
+		double sum = (sums[0]+sums[1])+(sums[2]+sums[3]);
+		for(int i=vector_n;i<n;++i)
+			sum += op(x[i]);
+		return sum;
+	}
+	if(precision==SumPrecision::Kahan)
+	{
+		__m256 sum = _mm256_setzero_ps();
+		__m256 compensation = _mm256_setzero_ps();
+		for(int i=0;i<vector_n;i+=8)
+		{
+			const __m256 y = _mm256_sub_ps(op.vector(_mm256_loadu_ps(x+i)),compensation);
+			const __m256 t = _mm256_add_ps(sum,y);
+			compensation = _mm256_sub_ps(_mm256_sub_ps(t,sum),y);
+			sum = t;
+		}
+		alignas(32) float compensations[8];
+		_mm256_store_ps(lanes,sum);
+		_mm256_store_ps(compensations,compensation);
+		float s = 0.0f;
+		float c = 0.0f;
+		for(int l=0;l<8;++l)
+		{
+			reduce_kahan_add(s,c,lanes[l]);
+			reduce_kahan_add(s,c,-compensations[l]);
+		}
+		for(int i=vector_n;i<n;++i)
+			reduce_kahan_add(s,c,op(x[i]));
+		return s;
+	}
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	int i = 0;
+	for(;i+16<=vector_n;i+=16)
+	{
+		acc0 = _mm256_add_ps(acc0,op.vector(_mm256_loadu_ps(x+i)));
+		acc1 = _mm256_add_ps(acc1,op.vector(_mm256_loadu_ps(x+i+8)));
+	}
+	if(i<vector_n)
+		acc0 = _mm256_add_ps(acc0,op.vector(_mm256_loadu_ps(x+i)));
+	_mm256_store_ps(lanes,_mm256_add_ps(acc0,acc1));
+	float sum = ((lanes[0]+lanes[1])+(lanes[2]+lanes[3]))+((lanes[4]+lanes[5])+(lanes[6]+lanes[7]));
+	for(i=vector_n;i<n;++i)
+		sum += op(x[i]);
+	return sum;
+}
+
+
+// Pairwise sum of 'n' partial sums.
+//
+static float reduce_pairwise(const double* const partials,const int n)
+{
+	if(n==1)
+		return float(partials[0]);
+	const int half = n/2;
+	return reduce_pairwise(partials,half)+reduce_pairwise(partials+half,n-half);
+}
+
+
+// Sum of op(x) over 'n' contiguous values.
+//
+template<typename OP>
+static double reduce_full(const OP& op,const ptrdiff_t n,const float* const x,const SumPrecision precision)
+{
+	if(n==0)
+		return 0.0;
+
+	const int blocks = (int)((n+reduce_sum_block-1)/reduce_sum_block);
+	std::vector<double> partials(blocks);
+	const bool avx2 = OP::avx2&&cpu_has_avx2();
+	NDThreadPool::ParallelFor(0,blocks,(std::max)(elementwise_grain/reduce_sum_block,1),[&op,n,x,precision,avx2,&partials](const int b)
+	{
+		const ptrdiff_t first = (ptrdiff_t)b*reduce_sum_block;
+		const int length = (int)(std::min)((ptrdiff_t)reduce_sum_block,n-first);
+		if constexpr(OP::avx2)
+		{
+			if(avx2)
+			{
+				partials[b] = reduce_block_avx2(op,length,x+first,precision);
+				return;
+			}
+		}
+		partials[b] = reduce_block_generic(op,length,x+first,precision);
+	});
+
+	// Combine in block order.
+	if(precision==SumPrecision::Double)
+	{
+		double sum = 0.0;
+		for(const double partial:partials)
+			sum += partial;
+		return sum;
+	}
+	if(precision==SumPrecision::Kahan)
+	{
+		float sum = 0.0f;
+		float compensation = 0.0f;
+		for(const double partial:partials)
+			reduce_kahan_add(sum,compensation,float(partial));
+		return sum;
+	}
+	return reduce_pairwise(partials.data(),blocks);
+}
+
+
+#ifdef _MSC_VER
+#pragma float_control(pop)
+#endif
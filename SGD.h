@@ -16,14 +16,33 @@ public:
 	{
 	}
 
+	SGD(const ParameterArenaPtr& arena,FP alpha) :
+		Optimiser(arena),
+		_alpha(alpha)
+	{
+	}
+
 	void Step(bool zero=true)
 	{
+		std::vector<NDArrays> dense;
 		for(auto p:_parameters)
 		{
-			// Reduce data by fraction of gradient to steer loss toward 0.
-			p->Data() -= p->Gradient()->Data()*_alpha;
-			if(zero)
-				p->Gradient()->Data() *= 0.0;
+			p->MergeSparseGradient();		// Both sparse and dense gradients are stepped as dense.
+			const SparseRowsPtr& sparse = p->SparseGradient();
+			if(sparse&&!p->Gradient())
+			{
+				// Only the rows with a gradient change.
+				if(!sparse->Empty())
+					p->Data()._AddRows(sparse->Rows(),sparse->Values()*(-_alpha));
+				if(zero)
+					sparse->Clear();
+			}
+			else if(p->Gradient()&&!InArena(p))
+				dense.push_back({p->Data(),p->Gradient()->Data()});
 		}
+		AddArena(dense);
+
+		// Reduce data by fraction of gradient to steer loss toward 0.
+		NDData::_OptimiserStep(optimiser_sgd{_alpha},dense,zero);
 	}
 };
\ No newline at end of file
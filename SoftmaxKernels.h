@@ -0,0 +1,499 @@
+#pragma once
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include "CpuFeatures.h"
+#include "VectorMath.h"
+#include "NDThreadPool.h"
+#include "ElementwiseKernels.h"
+
+
+// Fused softmax kernels.
+// ======================
+//
+// Softmax and log-softmax along one dimension of a row major array, viewed as 'outer' blocks of 'n' rows of 'inner' elements: the values
+// being normalised are 'inner' elements apart and row (o,i) starts at o*n*inner+i. When the dimension is the last one 'inner' is 1 and
+// each row is contiguous, which is the only layout that is vectorised.
+//
+// Forward finds max(x) and sum(e^(x-max)) for each row, then writes the result:
+//
+//	softmax(x)		= e^(x-max)/sum
+//	log_softmax(x)	= x-(max+log(sum))
+//
+// Log softmax finds the max and sum in a single pass block by block (online softmax), a block's max is found first and the running sum
+// is rescaled only when it increases, so each element is exponentiated once while the block is still in L1. Softmax needs e^(x-max) as
+// its output, so it stores the exponentials while summing them and scales the row by 1/sum afterwards, also one exponential per element.
+//
+// Backward uses the closed forms, where y is the forward output and g the gradient of the output:
+//
+//	softmax			dx = y*(g-sum(g*y))
+//	log_softmax		dx = g-e^y*sum(g)
+//
+// Rows are split across the thread pool. 'fast' selects the vectorised exp from VectorMath.h, otherwise the C library is used.
+//
+
+
+// Elements per online softmax block.
+constexpr int softmax_block = 512;
+
+
+// Row layout of the softmax dimension.
+//
+struct softmax_layout
+{
+	int	outer;		// Product of the dimensions before the softmax dimension.
+	int	n;			// Length of the softmax dimension.
+	int	inner;		// Product of the dimensions after the softmax dimension (stride between values of a row).
+
+	int Rows() const
+	{
+		return outer*inner;
+	}
+
+	ptrdiff_t Offset(const int row) const
+	{
+		return (ptrdiff_t)(row/inner)*n*inner+row%inner;
+	}
+};
+
+
+// Returns the max and sum(e^(x-max)) of a strided row.
+//
+static void softmax_row_stats_generic(const int n,const float* const x,const int stride,float& max,float& sum)
+{
+	float m = -INFINITY;
+	float s = 0.0f;
+	for(int first=0;first<n;first+=softmax_block)
+	{
+		const int last = (std::min)(first+softmax_block,n);
+		float block_max = -INFINITY;
+		for(int i=first;i<last;++i)
+			block_max = (std::max)(block_max,x[(ptrdiff_t)i*stride]);
+		if(block_max==-INFINITY)
+			continue;	// Every value is masked.
+		if(block_max>m)
+		{
+			s *= std::exp(m-block_max);
+			m = block_max;
+		}
+		for(int i=first;i<last;++i)
+			s += std::exp(x[(ptrdiff_t)i*stride]-m);
+	}
+	max = m;
+	sum = s;
+}
+
+
+// Horizontal max and sum of 8 lanes.
+//
+TARGET_AVX2
+inline float softmax_hmax_avx2(const __m256 v)
+{
+	__m128 r = _mm_max_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+	r = _mm_max_ps(r,_mm_movehl_ps(r,r));
+	r = _mm_max_ss(r,_mm_movehdup_ps(r));
+	return _mm_cvtss_f32(r);
+}
+
+TARGET_AVX2
+inline float softmax_hsum_avx2(const __m256 v)
+{
+	__m128 r = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+	r = _mm_add_ps(r,_mm_movehl_ps(r,r));
+	r = _mm_add_ss(r,_mm_movehdup_ps(r));
+	return _mm_cvtss_f32(r);
+}
+
+
+// Returns the max and sum(e^(x-max)) of a contiguous row using the vectorised exp.
+//
+TARGET_AVX2
+static void softmax_row_stats_avx2(const int n,const float* const x,float& max,float& sum)
+{
+	float m = -INFINITY;
+	__m256 vs = _mm256_setzero_ps();
+	float tail = 0.0f;
+	for(int first=0;first<n;first+=softmax_block)
+	{
+		const int last = (std::min)(first+softmax_block,n);
+		const int vector_last = first+((last-first)&~7);
+
+		__m256 vmax = _mm256_set1_ps(-INFINITY);
+		for(int i=first;i<vector_last;i+=8)
+			vmax = _mm256_max_ps(vmax,_mm256_loadu_ps(x+i));
+		float block_max = softmax_hmax_avx2(vmax);
+		for(int i=vector_last;i<last;++i)
+			block_max = (std::max)(block_max,x[i]);
+		if(block_max==-INFINITY)
+			continue;
+		if(block_max>m)
+		{
+			const float scale = std::exp(m-block_max);
+			vs = _mm256_mul_ps(vs,_mm256_set1_ps(scale));
+			tail *= scale;
+			m = block_max;
+		}
+
+		const __m256 vm = _mm256_set1_ps(m);
+		for(int i=first;i<vector_last;i+=8)
+			vs = _mm256_add_ps(vs,exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x+i),vm)));
+		for(int i=vector_last;i<last;++i)
+			tail += std::exp(x[i]-m);
+	}
+	max = m;
+	sum = softmax_hsum_avx2(vs)+tail;
+}
+
+
+// Returns the max of a contiguous row.
+//
+TARGET_AVX2
+static float softmax_row_max_avx2(const int n,const float* const x)
+{
+	__m256 vmax = _mm256_set1_ps(-INFINITY);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		vmax = _mm256_max_ps(vmax,_mm256_loadu_ps(x+i));
+	float max = softmax_hmax_avx2(vmax);
+	for(;i<n;++i)
+		max = (std::max)(max,x[i]);
+	return max;
+}
+
+
+// y = e^(x-max) for a contiguous row, returns sum(y).
+//
+TARGET_AVX2
+static float softmax_row_exp_avx2(const int n,const float* const x,float* const y,const float max)
+{
+	const __m256 vm = _mm256_set1_ps(max);
+	__m256 vs = _mm256_setzero_ps();
+	int i = 0;
+	for(;i+8<=n;i+=8)
+	{
+		const __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x+i),vm));
+		_mm256_storeu_ps(y+i,e);
+		vs = _mm256_add_ps(vs,e);
+	}
+	float sum = softmax_hsum_avx2(vs);
+	for(;i<n;++i)
+		sum += y[i] = std::exp(x[i]-max);
+	return sum;
+}
+
+
+// y *= scale for a contiguous row.
+//
+TARGET_AVX2
+static void softmax_row_scale_avx2(const int n,float* const y,const float scale)
+{
+	const __m256 vscale = _mm256_set1_ps(scale);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(y+i,_mm256_mul_ps(_mm256_loadu_ps(y+i),vscale));
+	for(;i<n;++i)
+		y[i] *= scale;
+}
+
+
+// y = x-shift for a contiguous row.
+//
+TARGET_AVX2
+static void softmax_row_shift_avx2(const int n,const float* const x,float* const y,const float shift)
+{
+	const __m256 vshift = _mm256_set1_ps(shift);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(y+i,_mm256_sub_ps(_mm256_loadu_ps(x+i),vshift));
+	for(;i<n;++i)
+		y[i] = x[i]-shift;
+}
+
+
+// Returns sum(a*b) for contiguous rows.
+//
+TARGET_AVX2
+static float softmax_row_dot_avx2(const int n,const float* const a,const float* const b)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i),acc);
+	float r = softmax_hsum_avx2(acc);
+	for(;i<n;++i)
+		r += a[i]*b[i];
+	return r;
+}
+
+
+// dx = y*(g-dot) for contiguous rows.
+//
+TARGET_AVX2
+static void softmax_row_backward_avx2(const int n,const float* const y,const float* const g,float* const dx,const float dot)
+{
+	const __m256 vdot = _mm256_set1_ps(dot);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(dx+i,_mm256_mul_ps(_mm256_loadu_ps(y+i),_mm256_sub_ps(_mm256_loadu_ps(g+i),vdot)));
+	for(;i<n;++i)
+		dx[i] = y[i]*(g[i]-dot);
+}
+
+
+// dx = g-e^y*sum for contiguous rows.
+//
+TARGET_AVX2
+static void log_softmax_row_backward_avx2(const int n,const float* const y,const float* const g,float* const dx,const float sum)
+{
+	const __m256 vsum = _mm256_set1_ps(sum);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(dx+i,_mm256_fnmadd_ps(exp_avx2(_mm256_loadu_ps(y+i)),vsum,_mm256_loadu_ps(g+i)));
+	for(;i<n;++i)
+		dx[i] = g[i]-std::exp(y[i])*sum;
+}
+
+
+// Runs 'row(offset)' for every row of the layout in parallel.
+//
+template<typename ROW>
+static void softmax_for_each_row(const softmax_layout& layout,const ROW& row)
+{
+	const int grain = (std::max)(elementwise_grain/(std::max)(layout.n,1),1);
+	NDThreadPool::ParallelFor(0,layout.Rows(),grain,[&layout,&row](const int r)
+	{
+		row(layout.Offset(r));
+	});
+}
+
+
+// y = softmax(x) or log_softmax(x).
+//
+static void softmax_forward(const softmax_layout& layout,const float* const x,float* const y,const bool log,const bool fast)
+{
+	const bool avx2 = layout.inner==1&&cpu_has_avx2();
+	softmax_for_each_row(layout,[&layout,x,y,log,fast,avx2](const ptrdiff_t offset)
+	{
+		const int n = layout.n;
+		const int stride = layout.inner;
+		const float* const xr = x+offset;
+		float* const yr = y+offset;
+
+		if(log)
+		{
+			// Online max and sum, the output needs no exponential.
+			float max,sum;
+			if(avx2&&fast)
+				softmax_row_stats_avx2(n,xr,max,sum);
+			else
+				softmax_row_stats_generic(n,xr,stride,max,sum);
+			const float shift = sum>0.0f?max+std::log(sum):INFINITY;	// Every value masked gives -inf.
+			if(avx2)
+				softmax_row_shift_avx2(n,xr,yr,shift);
+			else
+			{
+				for(int i=0;i<n;++i)
+					yr[(ptrdiff_t)i*stride] = xr[(ptrdiff_t)i*stride]-shift;
+			}
+		}
+		else
+		{
+			// The output is e^(x-max) so the exponentials are written on the summing pass and scaled, rather than found twice.
+			float max;
+			float sum = 0.0f;
+			if(avx2)
+			{
+				max = softmax_row_max_avx2(n,xr);
+				if(max==-INFINITY)
+					max = 0.0f;		// Every value is masked, softmax is 0.
+				if(fast)
+					sum = softmax_row_exp_avx2(n,xr,yr,max);
+				else
+				{
+					for(int i=0;i<n;++i)
+						sum += yr[i] = std::exp(xr[i]-max);
+				}
+				softmax_row_scale_avx2(n,yr,sum>0.0f?1.0f/sum:0.0f);
+			}
+			else
+			{
+				max = -INFINITY;
+				for(int i=0;i<n;++i)
+					max = (std::max)(max,xr[(ptrdiff_t)i*stride]);
+				if(max==-INFINITY)
+					max = 0.0f;
+				for(int i=0;i<n;++i)
+					sum += yr[(ptrdiff_t)i*stride] = std::exp(xr[(ptrdiff_t)i*stride]-max);
+				const float scale = sum>0.0f?1.0f/sum:0.0f;
+				for(int i=0;i<n;++i)
+					yr[(ptrdiff_t)i*stride] *= scale;
+			}
+		}
+	});
+}
+
+
+// dx from the output 'y' of softmax/log_softmax and the output gradient 'g'.
+//
+static void softmax_backward(const softmax_layout& layout,const float* const y,const float* const g,float* const dx,const bool log,const bool fast)
+{
+	const bool avx2 = layout.inner==1&&cpu_has_avx2();
+	softmax_for_each_row(layout,[&layout,y,g,dx,log,fast,avx2](const ptrdiff_t offset)
+	{
+		const int n = layout.n;
+		const int stride = layout.inner;
+		const float* const yr = y+offset;
+		const float* const gr = g+offset;
+		float* const dxr = dx+offset;
+
+		if(log)
+		{
+			float sum = 0.0f;
+			for(int i=0;i<n;++i)
+				sum += gr[(ptrdiff_t)i*stride];
+			if(avx2&&fast)
+				log_softmax_row_backward_avx2(n,yr,gr,dxr,sum);
+			else
+			{
+				for(int i=0;i<n;++i)
+					dxr[(ptrdiff_t)i*stride] = gr[(ptrdiff_t)i*stride]-std::exp(yr[(ptrdiff_t)i*stride])*sum;
+			}
+		}
+		else
+		{
+			if(avx2)
+				softmax_row_backward_avx2(n,yr,gr,dxr,softmax_row_dot_avx2(n,gr,yr));
+			else
+			{
+				float dot = 0.0f;
+				for(int i=0;i<n;++i)
+					dot += gr[(ptrdiff_t)i*stride]*yr[(ptrdiff_t)i*stride];
+				for(int i=0;i<n;++i)
+					dxr[(ptrdiff_t)i*stride] = yr[(ptrdiff_t)i*stride]*(gr[(ptrdiff_t)i*stride]-dot);
+			}
+		}
+	});
+}
+
+
+// Fused cross entropy.
+// ====================
+//
+// Cross entropy of contiguous rows of logits 'x' against class indices, without building one hot targets. With 'e' label smoothing
+// the target distribution is (1-e) on the target class plus e/n on every class, so for a row with target 't':
+//
+//	lse		= max+log(sum(e^(x-max)))
+//	loss	= lse-(1-e)*x[t]-(e/n)*sum(x)
+//	dx		= e^(x-lse)-(1-e)*onehot(t)-e/n
+//
+// Only the per-row lse is kept for backward, which writes the softmax and subtracts the target directly into the gradient. Rows whose
+// target is 'ignore_index' have no loss or gradient and are not counted in the mean.
+//
+
+
+// Returns sum(x) for a contiguous row.
+//
+TARGET_AVX2
+static float softmax_row_sum_avx2(const int n,const float* const x)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		acc = _mm256_add_ps(acc,_mm256_loadu_ps(x+i));
+	float r = softmax_hsum_avx2(acc);
+	for(;i<n;++i)
+		r += x[i];
+	return r;
+}
+
+
+// y = e^(x-shift)*scale-bias for a contiguous row.
+//
+TARGET_AVX2
+static void softmax_row_exp_affine_avx2(const int n,const float* const x,float* const y,const float shift,const float scale,const float bias)
+{
+	const __m256 vshift = _mm256_set1_ps(shift);
+	const __m256 vscale = _mm256_set1_ps(scale);
+	const __m256 vbias = _mm256_set1_ps(bias);
+	int i = 0;
+	for(;i+8<=n;i+=8)
+		_mm256_storeu_ps(y+i,_mm256_fmsub_ps(exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x+i),vshift)),vscale,vbias));
+	for(;i<n;++i)
+		y[i] = std::exp(x[i]-shift)*scale-bias;
+}
+
+
+// Per row loss and lse of 'rows' rows of 'n' logits, ignored rows have a loss of 0.
+//
+static void cross_entropy_forward(const int rows,const int n,const float* const x,const int* const targets,const int ignore_index,const float smoothing,
+	float* const lse,float* const loss,const bool fast)
+{
+	const softmax_layout layout = {rows,n,1};
+	const bool avx2 = cpu_has_avx2();
+	softmax_for_each_row(layout,[n,x,targets,ignore_index,smoothing,lse,loss,fast,avx2](const ptrdiff_t offset)
+	{
+		const int row = (int)(offset/n);
+		const int target = targets[row];
+		if(target==ignore_index)
+		{
+			lse[row] = 0.0f;
+			loss[row] = 0.0f;
+			return;
+		}
+
+		const float* const xr = x+offset;
+		float max,sum;
+		if(avx2&&fast)
+			softmax_row_stats_avx2(n,xr,max,sum);
+		else
+			softmax_row_stats_generic(n,xr,1,max,sum);
+		lse[row] = max+std::log(sum);
+
+		loss[row] = lse[row]-(1.0f-smoothing)*xr[target];
+		if(smoothing!=0.0f)
+		{
+			float total = 0.0f;
+			if(avx2)
+				total = softmax_row_sum_avx2(n,xr);
+			else
+			{
+				for(int i=0;i<n;++i)
+					total += xr[i];
+			}
+			loss[row] -= smoothing/n*total;
+		}
+	});
+}
+
+
+// dx = scale*(softmax(x)-target distribution) for each row.
+//
+static void cross_entropy_backward(const int rows,const int n,const float* const x,const int* const targets,const int ignore_index,const float smoothing,
+	const float* const lse,const float scale,float* const dx,const bool fast)
+{
+	const softmax_layout layout = {rows,n,1};
+	const bool avx2 = cpu_has_avx2();
+	softmax_for_each_row(layout,[n,x,targets,ignore_index,smoothing,lse,scale,dx,fast,avx2](const ptrdiff_t offset)
+	{
+		const int row = (int)(offset/n);
+		const int target = targets[row];
+		float* const dxr = dx+offset;
+		if(target==ignore_index)
+		{
+			std::fill(dxr,dxr+n,0.0f);
+			return;
+		}
+
+		const float* const xr = x+offset;
+		const float bias = scale*smoothing/n;
+		if(avx2&&fast)
+			softmax_row_exp_affine_avx2(n,xr,dxr,lse[row],scale,bias);
+		else
+		{
+			for(int i=0;i<n;++i)
+				dxr[i] = std::exp(xr[i]-lse[row])*scale-bias;
+		}
+		dxr[target] -= scale*(1.0f-smoothing);
+	});
+}
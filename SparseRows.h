@@ -0,0 +1,115 @@
+#pragma once
+
+#include "NDArray.h"
+
+
+typedef std::shared_ptr<class SparseRows> SparseRowsPtr;
+
+// Gradient of an array where only some rows (slices of the most significant dimension) are non-zero, as produced by backprop through
+// IndexSelect into an embedding table. Holds the sorted, distinct row numbers and one slice of values for each, so the cost of a step
+// scales with the rows selected by a batch rather than the size of the table.
+//
+class SparseRows
+{
+	const NDShape		_shape;		// Shape of the dense array.
+	std::vector<int>	_rows;		// Sorted distinct row numbers.
+	NDArray				_values;	// Values for each row, shape (rows,...) - unset when there are no rows.
+
+public:
+	SparseRows(const NDShape& shape,const std::vector<int>& rows,const NDArray& values) :
+		_shape(shape),
+		_rows(rows),
+		_values(values)
+	{
+	}
+
+	// Gradient WRT 'table' from the gradient of IndexSelect(indices), duplicate indices are summed.
+	//
+	static SparseRowsPtr New(const NDArray& table,const NDArray& indices,const NDArray& gradient)
+	{
+		std::vector<int> rows;
+		const NDArray values = table.CoalesceRows(indices,gradient,rows);
+		return std::make_shared<SparseRows>(table.Shape(),rows,values);
+	}
+
+	const NDShape& Shape() const
+	{
+		return _shape;
+	}
+
+	const std::vector<int>& Rows() const
+	{
+		return _rows;
+	}
+
+	NDArray& Values()
+	{
+		return _values;
+	}
+
+	const NDArray& Values() const
+	{
+		return _values;
+	}
+
+	bool Empty() const
+	{
+		return _rows.empty();
+	}
+
+	// Inplace addition, rows in both are summed.
+	//
+	void Add(const SparseRows& other)
+	{
+		if(other._shape!=_shape)
+			throw IncompatibleShape(other._shape,_shape);
+		if(other.Empty())
+			return;
+		if(Empty())
+		{
+			_rows = other._rows;
+			_values._Attach(other._values);
+			return;
+		}
+
+		// Merge the row lists, then add each set of values at its position in the merged list.
+		std::vector<int> rows;
+		std::set_union(_rows.begin(),_rows.end(),other._rows.begin(),other._rows.end(),std::back_inserter(rows));
+		auto positions = [&rows](const std::vector<int>& subset)
+		{
+			std::vector<int> r(subset.size());
+			for(size_t i=0,j=0;i<subset.size();++i)
+			{
+				while(rows[j]!=subset[i])
+					++j;
+				r[i] = (int)j;
+			}
+			return r;
+		};
+		NDShape shape(_shape);
+		shape[0] = (int)rows.size();
+		NDArray values = NDData::New(shape,0.0f);
+		values._AddRows(positions(_rows),_values);
+		values._AddRows(positions(other._rows),other._values);
+		_rows.swap(rows);
+		_values._Attach(values);
+	}
+
+	// Removes every row, the gradient becomes zero.
+	//
+	void Clear()
+	{
+		_rows.clear();
+		_values._Reset();
+	}
+
+	// Returns the dense equivalent.
+	//
+	NDArray ToDense() const
+	{
+		NDArray r = NDData::New(_shape,0.0f);
+		if(!Empty())
+			r._AddRows(_rows,_values);
+		return r;
+	}
+};
@@ -3,6 +3,9 @@
 #include "NDArray.h"
 #include "String.h"
 #include <map>
+#include <exception>
+#include <functional>
+#include <unordered_set>
 #include "KoAdd.h"
 #include "KoArgMax.h"
 #include "KoCat.h"
@@ -11,9 +14,11 @@
 #include "KoDot.h"
 #include "KoDropout.h"
 #include "KoExp.h"
+#include "KoExpand.h"
 #include "KoGather.h"
 #include "KoIndexSelect.h"
 #include "KoLog.h"
+#include "KoLogSoftmax.h"
 #include "KoMaskedFill.h"
 #include "KoMax.h"
 #include "KoMean.h"
@@ -24,6 +29,7 @@
 #include "KoRepeat.h"
 #include "KoReshape.h"
 #include "KoSlice.h"
+#include "KoSoftmax.h"
 #include "KoSqueeze.h"
 #include "KoSub.h"
 #include "KoSum.h"
@@ -35,7 +41,11 @@
 typedef std::shared_ptr<class Tensor> TensorPtr;
 class Tensor : public std::enable_shared_from_this<class Tensor>
 {
+	friend class Graph;
+	friend class MemoryPlanner;
+
 	static inline std::atomic<int>	_nextId = 0;
+	static inline thread_local std::vector<TensorPtr>* _capture = nullptr;	// Graph capture, tensors created by kernels are added.
 
 	const int				_id;			// Unique ID for this tensor, used to identify it in the children map.
 	std::mutex              _lock;			// State protection mutex.
@@ -47,6 +57,10 @@ class Tensor : public std::enable_shared_from_this<class Tensor>
 	NDArray					_data;			// N-Dimensional data array.
 	
 	TensorPtr				_gradient;		// Gradient of loss with respect to this.
+	bool					_ownsGradient;	// Gradient was allocated for this tensor, rather than passed back, so can be added to in place.
+	std::atomic<int>		_pending;		// Backward, gradients still to be passed back by children in the graph.
+	bool					_sparse;		// Take the gradient as sparse rows from kernels that can produce it.
+	SparseRowsPtr			_sparseGradient;// Gradient of loss with respect to this when sparse.
 	
 	TensorPtr				_momentum;		// Optimizer, momentum.
 	TensorPtr				_momentum2;		// Optimizer, second momentum (ADAM).
@@ -58,14 +72,6 @@ class Tensor : public std::enable_shared_from_this<class Tensor>
 		return ++_nextId;
 	}
 
-	bool AllChildrenGradsAccountedFor() const
-	{
-		for(auto& c:_children)
-			if(c.second>0)
-				return false;
-		return true;
-	}
-
 	Tensor(const Tensor&) = delete;
 	void operator = (const Tensor&) = delete;
 
@@ -87,6 +93,254 @@ class Tensor : public std::enable_shared_from_this<class Tensor>
 			_children[childId]++;
 	}
 
+	// Acknowledges a gradient passed back by a child, a child passes one back for each time it used this tensor.
+	//	Caller holds the lock.
+	//
+	void AcknowledgeChild(const int childId)
+	{
+		const auto i = _children.find(childId);
+		if(i==_children.end())
+			throw MissingChild();
+		if(i->second==0)
+			throw AlreadyPropagated();
+		i->second--;
+	}
+
+	// Returns 'true' if every child has passed back its gradient.
+	//	Caller holds the lock.
+	//
+	bool AllChildrenGradsAccountedFor() const
+	{
+		for(auto& c:_children)
+			if(c.second>0)
+				return false;
+		return true;
+	}
+
+	// Adds a gradient passed back to the gradient of this tensor.
+	//	The first is kept as it is, without a copy, it may also be the gradient of another tensor (i.e. both inputs of Add) so a new
+	//	array is made for the sum the first time another is added, after which they're added in place.
+	//
+	void Accumulate(const NDArray& gradient)
+	{
+		// Shape of gradient should be the same as (this) the Tensor it relates to - there should be a gradient for each value.
+		if(_data.Shape()!=gradient.Shape())
+			throw IncompatibleShape(_data.Shape(),gradient.Shape());
+
+		// Learnable model parameters (without any other identifier these don't have creators) keep their gradient and momentum after
+		// the step, so they're not made in a step arena.
+		const NDArena::Suspend persistent(_creators.size()==0);
+
+		if(!_gradient)
+		{
+			// First/only gradient passed back. A parameter's is copied: the optimiser zeroes it in place, and the array passed back may
+			// be shared (i.e. by both inputs of an Add, or repeated by a view for a Sum) or in the step arena.
+			if(_creators.size()==0)
+			{
+				_gradient = Tensor::New(NDData::New(*gradient));
+				_ownsGradient = true;
+			}
+			else
+			{
+				_gradient = Tensor::New(gradient);
+				_ownsGradient = false;
+			}
+
+			// Only need momentum for learnable model parameters (a sparse gradient may already have made it).
+			if(_creators.size()==0&&!_momentum)
+			{
+				_momentum = Tensor::New(gradient.Zeros());
+				_momentum2 = Tensor::New(gradient.Zeros());
+			}
+		}
+		else if(_ownsGradient)
+			_gradient->_data += gradient;
+		else
+		{
+			_gradient->_data._Attach(_gradient->_data+gradient);
+			_ownsGradient = true;
+		}
+	}
+
+	// Adds a sparse gradient passed back to the sparse gradient of this tensor.
+	//
+	void AccumulateSparse(const SparseRows& gradient)
+	{
+		if(_creators.size()>0)
+			throw NotImplemented("Sparse gradients are only accumulated by tensors without creators (parameters).");
+		if(_data.Shape()!=gradient.Shape())
+			throw IncompatibleShape(_data.Shape(),gradient.Shape());
+
+		const NDArena::Suspend persistent;
+		if(!_sparseGradient)
+		{
+			// First gradient passed back, the optimiser state is for every row (unless a dense gradient already made it).
+			_sparseGradient = std::make_shared<SparseRows>(_data.Shape(),std::vector<int>(),NDArray());
+			if(!_momentum)
+			{
+				_momentum = Tensor::New(_data.Zeros());
+				_momentum2 = Tensor::New(_data.Zeros());
+			}
+		}
+		if(!gradient.Empty()&&(*gradient.Values()).InArena())
+			_sparseGradient->Add(SparseRows(gradient.Shape(),gradient.Rows(),NDData::New(*gradient.Values())));	// Copied out of the step arena.
+		else
+			_sparseGradient->Add(gradient);
+	}
+
+	// Returns this and the tensors it was created from that need a gradient, each before the tensors it was created from. Sets the
+	// pending count of each to the number of gradients it will be passed back.
+	//
+	std::vector<Tensor*> TopologicalOrder()
+	{
+		// Depth first, a tensor is added after all its creators.
+		std::vector<Tensor*> order;
+		std::unordered_set<Tensor*> visited = {this};
+		std::vector<std::pair<Tensor*,size_t>> stack = {{this,0}};	// Tensor and its next creator.
+		_pending = 0;
+		while(!stack.empty())
+		{
+			Tensor* const tensor = stack.back().first;
+			const size_t next = stack.back().second++;
+			if(next<tensor->_creators.size())
+			{
+				Tensor* const creator = tensor->_creators[next].get();
+				if(!creator->_autograd)
+					continue;
+				if(visited.insert(creator).second)
+				{
+					creator->_pending = 1;
+					stack.emplace_back(creator,0);
+				}
+				else
+					creator->_pending++;
+			}
+			else
+			{
+				order.push_back(tensor);
+				stack.pop_back();
+			}
+		}
+		std::reverse(order.begin(),order.end());
+		return order;
+	}
+
+	// Runs BackwardStep for each tensor in 'order' from TopologicalOrder, with the pending counts set, the first is the root which
+	// keeps its gradient.
+	//
+	static void BackwardOrder(const std::vector<Tensor*>& order,const bool acknowledge)
+	{
+		Tensor* const root = order[0];
+
+		// The order only matters with a single worker, the ready counts order the parallel version.
+		if(NDThreadPool::WorkerCount()==1||order.size()==1)
+		{
+			for(Tensor* const tensor:order)
+				tensor->BackwardStep(tensor!=root,acknowledge);
+			return;
+		}
+
+		// A tensor runs its creators that become ready, the first on this thread and the rest as new tasks.
+		std::mutex errorLock;
+		std::exception_ptr error;
+		std::function<void(Tensor*)> run;
+		{
+			NDThreadPool::TaskGroup group;		// Waits for every task when it goes out of scope.
+			run = [&](Tensor* tensor)
+			{
+				try
+				{
+					while(tensor)
+					{
+						const std::vector<Tensor*> ready = tensor->BackwardStep(tensor!=root,acknowledge);
+						tensor = nullptr;
+						for(Tensor* const creator:ready)
+						{
+							if(!tensor)
+								tensor = creator;
+							else
+								group.Run([&run,creator](){run(creator);});
+						}
+					}
+				}
+				catch(...)
+				{
+					std::unique_lock<std::mutex> lock(errorLock);
+					if(!error)
+						error = std::current_exception();
+				}
+			};
+			run(root);
+		}
+		if(error)
+			std::rethrow_exception(error);
+	}
+
+	// Passes the gradient of this tensor back to its creators, once every child (in any backward pass) has passed back its gradient.
+	// Releases the gradient if 'release', acknowledges this as a child of the creators if 'acknowledge' (replaying a Graph doesn't track
+	// children). Returns the creators that have then been passed all their gradients.
+	//
+	std::vector<Tensor*> BackwardStep(const bool release,const bool acknowledge)
+	{
+		std::vector<Tensor*> ready;
+		if(_creators.size()==0)
+			return ready;
+
+		// A child outside this backward pass (i.e. of another loss backpropagated separately) hasn't passed back its gradient yet, keep
+		// the gradient and data until its own pass.
+		if(acknowledge)
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			if(!AllChildrenGradsAccountedFor())
+				return ready;
+		}
+
+		// Acknowledge this child first, backprop through a graph a second time fails here rather than in a kernel.
+		for(auto& creator:_creators)
+		{
+			if(acknowledge&&creator->_autograd)
+			{
+				std::unique_lock<std::mutex> lock(creator->_lock);
+				creator->AcknowledgeChild(_id);
+			}
+		}
+
+		// For some reason kernel operators take NDArrays as input, so convert creators (Tensors) to NDArrays.
+		const NDArrays inputs = Arrays(_creators);
+
+		// A sparse creator takes its gradient as rows if the kernel can produce them, saving a dense gradient the size of the creator.
+		const SparseRowsPtr sparse = _creators.size()==1&&_creators[0]->_sparse?_kernel->SparseBackward(_gradient->_data,inputs):nullptr;
+
+		// Compute gradients for each creator.
+		const NDArrays gradients = sparse?NDArrays():_kernel->Backward(_gradient->_data,inputs);
+
+		// Release the gradient for this tensor, it has been passed back to the creators.
+		if(release)
+			_gradient.reset();
+
+		// Reset data to release memory, it is no longer needed, this was an intermediate result.
+		if(_children.size()>0)
+			_data._Reset();
+
+		// Pass gradients back to each creator.
+		for(size_t i=0;i<_creators.size();++i)
+		{
+			Tensor* const creator = _creators[i].get();
+			if(!creator->_autograd)
+				continue;
+			{
+				std::unique_lock<std::mutex> lock(creator->_lock);
+				if(sparse)
+					creator->AccumulateSparse(*sparse);
+				else
+					creator->Accumulate(gradients[i]);
+			}
+			if(--creator->_pending==0)
+				ready.push_back(creator);
+		}
+		return ready;
+	}
+
 	class P
 	{
 	};
@@ -97,7 +351,10 @@ public:
 	Tensor(const P&,const NDArray& data,bool autograd,const iter& begin,const iter& end) :
 		_id(NextId()),
 		_autograd(autograd),
-		_data(data)
+		_data(data),
+		_ownsGradient(false),
+		_pending(0),
+		_sparse(false)
 	{
 		// Store list of creators.
 		for(auto i=begin;i!=end;++i)
@@ -115,7 +372,10 @@ public:
 		_creators(begin,end),
 		_kernel(kernel),
 		_autograd(autograd),
-		_data(kernel->Forward(Arrays(_creators)))
+		_data(kernel->Forward(Arrays(_creators))),
+		_ownsGradient(false),
+		_pending(0),
+		_sparse(false)
 	{
 		// Add this as a child of it's creators.
 		for(auto& c:_creators)
@@ -126,24 +386,48 @@ public:
 	Tensor(const P&,const NDShape& shape) :
 		_data(NDData::New(shape)),
 		_autograd(false),
-		_id(NextId())
+		_id(NextId()),
+		_ownsGradient(false),
+		_pending(0),
+		_sparse(false)
 	{
 	}
 
+	~Tensor()
+	{
+		// Release creators without recursing, the last reference to a long chain of tensors could otherwise exhaust the stack.
+		std::vector<TensorPtr> creators;
+		creators.swap(_creators);
+		while(!creators.empty())
+		{
+			TensorPtr creator = std::move(creators.back());
+			creators.pop_back();
+			if(creator.use_count()==1)
+			{
+				for(auto& c:creator->_creators)
+					creators.emplace_back(std::move(c));
+				creator->_creators.clear();
+			}
+		}
+	}
+
 	static TensorPtr New(const NDArray& data,bool autograd=false,const std::initializer_list<TensorPtr>& creators={})
 	{
-		return std::make_shared<Tensor>(P(),data,autograd,creators.begin(),creators.end());
+		return NDAllocator::MakeShared<Tensor>(P(),data,autograd,creators.begin(),creators.end());
 	}
 
 	static TensorPtr New(const bool autograd,const std::vector<TensorPtr>& creators,const KernelPtr& creationOp)
 	{
-		return std::make_shared<Tensor>(P(),autograd,creators.begin(),creators.end(),creationOp);
+		TensorPtr tensor = NDAllocator::MakeShared<Tensor>(P(),autograd,creators.begin(),creators.end(),creationOp);
+		if(_capture)
+			_capture->push_back(tensor);
+		return tensor;
 	}
 
 	// Added for CategoricalDistribution, need to create a tensor derived from a user defined shape.
 	static TensorPtr New(const NDShape& shape)
 	{
-		return std::make_shared<Tensor>(P(),shape);
+		return NDAllocator::MakeShared<Tensor>(P(),shape);
 	}
 
 	static TensorPtr New(const std::initializer_list<int>& shape,const std::vector<FP>& data)
@@ -161,21 +445,33 @@ public:
 		_name = name;
 	}
 
+	bool Sparse() const
+	{
+		return _sparse;
+	}
+
+	// Take the gradient as sparse rows where possible (i.e. an embedding table selected by IndexSelect), see SparseGradient.
+	//
+	void Sparse(const bool sparse)
+	{
+		_sparse = sparse;
+	}
+
 	TensorPtr Add(const TensorPtr& other) const
 	{
-		return Tensor::New(_autograd,{Self(),other},std::make_shared<KoAdd>());
+		return Tensor::New(_autograd,{Self(),other},NDAllocator::MakeShared<KoAdd>());
 	}
 
 	TensorPtr ArgMax(const int dim) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoArgMax>(dim));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoArgMax>(dim));
 	}
 
 	void AssertReadyForBackprop(int nest=0) const
 	{
 		for(int i=0;i<nest;i++)
 			std::cout << ".";
-		if(!_gradient)
+		if(!_gradient&&!_sparseGradient)
 			throw "No gradient";
 		for(auto& child:_children)
 		{
@@ -197,77 +493,25 @@ public:
 			return Tensor::New(NDData::ReverseBroadcast(_data,creator->Shape()));
 	}
 
+	// Backpropagates 'gradient', the gradient of the loss with respect to this tensor, to every tensor it was created from. 'child' is
+	// for compatibility and must be null, this is where backprop starts.
+	//
+	// The tensors reachable through creators are put in topological order once, each is then processed as soon as all its children in
+	// the graph have passed their gradient back (a ready count per tensor) rather than recursing through creators, so long graphs don't
+	// exhaust the stack. Independent branches (i.e. attention heads joined by Cat) run in parallel on the thread pool.
+	// The gradient of this tensor and parameters (tensors without creators) are kept, other gradients are released once passed back.
+	//
 	void Backward(const TensorPtr& gradient,const TensorPtr& child)
 	{
-		if(!child&&_children.size()>0)
-			throw ChildNotSpecified();
-		if(child&&_children.size()==0)
+		if(child)
+			throw NotImplemented("Gradients are passed between tensors by the backward engine.");
+		if(_children.size()>0)
 			throw ChildNotSpecified();
+		if(!_autograd)
+			return;
 
-		//gradient->Print();
-
-		//std::cout<<_id<<std::endl;
-		//if(_id==412)
-//			int a = 1;
-
-		if(_autograd)
-		{
-			// Acknowledge child contribution to gradient.
-			if(child)
-			{
-				const auto i = _children.find(child->_id);
-				if(i==_children.end())
-					throw MissingChild();
-				if(i->second==0)
-					throw AlreadyPropagated();
-				else
-					i->second--;
-			}
-
-			if(!_gradient)
-			{
-				// First/only gradient passed back.
-				_gradient = gradient;
-
-				// Only need momentum for learnable model parameters - without any other identifier these don't have creators.
-				if(_creators.size()==0)
-				{
-					_momentum = Tensor::New(_gradient->_data.Zeros());
-					_momentum2 = Tensor::New(_gradient->_data.Zeros());
-				}
-			}
-			else
-			{
-				// Subsequent gradient passed back, add to existing gradient.
-				// Inplace addition is more efficient and also creating a new Tenosr can create a circular reference.
-				_gradient->_data += gradient->_data;
-			}
-
-			// Shape of gradient should be the same as (this) the Tensor it relates to - there should be a gradient for each value.
-			if(_data.Shape()!=_gradient->_data.Shape())
-				throw IncompatibleShape(_data.Shape(),_gradient->_data.Shape());
-
-			// Backprop to tensor(s) used to create this tensor if gradient is ready.
-			if(_creators.size()>0&&AllChildrenGradsAccountedFor())
-			{
-				// For some reason kernel operators take NDArrays as input, so convert creators (Tensors) to NDArrays.
-				const NDArrays inputs = Arrays(_creators);
-
-				// Compute gradients for each creator.
-				const NDArrays gradients = _kernel->Backward(_gradient->_data,inputs);
-
-				// Release the gradient for this tensor, it has been passed back to the creators.
-				_gradient.reset();
-
-				// Reset data to release memory, it is no longer needed, this was an intermediate result.
-				if(_children.size()>0)
-					_data._Reset();		
-
-				// Pass gradients back to each creator.
-				for(size_t i=0;i<_creators.size();++i)
-					_creators[i]->Backward(Tensor::New(gradients[i]),Self());
-			}
-		}
+		Accumulate(gradient->_data);
+		BackwardOrder(TopologicalOrder(),true);
 	}
 
 	void Backward()
@@ -276,6 +520,31 @@ public:
 		Backward(Tensor::New(_data.Ones()),nullptr);
 	}
 
+	// Moves the data of a parameter into 'data' and gives it the gradient and optimiser state 'gradient', 'momentum' and 'momentum2',
+	// all of the same shape (views of a ParameterArena). Gradients passed back are then accumulated in place.
+	//
+	void Bind(const NDArray& data,const NDArray& gradient,const NDArray& momentum,const NDArray& momentum2)
+	{
+		if(_creators.size()>0)
+			throw NotImplemented("Only parameters (tensors without creators) can be bound.");
+		NDArray view(data);
+		view = _data;
+		_data._Attach(view);
+
+		// Existing gradient and state are copied, otherwise they keep the values given (zero).
+		auto move = [](TensorPtr& tensor,const NDArray& to)
+		{
+			NDArray view(to);
+			if(tensor)
+				view = tensor->_data;
+			tensor = Tensor::New(view);
+		};
+		move(_gradient,gradient);
+		_ownsGradient = true;
+		move(_momentum,momentum);
+		move(_momentum2,momentum2);
+	}
+
 
 	// Concatenates tensors along dimension.
 	//
@@ -290,32 +559,34 @@ public:
 		for(auto& tensor:tensors)
 			autograd |= tensor->_autograd;
 
-		return Tensor::New(autograd,tensors,std::make_shared<KoCat>(dim));
+		return Tensor::New(autograd,tensors,NDAllocator::MakeShared<KoCat>(dim));
 	}
 
 
-	TensorPtr CrossEntropy(const TensorPtr& targets) const
+	// Targets are class indices, 'smoothing' spreads that probability over all classes and targets equal to 'ignoreIndex' are skipped.
+	//
+	TensorPtr CrossEntropy(const TensorPtr& targets,const FP smoothing=0,const int ignoreIndex=-100) const
 	{
 		// Must be one target 'index' for each sample in the batch.
 		if(targets->Shape().size()!=1||targets->Shape()[0]!=Shape()[0])
 			throw IncompatibleShape();
 
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoCrossEntropy>(targets->_data));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoCrossEntropy>(targets->_data,smoothing,ignoreIndex));
 	}
 
 	TensorPtr Div(const TensorPtr& other) const
 	{
-		return Tensor::New(_autograd,{Self(),other},std::make_shared<KoDiv>());
+		return Tensor::New(_autograd,{Self(),other},NDAllocator::MakeShared<KoDiv>());
 	}
 
 	TensorPtr Dot(const TensorPtr& other) const
 	{
-		return Tensor::New(_autograd,{Self(),other},std::make_shared<KoDot>());
+		return Tensor::New(_autograd,{Self(),other},NDAllocator::MakeShared<KoDot>());
 	}
 
 	TensorPtr Dropout(const FP p) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoDropout>(p));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoDropout>(p));
 	}
 
 	TensorPtr Equal(const TensorPtr& other) const
@@ -328,19 +599,26 @@ public:
 
 	TensorPtr Exp() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoExp>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoExp>());
+	}
+
+	// Repeats unit length dimensions to 'shape' (and adds dimensions to the left) as a view, without copying.
+	//
+	TensorPtr Expand(const NDShape& shape) const
+	{
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoExpand>(shape));
 	}
 
 	// Repeat n times - note this "projects" each row, and does not simply stack n copies of the data.
 	//
 	TensorPtr Repeat(const int dim,const int copies) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoRepeat>(dim,copies));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoRepeat>(dim,copies));
 	}
 
 	TensorPtr Gather(const int dim,const TensorPtr& indices) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoGather>(dim,indices->_data));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoGather>(dim,indices->_data));
 	}
 	
 	const TensorPtr& Gradient() const
@@ -353,6 +631,33 @@ public:
 		return _data[{}];
 	}
 
+	// Sparse gradient of a parameter with Sparse(true), null until backprop reaches it.
+	//
+	const SparseRowsPtr& SparseGradient() const
+	{
+		return _sparseGradient;
+	}
+
+	// Adds the sparse gradient to the dense gradient, and clears it, if this has both (a sparse parameter also used by an operation
+	// without a sparse backward, i.e. an embedding table tied to an output layer). Optimisers then step it once on the dense gradient.
+	//
+	void MergeSparseGradient()
+	{
+		if(!_sparseGradient||!_gradient)
+			return;
+		if(!_sparseGradient->Empty())
+		{
+			const NDArena::Suspend persistent;
+			if(!_ownsGradient)
+			{
+				_gradient->_data._Attach(NDData::New(*_gradient->_data));
+				_ownsGradient = true;
+			}
+			_gradient->_data._AddRows(_sparseGradient->Rows(),_sparseGradient->Values());
+		}
+		_sparseGradient->Clear();
+	}
+
 	const TensorPtr& Momentum() const
 	{
 		return _momentum;
@@ -365,7 +670,7 @@ public:
 
 	TensorPtr IndexSelect(const TensorPtr& indices) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoIndexSelect>(indices->_data));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoIndexSelect>(indices->_data));
 	}
 
 	bool IsEqualTo(const TensorPtr& v) const
@@ -380,12 +685,17 @@ public:
 
 	TensorPtr Log() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoLog>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoLog>());
+	}
+
+	TensorPtr LogSoftmax(const int dim) const
+	{
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoLogSoftmax>(dim));
 	}
 
 	TensorPtr MaskedFill(const TensorPtr& mask,const FP value)
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoMaskedFill>(mask->_data,value));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoMaskedFill>(mask->_data,value));
 	}
 
 	TensorPtr Max(int dim) const
@@ -394,42 +704,42 @@ public:
 		if(dim<0)
 			dim += (int)Shape().size();
 
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoMax>(dim));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoMax>(dim));
 	}
 
 	TensorPtr Mean(const bool keepDims) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoMean>(keepDims));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoMean>(keepDims));
 	}
 
 	TensorPtr Mean(const int dim,const bool keepDims) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoMean>(dim,keepDims));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoMean>(dim,keepDims));
 	}
 
 	TensorPtr Mul(const TensorPtr& other) const
 	{
-		return Tensor::New(_autograd,{Self(),other},std::make_shared<KoMul>());
+		return Tensor::New(_autograd,{Self(),other},NDAllocator::MakeShared<KoMul>());
 	}
 
 	TensorPtr Neg() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoNeg>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoNeg>());
 	}
 
 	TensorPtr Pow(const FP exponent) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoPow>(exponent));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoPow>(exponent));
 	}
 
 	TensorPtr Relu() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoRelu>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoRelu>());
 	}
 
 	TensorPtr Reshape(const std::initializer_list<int>& shape) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoReshape>(shape));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoReshape>(shape));
 	}
 
 	void Save(const std::string& filename) const
@@ -444,18 +754,14 @@ public:
 
 	TensorPtr Slice(const std::initializer_list<std::initializer_list<int>>& slicer)
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoSlice>(slicer));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoSlice>(slicer));
 	}
 
 	TensorPtr Softmax(const int dim) const
 	{
-		// KeepDim=true else backprop would need to add it back (old comment,feel free to change this).
-		// This likely would be more efficient not use add this to the tensor graph and instead add analytic backprop for softmax.
-		// Here we use the numerically equivalent softmax where max(x) is subtracted to avoid e^(large) overflowing.
-		// This avoids overflows which would be catastrophic and instead e^(-large) is close to zero and so does not affect the result.
-		// The word 'large' here is just to indtcate magnitude and does not imply max(x) has it's sign flipped.
-		const TensorPtr expo = Sub(Max(dim))->Exp();
-		return expo->Div(expo->Sum(dim,true));
+		// Fused numerically stable softmax (max(x) is subtracted to avoid e^(large) overflowing) with the analytic backprop, this
+		// is a single node rather than the Sub(Max)->Exp->Div(Sum) graph.
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoSoftmax>(dim));
 	}
 
 	TensorPtr Sqrt() const
@@ -465,7 +771,7 @@ public:
 
 	TensorPtr Squeeze(const int dim) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoSqueeze>(dim));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoSqueeze>(dim));
 	}
 
 	// Stack row vectors into a matrix.
@@ -493,7 +799,7 @@ public:
 
 	TensorPtr Sub(const TensorPtr& other) const
 	{
-		return Tensor::New(_autograd,{Self(),other},std::make_shared<KoSub>());
+		return Tensor::New(_autograd,{Self(),other},NDAllocator::MakeShared<KoSub>());
 	}
 
 	TensorPtr Sum(int dim,const bool keepDims) const
@@ -502,17 +808,17 @@ public:
 		if(dim<0)
 			dim += (int)Shape().size();
 
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoSum>(dim,keepDims));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoSum>(dim,keepDims));
 	}
 
 	TensorPtr Tanh() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoTanh>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoTanh>());
 	}
 
 	TensorPtr Transpose() const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoTranspose>());
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoTranspose>());
 	}
 
 	TensorPtr Tril() const
@@ -525,7 +831,7 @@ public:
 
 	TensorPtr Unsqueeze(const int dim) const
 	{
-		return Tensor::New(_autograd,{Self()},std::make_shared<KoUnsqueeze>(dim));
+		return Tensor::New(_autograd,{Self()},NDAllocator::MakeShared<KoUnsqueeze>(dim));
 	}
 
 	TensorPtr Var() const
@@ -8,6 +8,7 @@
 #include "Test_Tensor.h"
 #include "Test_NDThreadPool.h"
 #include "Test_Broadcast.h"
+#include "Tools.h"
 
 
 using namespace std;
@@ -59,6 +60,14 @@ void print(const NDShape& v)
 }
 
 
+// Returns 'true' if the benchmarks should run as well as the tests (AUTOGRAD_BENCHMARKS=1), some take seconds and hundreds of MB.
+//
+bool Benchmarks()
+{
+	return GetEnv("AUTOGRAD_BENCHMARKS")=="1";
+}
+
+
 void Test()
 {
 	Test_Broadcast();
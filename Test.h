@@ -20,5 +20,6 @@ void print(const std::string& str);
 void print(const NDArray& data,const char* label=nullptr);
 void print(const NDShape& v);
 void print(const TensorPtr& data,const char* label=nullptr);
+bool Benchmarks();
 
 extern void Test();
\ No newline at end of file
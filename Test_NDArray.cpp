@@ -1,5 +1,8 @@
 #include "NDArray.h"
 #include "Test.h"
+#include <climits>
+#include <cstring>
+#include <chrono>
 
 
 using namespace std;
@@ -7,6 +10,59 @@ using namespace std;
 
 namespace
 {
+	void Test_Allocator()
+	{
+		// A 4KB array (and its header) takes a 5KB block rather than 8KB, and a freed block is reused by the next of its class.
+		const NDAllocator::Statistics before = mem.Stats();
+		float* const a = mem.Alloc<float>(1024);
+		Assert(mem.Stats().inUse-before.inUse==5120,"Allocator: class size.");
+		mem.Free(a);
+		float* const b = mem.Alloc<float>(1020);
+		Assert(b==a,"Allocator: reuse.");
+		Assert(mem.Stats().highWater>=mem.Stats().inUse,"Allocator: high-water.");
+		mem.Free(b);
+
+		// Blocks freed by other threads.
+		std::vector<float*> blocks(1000);
+		NDThreadPool::ParallelFor(0,1000,1,[&blocks](const int i)
+		{
+			blocks[i] = mem.Alloc<float>((i+1)*37);
+			*blocks[i] = FP(i);
+		});
+		NDThreadPool::ParallelFor(0,1000,1,[&blocks](const int i)
+		{
+			Assert(*blocks[999-i]==FP(999-i),"Allocator: block data.");
+			mem.Free(blocks[999-i]);
+		},NDThreadPool::Schedule::Dynamic);
+		const NDAllocator::Statistics after = mem.Stats();
+		Assert(after.inUse==before.inUse,"Allocator: in use.");
+		Assert(after.cached>0,"Allocator: cached.");
+
+		// Trim releases the pooled blocks and those cached by this thread.
+		const size_t released = mem.Trim();
+		Assert(released>=5120,"Allocator: trim.");
+		Assert(mem.Stats().cached==after.cached-released,"Allocator: cached after trim.");
+
+		// Blocks larger than a thread cache freed on workers aren't cached by them, Trim releases them.
+		NDThreadPool::Resize(2);
+		const int workers = NDThreadPool::WorkerCount();
+		std::vector<float*> large(workers);
+		for(auto& block:large)
+			block = mem.Alloc<float>(1<<22);
+		std::atomic<int> started = 0;
+		NDThreadPool::ForEach(0,workers,[&](const int i)
+		{
+			++started;		// Each task waits for the others so every worker frees one.
+			const auto timeout = std::chrono::steady_clock::now()+std::chrono::seconds(10);
+			while(started<workers&&std::chrono::steady_clock::now()<timeout)
+				std::this_thread::yield();
+			mem.Free(large[i]);
+		});
+		Assert(started==workers,"Allocator: every worker frees a block.");
+		Assert(mem.Trim()>=(size_t)workers*(1<<22)*sizeof(float),"Allocator: trim large blocks freed by workers.");
+		NDThreadPool::Resize(0);
+	}
+
 	void Test_Add()
 	{
 		// Add(matrix,scalar)
@@ -141,6 +197,366 @@ namespace
 	}
 
 
+	// Elementwise engine - large arrays split across threads with vector and strided rows.
+	void Test_Elementwise()
+	{
+		// 'x op y' for every layout of 'y' against a reference computed one element at a time.
+		constexpr int I = 16;
+		constexpr int J = 33;
+		constexpr int K = 257;
+		const NDArray x = NDData::RandN({I,J,K});
+		const NDArray full = NDData::RandN({I,J,K});
+		const NDArray layouts[] =
+		{
+			full,											// Contiguous.
+			NDData::RandN({K}),								// Row broadcast.
+			NDData::RandN({I,J,1}),							// Column broadcast.
+			NDData::New({1},0.75f),							// Scalar broadcast.
+			NDData::RandN({I,K,J}).Transpose(),				// Strided.
+			NDData::RandN({J,1}),							// Middle broadcast.
+		};
+		for(const NDArray& y:layouts)
+		{
+			const NDArray yb = y.Exp();						// Positive for division.
+			const NDArray sum = x+yb;
+			const NDArray difference = x-yb;
+			const NDArray product = x*yb;
+			const NDArray quotient = x/yb;
+			NDArray expected[4] = {NDData::New({I,J,K}),NDData::New({I,J,K}),NDData::New({I,J,K}),NDData::New({I,J,K})};
+			for(int i=0;i<I;++i)
+			{
+				for(int j=0;j<J;++j)
+				{
+					for(int k=0;k<K;++k)
+					{
+						const FP a = x[{i,j,k}];
+						const FP b = y.Shape().size()==1?(y.Shape()[0]==K?exp(y[{k}]):exp(y[{0}])):
+							y.Shape().size()==2?exp(y[{j,0}]):y.Shape()[2]==1?exp(y[{i,j,0}]):exp(y[{i,j,k}]);
+						expected[0][{i,j,k}] = a+b;
+						expected[1][{i,j,k}] = a-b;
+						expected[2][{i,j,k}] = a*b;
+						expected[3][{i,j,k}] = a/b;
+					}
+				}
+			}
+			Assert(sum.IsEqualTo(expected[0]),"Elementwise: Add.");
+			Assert(difference.IsEqualTo(expected[1]),"Elementwise: Sub.");
+			Assert(product.IsEqualTo(expected[2]),"Elementwise: Mul.");
+			Assert(quotient.IsEqualTo(expected[3]),"Elementwise: Div.");
+		}
+
+		// Unary operations on a transposed view.
+		{
+			const NDArray xT = x.Transpose();
+			const NDArray negated = -xT;
+			const NDArray squared = xT.Pow(2);
+			const NDArray tanh = xT.Tanh();
+			for(int i=0;i<I;++i)
+			{
+				for(int k=0;k<K;++k)
+				{
+					for(int j=0;j<J;++j)
+					{
+						const FP a = x[{i,j,k}];
+						Assert(negated[{i,k,j}]==-a,"Elementwise: Negate.");
+						Assert(squared[{i,k,j}]==a*a,"Elementwise: Pow(2).");
+						Assert(abs(tanh[{i,k,j}]-std::tanh(a))<1e-6f,"Elementwise: Tanh.");
+					}
+				}
+			}
+		}
+
+		// Inplace with broadcast operand.
+		{
+			NDArray z = NDData::New(*x);
+			const NDArray row = NDData::RandN({K});
+			z += row;
+			for(int i=0;i<I;++i)
+				for(int j=0;j<J;++j)
+					for(int k=0;k<K;++k)
+						Assert(z[{i,j,k}]==x[{i,j,k}]+row[{k}],"Elementwise: Inplace add.");
+		}
+
+		// Fused expressions of arrays, broadcast arrays and scalars, on a strided view and assigned in place.
+		{
+			const NDArray xT = x.Transpose();
+			const NDArray y = NDData::RandN({I,K,J});
+			const NDArray row = NDData::RandN({J});
+			const NDArray fused = -(xT-y)/FP(J)*row+2;
+			NDArray z = NDData::New(*y);
+			z = z*z-row;
+			for(int i=0;i<I;++i)
+			{
+				for(int k=0;k<K;++k)
+				{
+					for(int j=0;j<J;++j)
+					{
+						const FP a = x[{i,j,k}];
+						const FP b = y[{i,k,j}];
+						const FP c = row[{j}];
+						Assert(abs(fused[{i,k,j}]-(-(a-b)/FP(J)*c+2))<1e-5f,"Elementwise: Fused.");
+						Assert(abs(z[{i,k,j}]-(b*b-c))<1e-5f,"Elementwise: Fused assign.");
+					}
+				}
+			}
+
+			// Assigned to a view of an operand's memory.
+			NDArray w = NDData::New({2,2},{1,2,3,4});
+			NDArray wT = w.Transpose();
+			wT = w+1;
+			Assert(w.IsEqualTo(NDData::New({2,2},{2,4,3,5})),"Elementwise: Fused assign to view.");
+		}
+	}
+
+
+	// Reductions along each dimension, both kernel strategies, against references computed one element at a time, plus multiple
+	// dimensions, a strided input and the fused max/argmax and mean/variance.
+	void Test_Reduce()
+	{
+		constexpr int I = 5;
+		constexpr int J = 37;
+		constexpr int K = 67;
+		const NDArray x = NDData::RandN({I,J,K});
+		const int sizes[] = {I,J,K};
+		for(int dim=0;dim<3;++dim)
+		{
+			const NDArray sum = x.Sum(dim,true);
+			const NDArray mean = x.Mean(dim,true);
+			const NDArray max = x.Max(dim);
+			const NDArray argmax = x.ArgMax(dim);
+			NDArray fusedArgmax,fusedMean;
+			const NDArray fusedMax = x.Max(dim,fusedArgmax);
+			const NDArray var = x.Var(dim,true,1,fusedMean);
+			for(int row=0;row<I*J*K;++row)
+			{
+				int indices[3] = {row/(J*K),row/K%J,row%K};
+				if(indices[dim]!=0)
+					continue;		// Each output once.
+				const int out[3] = {indices[0],indices[1],indices[2]};
+				auto at = [&indices,dim](const NDArray& a,const int i)
+				{
+					indices[dim] = i;
+					return a[{indices[0],indices[1],indices[2]}];
+				};
+				double s = 0.0;
+				FP m = at(x,0);
+				int mi = 0;
+				for(int i=0;i<sizes[dim];++i)
+				{
+					s += at(x,i);
+					if(at(x,i)>m)
+					{
+						m = at(x,i);
+						mi = i;
+					}
+				}
+				double se = 0.0;
+				for(int i=0;i<sizes[dim];++i)
+					se += (at(x,i)-s/sizes[dim])*(at(x,i)-s/sizes[dim]);
+				Assert(abs(sum[{out[0],out[1],out[2]}]-s)<1e-4,"Reduce: Sum.");
+				Assert(abs(mean[{out[0],out[1],out[2]}]-s/sizes[dim])<1e-5,"Reduce: Mean.");
+				Assert(max[{out[0],out[1],out[2]}]==m&&fusedMax[{out[0],out[1],out[2]}]==m,"Reduce: Max.");
+				Assert(argmax[{out[0],out[1],out[2]}]==mi&&fusedArgmax[{out[0],out[1],out[2]}]==mi,"Reduce: ArgMax.");
+				Assert(abs(var[{out[0],out[1],out[2]}]-se/(sizes[dim]-1))<1e-4,"Reduce: Var.");
+				Assert(abs(fusedMean[{out[0],out[1],out[2]}]-s/sizes[dim])<1e-5,"Reduce: Var mean.");
+			}
+		}
+
+		// Multiple dimensions, neighbours and not.
+		Assert(x.Sum({0,2},false).IsEqualTo(x.Sum(2,false).Sum(0,false)),"Reduce: Sum({0,2}).");
+		Assert(x.Mean({1,2},true).IsEqualTo(x.Mean(2,true).Mean(1,true)),"Reduce: Mean({1,2}).");
+		Assert(x.Sum({-1,0,1},false).Shape()==NDShape({}),"Reduce: Sum all.");
+
+		// Strided input.
+		Assert(x.Transpose().Max(1).IsEqualTo(x.Max(2).Transpose()),"Reduce: Strided Max.");
+		Assert(x.Transpose().Sum(-1,true).IsEqualTo(x.Sum(1,true).Transpose()),"Reduce: Strided Sum.");
+
+		// First of equal maxima.
+		Assert(NDData::New({2,20},1.0f).ArgMax(1).IsEqualTo(NDData::New({2,1},0.0f)),"Reduce: ArgMax ties.");
+	}
+
+
+	// Full reductions - accuracy of each precision against double, repeatability, and Mean/Norm/Var/StdDev on strided input.
+	void Test_FullReduce()
+	{
+		// 0.1 is not exact in binary, a float running sum of 2^24 of them stalls once the increments fall below half an ulp.
+		{
+			const int n = 1<<24;
+			const NDArray x = NDData::New({n},0.1f);
+			const double exact = double(0.1f)*n;
+			for(const SumPrecision precision:{SumPrecision::Pairwise,SumPrecision::Kahan,SumPrecision::Double})
+			{
+				const double error = abs(x.Sum(precision)[{0}]-exact)/exact;
+				Assert(error<(precision==SumPrecision::Pairwise?1e-5:1e-7),"FullReduce: Sum accuracy.");
+			}
+		}
+
+		// Repeated reductions are bit identical however the blocks are scheduled and however many workers there are.
+		{
+			const NDArray x = NDData::RandN({1000003});
+			const FP first = x.Sum()[{0}];
+			for(int i=0;i<8;++i)
+				Assert(memcmp(&first,&x.Sum()[{0}],sizeof(FP))==0,"FullReduce: Deterministic.");
+			const FP kahan = x.Sum(SumPrecision::Kahan)[{0}];
+			for(const int workers:{1,3,8})
+			{
+				NDThreadPool::Resize(workers);
+				Assert(memcmp(&first,&x.Sum()[{0}],sizeof(FP))==0,"FullReduce: Deterministic across worker counts.");
+				Assert(memcmp(&kahan,&x.Sum(SumPrecision::Kahan)[{0}],sizeof(FP))==0,"FullReduce: Kahan deterministic across worker counts.");
+			}
+			NDThreadPool::Resize(0);
+		}
+
+		// Mean, Norm, Var and StdDev against double, including a transposed view.
+		{
+			const NDArray x = NDData::RandN({301,513})+NDData::New({},3.0f);
+			for(const NDArray& a:{x,x.Transpose()})
+			{
+				double sum = 0.0;
+				double squares = 0.0;
+				for(int i=0;i<301;++i)
+					for(int j=0;j<513;++j)
+					{
+						sum += x[{i,j}];
+						squares += double(x[{i,j}])*x[{i,j}];
+					}
+				const double n = 301*513;
+				const double mean = sum/n;
+				double se = 0.0;
+				for(int i=0;i<301;++i)
+					for(int j=0;j<513;++j)
+						se += (x[{i,j}]-mean)*(x[{i,j}]-mean);
+				Assert(abs(a.Mean(false)[{}]-mean)<1e-5,"FullReduce: Mean.");
+				Assert(abs(a.Norm()-sqrt(squares))/sqrt(squares)<1e-6,"FullReduce: Norm.");
+				Assert(abs(a.Var()[{}]-se/n)<1e-4,"FullReduce: Var.");
+				Assert(abs(a.StdDev()[{0}]-sqrt(se/n))<1e-4,"FullReduce: StdDev.");
+			}
+		}
+	}
+
+
+	// Throughput of the full sum against a sequential float loop.
+	void Benchmark_FullReduce()
+	{
+		for(const int n:{1000000,10000000,100000000})
+		{
+			const NDArray x = NDData::New({n},0.1f);
+			const FP* const data = &x[{0}];
+			auto time = [n](const auto& sum)
+			{
+				const int repeats = (std::max)(100000000/n,1);
+				volatile FP result = 0;
+				const auto start = std::chrono::steady_clock::now();
+				for(int r=0;r<repeats;++r)
+					result = sum();
+				const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()/repeats;
+				return double(n)*sizeof(FP)/seconds/1e9;
+			};
+			const double loop = time([data,n]()
+			{
+				FP sum = 0;
+				for(int i=0;i<n;++i)
+					sum += data[i];
+				return sum;
+			});
+			std::cout<<"Sum "<<n<<" values GB/s: loop "<<loop;
+			for(const auto& [name,precision]:{std::make_pair("pairwise",SumPrecision::Pairwise),std::make_pair("kahan",SumPrecision::Kahan),std::make_pair("double",SumPrecision::Double)})
+				std::cout<<", "<<name<<" "<<time([&x,precision=precision]()
+				{
+					return x.Sum(precision)[{0}];
+				});
+			std::cout<<std::endl;
+		}
+	}
+
+
+	// Distance between two floats in units in the last place, zero if both are NaN.
+	long long UlpDistance(const float a,const float b)
+	{
+		if(isnan(a)||isnan(b))
+			return isnan(a)&&isnan(b)?0:LLONG_MAX;
+		auto ordered = [](const float f)
+		{
+			int32_t i;
+			memcpy(&i,&f,sizeof(i));
+			return i<0?(long long)INT32_MIN-i:(long long)i;
+		};
+		return llabs(ordered(a)-ordered(b));
+	}
+
+
+	// Fast math policy - vectorised exp, log, tanh and pow against the C library (in double, rounded to float) across the float range.
+	void Test_FastMath()
+	{
+		// Every 1021st float, including subnormals, infinities and NaNs.
+		std::vector<float> values;
+		for(long long bits=0;bits<=0xffffffffLL;bits+=1021)
+		{
+			const uint32_t u = (uint32_t)bits;
+			float f;
+			memcpy(&f,&u,sizeof(f));
+			values.emplace_back(f);
+		}
+		for(const float f:{0.0f,-0.0f,INFINITY,-INFINITY,NAN,1.0f,-1.0f,88.7f,-103.9f,0.625f,-0.625f,1e-40f})
+			values.emplace_back(f);
+		const int n = (int)values.size();
+		NDArray x = NDData::New({n});
+		for(int i=0;i<n;++i)
+			x[{i}] = values[i];
+
+		// Maximum error of the NDArray method (widest instruction set) and, if the CPU has it, the AVX2 row kernel.
+		auto maxUlp = [&x,n](const char* name,const NDArray& y,auto op,auto reference,const long long bound)
+		{
+			std::vector<float> avx2(n);
+			if(cpu_has_avx2())
+				elementwise_row_avx2(op,n,avx2.data(),&x[{0}]);
+			long long worst = 0;
+			for(int i=0;i<n;++i)
+			{
+				const float a = x[{i}];
+				const float expected = (float)reference((double)a);
+				const long long ulp = UlpDistance(y[{i}],expected);
+				Assert(ulp<=bound,"FastMath: Error bound.");
+				Assert(!cpu_has_avx2()||UlpDistance(avx2[i],expected)<=bound,"FastMath: Error bound (AVX2).");
+				worst = (std::max)(worst,ulp);
+			}
+			std::cout<<"FastMath "<<name<<" max "<<worst<<" ULP"<<std::endl;
+		};
+		maxUlp("exp",x.Exp(MathPolicy::Fast),elementwise_fast_exp(),[](const double v){return exp(v);},1);
+		maxUlp("log",x.Log(MathPolicy::Fast),elementwise_fast_log(),[](const double v){return log(v);},1);
+		maxUlp("tanh",x.Tanh(MathPolicy::Fast),elementwise_fast_tanh(),[](const double v){return tanh(v);},1);
+
+		// pow, the bound grows with the size of the result's exponent.
+		for(const float exponent:{0.5f,-1.0f,3.0f,-2.5f,1.7f,0.0f})
+		{
+			const NDArray y = x.Pow(exponent,MathPolicy::Fast);
+			for(int i=0;i<n;++i)
+			{
+				const float a = x[{i}];
+				const float expected = (float)pow((double)a,(double)exponent);
+				const double magnitude = abs(exponent*log(abs((double)a)));
+				if(isinf(magnitude)&&!isinf(expected))
+					continue;	// pow(0,0) and pow(inf,0).
+				const long long bound = 1+(long long)(isfinite(magnitude)?2*magnitude:0.0);
+				Assert(UlpDistance(y[{i}],expected)<=bound,"FastMath: pow.");
+			}
+		}
+
+		// Global policy.
+		const NDArray exact = x.Exp();
+		set_math_policy(MathPolicy::Fast);
+		const NDArray fast = x.Exp();
+		set_math_policy(MathPolicy::Exact);
+		bool differs = false;
+		for(int i=0;i<n;++i)
+		{
+			Assert(UlpDistance(exact[{i}],(float)exp((double)x[{i}]))==0||UlpDistance(exact[{i}],std::exp(x[{i}]))==0,"FastMath: Exact policy uses the C library.");
+			differs |= exact[{i}]!=fast[{i}]&&!isnan(exact[{i}]);
+		}
+		Assert(differs,"FastMath: Global policy selects the fast functions.");
+	}
+
+
 	void Test_Argmax()
 	{
 		// ArgMax()
@@ -1103,6 +1519,75 @@ namespace
 					211,226
 				})));
 		}
+
+		// CPU matrix multiply backends against a reference on sizes that are not multiples of the micro-kernel or cache blocks.
+		{
+			const int sizes[][3] = {{1,1,1},{7,13,5},{6,16,32},{37,300,70},{130,257,129}};
+			for(const auto& size:sizes)
+			{
+				const int m = size[0];
+				const int k = size[1];
+				const int n = size[2];
+				const NDArray a = NDData::RandN({m,k})*0.1;
+				const NDArray b = NDData::RandN({k,n})*0.1;
+				const NDArray aT = NDData::RandN({k,m})*0.1;
+				const NDArray bT = NDData::RandN({n,k})*0.1;
+
+				// Reference product accumulated in double precision.
+				const auto reference = [m,k,n](const NDArray& x,const NDArray& y)
+				{
+					NDArray r = NDData::New({m,n});
+					for(int i=0;i<m;++i)
+					{
+						for(int j=0;j<n;++j)
+						{
+							double sum = 0.0;
+							for(int p=0;p<k;++p)
+								sum += double(x[{i,p}])*double(y[{p,j}]);
+							r[{i,j}] = FP(sum);
+						}
+					}
+					return r;
+				};
+
+				// Row major, and transposed views which are read through their strides, for each CPU backend.
+				for(const char* const backend:{"packed","tiled"})
+				{
+					Assert(a.MatMul(b,backend).IsEqualTo(reference(a,b)),"MatMul(a,b).");
+					Assert(aT.Transpose().MatMul(b,backend).IsEqualTo(reference(aT.Transpose(),b)),"MatMul(aT.T,b).");
+					Assert(a.MatMul(bT.Transpose(),backend).IsEqualTo(reference(a,bT.Transpose())),"MatMul(a,bT.T).");
+					Assert(aT.Transpose().MatMul(bT.Transpose(),backend).IsEqualTo(reference(aT.Transpose(),bT.Transpose())),"MatMul(aT.T,bT.T).");
+				}
+			}
+		}
+
+		// Transpose flags match multiplying transposed views.
+		{
+			const NDArray a = NDData::RandN({3,5,4});
+			const NDArray b = NDData::RandN({3,6,4});
+			const NDArray c = NDData::RandN({3,5,6});
+			const NDArray w = NDData::RandN({6,4});
+			const NDArray x = NDData::RandN({5,6});
+			Assert(a.Dot(b,false,true).IsEqualTo(a.Dot(b.Transpose())),"Dot(a,b,false,true).");
+			Assert(a.Dot(a,true,false).IsEqualTo(a.Transpose().Dot(a)),"Dot(a,a,true,false).");
+			Assert(b.Dot(c,true,true).IsEqualTo(b.Transpose().Dot(c.Transpose())),"Dot(b,c,true,true).");
+			Assert(a.Dot(w,false,true).IsEqualTo(a.Dot(w.Transpose())),"Dot(a,w,false,true).");
+			Assert(a.Dot(x,true,false).IsEqualTo(a.Transpose().Dot(x)),"Dot(a,x,true,false).");
+			Assert(w.Dot(x,true,true).IsEqualTo(w.Transpose().Dot(x.Transpose())),"Dot(w,x,true,true).");
+		}
+
+		// Batched product with a broadcast operand matches the product of each matrix in the batch.
+		{
+			const NDArray x = NDData::RandN({5,6});
+			const NDArray b = NDData::RandN({3,6,4});
+			const NDArray y = x.Dot(b);
+			const NDArray z = b.Dot(x,true,true);
+			for(int i=0;i<3;++i)
+			{
+				Assert(y.Slice({{i}}).IsEqualTo(x.Dot(b.Slice({{i}}))),"Dot(x,b[i]).");
+				Assert(z.Slice({{i}}).IsEqualTo(b.Slice({{i}}).Transpose().Dot(x.Transpose())),"Dot(b[i],x,true,true).");
+			}
+		}
 	}
 
 
@@ -1149,6 +1634,46 @@ namespace
 		}
 	}
 
+	void Test_HighRank()
+	{
+		// Six dimensions through the merged row iteration: a deep copy of a strided view, a broadcast operand, assignment to a strided view
+		// and a reduction.
+		const NDArray x = NDData::RandN({2,3,1,4,2,5});
+		const NDArray xT = x.Transpose();
+		const NDArray copy = NDData::New(*xT);
+		const NDArray row = NDData::RandN({2});
+		const NDArray sum = xT+row;
+		NDArray assigned = NDData::New({2,3,1,4,2,5},0.0f);
+		NDArray assignedT = assigned.Transpose();
+		assignedT = copy;
+		const NDArray total = x.Sum(4,false);
+		Assert(copy.Shape()==NDShape({2,3,1,4,5,2}),"HighRank: shape.");
+		for(int a=0;a<2;++a)
+		{
+			for(int b=0;b<3;++b)
+			{
+				for(int d=0;d<4;++d)
+				{
+					for(int f=0;f<5;++f)
+					{
+						for(int e=0;e<2;++e)
+						{
+							const FP v = x[{a,b,0,d,e,f}];
+							Assert(copy[{a,b,0,d,f,e}]==v,"HighRank: copy.");
+							Assert(sum[{a,b,0,d,f,e}]==v+row[{e}],"HighRank: broadcast.");
+							Assert(assigned[{a,b,0,d,e,f}]==v,"HighRank: assign.");
+						}
+						Assert(abs(total[{a,b,0,d,f}]-(x[{a,b,0,d,0,f}]+x[{a,b,0,d,1,f}]))<1e-6f,"HighRank: sum.");
+					}
+				}
+			}
+		}
+
+		// Eight dimensions.
+		const NDArray y = x.Reshape({1,2,3,1,4,2,5,1});
+		Assert(abs(y.Sum()[{}]-x.Sum()[{}])<1e-4f,"HighRank: eight.");
+	}
+
 	void Test_IndexSelect()
 	{
 		// scalar[scalar]
@@ -1583,6 +2108,53 @@ namespace
 			print(r2,"r2=");
 			Assert(r2.IsEqualTo(NDData::New({1,9},{1,4,7,2,5,8,3,6,9})));
 		}
+
+		// Reshape of a non-contiguous view is a view when the strides allow, a copy when they don't.
+		{
+			std::vector<FP> values(24);
+			for(int i=0;i<24;++i)
+				values[i] = FP(i);
+			NDArray x = NDData::New({2,3,4},values);
+			const NDArray t = x.Transpose();											// (2,4,3), strides (12,1,4).
+
+			const NDArray split = t.Reshape({2,2,2,3});									// Splits the unit stride dimension, a view.
+			Assert((*split).DataOwner()==(*x).DataOwner(),"split view");
+			Assert(split.IsEqualTo(t.Contiguous().Reshape({2,2,2,3})),"split values");
+
+			const NDArray merge = t.Reshape({8,3});									// Merges unevenly spaced dimensions, a copy.
+			Assert((*merge).DataOwner()!=(*x).DataOwner(),"merge copy");
+			Assert(merge.IsEqualTo(t.Contiguous().Reshape({8,3})),"merge values");
+
+			const NDArray sub = x.Slice({{},{1,3},{}}).Reshape({2,8});					// Contiguous rows of each slice, a view.
+			Assert((*sub).DataOwner()==(*x).DataOwner(),"slice view");
+			Assert(sub[{1,0}]==16&&sub[{0,7}]==11,"slice values");
+
+			const NDArray repeated = x.Slice({{},{0},{}}).Unsqueeze(1).Repeat_Numpy(1,3).Reshape({2,3,2,2});	// Repeated dimension split, a view.
+			Assert((*repeated).DataOwner()==(*x).DataOwner(),"repeated view");
+			Assert(repeated[{1,2,1,0}]==14,"repeated values");
+
+			const NDArray c = x.Contiguous();											// Already natural, a view.
+			Assert((*c).DataOwner()==(*x).DataOwner(),"contiguous view");
+			Assert((*t.Contiguous()).DataOwner()!=(*x).DataOwner(),"contiguous copy");
+		}
+
+		// Flatten, Softmax, != and row updates of views read (and write) through the strides.
+		{
+			const NDArray x = NDData::New({2,3},{1,2,3,4,5,6});
+			const NDArray repeated = x.Repeat_Torch({3});								// (3,2,3), stride 0 in the first dimension.
+			Assert(repeated.Flatten().IsEqualTo(repeated.Contiguous().Reshape({18})),"flatten repeated");
+			const NDArray t = x.Transpose();
+			Assert(t.Flatten().IsEqualTo(NDData::New({6},{1,4,2,5,3,6})),"flatten transposed");
+			Assert((*t).Softmax().IsEqualTo((*t.Contiguous()).Softmax()),"softmax transposed");
+			Assert((*repeated).Softmax().IsEqualTo((*repeated.Contiguous()).Softmax()),"softmax repeated");
+			Assert((t!=t.Contiguous()).IsEqualTo(t.Zeros()),"not equal transposed");
+			Assert((t.Contiguous()!=t).IsEqualTo(t.Zeros()),"not equal strided operand");
+
+			NDArray y = NDData::New({3,2},{1,2,3,4,5,6});
+			NDArray u = y.Transpose();													// Rows of 'u' are columns of 'y'.
+			u._AddRows({1},NDData::New({1,3},{10,20,30}));
+			Assert(y.IsEqualTo(NDData::New({3,2},{1,12,3,24,5,36})),"add rows transposed");
+		}
 	}
 
 
@@ -1654,8 +2226,68 @@ namespace
 	}
 
 
+	// Fused softmax and log softmax against a row by row reference (in double), over each dimension including masked values and rows
+	// longer than one online block, and the analytic gradients against the product with the Jacobian diag(y)-y.y^T.
 	void Test_Softmax()
 	{
+		constexpr int I = 3;
+		constexpr int J = 5;
+		constexpr int K = 1031;
+		NDArray x = NDData::RandN({I,J,K});
+		x[{1,2,7}] = -INFINITY;
+		for(int k=0;k<K;++k)
+			x[{2,3,k}] = k<600?-INFINITY:x[{2,3,k}];		// First online block entirely masked.
+		const NDArray g = NDData::RandN({I,J,K});
+		const int sizes[] = {I,J,K};
+		for(int dim=0;dim<3;++dim)
+		{
+			for(const MathPolicy policy:{MathPolicy::Exact,MathPolicy::Fast})
+			{
+				const NDArray y = x.Softmax(dim,policy);
+				const NDArray logy = x.LogSoftmax(dim,policy);
+				const NDArray dy = y.SoftmaxGradient(g,dim,policy);
+				const NDArray dlogy = logy.LogSoftmaxGradient(g,dim,policy);
+				for(int row=0;row<I*J*K;++row)
+				{
+					int indices[3] = {row/(J*K),row/K%J,row%K};
+					if(indices[dim]!=0)
+						continue;		// Each row once, from its first element.
+					auto at = [&indices,dim](const NDArray& a,const int i)
+					{
+						indices[dim] = i;
+						return a[{indices[0],indices[1],indices[2]}];
+					};
+					double max = -INFINITY;
+					for(int i=0;i<sizes[dim];++i)
+						max = (std::max)(max,(double)at(x,i));
+					double sum = 0.0;
+					for(int i=0;i<sizes[dim];++i)
+						sum += exp(at(x,i)-max);
+					double dot = 0.0;
+					double gsum = 0.0;
+					for(int i=0;i<sizes[dim];++i)
+					{
+						dot += at(g,i)*exp(at(x,i)-max)/sum;
+						gsum += at(g,i);
+					}
+					for(int i=0;i<sizes[dim];++i)
+					{
+						const double p = exp(at(x,i)-max)/sum;
+						Assert(abs(at(y,i)-p)<1e-6,"Softmax: Value.");
+						Assert(at(x,i)==-INFINITY?at(logy,i)==-INFINITY:abs(at(logy,i)-(at(x,i)-max-log(sum)))<1e-4,"LogSoftmax: Value.");
+						Assert(abs(at(dy,i)-p*(at(g,i)-dot))<1e-5,"Softmax: Gradient.");
+						Assert(abs(at(dlogy,i)-(at(g,i)-p*gsum))<1e-4,"LogSoftmax: Gradient.");
+					}
+				}
+			}
+		}
+
+		// Strided input, softmax of the transpose is the transpose of the softmax over the other dimension.
+		{
+			const NDArray a = NDData::RandN({33,17});
+			Assert(a.Transpose().Softmax(-1).IsEqualTo(a.Softmax(0).Transpose()),"Softmax: Strided.");
+			Assert(a.Transpose().LogSoftmax(0).IsEqualTo(a.LogSoftmax(1).Transpose()),"LogSoftmax: Strided.");
+		}
 	}
 
 
@@ -2198,6 +2830,18 @@ void Test_Unsqueeze()
 				4
 			})),"Unsqueeze(1).");
 	}
+
+	// Unsqueeze and Squeeze are views, Unsqueeze of a natural array stays natural.
+	{
+		NDArray x = NDData::New({2,3},{1,2,3,4,5,6});
+		NDArray y = x.Unsqueeze(1);
+		Assert(y.Shape()==NDShape({2,1,3})&&(*y.Contiguous()).DataOwner()==(*x).DataOwner(),"Unsqueeze natural.");
+		NDArray z = y.Squeeze(-2);
+		Assert(z.Shape()==NDShape({2,3})&&(*z.Contiguous()).DataOwner()==(*x).DataOwner(),"Squeeze natural.");
+		z[{1,2}] = 60;
+		Assert(x[{1,2}]==60&&y[{1,0,2}]==60,"Unsqueeze/Squeeze view.");
+		Assert(x.Transpose().Unsqueeze(0).Squeeze(0).IsEqualTo(x.Transpose()),"Squeeze transposed.");
+	}
 }
 
 
@@ -2215,6 +2859,7 @@ void Test_NDIterator2()
 
 void Test_NDArray()
 {
+	Test_Allocator();
 	Test_Sum();
 	Test_NDIterator2();
 
@@ -2277,6 +2922,12 @@ void Test_NDArray()
 
 	Test_Div();
 	Test_Dot();
+	Test_Elementwise();
+	Test_FastMath();
+	Test_Reduce();
+	Test_FullReduce();
+	if(Benchmarks())
+		Benchmark_FullReduce();
 
 	// Entropy.
 	{
@@ -2303,6 +2954,7 @@ void Test_NDArray()
 	}
 
 	Test_Gather();
+	Test_HighRank();
 	Test_IndexSelect();
 	Test_LoadWithImplicitShape();
 
@@ -1,17 +1,167 @@
 #include "Test_NDThreadPool.h"
 #include "NDThreadPool.h"
+#include "Test.h"
+#include <chrono>
+#include <vector>
 
 
-void Test_NDThreadPool()
+namespace
 {
 	// Outer 'foreach' runs 2 nested 'foreach' loops.
 	// The inner 'foreach' loops take different times to run.
 	// The notification of completion for the first must be ignored by the second.
-	NDThreadPool::ForEach(0,2,[](const int i)
+	void Test_NestedForEach()
+	{
+		NDThreadPool::ForEach(0,2,[](const int i)
+		{
+			NDThreadPool::ForEach(0,i,[](const int i)
+			{
+				std::this_thread::sleep_for(std::chrono::seconds(i+1));
+			});
+		});
+	}
+
+
+	// Every index of a range not starting at zero is visited exactly once for each schedule and grain.
+	void Test_ParallelFor()
+	{
+		const NDThreadPool::Schedule schedules[] = {NDThreadPool::Schedule::Static,NDThreadPool::Schedule::Dynamic,NDThreadPool::Schedule::Guided};
+		const int grains[] = {0,1,7,64,1000};
+		constexpr int begin = 13;
+		constexpr int end = 613;
+		for(const auto schedule:schedules)
+		{
+			for(const int grain:grains)
+			{
+				std::vector<std::atomic<int>> visits(end);
+				NDThreadPool::ParallelFor(begin,end,grain,[&visits](const int i)
+				{
+					++visits[i];
+				},schedule);
+				for(int i=0;i<end;++i)
+					Assert(visits[i]==(i<begin?0:1),"ParallelFor must visit each index in the range exactly once.");
+			}
+
+			// Empty range.
+			NDThreadPool::ParallelFor(5,5,1,[](const int)
+			{
+				Assert(false,"ParallelFor must not call the lambda for an empty range.");
+			},schedule);
+		}
+
+		// Original ForEach overload with a nonzero begin.
+		std::vector<std::atomic<int>> visits(100);
+		NDThreadPool::ForEach(40,100,[&visits](const int i)
+		{
+			++visits[i];
+		});
+		for(int i=0;i<100;++i)
+			Assert(visits[i]==(i<40?0:1),"ForEach must visit each index in the range exactly once.");
+	}
+
+
+	// Every cell of a grid whose size isn't a multiple of the block size is visited exactly once.
+	void Test_ParallelFor2D()
+	{
+		constexpr int rows = 37;
+		constexpr int cols = 23;
+		std::vector<std::atomic<int>> visits(rows*cols);
+		NDThreadPool::ParallelFor2D(2,rows,8,3,cols,5,[&visits](const int i,const int j)
+		{
+			++visits[i*cols+j];
+		});
+		for(int i=0;i<rows;++i)
+			for(int j=0;j<cols;++j)
+				Assert(visits[i*cols+j]==(i<2||j<3?0:1),"ParallelFor2D must visit each cell in the grid exactly once.");
+	}
+
+
+	// Resizing keeps the processors detected at startup (the main thread, worker 0, is pinned by then) and workers that aren't pinned,
+	// those beyond the number of logical processors, may run on any of them rather than just the main thread's.
+	void Test_Resize()
 	{
-		NDThreadPool::ForEach(0,i,[](const int i)
+		const int cpus = (int)NDThreadPool::DetectTopology().size();
+		const int workers = cpus+2;
+		NDThreadPool::Resize(workers);
+		Assert(NDThreadPool::WorkerCount()==workers,"Resize must start the requested number of workers.");
+		Assert((int)NDThreadPool::DetectTopology().size()==cpus,"Resize must detect the processors of the process, not of the pinned main thread.");
+
+		// Each task waits for all the others so every worker runs exactly one.
+		std::vector<std::atomic<int>> processors(workers);
+		std::atomic<int> started = 0;
+		NDThreadPool::ForEach(0,workers,[&](const int)
 		{
-			Sleep(1000*(i+1));
+			const int worker = NDThreadPool::CurrentWorker();
+			processors[worker] = NDThreadPool::ThreadProcessorCount();
+			++started;
+			const auto timeout = std::chrono::steady_clock::now()+std::chrono::seconds(10);
+			while(started<workers&&std::chrono::steady_clock::now()<timeout)
+				std::this_thread::yield();
 		});
-	});
+		Assert(started==workers,"Every worker must run a task.");
+
+		int unpinned = 0;
+		for(int i=0;i<workers;++i)
+		{
+			Assert(processors[i]==1||processors[i]==cpus,"A worker is either pinned or may run on any processor of the process.");
+			unpinned += processors[i]==cpus;
+		}
+		Assert(unpinned>=workers-cpus,"Workers beyond the number of processors mustn't inherit the main thread's affinity.");
+		NDThreadPool::Resize(0);
+		Assert((int)NDThreadPool::DetectTopology().size()==cpus,"Resize(0) must detect the processors of the process.");
+	}
+
+
+	// Microbenchmark of task spawn/complete overhead.
+	//	Flat: one thread creates every task in a single group.
+	//	Nested: tasks create groups of tasks, so work must be stolen from the creating workers.
+	void Benchmark_TaskOverhead()
+	{
+		constexpr int flatTasks = 100000;
+		constexpr int outerTasks = 64;
+		constexpr int innerTasks = 1000;
+		std::atomic<int> counter = 0;
+
+		const auto start = std::chrono::steady_clock::now();
+		{
+			NDThreadPool::TaskGroup taskGroup;
+			for(int i=0;i<flatTasks;++i)
+				taskGroup.Run([&counter]()
+				{
+					++counter;
+				});
+		}
+		const auto flat = std::chrono::steady_clock::now();
+		{
+			NDThreadPool::TaskGroup outer;
+			for(int i=0;i<outerTasks;++i)
+				outer.Run([&counter]()
+				{
+					NDThreadPool::TaskGroup inner;
+					for(int j=0;j<innerTasks;++j)
+						inner.Run([&counter]()
+						{
+							++counter;
+						});
+				});
+		}
+		const auto nested = std::chrono::steady_clock::now();
+
+		Assert(counter==flatTasks+outerTasks*innerTasks,"Every task must run exactly once.");
+
+		const double flatNs = std::chrono::duration<double,std::nano>(flat-start).count()/flatTasks;
+		const double nestedNs = std::chrono::duration<double,std::nano>(nested-flat).count()/(outerTasks*(innerTasks+1));
+		std::cout<<"NDThreadPool "<<NDThreadPool::WorkerCount()<<" workers, task overhead: flat "<<flatNs<<"ns/task, nested "<<nestedNs<<"ns/task"<<std::endl;
+	}
+}
+
+
+void Test_NDThreadPool()
+{
+	Test_NestedForEach();
+	Test_ParallelFor();
+	Test_ParallelFor2D();
+	Test_Resize();
+	if(Benchmarks())
+		Benchmark_TaskOverhead();
 }
\ No newline at end of file
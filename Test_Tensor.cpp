@@ -1,3 +1,13 @@
+#include "ADAM.h"
+#include "AdamW.h"
+#include "Graph.h"
+#include "Linear.h"
+#include "MemoryPlanner.h"
+#include "ParameterArena.h"
+#include "RMSProp.h"
+#include "SGD.h"
+#include "Sequential.h"
+#include "Tanh.h"
 #include "Tensor.h"
 #include "Test.h"
 
@@ -521,6 +531,84 @@ namespace
 		}
 	}
 
+	void Test_Backward()
+	{
+		{	// Long chain, deeper than recursion through creators could go.
+			TensorPtr x = Tensor::New(NDData::New({2},{1,2}),true);
+			const TensorPtr one = Tensor::New(NDData::New({2},{1,1}));
+			TensorPtr y = x;
+			for(int i=0;i<100000;++i)
+				y = y->Add(one);
+			y->Backward();
+			Assert(y->Data().IsEqualTo(NDData::New({2},{100001,100002})),"chain: y");
+			Assert(x->Gradient()->IsEqualTo(Tensor::New(NDData::New({2},{1,1}))),"chain: x");
+		}
+
+		{	// Tensor used more than once, 'Add' passes the same gradient back to both inputs which mustn't change when one is added to.
+			TensorPtr x = Tensor::New(NDData::New({2},{1,2}),true);
+			TensorPtr w = Tensor::New(NDData::New({2},{3,4}),true);
+			TensorPtr y = x->Add(w)->Add(x->Mul(Tensor::New(NDData::New({2},{5,6}))))->Add(x);
+			y->Backward();
+			Assert(x->Gradient()->IsEqualTo(Tensor::New(NDData::New({2},{7,8}))),"shared: x");
+			Assert(w->Gradient()->IsEqualTo(Tensor::New(NDData::New({2},{1,1}))),"shared: w");
+			Assert(y->Gradient()->IsEqualTo(Tensor::New(NDData::New({2},{1,1}))),"shared: y");
+			bool propagated = false;
+			try
+			{
+				y->Backward();
+			}
+			catch(AlreadyPropagated&)
+			{
+				propagated = true;
+			}
+			Assert(propagated,"shared: backward twice");
+		}
+
+		{	// Independent branches joined by Cat (heads), each branch can run in parallel.
+			const int heads = 8;
+			TensorPtr x = Tensor::New(NDData::RandN({4,16}),true);
+			std::vector<TensorPtr> weights,outputs;
+			for(int i=0;i<heads;++i)
+			{
+				weights.push_back(Tensor::New(NDData::RandN({16,16}),true));
+				outputs.push_back(x->Dot(weights.back())->Tanh());
+			}
+			TensorPtr y = Tensor::Cat(outputs,1);
+			const NDArray g = NDData::RandN({4,16*heads});
+			y->Backward(Tensor::New(g),nullptr);
+
+			// Same gradients from each branch on its own.
+			NDArray dx = x->Data().Zeros();
+			for(int i=0;i<heads;++i)
+			{
+				TensorPtr xi = Tensor::New(NDData::New(*x->Data()),true);
+				TensorPtr wi = Tensor::New(NDData::New(*weights[i]->Data()),true);
+				const NDArray gi = g.Slice({{},{16*i,16*(i+1)}});
+				xi->Dot(wi)->Tanh()->Backward(Tensor::New(NDData::New(*gi)),nullptr);
+				Assert(weights[i]->Gradient()->Data().IsEqualTo(wi->Gradient()->Data()),"heads: w");
+				dx += xi->Gradient()->Data();
+			}
+			Assert(x->Gradient()->Data().IsEqualTo(dx),"heads: x");
+		}
+
+		{	// Two losses sharing a hidden tensor, each backpropagated separately, the hidden tensor waits for the second.
+			const NDArray x = NDData::RandN({5,4});
+			const NDArray w0 = NDData::RandN({4,3});
+			TensorPtr w = Tensor::New(NDData::New(*w0),true);
+			TensorPtr h = Tensor::New(x,true)->Dot(w)->Tanh();
+			TensorPtr loss1 = h->Mean(false);
+			TensorPtr loss2 = h->Pow(2)->Mean(false);
+			loss1->Backward();
+			Assert(!w->Gradient(),"two losses: waits");
+			loss2->Backward();
+
+			TensorPtr summed = Tensor::New(NDData::New(*w0),true);
+			TensorPtr g = Tensor::New(x,true)->Dot(summed)->Tanh();
+			g->Mean(false)->Add(g->Pow(2)->Mean(false))->Backward();
+			Assert(w->Gradient()->Data().IsEqualTo(summed->Gradient()->Data()),"two losses: w");
+		}
+	}
+
 	void Test_Cat()
 	{
 		{
@@ -609,6 +697,47 @@ namespace
 			print(g);
 			Assert(x->Gradient()->IsEqualTo(g),"gradient");
 		}
+
+		{
+			// Label smoothing and ignored targets against the loss and gradient of the smoothed target distribution.
+			constexpr int B = 6;
+			constexpr int C = 37;
+			constexpr FP smoothing = 0.1f;
+			const NDArray logits = NDData::RandN({B,C});
+			const NDArray targets = NDData::New({B},{3,-100,0,36,-100,17});
+			TensorPtr x = Tensor::New(logits,true);
+			TensorPtr z = x->CrossEntropy(Tensor::New(targets),smoothing);
+			z->Backward();
+
+			const NDArray logp = logits.LogSoftmax(-1);
+			NDArray expected = NDData::New({B,C},0.0f);
+			double loss = 0.0;
+			int count = 0;
+			for(int b=0;b<B;++b)
+			{
+				const int t = (int)targets[{b}];
+				if(t==-100)
+					continue;
+				++count;
+				for(int c=0;c<C;++c)
+				{
+					const FP q = (c==t?1-smoothing:0)+smoothing/C;	// Smoothed target distribution.
+					loss -= q*logp[{b,c}];
+					expected[{b,c}] = exp(logp[{b,c}])-q;
+				}
+			}
+			Assert(z->IsEqualTo(Tensor::New(NDData::New({},FP(loss/count)))),"smoothing: loss");
+			Assert(x->Gradient()->Data().IsEqualTo(expected/NDData::New({},FP(count))),"smoothing: gradient");
+		}
+
+		{
+			// Every target ignored.
+			TensorPtr x = Tensor::New(NDData::RandN({2,5}),true);
+			TensorPtr z = x->CrossEntropy(Tensor::New(NDData::New({2},{-1,-1})),0,-1);
+			z->Backward();
+			Assert(z->IsEqualTo(Tensor::New(NDData::New({},0.0f))),"ignored: loss");
+			Assert(x->Gradient()->Data().IsEqualTo(NDData::New({2,5},0.0f)),"ignored: gradient");
+		}
 	}
 
 	void Test_Dot()
@@ -734,6 +863,37 @@ namespace
 		}
 	}
 
+	void Test_Expand()
+	{
+		{
+			// Unit length dimensions and an added dimension are repeated by a view, the gradient is summed over them.
+			TensorPtr x = Tensor::New(NDData::New({2,1,3},{1,2,3,4,5,6}),true);
+			TensorPtr y = x->Expand({4,2,5,-1});
+			print(y,"y");
+			Assert(y->Shape()==NDShape({4,2,5,3}),"shape");
+			Assert((*y->Data()).DataOwner()==(*x->Data()).DataOwner(),"view");
+			Assert(y->Data().IsEqualTo(x->Data().Reshape({1,2,1,3})+NDData::New({4,2,5,3},0.0)),"values");
+			y->Backward();
+			print(x->Gradient(),"xg");
+			Assert(x->Gradient()->IsEqualTo(Tensor::New(NDData::New({2,1,3},20.0))),"gradient");
+		}
+
+		{
+			// Only unit length dimensions can be expanded.
+			TensorPtr x = Tensor::New(NDData::New({2,3},0.0),true);
+			bool thrown = false;
+			try
+			{
+				x->Expand({4,3});
+			}
+			catch(const IncompatibleShape&)
+			{
+				thrown = true;
+			}
+			Assert(thrown,"expand non-unit");
+		}
+	}
+
 	void Test_Gather()
 	{
 		{
@@ -946,6 +1106,201 @@ namespace
 		}
 	}
 
+	void Test_Optimiser()
+	{
+		// Parameters of odd sizes, one larger than a block, each with a fixed gradient from 'Mul'.
+		const std::vector<NDArray> initial = {NDData::RandN({3,7}),NDData::RandN({40001})};
+		const std::vector<NDArray> gradients = {NDData::RandN({3,7}),NDData::RandN({40001})};
+		const FP alpha = FP(0.01);
+		auto parameters = [&]()
+		{
+			std::vector<TensorPtr> r;
+			for(auto& p:initial)
+				r.push_back(Tensor::New(NDData::New(*p),true));
+			return r;
+		};
+		auto backward = [&](const std::vector<TensorPtr>& parameters)
+		{
+			for(size_t i=0;i<parameters.size();++i)
+				parameters[i]->Mul(Tensor::New(gradients[i]))->Backward();
+		};
+
+		// Each optimiser takes three steps, compared to the same update composed from NDArray operators.
+		auto check = [&](Optimiser& optimiser,const std::vector<TensorPtr>& parameters,const std::function<void(NDArray& p,NDArray& m,NDArray& v,const NDArray& g,int t)>& step,const char* name)
+		{
+			std::vector<NDArray> p,m,v;
+			for(auto& x:initial)
+			{
+				p.push_back(NDData::New(*x));
+				m.push_back(x.Zeros());
+				v.push_back(x.Zeros());
+			}
+			for(int t=1;t<=3;++t)
+			{
+				backward(parameters);
+				optimiser.Step();
+				for(size_t i=0;i<p.size();++i)
+				{
+					step(p[i],m[i],v[i],gradients[i],t);
+					Assert(parameters[i]->Data().IsEqualTo(p[i]),name);
+					Assert(parameters[i]->Gradient()->Data().IsEqualTo(gradients[i].Zeros()),name);
+				}
+			}
+		};
+		{
+			auto x = parameters();
+			SGD sgd(x,alpha);
+			check(sgd,x,[&](NDArray& p,NDArray&,NDArray&,const NDArray& g,int)
+			{
+				p -= g*alpha;
+			},"SGD");
+		}
+		{
+			auto x = parameters();
+			RMSProp rmsprop(x,alpha);
+			check(rmsprop,x,[&](NDArray& p,NDArray& m,NDArray&,const NDArray& g,int)
+			{
+				m = m*FP(0.99) + (g*g)*FP(0.01);
+				p -= (g/(m.Sqrt()+FP(1e-8)))*alpha;
+			},"RMSProp");
+		}
+		for(const FP decay:{FP(0),FP(0.1)})
+		{
+			// The bias correction is for the step, not each parameter.
+			auto x = parameters();
+			ADAM adam(x,alpha,decay);
+			check(adam,x,[&](NDArray& p,NDArray& m,NDArray& v,const NDArray& g,int t)
+			{
+				m = m*FP(0.9) + g*FP(0.1);
+				v = v*FP(0.999) + (g*g)*FP(0.001);
+				const NDArray mhat = m/(1-pow(FP(0.9),FP(t)));
+				const NDArray vhat = v/(1-pow(FP(0.999),FP(t)));
+				p -= p*(alpha*decay);
+				p -= (mhat*alpha)/(vhat.Sqrt()+FP(1e-8));
+			},decay==0?"ADAM":"ADAM weight decay");
+		}
+		{
+			// AdamW is ADAM with a default weight decay.
+			auto x = parameters();
+			auto y = parameters();
+			AdamW adamw(x,alpha);
+			ADAM adam(y,alpha,FP(0.01));
+			backward(x);
+			backward(y);
+			adamw.Step();
+			adam.Step();
+			for(size_t i=0;i<x.size();++i)
+				Assert(x[i]->Data().IsEqualTo(y[i]->Data()),"AdamW");
+		}
+		{
+			// A layer used twice by a model has its parameters listed twice by GetParameters, they're stepped once.
+			const NDArray input = NDData::RandN({4,3});
+			auto model = [&](LinearPtr& shared)
+			{
+				shared = Linear::New(3,3);
+				return std::make_shared<Sequential>(std::initializer_list<LayerPtr>{shared,Tanh::New(),shared});
+			};
+			LinearPtr a,b;
+			const SequentialPtr twice = model(a);
+			const SequentialPtr once = model(b);
+			b->_weight->Data() = a->_weight->Data();
+			b->_bias->Data() = a->_bias->Data();
+			Assert(twice->GetParameters().size()==4,"Shared layer: listed twice.");
+			ADAM listedTwice(twice->GetParameters(),alpha);
+			ADAM listedOnce({b->_weight,b->_bias},alpha);
+			for(int i=0;i<3;++i)
+			{
+				twice->Forward(Tensor::New(input))[0]->Backward();
+				once->Forward(Tensor::New(input))[0]->Backward();
+				listedTwice.Step();
+				listedOnce.Step();
+				Assert(a->_weight->Data().IsEqualTo(b->_weight->Data())&&a->_bias->Data().IsEqualTo(b->_bias->Data()),"Shared layer: one step.");
+			}
+
+			// Parameters passed the same gradient array (both inputs of an Add, and a view repeating the gradient of a Sum) each own a
+			// copy, so zeroing one doesn't zero the other's before it's applied.
+			for(const bool sum:{false,true})
+			{
+				TensorPtr p = Tensor::New(NDData::New({2,3},1.0f),true);
+				TensorPtr q = Tensor::New(NDData::New({2,3},2.0f),true);
+				TensorPtr y = p->Add(q);
+				(sum?y->Sum(1,false):y)->Backward();
+				SGD sgd({p,q},alpha);
+				sgd.Step();
+				Assert(p->Data().IsEqualTo(NDData::New({2,3},1.0f-alpha))&&q->Data().IsEqualTo(NDData::New({2,3},2.0f-alpha)),"Shared gradient.");
+			}
+
+			// Parameters sharing data but not gradients can't be stepped together.
+			const NDArray data = NDData::RandN({5});
+			bool thrown = false;
+			try
+			{
+				NDData::_OptimiserStep(optimiser_sgd{alpha},{{data,data.Zeros()},{data,data.Zeros()}},true);
+			}
+			catch(const Exception&)
+			{
+				thrown = true;
+			}
+			Assert(thrown,"Aliased parameters.");
+		}
+	}
+
+	void Test_ParameterArena()
+	{
+		const std::vector<NDArray> initial = {NDData::RandN({3,7}),NDData::RandN({5}),NDData::RandN({300,70})};
+		const std::vector<NDArray> gradients = {NDData::RandN({3,7}),NDData::RandN({5}),NDData::RandN({300,70})};
+		auto parameters = [&]()
+		{
+			std::vector<TensorPtr> r;
+			for(auto& p:initial)
+				r.push_back(Tensor::New(NDData::New(*p),true));
+			return r;
+		};
+		auto backward = [&](const std::vector<TensorPtr>& parameters)
+		{
+			for(size_t i=0;i<parameters.size();++i)
+				parameters[i]->Mul(Tensor::New(gradients[i]))->Backward();
+		};
+
+		// Parameters keep their values and have a zero gradient, each starts on a 64 byte boundary.
+		const std::vector<TensorPtr> x = parameters();
+		const ParameterArenaPtr arena = ParameterArena::New(x);
+		Assert(arena->Data().Size()==32+16+21008,"arena size");
+		for(size_t i=0;i<x.size();++i)
+		{
+			Assert(arena->Contains(x[i]),"contains");
+			Assert(x[i]->Data().IsEqualTo(initial[i]),"bound data");
+			Assert(x[i]->Gradient()->Data().IsEqualTo(initial[i].Zeros()),"bound gradient");
+		}
+		x[1]->Data()[{2}] = 10;
+		Assert(arena->Data()[{32+2}]==10,"parameter view");
+		x[1]->Data() = initial[1];
+
+		// Gradients accumulate in the arena and optimiser steps match separate parameters.
+		const std::vector<TensorPtr> y = parameters();
+		ADAM adamx(arena,FP(0.01),FP(0.1));
+		ADAM adamy(y,FP(0.01),FP(0.1));
+		for(int step=0;step<2;++step)
+		{
+			backward(x);
+			backward(y);
+			Assert(abs(arena->GradNorm()-adamy.ClipGradNorm(FP(1e9)))<1e-3,"gradient norm");
+			adamx.Step();
+			adamy.Step();
+			for(size_t i=0;i<x.size();++i)
+				Assert(x[i]->Data().IsEqualTo(y[i]->Data()),"ADAM");
+			Assert(arena->Gradient().IsEqualTo(arena->Gradient().Zeros()),"zero gradient");
+		}
+
+		// Clipping by the total norm scales every gradient.
+		backward(x);
+		const FP norm = adamx.ClipGradNorm(FP(1));
+		Assert(abs(arena->GradNorm()-1)<1e-4,"clipped norm");
+		Assert(x[2]->Gradient()->Data().IsEqualTo(gradients[2]*(1/norm)),"clipped gradient");
+		adamx.ZeroGrad();
+		Assert(arena->GradNorm()==0,"ZeroGrad");
+	}
+
 	void Test_Pow()
 	{
 	}
@@ -993,6 +1348,398 @@ namespace
 		}
 	}
 
+	void Test_Graph()
+	{
+		// Two layer classifier, a captured step replayed with new batches matches the same steps built eagerly.
+		const NDArray w1 = NDData::RandN({4,8});
+		const NDArray b1 = NDData::RandN({8});
+		const NDArray w2 = NDData::RandN({8,3});
+		auto parameters = [&]()
+		{
+			return std::vector<TensorPtr>{Tensor::New(NDData::New(*w1),true),Tensor::New(NDData::New(*b1),true),Tensor::New(NDData::New(*w2),true)};
+		};
+		auto step = [](const std::vector<TensorPtr>& p,const TensorPtr& x,const TensorPtr& targets)
+		{
+			return x->Dot(p[0])->Add(p[1])->Tanh()->Dot(p[2])->CrossEntropy(targets);
+		};
+		int count = 0;
+		auto batch = [&count](NDArray& x,NDArray& targets)
+		{
+			x._Attach(NDData::RandN({5,4}));
+			std::vector<FP> t(5);
+			for(auto& target:t)
+				target = FP(count++%3);
+			targets._Attach(NDData::New({5},t));
+		};
+
+		const std::vector<TensorPtr> eager = parameters();
+		const std::vector<TensorPtr> captured = parameters();
+		SGD eagerSGD(eager,FP(0.1));
+		SGD capturedSGD(captured,FP(0.1));
+
+		NDArray x,targets;
+		batch(x,targets);
+		const TensorPtr input = Tensor::New(NDData::New(*x),true);	// Autograd so the layers derived from it have autograd.
+		const TensorPtr inputTargets = Tensor::New(NDData::New(*targets));
+		const GraphPtr graph = Graph::Capture({input,inputTargets},[&](){return step(captured,input,inputTargets);});
+		Assert(graph->Nodes().size()==5,"nodes");
+		for(int i=0;i<4;++i)
+		{
+			if(i>0)
+			{
+				batch(x,targets);
+				graph->Replay({x,targets});
+			}
+			TensorPtr loss = step(eager,Tensor::New(x,true),Tensor::New(targets));
+			loss->Backward();
+			Assert(graph->Loss()->IsEqualTo(loss),"loss");
+			for(size_t j=0;j<eager.size();++j)
+				Assert(captured[j]->Gradient()->IsEqualTo(eager[j]->Gradient()),"gradient");
+			eagerSGD.Step();
+			capturedSGD.Step();
+		}
+
+		// Inputs must have the shapes captured.
+		bool incompatible = false;
+		try
+		{
+			graph->Replay({NDData::RandN({6,4}),targets});
+		}
+		catch(IncompatibleShape&)
+		{
+			incompatible = true;
+		}
+		Assert(incompatible,"input shape");
+	}
+
+	void Test_GraphFusion()
+	{
+		// Chains of elementwise kernels (with broadcast inputs) ending with reductions, a fused step matches the same steps built eagerly.
+		const NDArray w = NDData::RandN({4,8});
+		const NDArray b = NDData::RandN({8});
+		auto parameters = [&]()
+		{
+			return std::vector<TensorPtr>{Tensor::New(NDData::New(*w),true),Tensor::New(NDData::New(*b),true)};
+		};
+		auto step = [](const std::vector<TensorPtr>& p,const TensorPtr& x,const TensorPtr& y)
+		{
+			const TensorPtr h = x->Dot(p[0])->Add(p[1])->Tanh();
+			const TensorPtr spread = h->Var(1,true)->Relu();
+			return h->Sub(y)->Pow(2)->Mul(spread)->Neg()->Exp()->Mean(true);
+		};
+
+		const std::vector<TensorPtr> eager = parameters();
+		const std::vector<TensorPtr> captured = parameters();
+		SGD eagerSGD(eager,FP(0.1));
+		SGD capturedSGD(captured,FP(0.1));
+		NDArray x = NDData::RandN({5,4});
+		NDArray y = NDData::RandN({5,8});
+		const TensorPtr input = Tensor::New(NDData::New(*x),true);
+		const TensorPtr target = Tensor::New(NDData::New(*y));
+		const GraphPtr graph = Graph::Capture({input,target},[&](){return step(captured,input,target);});
+		Assert(graph->Nodes().size()==15,"nodes");
+		const int naive = MemoryPlanner::New(graph)->Naive();
+
+		// Add+Tanh, Sub+Pow+Sum (of Var) and the loss from Sub to Mean, which takes in the Div and Relu of Var.
+		Assert(graph->Fuse()==10,"fused");
+		Assert(graph->Nodes().size()==5,"fused nodes");
+		Assert(MemoryPlanner::New(graph)->Naive()<naive,"fused memory");
+
+		for(int i=0;i<4;++i)
+		{
+			if(i>0)
+			{
+				x._Attach(NDData::RandN({5,4}));
+				y._Attach(NDData::RandN({5,8}));
+				graph->Replay({x,y});
+			}
+			TensorPtr loss = step(eager,Tensor::New(x,true),Tensor::New(y));
+			loss->Backward();
+			Assert(graph->Loss()->IsEqualTo(loss),"loss");
+			for(size_t j=0;j<eager.size();++j)
+				Assert(captured[j]->Gradient()->IsEqualTo(eager[j]->Gradient()),"gradient");
+			eagerSGD.Step();
+			capturedSGD.Step();
+		}
+	}
+
+	void Test_MemoryPlanner()
+	{
+		const TensorPtr w1 = Tensor::New(NDData::RandN({4,8}),true);
+		const TensorPtr b1 = Tensor::New(NDData::RandN({8}),true);
+		const TensorPtr w2 = Tensor::New(NDData::RandN({8,3}),true);
+		const TensorPtr x = Tensor::New(NDData::RandN({5,4}),true);
+		const TensorPtr targets = Tensor::New(NDData::New({5},{0,1,2,0,1}));
+		const GraphPtr graph = Graph::Capture({x,targets},[&]()
+		{
+			return x->Dot(w1)->Add(b1)->Relu()->Reshape({5,8})->Dot(w2)->CrossEntropy(targets);
+		});
+		Assert(graph->Nodes().size()==6,"nodes");
+		const MemoryPlannerPtr plan = MemoryPlanner::New(graph);
+
+		// Add is in place (its input isn't read again), Relu isn't (its backward reads its input) and Reshape is a view of Relu.
+		Assert(plan->OutputBuffer(1)==plan->OutputBuffer(0),"in place");
+		Assert(plan->OutputBuffer(2)!=plan->OutputBuffer(1),"not in place");
+		Assert(graph->Memory()[3].owner==2,"view owner");
+		Assert(plan->OutputBuffer(3)==plan->OutputBuffer(2),"view");
+
+		// No two buffers live at the same time overlap in the slab.
+		const std::vector<MemoryPlanner::Buffer>& buffers = plan->Buffers();
+		for(size_t i=0;i<buffers.size();++i)
+		{
+			const MemoryPlanner::Buffer& a = buffers[i];
+			Assert(a.offset%MemoryPlanner::Alignment==0,"aligned");
+			Assert(a.offset+a.size<=plan->Size(),"in slab");
+			for(size_t j=i+1;j<buffers.size();++j)
+			{
+				const MemoryPlanner::Buffer& b = buffers[j];
+				const bool live = a.first<=b.last&&b.first<=a.last;
+				const bool overlap = a.offset<b.offset+b.size&&b.offset<a.offset+a.size;
+				Assert(!(live&&overlap),"overlap");
+			}
+		}
+		Assert(plan->Live()<=plan->Size(),"live peak");
+		Assert(plan->Size()<plan->Naive(),"planned peak");
+
+		// Views of the slab.
+		const NDArray slab = plan->Slab();
+		NDArray output = plan->View(slab,plan->OutputBuffer(2),graph->Memory()[2].shape);
+		output = NDData::New(graph->Memory()[2].shape,1.0f);
+		Assert(slab[{plan->Buffers()[plan->OutputBuffer(2)].offset+39}]==1,"view in slab");
+		bool incompatible = false;
+		try
+		{
+			plan->View(slab,plan->OutputBuffer(2),NDShape({6,8}));
+		}
+		catch(IncompatibleShape&)
+		{
+			incompatible = true;
+		}
+		Assert(incompatible,"view shape");
+
+		// Applied, Replay writes Add and Relu into the slab and matches the same steps built eagerly (backward releases the outputs of the
+		// nodes, the slab keeps them).
+		const std::vector<TensorPtr> captured = {w1,b1,w2};
+		std::vector<TensorPtr> eager;
+		for(auto& p:captured)
+			eager.emplace_back(Tensor::New(NDData::New(*p->Data()),true));
+		SGD eagerSGD(eager,FP(0.1));
+		SGD capturedSGD(captured,FP(0.1));
+		const NDArray applied = plan->Apply();
+		for(int i=0;i<4;++i)
+		{
+			NDArray input = x->Data();
+			if(i>0)
+			{
+				input._Attach(NDData::RandN({5,4}));
+				graph->Replay({input,targets->Data()});
+			}
+			const TensorPtr hidden = Tensor::New(input,true)->Dot(eager[0])->Add(eager[1])->Relu();
+			if(i>0)
+				Assert(plan->View(applied,plan->OutputBuffer(2),{5,8}).IsEqualTo(hidden->Data()),"placed output");
+			TensorPtr loss = hidden->Reshape({5,8})->Dot(eager[2])->CrossEntropy(targets);
+			loss->Backward();
+			Assert(graph->Loss()->IsEqualTo(loss),"applied loss");
+			for(size_t j=0;j<eager.size();++j)
+				Assert(captured[j]->Gradient()->IsEqualTo(eager[j]->Gradient()),"applied gradient");
+			eagerSGD.Step();
+			capturedSGD.Step();
+		}
+	}
+
+	void Test_StepArena()
+	{
+		const NDArray w0 = NDData::RandN({4,3});
+		const TensorPtr w = Tensor::New(NDData::New(*w0),true);
+		const TensorPtr eager = Tensor::New(NDData::New(*w0),true);
+		SGD sgd({w},FP(0.1));
+		SGD eagerSGD({eager},FP(0.1));
+		auto step = [](const TensorPtr& w,const NDArray& x)
+		{
+			return Tensor::New(x,true)->Dot(w)->Tanh()->Mean(false);
+		};
+
+		NDArena arena(1<<20);
+		for(int i=0;i<3;++i)
+		{
+			const NDArray x = NDData::RandN({5,4});
+			{
+				NDArena::Scope scope(arena);
+				TensorPtr loss = step(w,x);
+				Assert((*loss->Data()).InArena(),"step arena: intermediate");
+				loss->Backward();
+			}
+			step(eager,x)->Backward();
+
+			// Every block of the step has been freed, the region is reused. The gradient and momentum of the parameter aren't in the arena.
+			Assert(arena.RegionsInUse()==0,"step arena: reset");
+			Assert(arena.Reserved()==1<<20,"step arena: reused");
+			Assert(!(*w->Gradient()->Data()).InArena(),"step arena: gradient");
+			Assert(!(*w->Momentum()->Data()).InArena(),"step arena: momentum");
+			Assert(w->Gradient()->IsEqualTo(eager->Gradient()),"step arena: gradient value");
+			sgd.Step();
+			eagerSGD.Step();
+		}
+		Assert(w->IsEqualTo(eager),"step arena: parameter");
+
+		// A result kept after the step keeps its region, the next step uses another.
+		TensorPtr kept;
+		{
+			NDArena::Scope scope(arena);
+			kept = step(w,NDData::RandN({5,4}));
+		}
+		Assert(arena.RegionsInUse()==1,"step arena: kept");
+		{
+			NDArena::Scope scope(arena);
+			step(w,NDData::RandN({5,4}));
+		}
+		Assert(arena.Reserved()==2<<20,"step arena: second region");
+		kept.reset();
+		Assert(arena.RegionsInUse()==0,"step arena: released");
+	}
+
+	void Test_IndexSelect()
+	{
+		auto newTable = []()
+		{
+			return NDData::New({5,3},
+				{
+					0.1,0.2,0.3,
+					0.4,0.5,0.6,
+					0.7,0.8,0.9,
+					1.0,1.1,1.2,
+					1.3,1.4,1.5
+				});
+		};
+		const NDArray table = newTable();
+		const NDArray indices = NDData::New({2,2},
+			{
+				3,1,
+				3,0
+			});
+		const NDArray scale = NDData::New({2,2,3},
+			{
+				1,2,3, 4,5,6,
+				7,8,9, 1,1,1
+			});
+
+		// Returns the dense and sparse parameters after a backward pass through IndexSelect with a duplicate index.
+		auto backward = [&](const bool sparse)
+		{
+			TensorPtr x = Tensor::New(newTable(),true);
+			x->Sparse(sparse);
+			x->IndexSelect(Tensor::New(indices))->Mul(Tensor::New(scale))->Backward();
+			return x;
+		};
+
+		{	// Sparse gradient has the distinct rows and is the same as the dense gradient.
+			TensorPtr dense = backward(false);
+			TensorPtr sparse = backward(true);
+			print(dense->Gradient(),"dense");
+			Assert(!sparse->Gradient(),"sparse has dense gradient");
+			Assert(sparse->SparseGradient()->Rows()==std::vector<int>({0,1,3}),"sparse rows");
+			Assert(sparse->SparseGradient()->ToDense().IsEqualTo(dense->Gradient()->Data()),"sparse gradient");
+			Assert(dense->Gradient()->Data().IsEqualTo(NDData::New({5,3},
+				{
+					1,1,1,
+					4,5,6,
+					0,0,0,
+					8,10,12,
+					0,0,0
+				})),"dense gradient");
+		}
+
+		// Each optimiser step on the sparse gradient matches the dense step for the rows selected, the other rows are unchanged.
+		// SGD leaves rows without a gradient unchanged either way so matches exactly, ADAM and RMSProp are lazy so only match on the selected rows.
+		const std::vector<int> selected = {0,1,3};
+		const std::vector<int> unselected = {2,4};
+		auto step = [&](const std::function<std::shared_ptr<Optimiser>(const TensorPtr&)>& optimiser,const std::string& name)
+		{
+			TensorPtr dense = backward(false);
+			TensorPtr sparse = backward(true);
+			optimiser(dense)->Step();
+			optimiser(sparse)->Step();
+			print(sparse,name.c_str());
+			Assert(sparse->Data().SelectRows(selected).IsEqualTo(dense->Data().SelectRows(selected)),(name+": selected rows").c_str());
+			Assert(sparse->Data().SelectRows(unselected).IsEqualTo(table.SelectRows(unselected)),(name+": unselected rows").c_str());
+			Assert(sparse->SparseGradient()->Empty(),(name+": zero gradient").c_str());
+		};
+		step([](const TensorPtr& p){return std::make_shared<SGD>(std::vector<TensorPtr>{p},FP(0.1));},"SGD");
+		step([](const TensorPtr& p){return std::make_shared<ADAM>(std::vector<TensorPtr>{p},FP(0.1));},"ADAM");
+		step([](const TensorPtr& p){return std::make_shared<RMSProp>(std::vector<TensorPtr>{p},0.1);},"RMSProp");
+
+		{	// Gradients of two backward passes accumulate, a sparse parameter with no rows selected is unchanged by a step.
+			TensorPtr x = backward(true);
+			x->IndexSelect(Tensor::New(NDData::New({1},{2})))->Backward();
+			Assert(x->SparseGradient()->Rows()==std::vector<int>({0,1,2,3}),"accumulated rows");
+			Assert(x->SparseGradient()->ToDense().SelectRows({2}).IsEqualTo(NDData::New({1,3},{1,1,1})),"accumulated gradient");
+			SGD sgd({x},FP(0.1));
+			sgd.Step();
+			sgd.Step();
+			Assert(x->Data().SelectRows({4}).IsEqualTo(table.SelectRows({4})),"step without gradient");
+		}
+
+		{	// Tied weights, a sparse parameter also used by an operation without a sparse backward (Mul) gets both gradients. Each
+			// optimiser steps them together, as the dense parameter.
+			auto tied = [&](const bool sparse)
+			{
+				TensorPtr x = backward(sparse);
+				x->Mul(Tensor::New(table))->Backward();
+				return x;
+			};
+			auto tiedStep = [&](const std::function<std::shared_ptr<Optimiser>(const TensorPtr&)>& optimiser,const std::string& name)
+			{
+				TensorPtr dense = tied(false);
+				TensorPtr sparse = tied(true);
+				Assert(sparse->Gradient()&&!sparse->SparseGradient()->Empty(),(name+": tied gradients").c_str());
+				const std::shared_ptr<Optimiser> denseOptimiser = optimiser(dense);
+				const std::shared_ptr<Optimiser> sparseOptimiser = optimiser(sparse);
+				for(int i=0;i<2;++i)
+				{
+					denseOptimiser->Step();
+					sparseOptimiser->Step();
+					Assert(sparse->Data().IsEqualTo(dense->Data()),(name+": tied step").c_str());
+					Assert(sparse->SparseGradient()->Empty()&&sparse->Gradient()->Data().IsEqualTo(table.Zeros()),(name+": tied zero gradient").c_str());
+					sparse->IndexSelect(Tensor::New(indices))->Mul(Tensor::New(scale))->Backward();
+					sparse->Mul(Tensor::New(table))->Backward();
+					dense->IndexSelect(Tensor::New(indices))->Mul(Tensor::New(scale))->Backward();
+					dense->Mul(Tensor::New(table))->Backward();
+				}
+			};
+			tiedStep([](const TensorPtr& p){return std::make_shared<SGD>(std::vector<TensorPtr>{p},FP(0.1));},"SGD");
+			tiedStep([](const TensorPtr& p){return std::make_shared<ADAM>(std::vector<TensorPtr>{p},FP(0.1));},"ADAM");
+			tiedStep([](const TensorPtr& p){return std::make_shared<RMSProp>(std::vector<TensorPtr>{p},0.1);},"RMSProp");
+		}
+	}
+
+	void Test_LogSoftmax()
+	{
+		// Fused softmax and log softmax nodes against the composed graph they replace.
+		for(const int dim:{0,1,-1})
+		{
+			const NDArray data = NDData::RandN({4,6,9});
+			const TensorPtr g = Tensor::New(NDData::RandN({4,6,9}));
+
+			TensorPtr x = Tensor::New(data,true);
+			x->Softmax(dim)->Backward(g,nullptr);
+			TensorPtr xr = Tensor::New(data,true);
+			TensorPtr expo = xr->Sub(xr->Max(dim))->Exp();
+			TensorPtr yr = expo->Div(expo->Sum(dim,true));
+			yr->Backward(g,nullptr);
+			Assert(x->Softmax(dim)->Data().IsEqualTo(yr->Data()),"softmax: forward");
+			Assert(x->Gradient()->IsEqualTo(xr->Gradient()),"softmax: gradient");
+
+			TensorPtr l = Tensor::New(data,true);
+			l->LogSoftmax(dim)->Backward(g,nullptr);
+			TensorPtr lr = Tensor::New(data,true);
+			TensorPtr z = lr->Sub(lr->Max(dim));
+			TensorPtr ylr = z->Sub(z->Exp()->Sum(dim,true)->Log());
+			ylr->Backward(g,nullptr);
+			Assert(l->LogSoftmax(dim)->Data().IsEqualTo(ylr->Data()),"log softmax: forward");
+			Assert(l->Gradient()->IsEqualTo(lr->Gradient()),"log softmax: gradient");
+		}
+	}
+
 	void Test_Transpose()
 	{
 		{
@@ -1074,17 +1821,27 @@ void Test_Var()
 void Test_Tensor()
 {
 	Test_Add();
+	Test_Backward();
 	Test_Cat();
 	Test_CrossEntropy();
 	Test_Dot();
 	Test_Dropout();
+	Test_Expand();
 	Test_Gather();
+	Test_Graph();
+	Test_GraphFusion();
+	Test_IndexSelect();
+	Test_LogSoftmax();
 	Test_MaskedFill();
 	Test_Mean();
+	Test_MemoryPlanner();
 	Test_Mul();
+	Test_Optimiser();
+	Test_ParameterArena();
 	Test_Pow();
 	Test_Reshape();
 	Test_Softmax();
+	Test_StepArena();
 	Test_Transpose();
 	Test_Var();
 
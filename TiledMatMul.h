@@ -1,5 +1,8 @@
 #pragma once
 
+#include <immintrin.h>
+#include "NDAllocator.h"
+#include "NDThreadPool.h"
 
 constexpr int tile_size = 32;	// Tile size for matrix multiplication.
 
@@ -20,9 +23,9 @@ static void add_from_whole_tile(
 		for(int j=0;j<tile_size;j+=8)
 		{
 			__m256 v_tile = _mm256_load_ps(&tile_row[j]);   // aligned load from tile
-			__m256 v_dst  = _mm256_load_ps(&dst_row[j]);    // aligned load from dst
+			__m256 v_dst  = _mm256_loadu_ps(&dst_row[j]);   // unaligned load from dst (rows are only aligned when the row stride is a multiple of 16)
 			__m256 v_sum  = _mm256_add_ps(v_dst,v_tile);	// element-wise add
-			_mm256_store_ps(&dst_row[j],v_sum);             // aligned store to dst
+			_mm256_storeu_ps(&dst_row[j],v_sum);            // unaligned store to dst
 		}
 		tile_row += tile_size;
 	}
@@ -177,3 +180,74 @@ static void matmul_tile(const float* const a,const float* const bT,float* const
 		}
 	}
 }
+
+
+// Copies an (rows,cols) strided matrix to a new row major buffer allocated from 'mem'.
+//
+static float* copy_to_row_major(const float* const src,const int rows,const int cols,const int row_stride,const int col_stride)
+{
+	float* const dst = mem.Alloc<float>((size_t)rows*cols);
+	for(int i=0;i<rows;++i)
+		for(int j=0;j<cols;++j)
+			dst[i*cols+j] = src[i*row_stride+j*col_stride];
+	return dst;
+}
+
+
+// C(m,n) = A(m,k) @ B(k,n) using square tiles.
+//	A and B are addressed through row and column strides, C is row major with row stride 'ldc' and is overwritten.
+//	A is copied if it's not row major and B is copied if it's not column major, so copying tiles is cache friendly.
+//
+static void tiled_gemm(
+	const int m,const int n,const int k,
+	const float* const a,const int a_rs,const int a_cs,
+	const float* const b,const int b_rs,const int b_cs,
+	float* const c,const int ldc)
+{
+	// Output tiles accumulate into C.
+	for(int i=0;i<m;++i)
+		memset(c+i*ldc,0,n*sizeof(float));
+	if(m==0||n==0||k==0)
+		return;
+
+	// Row major A(m,k) and row major B transposed (n,k).
+	float* const a_copy = a_cs==1?nullptr:copy_to_row_major(a,m,k,a_rs,a_cs);
+	float* const bT_copy = b_rs==1?nullptr:copy_to_row_major(b,n,k,b_cs,b_rs);
+	const float* const a_tiles = a_copy?a_copy:a;
+	const int a_row_stride = a_copy?k:a_rs;
+	const float* const bT_tiles = bT_copy?bT_copy:b;
+	const int bT_row_stride = bT_copy?k:b_cs;
+
+	// Dimensions of the output matrix in tiles.
+	const int tile_rows = ((m-1)/tile_size)+1;
+	const int tile_cols = ((n-1)/tile_size)+1;
+	const int inner_tiles = ((k-1)/tile_size)+1;
+
+	// Compute the output tiles - one tile per claim so uneven edge tiles balance across workers.
+	NDThreadPool::ParallelFor2D(0,tile_rows,1,0,tile_cols,1,[m,n,k,a_tiles,a_row_stride,bT_tiles,bT_row_stride,c,ldc,inner_tiles](const int tile_row,const int tile_col)
+	{
+		// Reserve tile buffers per thread - these are held in L1 cache.
+		alignas(64) float x[tile_size][tile_size];
+		alignas(64) float y[tile_size][tile_size];
+		alignas(64) float z[tile_size][tile_size];
+		for(int p=0;p<inner_tiles;++p)
+		{
+			// Copy p-th inner tile from tile row a.
+			copy_to_tile(&x[0][0],a_tiles,m,k,a_row_stride,tile_row*tile_size,p*tile_size);
+
+			// Copy p-th inner tile from tile row bT.
+			copy_to_tile(&y[0][0],bT_tiles,n,k,bT_row_stride,tile_col*tile_size,p*tile_size);
+
+			// Multiply the two tiles a@bT.
+			matmul_tile(&x[0][0],&y[0][0],&z[0][0]);
+
+			// Add the result tile to the output matrix.
+			add_from_tile(&z[0][0],c,m,n,ldc,tile_row*tile_size,tile_col*tile_size);
+		}
+	},NDThreadPool::Schedule::Dynamic);
+
+	if(a_copy)
+		mem.Free(a_copy);
+	if(bT_copy)
+		mem.Free(bT_copy);
+}
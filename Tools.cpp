@@ -156,4 +156,24 @@ string AbsPath(const string& path)
 			path;
 	else
 		return path;
+}
+
+// Returns the value of an environment variable, or an empty string if it's not set.
+//
+string GetEnv(const char* name)
+{
+#ifdef _MSC_VER
+	char* value = nullptr;
+	size_t length = 0;
+	string result;
+	if(_dupenv_s(&value,&length,name)==0&&value)
+	{
+		result = value;
+		free(value);
+	}
+	return result;
+#else
+	const char* const value = getenv(name);
+	return value?value:"";
+#endif
 }
\ No newline at end of file
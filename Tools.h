@@ -20,6 +20,8 @@ std::wstring Escape(std::wstringstream& ss,const std::wstring& str,const wchar_t
 
 std::string AbsPath(const std::string& path);
 
+std::string GetEnv(const char* name);
+
 #ifndef _WIN32
 
 #define UNREFERENCED_PARAMETER(x) do { (void)(x); } while (0)
@@ -0,0 +1,24 @@
+#include "VectorMath.h"
+#include "Tools.h"
+#include <atomic>
+
+
+// Global policy, read once from the environment.
+//
+static std::atomic<MathPolicy>& global_math_policy()
+{
+	static std::atomic<MathPolicy> policy(GetEnv("AUTOGRAD_MATH")=="fast"?MathPolicy::Fast:MathPolicy::Exact);
+	return policy;
+}
+
+
+MathPolicy math_policy()
+{
+	return global_math_policy().load(std::memory_order_relaxed);
+}
+
+
+void set_math_policy(const MathPolicy policy)
+{
+	global_math_policy() = policy==MathPolicy::Default?MathPolicy::Exact:policy;
+}
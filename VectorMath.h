@@ -0,0 +1,290 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cmath>
+#include "CpuFeatures.h"
+
+
+// Vectorised transcendental functions.
+// ====================================
+//
+// Polynomial approximations of exp, log, tanh and pow on 8 (AVX2) or 16 (AVX-512) floats, used by the elementwise kernels when the
+// math policy is Fast. The polynomials are the single precision minimax fits from Cephes, evaluated with FMA.
+//
+// Maximum error against the correctly rounded result, checked by Test_FastMath over every 1021st float:
+//
+//	exp		1 ULP	for all x, including subnormal results. Overflows to inf above 88.72, underflows to 0 below -103.97.
+//	log		1 ULP	for x>0 including subnormals. log(0)=-inf, log(x<0)=NaN, log(inf)=inf.
+//	tanh	1 ULP	for all x.
+//	pow		1+2|y*ln(x)| ULP, computed as exp(y*ln|x|) so the error of the log is scaled by the exponent of the result, e.g. 3 ULP for
+//			results near e^1, 25 ULP for results near 1e5. Finite x<0 gives NaN unless y is an integer, pow(x,0)=1.
+//	sqrt	0.5 ULP	the hardware square root is correctly rounded, so it is used in every policy.
+//
+// NaN inputs give NaN. The Exact policy calls the C library one element at a time instead.
+//
+
+
+// Accuracy of Exp, Log, Tanh and Pow.
+//
+enum class MathPolicy
+{
+	Default,	// Use the global policy.
+	Exact,		// C library functions.
+	Fast		// Vectorised approximations.
+};
+
+
+// Returns the global policy, Exact unless the AUTOGRAD_MATH environment variable is "fast" or set_math_policy() has been called.
+//
+MathPolicy math_policy();
+
+
+// Sets the global policy.
+//
+void set_math_policy(const MathPolicy policy);
+
+
+// Returns 'true' if 'policy' selects the fast functions, Default is resolved with the global policy.
+//
+inline bool math_fast(const MathPolicy policy)
+{
+	return (policy==MathPolicy::Default?math_policy():policy)==MathPolicy::Fast;
+}
+
+
+// Cephes coefficients.
+//
+namespace vector_math
+{
+	constexpr float exp_hi		= 88.72283935546875f;		// Largest x with a finite exp(x).
+	constexpr float exp_lo		= -104.0f;					// exp(x) rounds to 0 below -103.97.
+	constexpr float log2e		= 1.44269504088896341f;
+	constexpr float ln2_hi		= 0.693359375f;				// ln2 split so n*ln2_hi is exact.
+	constexpr float ln2_lo		= -2.12194440e-4f;
+	constexpr float sqrt2		= 1.41421356237309505f;
+	constexpr float tanh_small	= 0.625f;					// Polynomial below, 1-2/(exp(2x)+1) above.
+
+	constexpr float exp_p[6]	= {1.9875691500e-4f,1.3981999507e-3f,8.3334519073e-3f,4.1665795894e-2f,1.6666665459e-1f,5.0000001201e-1f};
+	constexpr float log_p[9]	= {7.0376836292e-2f,-1.1514610310e-1f,1.1676998740e-1f,-1.2420140846e-1f,1.4249322787e-1f,-1.6668057665e-1f,2.0000714765e-1f,-2.4999993993e-1f,3.3333331174e-1f};
+	constexpr float tanh_p[5]	= {-5.70498872745e-3f,2.06390887954e-2f,-5.37397155531e-2f,1.33314422036e-1f,-3.33332819422e-1f};
+
+	// Floats of 2^24 and above are all even integers.
+	inline bool pow_integer(const float y)
+	{
+		return std::abs(y)>=16777216.0f||y==(float)(int)y;
+	}
+
+	inline bool pow_odd(const float y)
+	{
+		return std::abs(y)<16777216.0f&&y==(float)(int)y&&((int)y&1)!=0;
+	}
+}
+
+
+// AVX2.
+// =====
+
+// e^x
+//	x = n*ln2+r where |r|<=ln2/2, e^x = 2^n*e^r. 2^n is applied as two factors so subnormal results don't underflow early.
+//
+TARGET_AVX2
+inline __m256 exp_avx2(const __m256 x)
+{
+	using namespace vector_math;
+	const __m256 xc = _mm256_min_ps(_mm256_max_ps(x,_mm256_set1_ps(exp_lo)),_mm256_set1_ps(exp_hi+1.0f));
+	const __m256 n = _mm256_round_ps(_mm256_mul_ps(xc,_mm256_set1_ps(log2e)),_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	__m256 r = _mm256_fnmadd_ps(n,_mm256_set1_ps(ln2_hi),xc);
+	r = _mm256_fnmadd_ps(n,_mm256_set1_ps(ln2_lo),r);
+
+	__m256 p = _mm256_set1_ps(exp_p[0]);
+	for(int i=1;i<6;++i)
+		p = _mm256_fmadd_ps(p,r,_mm256_set1_ps(exp_p[i]));
+	p = _mm256_fmadd_ps(p,_mm256_mul_ps(r,r),_mm256_add_ps(r,_mm256_set1_ps(1.0f)));
+
+	const __m256i ni = _mm256_cvtps_epi32(n);
+	const __m256i n1 = _mm256_srai_epi32(ni,1);
+	const __m256i n2 = _mm256_sub_epi32(ni,n1);
+	const __m256 s1 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n1,_mm256_set1_epi32(127)),23));
+	const __m256 s2 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n2,_mm256_set1_epi32(127)),23));
+	const __m256 y = _mm256_mul_ps(_mm256_mul_ps(p,s1),s2);
+
+	return _mm256_blendv_ps(y,x,_mm256_cmp_ps(x,x,_CMP_UNORD_Q));
+}
+
+
+// ln(x)
+//	x = m*2^e where m is in [sqrt(0.5),sqrt(2)), ln(x) = ln(m)+e*ln2.
+//
+TARGET_AVX2
+inline __m256 log_avx2(const __m256 x)
+{
+	using namespace vector_math;
+
+	// Normalise subnormals.
+	const __m256 subnormal = _mm256_cmp_ps(x,_mm256_set1_ps(1.17549435e-38f),_CMP_LT_OQ);
+	const __m256 xn = _mm256_blendv_ps(x,_mm256_mul_ps(x,_mm256_set1_ps(8388608.0f)),subnormal);
+	__m256 e = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_castps_si256(xn),23)),_mm256_set1_ps(127.0f));
+	e = _mm256_sub_ps(e,_mm256_and_ps(subnormal,_mm256_set1_ps(23.0f)));
+
+	// Mantissa in [1,2), then halved if above sqrt(2).
+	__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(xn),_mm256_set1_epi32(0x007fffff)),_mm256_set1_epi32(0x3f800000)));
+	const __m256 high = _mm256_cmp_ps(m,_mm256_set1_ps(sqrt2),_CMP_GT_OQ);
+	m = _mm256_blendv_ps(m,_mm256_mul_ps(m,_mm256_set1_ps(0.5f)),high);
+	e = _mm256_add_ps(e,_mm256_and_ps(high,_mm256_set1_ps(1.0f)));
+
+	const __m256 f = _mm256_sub_ps(m,_mm256_set1_ps(1.0f));
+	const __m256 z = _mm256_mul_ps(f,f);
+	__m256 p = _mm256_set1_ps(log_p[0]);
+	for(int i=1;i<9;++i)
+		p = _mm256_fmadd_ps(p,f,_mm256_set1_ps(log_p[i]));
+	__m256 y = _mm256_mul_ps(_mm256_mul_ps(p,f),z);
+	y = _mm256_fmadd_ps(e,_mm256_set1_ps(ln2_lo),y);
+	y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f),z,y);
+	__m256 r = _mm256_add_ps(f,y);
+	r = _mm256_fmadd_ps(e,_mm256_set1_ps(ln2_hi),r);
+
+	// Special values.
+	const __m256 inf = _mm256_set1_ps(INFINITY);
+	r = _mm256_blendv_ps(r,inf,_mm256_cmp_ps(x,inf,_CMP_EQ_OQ));
+	r = _mm256_blendv_ps(r,_mm256_set1_ps(-INFINITY),_mm256_cmp_ps(x,_mm256_setzero_ps(),_CMP_EQ_OQ));
+	r = _mm256_blendv_ps(r,_mm256_set1_ps(NAN),_mm256_cmp_ps(x,_mm256_setzero_ps(),_CMP_NGE_UQ));	// x<0 or NaN.
+	return r;
+}
+
+
+// tanh(x)
+//	Odd polynomial for |x|<0.625, otherwise 1-2/(e^2|x|+1) with the sign of x.
+//
+TARGET_AVX2
+inline __m256 tanh_avx2(const __m256 x)
+{
+	using namespace vector_math;
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 ax = _mm256_andnot_ps(sign,x);
+
+	const __m256 z = _mm256_mul_ps(x,x);
+	__m256 p = _mm256_set1_ps(tanh_p[0]);
+	for(int i=1;i<5;++i)
+		p = _mm256_fmadd_ps(p,z,_mm256_set1_ps(tanh_p[i]));
+	const __m256 small = _mm256_fmadd_ps(_mm256_mul_ps(p,z),x,x);
+
+	const __m256 e = exp_avx2(_mm256_add_ps(ax,ax));
+	__m256 large = _mm256_sub_ps(_mm256_set1_ps(1.0f),_mm256_div_ps(_mm256_set1_ps(2.0f),_mm256_add_ps(e,_mm256_set1_ps(1.0f))));
+	large = _mm256_or_ps(large,_mm256_and_ps(sign,x));
+
+	return _mm256_blendv_ps(large,small,_mm256_cmp_ps(ax,_mm256_set1_ps(tanh_small),_CMP_LT_OQ));
+}
+
+
+// x^y for a scalar exponent.
+//	e^(y*ln|x|), finite negative 'x' are only defined for integer 'y' where odd 'y' gives the result the sign of 'x'.
+//
+TARGET_AVX2
+inline __m256 pow_avx2(const __m256 x,const float y)
+{
+	using namespace vector_math;
+	if(y==0.0f)
+		return _mm256_set1_ps(1.0f);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 r = exp_avx2(_mm256_mul_ps(_mm256_set1_ps(y),log_avx2(_mm256_andnot_ps(sign,x))));
+
+	const __m256 negative = _mm256_cmp_ps(x,_mm256_setzero_ps(),_CMP_LT_OQ);
+	if(!pow_integer(y))
+		return _mm256_blendv_ps(r,_mm256_set1_ps(NAN),_mm256_and_ps(negative,_mm256_cmp_ps(x,_mm256_set1_ps(-INFINITY),_CMP_NEQ_OQ)));
+	if(pow_odd(y))
+		r = _mm256_or_ps(r,_mm256_and_ps(x,sign));
+	return r;
+}
+
+
+// AVX-512.
+// ========
+//	Same algorithms, with the exponent handled by scalef/getexp/getmant.
+
+TARGET_AVX512
+inline __m512 exp_avx512(const __m512 x)
+{
+	using namespace vector_math;
+	const __m512 xc = _mm512_min_ps(_mm512_max_ps(x,_mm512_set1_ps(exp_lo)),_mm512_set1_ps(exp_hi+1.0f));
+	const __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(xc,_mm512_set1_ps(log2e)),_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	__m512 r = _mm512_fnmadd_ps(n,_mm512_set1_ps(ln2_hi),xc);
+	r = _mm512_fnmadd_ps(n,_mm512_set1_ps(ln2_lo),r);
+
+	__m512 p = _mm512_set1_ps(exp_p[0]);
+	for(int i=1;i<6;++i)
+		p = _mm512_fmadd_ps(p,r,_mm512_set1_ps(exp_p[i]));
+	p = _mm512_fmadd_ps(p,_mm512_mul_ps(r,r),_mm512_add_ps(r,_mm512_set1_ps(1.0f)));
+
+	const __m512 y = _mm512_scalef_ps(p,n);
+	return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x,x,_CMP_UNORD_Q),y,x);
+}
+
+
+TARGET_AVX512
+inline __m512 log_avx512(const __m512 x)
+{
+	using namespace vector_math;
+
+	// Mantissa in [1,2) (subnormals included), then halved if above sqrt(2).
+	__m512 m = _mm512_getmant_ps(x,_MM_MANT_NORM_1_2,_MM_MANT_SIGN_zero);
+	__m512 e = _mm512_getexp_ps(x);
+	const __mmask16 high = _mm512_cmp_ps_mask(m,_mm512_set1_ps(sqrt2),_CMP_GT_OQ);
+	m = _mm512_mask_mul_ps(m,high,m,_mm512_set1_ps(0.5f));
+	e = _mm512_mask_add_ps(e,high,e,_mm512_set1_ps(1.0f));
+
+	const __m512 f = _mm512_sub_ps(m,_mm512_set1_ps(1.0f));
+	const __m512 z = _mm512_mul_ps(f,f);
+	__m512 p = _mm512_set1_ps(log_p[0]);
+	for(int i=1;i<9;++i)
+		p = _mm512_fmadd_ps(p,f,_mm512_set1_ps(log_p[i]));
+	__m512 y = _mm512_mul_ps(_mm512_mul_ps(p,f),z);
+	y = _mm512_fmadd_ps(e,_mm512_set1_ps(ln2_lo),y);
+	y = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f),z,y);
+	__m512 r = _mm512_add_ps(f,y);
+	r = _mm512_fmadd_ps(e,_mm512_set1_ps(ln2_hi),r);
+
+	// Special values.
+	const __m512 inf = _mm512_set1_ps(INFINITY);
+	r = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x,inf,_CMP_EQ_OQ),r,inf);
+	r = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x,_mm512_setzero_ps(),_CMP_EQ_OQ),r,_mm512_set1_ps(-INFINITY));
+	r = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x,_mm512_setzero_ps(),_CMP_NGE_UQ),r,_mm512_set1_ps(NAN));
+	return r;
+}
+
+
+TARGET_AVX512
+inline __m512 tanh_avx512(const __m512 x)
+{
+	using namespace vector_math;
+	const __m512i sign = _mm512_set1_epi32(0x80000000);
+	const __m512 ax = _mm512_abs_ps(x);
+
+	const __m512 z = _mm512_mul_ps(x,x);
+	__m512 p = _mm512_set1_ps(tanh_p[0]);
+	for(int i=1;i<5;++i)
+		p = _mm512_fmadd_ps(p,z,_mm512_set1_ps(tanh_p[i]));
+	const __m512 small = _mm512_fmadd_ps(_mm512_mul_ps(p,z),x,x);
+
+	const __m512 e = exp_avx512(_mm512_add_ps(ax,ax));
+	const __m512 large = _mm512_sub_ps(_mm512_set1_ps(1.0f),_mm512_div_ps(_mm512_set1_ps(2.0f),_mm512_add_ps(e,_mm512_set1_ps(1.0f))));
+	const __m512 signed_large = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(large),_mm512_and_si512(sign,_mm512_castps_si512(x))));
+
+	return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(ax,_mm512_set1_ps(tanh_small),_CMP_LT_OQ),signed_large,small);
+}
+
+
+TARGET_AVX512
+inline __m512 pow_avx512(const __m512 x,const float y)
+{
+	using namespace vector_math;
+	if(y==0.0f)
+		return _mm512_set1_ps(1.0f);
+	__m512 r = exp_avx512(_mm512_mul_ps(_mm512_set1_ps(y),log_avx512(_mm512_abs_ps(x))));
+
+	const __mmask16 negative = _mm512_cmp_ps_mask(x,_mm512_setzero_ps(),_CMP_LT_OQ);
+	if(!pow_integer(y))
+		return _mm512_mask_blend_ps(negative&_mm512_cmp_ps_mask(x,_mm512_set1_ps(-INFINITY),_CMP_NEQ_OQ),r,_mm512_set1_ps(NAN));
+	if(pow_odd(y))
+		r = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(r),_mm512_and_si512(_mm512_castps_si512(x),_mm512_set1_epi32(0x80000000))));
+	return r;
+}
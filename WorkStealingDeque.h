@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+
+// Chase-Lev work-stealing deque.
+// ==============================
+//
+// The owning thread pushes and pops at the bottom (LIFO, so it works on the most recently created and cache-hot item), any other
+// thread steals from the top (FIFO, so thieves take the oldest and typically largest pieces of work). Push and Pop are wait-free
+// for the owner, only the last item is contended with a compare-and-swap. The ring buffer grows when full, retired buffers are kept
+// until the deque is destroyed because a thief may still be reading them.
+//
+// Memory ordering follows "Correct and Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen and Zappa Nardelli, 2013).
+//
+template<typename T>
+class WorkStealingDeque
+{
+    class Array
+    {
+        const int64_t       _capacity;
+        const int64_t       _mask;
+        std::atomic<T>*     _items;
+
+    public:
+        Array(const int64_t capacity) :
+            _capacity(capacity),
+            _mask(capacity-1),
+            _items(new std::atomic<T>[capacity])
+        {
+        }
+
+        ~Array()
+        {
+            delete[] _items;
+        }
+
+        int64_t Capacity() const
+        {
+            return _capacity;
+        }
+
+        void Put(const int64_t i,const T item)
+        {
+            _items[i&_mask].store(item,std::memory_order_relaxed);
+        }
+
+        T Get(const int64_t i) const
+        {
+            return _items[i&_mask].load(std::memory_order_relaxed);
+        }
+
+        // Returns a copy of this array with twice the capacity holding items [top,bottom).
+        Array* Grow(const int64_t top,const int64_t bottom) const
+        {
+            Array* const array = new Array(_capacity*2);
+            for(int64_t i=top;i<bottom;++i)
+                array->Put(i,Get(i));
+            return array;
+        }
+    };
+
+    static int64_t RoundUpPow2(const int64_t n)
+    {
+        int64_t pow2 = 1;
+        while(pow2<n)
+            pow2 <<= 1;
+        return pow2;
+    }
+
+    alignas(64) std::atomic<int64_t>    _top;       // Next item to steal, only incremented.
+    alignas(64) std::atomic<int64_t>    _bottom;    // Next free slot, owned by the pushing thread.
+    alignas(64) std::atomic<Array*>     _array;
+    std::vector<Array*>                 _retired;   // Buffers replaced by Grow.
+
+public:
+    // Initial capacity is rounded up to a power of 2.
+    WorkStealingDeque(const int64_t capacity=1024) :
+        _top(0),
+        _bottom(0),
+        _array(new Array(RoundUpPow2(capacity)))
+    {
+    }
+
+    ~WorkStealingDeque()
+    {
+        for(auto array:_retired)
+            delete array;
+        delete _array.load();
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Approximate number of items (exact when called by the owner with no concurrent thieves).
+    int64_t Size() const
+    {
+        const int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        const int64_t top = _top.load(std::memory_order_relaxed);
+        return bottom>top?bottom-top:0;
+    }
+
+    // Adds an item to the bottom - owner only.
+    //
+    void Push(const T item)
+    {
+        const int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        const int64_t top = _top.load(std::memory_order_acquire);
+        Array* array = _array.load(std::memory_order_relaxed);
+        if(bottom-top>array->Capacity()-1)
+        {
+            // Full, replace with a larger buffer.
+            _retired.push_back(array);
+            array = array->Grow(top,bottom);
+            _array.store(array,std::memory_order_release);
+        }
+        array->Put(bottom,item);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(bottom+1,std::memory_order_relaxed);
+    }
+
+    // Removes an item from the bottom - owner only. Returns 'false' if empty.
+    //
+    bool Pop(T& item)
+    {
+        const int64_t bottom = _bottom.load(std::memory_order_relaxed)-1;
+        Array* const array = _array.load(std::memory_order_relaxed);
+        _bottom.store(bottom,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = _top.load(std::memory_order_relaxed);
+
+        if(top>bottom)
+        {
+            // Empty, restore.
+            _bottom.store(bottom+1,std::memory_order_relaxed);
+            return false;
+        }
+
+        item = array->Get(bottom);
+        if(top==bottom)
+        {
+            // Last item, race thieves for it.
+            const bool won = _top.compare_exchange_strong(top,top+1,std::memory_order_seq_cst,std::memory_order_relaxed);
+            _bottom.store(bottom+1,std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Removes an item from the top - any thread. Returns 'false' if empty or another thread won the item.
+    //
+    bool Steal(T& item)
+    {
+        int64_t top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t bottom = _bottom.load(std::memory_order_acquire);
+        if(top>=bottom)
+            return false;
+
+        Array* const array = _array.load(std::memory_order_acquire);
+        item = array->Get(top);
+        return _top.compare_exchange_strong(top,top+1,std::memory_order_seq_cst,std::memory_order_relaxed);
+    }
+};